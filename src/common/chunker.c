@@ -0,0 +1,163 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+
+#include "chunker.h"
+
+#include "logging.h"
+
+#include <sha1.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+/**
+ * Normalized chunking: before CHUNKER_AVG_SIZE, a boundary needs more
+ * zero bits (harder to match), after it fewer, so chunk sizes cluster
+ * around the average. The masks use the high bits of the gear hash, which
+ * depend on the last 64 bytes (the low bits only on the last few).
+ **/
+#define CHUNKER_MASK_S ((((uint64_t)1 << 18) - 1) << (64 - 18))
+#define CHUNKER_MASK_L ((((uint64_t)1 << 14) - 1) << (64 - 14))
+
+static uint64_t chunker_gear[256];
+static pthread_once_t chunker_gear_once = PTHREAD_ONCE_INIT;
+
+static void chunker_init_gear(void)
+{
+    // splitmix64 with a fixed seed, so the table is the same everywhere
+    uint64_t state = 0x53464d4643444331ull;
+    for (int i=0; i<256; i++) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        chunker_gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t chunker_next(const char *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    if (length <= CHUNKER_MIN_SIZE) {
+        return length;
+    }
+
+    pthread_once(&chunker_gear_once, chunker_init_gear);
+
+    size_t end = (length < CHUNKER_MAX_SIZE) ? length : CHUNKER_MAX_SIZE;
+    size_t normal = (end < CHUNKER_AVG_SIZE) ? end : CHUNKER_AVG_SIZE;
+
+    // The first CHUNKER_MIN_SIZE bytes can't contain a boundary, so skip them
+    uint64_t fp = 0;
+    size_t i = CHUNKER_MIN_SIZE;
+    for (; i<normal; i++) {
+        fp = (fp << 1) + chunker_gear[p[i]];
+        if ((fp & CHUNKER_MASK_S) == 0) {
+            return i + 1;
+        }
+    }
+
+    for (; i<end; i++) {
+        fp = (fp << 1) + chunker_gear[p[i]];
+        if ((fp & CHUNKER_MASK_L) == 0) {
+            return i + 1;
+        }
+    }
+
+    return end;
+}
+
+/* Data is read in blocks of this size, so that a whole chunk is always available */
+#define CHUNKER_BUFFER_SIZE (4 * CHUNKER_MAX_SIZE)
+
+uint32_t chunker_scan_file(const char *filename, struct SFMF_ChunkEntry **chunks,
+        chunker_func_t func, void *user_data)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        SFMF_FAIL_AND_EXIT("Can't open %s: %s\n", filename, strerror(errno));
+    }
+
+    char *buf = malloc(CHUNKER_BUFFER_SIZE);
+    size_t pos = 0;
+    size_t length = 0;
+    int eof = 0;
+    uint64_t offset = 0;
+
+    struct SFMF_ChunkEntry *result = NULL;
+    uint32_t count = 0;
+    uint32_t size = 0;
+
+    while (1) {
+        if (!eof && length - pos < CHUNKER_MAX_SIZE) {
+            memmove(buf, buf + pos, length - pos);
+            length -= pos;
+            pos = 0;
+
+            size_t res = fread(buf + length, 1, CHUNKER_BUFFER_SIZE - length, fp);
+            if (res < CHUNKER_BUFFER_SIZE - length) {
+                if (ferror(fp)) {
+                    SFMF_FAIL_AND_EXIT("Can't read %s: %s\n", filename, strerror(errno));
+                }
+                eof = 1;
+            }
+            length += res;
+        }
+
+        if (pos == length) {
+            break;
+        }
+
+        size_t chunk_length = chunker_next(buf + pos, length - pos);
+
+        if (count == size) {
+            size = size ? 2 * size : 16;
+            result = realloc(result, size * sizeof(struct SFMF_ChunkEntry));
+            assert(result != NULL);
+        }
+
+        struct SFMF_ChunkEntry *chunk = &(result[count++]);
+        memset(chunk, 0, sizeof(*chunk));
+        chunk->offset = offset;
+        chunk->hash.size = chunk_length;
+        chunk->hash.hashtype = HASHTYPE_SHA1;
+
+        SHA1_CTX ctx;
+        SHA1_Init(&ctx);
+        SHA1_Update(&ctx, (const uint8_t *)(buf + pos), chunk_length);
+        SHA1_Final(&ctx, chunk->hash.hash);
+
+        if (func) {
+            func(buf + pos, chunk, user_data);
+        }
+
+        pos += chunk_length;
+        offset += chunk_length;
+    }
+
+    free(buf);
+    fclose(fp);
+
+    *chunks = result;
+    return count;
+}
@@ -0,0 +1,58 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+
+#ifndef SFMF_CHUNKER_H
+#define SFMF_CHUNKER_H
+
+#include "sfmf.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Content-defined chunking (FastCDC): chunk boundaries are found with a
+ * rolling gear hash over the data, so they only depend on the bytes near
+ * them. Inserting or removing data in a file only changes the chunks
+ * around the modification, the others keep their hashes, and can be
+ * found in an older version of the file.
+ *
+ * The parameters (and the gear table) must never change, as files are
+ * chunked the same way when packing and (for local reference files)
+ * when unpacking.
+ **/
+
+#define CHUNKER_MIN_SIZE (16 * 1024)
+#define CHUNKER_AVG_SIZE (64 * 1024)
+#define CHUNKER_MAX_SIZE (256 * 1024)
+
+// Returns the length of the chunk at the start of data; length is the number of bytes
+// available, which must be at least CHUNKER_MAX_SIZE unless data is the end of the file
+size_t chunker_next(const char *data, size_t length);
+
+// Called for each chunk of a file (with the chunk data, and the chunk with its hash)
+typedef void (*chunker_func_t)(const char *data, struct SFMF_ChunkEntry *chunk, void *user_data);
+
+// Splits filename into chunks and hashes them; returns the number of chunks, which
+// are stored in *chunks (with entry set to 0, to be freed by the caller, NULL if the
+// file is empty); func (if not NULL) is called for each chunk
+uint32_t chunker_scan_file(const char *filename, struct SFMF_ChunkEntry **chunks,
+        chunker_func_t func, void *user_data);
+
+#endif /* SFMF_CHUNKER_H */
@@ -17,6 +17,8 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  **/
 
+#define _GNU_SOURCE
+
 #include "convert.h"
 #include "logging.h"
 #include "control.h"
@@ -32,15 +34,20 @@
 
 #include <sha1.h>
 
-#if defined(USE_LIBCURL)
-#include <curl/curl.h>
-#endif /* USE_LIBCURL */
+#if defined(USE_ZSTD)
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#if defined(USE_LZ4)
+#include <lz4frame.h>
+#endif
 
 
 struct ConvertIO {
     ssize_t (*transfer)(char *buffer, size_t len, void *user_data);
     void *user_data;
-    size_t total;
+    uint64_t total;
 };
 
 struct ConvertContext {
@@ -59,13 +66,26 @@ struct BufferConvertContextSource {
     size_t pos;
 };
 
+struct FileRangeConvertContextSource {
+    FILE *fp;
+    uint64_t remaining;
+};
+
 // Number of blocks transferred between mainloop pumps
 #define PUMP_MAINLOOP_EVERY_X_BLOCKS 300
 
+// Per-thread, as conversions can run in worker threads (see fileentry.c)
+static __thread int convert_thread_no_pump = 0;
+
+void convert_set_thread_pumps_mainloop(int enabled)
+{
+    convert_thread_no_pump = !enabled;
+}
+
 static ssize_t convert_io_transfer(struct ConvertIO *io, char *buffer, size_t len)
 {
-    static int iterations = 0;
-    if (++iterations >= PUMP_MAINLOOP_EVERY_X_BLOCKS) {
+    static __thread int iterations = 0;
+    if (!convert_thread_no_pump && ++iterations >= PUMP_MAINLOOP_EVERY_X_BLOCKS) {
         // Pump the mainloop after every X blocks transferred; should give
         // good responsiveness while not slowing down data transfer
         sfmf_control_process();
@@ -89,6 +109,26 @@ static ssize_t convert_io_write(struct ConvertContext *ctx, char *buffer, size_t
     return convert_io_transfer(ctx->write, buffer, len);
 }
 
+static void convert_io_write_all(struct ConvertContext *ctx, char *buf, size_t len)
+{
+    ssize_t res = convert_io_write(ctx, buf, len);
+    assert(res == len);
+}
+
+static ssize_t duplicate_convert_io_write(char *buffer, size_t len, void *user_data)
+{
+    struct DuplicateConvertIOContext *ctx = user_data;
+
+    ssize_t res = convert_io_transfer(ctx->master, buffer, len); // Write to master
+    if (res > 0) {
+        // Consumer MUST NOT modify the buffer it is given
+        ssize_t res2 = convert_io_transfer(ctx->slave, buffer, res); // Write to slave (what was written)
+        assert(res == res2);
+    }
+
+    return res;
+}
+
 static ssize_t duplicate_convert_io_read(char *buffer, size_t len, void *user_data)
 {
     struct DuplicateConvertIOContext *ctx = user_data;
@@ -108,12 +148,11 @@ void do_convert_uncompressed(struct ConvertContext *ctx)
     ssize_t len;
 
     while ((len = convert_io_read(ctx, buf, sizeof(buf)))) {
-        ssize_t res = convert_io_write(ctx, buf, len);
-        assert(res == len);
+        convert_io_write_all(ctx, buf, len);
     }
 }
 
-void do_convert_zcompressed(struct ConvertContext *ctx)
+void do_convert_zcompressed(struct ConvertContext *ctx, int level)
 {
     const uint32_t buffer_size = DEFAULT_BUFFER_SIZE;
     char tmp_in[buffer_size];
@@ -122,7 +161,7 @@ void do_convert_zcompressed(struct ConvertContext *ctx)
     z_stream stream;
     memset(&stream, 0, sizeof(stream));
 
-    int res = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+    int res = deflateInit(&stream, level ?: Z_DEFAULT_COMPRESSION);
     assert(res == Z_OK);
 
     ssize_t read_bytes = 0;
@@ -156,47 +195,501 @@ void do_convert_zcompressed(struct ConvertContext *ctx)
     deflateEnd(&stream);
 }
 
-void do_convert_zdecompress(struct ConvertContext *ctx)
-{
-    const uint32_t buffer_size = DEFAULT_BUFFER_SIZE;
-    char tmp_in[buffer_size];
-    char tmp_out[buffer_size];
+/**
+ * Decoders are fed compressed data as it becomes available, and write the
+ * decompressed data to output; this way the same code can be used for
+ * converting files and for hashing data while it is being downloaded.
+ **/
+struct ConvertDecoder {
+    const struct ConvertCodecOps *ops;
+    void *state;
+    struct ConvertIO *output;
+    int done; // set once the end of the compressed stream has been reached
+};
 
-    z_stream stream;
-    memset(&stream, 0, sizeof(stream));
+struct ConvertCodecOps {
+    const char *name;
+    uint32_t blob_flag; // SFMF_BlobEntry_Flag
+
+    // NULL if the codec is not compiled in
+    void (*compress)(struct ConvertContext *ctx, int level); // level 0 = default
+    void *(*decoder_new)();
+    // Returns nonzero if buf is not valid compressed data (or trailing garbage)
+    int (*decoder_update)(struct ConvertDecoder *decoder, char *buf, size_t len);
+    void (*decoder_free)(void *state);
+};
+
+static void convert_decoder_output(struct ConvertDecoder *decoder, char *buf, size_t len)
+{
+    if (len > 0) {
+        // Not using convert_io_transfer(), decoders must not pump the mainloop
+        // (they are also used by ConvertHasher from within download callbacks)
+        ssize_t res = decoder->output->transfer(buf, len, decoder->output->user_data);
+        assert(res == len);
+        decoder->output->total += res;
+    }
+}
 
-    int res = inflateInit(&stream);
+static void *zlib_decoder_new()
+{
+    z_stream *stream = calloc(1, sizeof(z_stream));
+    int res = inflateInit(stream);
     assert(res == Z_OK);
+    return stream;
+}
 
-    ssize_t read_bytes = 0;
-    while ((read_bytes = convert_io_read(ctx, tmp_in, buffer_size)) != 0) {
-        stream.next_in = (unsigned char *)tmp_in;
-        stream.avail_in = read_bytes;
+static int zlib_decoder_update(struct ConvertDecoder *decoder, char *buf, size_t len)
+{
+    z_stream *stream = decoder->state;
+    char tmp_out[DEFAULT_BUFFER_SIZE];
+
+    stream->next_in = (unsigned char *)buf;
+    stream->avail_in = len;
 
-        // Let inflate() consume the whole input buffer
+    // Let inflate() consume the whole input buffer, and drain all output
+    do {
+        stream->next_out = (unsigned char *)tmp_out;
+        stream->avail_out = sizeof(tmp_out);
+        int res = inflate(stream, Z_NO_FLUSH);
+        if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+            return 1;
+        }
+
+        convert_decoder_output(decoder, tmp_out, sizeof(tmp_out) - stream->avail_out);
+
+        if (res == Z_STREAM_END) {
+            decoder->done = 1;
+            return (stream->avail_in > 0);
+        }
+    } while (stream->avail_in > 0 || stream->avail_out == 0);
+
+    return 0;
+}
+
+static void zlib_decoder_free(void *state)
+{
+    inflateEnd(state);
+    free(state);
+}
+
+#if defined(USE_ZSTD)
+/* Compression level that the shared dictionary is prepared for (blobs using it are small) */
+#define CONVERT_DICTIONARY_LEVEL 19
+
+// Shared dictionary of CONVERT_CODEC_ZSTD_DICT, read-only once set
+static ZSTD_CDict *convert_zstd_cdict = NULL;
+static ZSTD_DDict *convert_zstd_ddict = NULL;
+
+static void zstd_compress_stream(struct ConvertContext *ctx, ZSTD_CCtx *cctx)
+{
+    char tmp_in[DEFAULT_BUFFER_SIZE];
+    char tmp_out[DEFAULT_BUFFER_SIZE];
+
+    ZSTD_EndDirective mode = ZSTD_e_continue;
+    while (mode != ZSTD_e_end) {
+        ssize_t read_bytes = convert_io_read(ctx, tmp_in, sizeof(tmp_in));
+        if (read_bytes == 0) {
+            mode = ZSTD_e_end;
+        }
+
+        ZSTD_inBuffer input = { tmp_in, read_bytes, 0 };
+        size_t remaining;
         do {
-            stream.next_out = (unsigned char *)tmp_out;
-            stream.avail_out = buffer_size;
-            res = inflate(&stream, 0);
-            assert(res == Z_OK || res == Z_STREAM_END);
-            ssize_t len = (buffer_size - stream.avail_out);
-            ssize_t res = convert_io_write(ctx, tmp_out, len);
-            assert(res == len);
-        } while (stream.avail_in > 0);
+            ZSTD_outBuffer output = { tmp_out, sizeof(tmp_out), 0 };
+            remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+            assert(!ZSTD_isError(remaining));
+            convert_io_write_all(ctx, tmp_out, output.pos);
+        } while ((mode == ZSTD_e_end) ? (remaining != 0) : (input.pos < input.size));
     }
+}
 
-    // Read output buffer empty
-    do {
-        stream.next_out = (unsigned char *)tmp_out;
-        stream.avail_out = buffer_size;
-        res = inflate(&stream, Z_FINISH);
-        assert(res == Z_OK || res == Z_STREAM_END);
-        ssize_t len = (buffer_size - stream.avail_out);
-        ssize_t res = convert_io_write(ctx, tmp_out, len);
-        assert(res == len);
-    } while (res != Z_STREAM_END);
+static void do_convert_zstd_compress(struct ConvertContext *ctx, int level)
+{
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    assert(cctx != NULL);
+    if (level) {
+        size_t res = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+        assert(!ZSTD_isError(res));
+    }
+
+    zstd_compress_stream(ctx, cctx);
+    ZSTD_freeCCtx(cctx);
+}
+
+// The level is ignored, the dictionary has been prepared for CONVERT_DICTIONARY_LEVEL
+static void do_convert_zstd_dict_compress(struct ConvertContext *ctx, int level)
+{
+    assert(convert_zstd_cdict != NULL);
+
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    assert(cctx != NULL);
+    size_t res = ZSTD_CCtx_refCDict(cctx, convert_zstd_cdict);
+    assert(!ZSTD_isError(res));
+
+    zstd_compress_stream(ctx, cctx);
+    ZSTD_freeCCtx(cctx);
+}
+
+static void *zstd_decoder_new()
+{
+    ZSTD_DStream *dstream = ZSTD_createDStream();
+    assert(dstream != NULL);
+    return dstream;
+}
+
+static void *zstd_dict_decoder_new()
+{
+    assert(convert_zstd_ddict != NULL);
+
+    ZSTD_DStream *dstream = zstd_decoder_new();
+    size_t res = ZSTD_DCtx_refDDict(dstream, convert_zstd_ddict);
+    assert(!ZSTD_isError(res));
+    return dstream;
+}
+
+static int zstd_decoder_update(struct ConvertDecoder *decoder, char *buf, size_t len)
+{
+    char tmp_out[DEFAULT_BUFFER_SIZE];
+
+    ZSTD_inBuffer input = { buf, len, 0 };
+    int flush = 0;
+    while (input.pos < input.size || flush) {
+        if (decoder->done) {
+            // Trailing data after the end of the frame
+            return 1;
+        }
+
+        ZSTD_outBuffer output = { tmp_out, sizeof(tmp_out), 0 };
+        size_t res = ZSTD_decompressStream(decoder->state, &output, &input);
+        if (ZSTD_isError(res)) {
+            return 1;
+        }
+
+        convert_decoder_output(decoder, tmp_out, output.pos);
+
+        // A full output buffer might mean there is more buffered output
+        decoder->done = (res == 0);
+        flush = (!decoder->done && output.pos == output.size);
+    }
+
+    return 0;
+}
+
+static void zstd_decoder_free(void *state)
+{
+    ZSTD_freeDStream(state);
+}
+#endif /* USE_ZSTD */
+
+#if defined(USE_LZ4)
+static void do_convert_lz4_compress(struct ConvertContext *ctx, int level)
+{
+    char tmp_in[DEFAULT_BUFFER_SIZE];
+
+    // Levels >= LZ4HC_CLEVEL_MIN (3) use the high compression mode
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = level;
+
+    // Large enough for the frame header and footer, and for any input block
+    size_t buffer_size = LZ4F_compressBound(sizeof(tmp_in), &prefs);
+    if (buffer_size < LZ4F_HEADER_SIZE_MAX) {
+        buffer_size = LZ4F_HEADER_SIZE_MAX;
+    }
+    char *tmp_out = malloc(buffer_size);
+
+    LZ4F_cctx *cctx = NULL;
+    size_t res = LZ4F_createCompressionContext(&cctx, LZ4F_VERSION);
+    assert(!LZ4F_isError(res));
+
+    res = LZ4F_compressBegin(cctx, tmp_out, buffer_size, &prefs);
+    assert(!LZ4F_isError(res));
+    convert_io_write_all(ctx, tmp_out, res);
+
+    ssize_t read_bytes = 0;
+    while ((read_bytes = convert_io_read(ctx, tmp_in, sizeof(tmp_in))) != 0) {
+        res = LZ4F_compressUpdate(cctx, tmp_out, buffer_size, tmp_in, read_bytes, NULL);
+        assert(!LZ4F_isError(res));
+        convert_io_write_all(ctx, tmp_out, res);
+    }
+
+    res = LZ4F_compressEnd(cctx, tmp_out, buffer_size, NULL);
+    assert(!LZ4F_isError(res));
+    convert_io_write_all(ctx, tmp_out, res);
+
+    LZ4F_freeCompressionContext(cctx);
+    free(tmp_out);
+}
+
+static void *lz4_decoder_new()
+{
+    LZ4F_dctx *dctx = NULL;
+    size_t res = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+    assert(!LZ4F_isError(res));
+    return dctx;
+}
+
+static int lz4_decoder_update(struct ConvertDecoder *decoder, char *buf, size_t len)
+{
+    char tmp_out[DEFAULT_BUFFER_SIZE];
+
+    size_t pos = 0;
+    int flush = 0;
+    while (pos < len || flush) {
+        if (decoder->done) {
+            // Trailing data after the end of the frame
+            return 1;
+        }
+
+        size_t in_size = len - pos;
+        size_t out_size = sizeof(tmp_out);
+        size_t res = LZ4F_decompress(decoder->state, tmp_out, &out_size, buf + pos, &in_size, NULL);
+        if (LZ4F_isError(res)) {
+            return 1;
+        }
+
+        pos += in_size;
+        convert_decoder_output(decoder, tmp_out, out_size);
+
+        // A full output buffer might mean there is more buffered output
+        decoder->done = (res == 0);
+        flush = (!decoder->done && out_size == sizeof(tmp_out));
+    }
+
+    return 0;
+}
+
+static void lz4_decoder_free(void *state)
+{
+    LZ4F_freeDecompressionContext(state);
+}
+#endif /* USE_LZ4 */
+
+static const struct ConvertCodecOps convert_codecs[CONVERT_CODEC_COUNT] = {
+    [CONVERT_CODEC_ZLIB] = { "zlib", BLOB_FLAG_ZCOMPRESSED,
+        do_convert_zcompressed, zlib_decoder_new, zlib_decoder_update, zlib_decoder_free },
+#if defined(USE_ZSTD)
+    [CONVERT_CODEC_ZSTD] = { "zstd", BLOB_FLAG_ZSTD,
+        do_convert_zstd_compress, zstd_decoder_new, zstd_decoder_update, zstd_decoder_free },
+#else
+    [CONVERT_CODEC_ZSTD] = { "zstd", BLOB_FLAG_ZSTD },
+#endif
+#if defined(USE_LZ4)
+    [CONVERT_CODEC_LZ4] = { "lz4", BLOB_FLAG_LZ4,
+        do_convert_lz4_compress, lz4_decoder_new, lz4_decoder_update, lz4_decoder_free },
+#else
+    [CONVERT_CODEC_LZ4] = { "lz4", BLOB_FLAG_LZ4 },
+#endif
+#if defined(USE_ZSTD)
+    [CONVERT_CODEC_ZSTD_DICT] = { "zstd-dict", BLOB_FLAG_ZSTD_DICT,
+        do_convert_zstd_dict_compress, zstd_dict_decoder_new, zstd_decoder_update, zstd_decoder_free },
+#else
+    [CONVERT_CODEC_ZSTD_DICT] = { "zstd-dict", BLOB_FLAG_ZSTD_DICT },
+#endif
+};
+
+int convert_set_dictionary(const char *data, size_t length)
+{
+#if defined(USE_ZSTD)
+    ZSTD_freeCDict(convert_zstd_cdict);
+    ZSTD_freeDDict(convert_zstd_ddict);
+    convert_zstd_cdict = NULL;
+    convert_zstd_ddict = NULL;
+
+    if (data == NULL) {
+        return 1;
+    }
+
+    convert_zstd_cdict = ZSTD_createCDict(data, length, CONVERT_DICTIONARY_LEVEL);
+    convert_zstd_ddict = ZSTD_createDDict(data, length);
+    if (convert_zstd_cdict == NULL || convert_zstd_ddict == NULL) {
+        convert_set_dictionary(NULL, 0);
+        return 0;
+    }
+
+    return 1;
+#else
+    return (data == NULL);
+#endif
+}
+
+size_t convert_train_dictionary(const char *samples, const size_t *sample_sizes, uint32_t count,
+        char *dictionary, size_t capacity)
+{
+#if defined(USE_ZSTD)
+    size_t res = ZDICT_trainFromBuffer(dictionary, capacity, samples, sample_sizes, count);
+    if (ZDICT_isError(res)) {
+        SFMF_DEBUG("Could not train dictionary: %s\n", ZDICT_getErrorName(res));
+        return 0;
+    }
+
+    return res;
+#else
+    return 0;
+#endif
+}
+
+const char *convert_codec_name(enum ConvertCodec codec)
+{
+    assert(codec < CONVERT_CODEC_COUNT);
+    return convert_codecs[codec].name;
+}
+
+int convert_codec_from_name(const char *name, enum ConvertCodec *codec)
+{
+    for (int i=0; i<CONVERT_CODEC_COUNT; i++) {
+        if (strcmp(convert_codecs[i].name, name) == 0) {
+            *codec = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int convert_codec_available(enum ConvertCodec codec)
+{
+#if defined(USE_ZSTD)
+    if (codec == CONVERT_CODEC_ZSTD_DICT && convert_zstd_cdict == NULL) {
+        return 0;
+    }
+#endif
+
+    return (codec < CONVERT_CODEC_COUNT && convert_codecs[codec].compress != NULL);
+}
+
+uint32_t convert_codec_blob_flag(enum ConvertCodec codec)
+{
+    assert(codec < CONVERT_CODEC_COUNT);
+    return convert_codecs[codec].blob_flag;
+}
+
+int convert_codec_from_blob_flags(uint32_t blob_flags, enum ConvertCodec *codec)
+{
+    for (int i=0; i<CONVERT_CODEC_COUNT; i++) {
+        if (blob_flags == convert_codecs[i].blob_flag) {
+            *codec = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+enum ConvertFlags convert_flags_compress(enum ConvertCodec codec)
+{
+    return CONVERT_FLAG_ZCOMPRESS | CONVERT_FLAG_CODEC(codec);
+}
+
+enum ConvertFlags convert_flags_compress_level(enum ConvertCodec codec, int level)
+{
+    assert(level >= 0 && level <= 0xFF);
+    return convert_flags_compress(codec) | CONVERT_FLAG_LEVEL(level);
+}
+
+enum ConvertFlags convert_flags_uncompress(enum ConvertCodec codec)
+{
+    return CONVERT_FLAG_ZUNCOMPRESS | CONVERT_FLAG_CODEC(codec);
+}
+
+enum ConvertCodec convert_flags_codec(enum ConvertFlags flags)
+{
+    return (flags >> CONVERT_FLAG_CODEC_SHIFT) & 0xFF;
+}
+
+int convert_flags_level(enum ConvertFlags flags)
+{
+    return (flags >> CONVERT_FLAG_LEVEL_SHIFT) & 0xFF;
+}
+
+uint32_t convert_flags_blob_flags(enum ConvertFlags flags)
+{
+    if ((flags & CONVERT_FLAG_DIRECTION_MASK) == CONVERT_FLAG_NONE) {
+        return BLOB_FLAG_NONE;
+    }
+
+    return convert_codec_blob_flag(convert_flags_codec(flags));
+}
+
+enum ConvertFlags convert_flags_for_blob(uint32_t blob_flags)
+{
+    if (blob_flags == BLOB_FLAG_NONE) {
+        return CONVERT_FLAG_NONE;
+    }
+
+    enum ConvertCodec codec;
+    if (!convert_codec_from_blob_flags(blob_flags, &codec)) {
+        SFMF_FAIL_AND_EXIT("Unsupported blob flags: 0x%x\n", blob_flags);
+    }
+
+    if (!convert_codec_available(codec)) {
+        if (codec == CONVERT_CODEC_ZSTD_DICT && convert_codec_available(CONVERT_CODEC_ZSTD)) {
+            SFMF_FAIL_AND_EXIT("Data is compressed with a dictionary, but none has been loaded\n");
+        }
+        SFMF_FAIL_AND_EXIT("Data is compressed with %s, which is not supported by this build\n",
+                convert_codec_name(codec));
+    }
+
+    return convert_flags_uncompress(codec);
+}
+
+static const struct ConvertCodecOps *convert_flags_get_codec(enum ConvertFlags flags)
+{
+    enum ConvertCodec codec = convert_flags_codec(flags);
+    assert(convert_codec_available(codec));
+    return &(convert_codecs[codec]);
+}
+
+static struct ConvertDecoder *convert_decoder_new(const struct ConvertCodecOps *ops, struct ConvertIO *output)
+{
+    struct ConvertDecoder *decoder = calloc(1, sizeof(struct ConvertDecoder));
+    decoder->ops = ops;
+    decoder->state = ops->decoder_new();
+    decoder->output = output;
+    return decoder;
+}
+
+static int convert_decoder_update(struct ConvertDecoder *decoder, char *buf, size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+
+    if (decoder->done) {
+        // Trailing garbage after the end of the compressed stream
+        return 1;
+    }
+
+    return decoder->ops->decoder_update(decoder, buf, len);
+}
+
+static void convert_decoder_free(struct ConvertDecoder *decoder)
+{
+    decoder->ops->decoder_free(decoder->state);
+    free(decoder);
+}
+
+// Returns nonzero if the input is not a valid (and complete) compressed stream
+static int do_convert_uncompress(struct ConvertContext *ctx, const struct ConvertCodecOps *ops)
+{
+    char buf[DEFAULT_BUFFER_SIZE];
+    ssize_t len;
+    int res = 0;
+
+    struct ConvertDecoder *decoder = convert_decoder_new(ops, ctx->write);
 
-    inflateEnd(&stream);
+    while (res == 0 && (len = convert_io_read(ctx, buf, sizeof(buf)))) {
+        res = convert_decoder_update(decoder, buf, len);
+    }
+
+    // Input must contain a complete compressed stream
+    if (res == 0 && !decoder->done) {
+        res = 1;
+    }
+
+    convert_decoder_free(decoder);
+
+    return res;
 }
 
 ssize_t file_convert_context_read(char *buffer, size_t len, void *user_data)
@@ -222,6 +715,20 @@ ssize_t buffer_convert_context_read(char *buffer, size_t len, void *user_data)
     return len;
 }
 
+ssize_t file_range_convert_context_read(char *buffer, size_t len, void *user_data)
+{
+    struct FileRangeConvertContextSource *source = user_data;
+
+    if (len > source->remaining) {
+        len = source->remaining;
+    }
+
+    size_t res = fread(buffer, 1, len, source->fp);
+    source->remaining -= res;
+
+    return res;
+}
+
 ssize_t file_convert_context_write(char *buffer, size_t len, void *user_data)
 {
     FILE *fp = user_data;
@@ -230,7 +737,7 @@ ssize_t file_convert_context_write(char *buffer, size_t len, void *user_data)
 
 static const char *get_compression_method(enum ConvertFlags flags)
 {
-    switch (flags) {
+    switch (flags & CONVERT_FLAG_DIRECTION_MASK) {
         case CONVERT_FLAG_NONE:
             return "copy";
         case CONVERT_FLAG_ZCOMPRESS:
@@ -245,55 +752,6 @@ static const char *get_compression_method(enum ConvertFlags flags)
     return "???";
 }
 
-#if defined(USE_LIBCURL)
-int convert_url_fp(const char *url, FILE *out, enum ConvertFlags flags)
-{
-    if (flags != CONVERT_FLAG_NONE) {
-        SFMF_WARN("Compression on URLs not supported\n");
-        return 1;
-    }
-
-    if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) {
-        SFMF_FAIL_AND_EXIT("Could not init cURL\n");
-    }
-
-    CURL *curl = curl_easy_init();
-    if (curl == NULL) {
-        SFMF_FAIL_AND_EXIT("Could not init cURL-easy\n");
-    }
-
-    SFMF_DEBUG("Download %s\n", url);
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, out);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "sfmf/" VERSION " (+https://sailfishos.org/)");
-
-    /* Error handling */
-    //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L * 20L /* seconds */);
-    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 4196L /* bytes/second */);
-    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 10L /* seconds */);
-
-    /* Authentication */
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-
-    /* Redirection */
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 10L);
-
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        SFMF_FAIL_AND_EXIT("Could not download %s: %s\n", url, curl_easy_strerror(res));
-    }
-
-    curl_easy_cleanup(curl);
-    curl_global_cleanup();
-
-    return 0;
-}
-#endif /* USE_LIBCURL */
-
 int convert_file(const char *infile, const char *outfile, enum ConvertFlags flags)
 {
     SFMF_DEBUG("Convert %s -> %s (%s)\n", infile, outfile, get_compression_method(flags));
@@ -312,29 +770,82 @@ int convert_file(const char *infile, const char *outfile, enum ConvertFlags flag
     return 0;
 }
 
+static ssize_t sha1_convert_context_write(char *buf, size_t len, void *user_data)
+{
+    SHA1_CTX *ctx = user_data;
+
+    // SHA1HANDSOFF is defined, so SHA1_Update() doesn't modify the buffer
+    SHA1_Update(ctx, (const uint8_t *)buf, len);
+
+    return len;
+}
+
 static int run_conversion(struct ConvertIO *read_io, struct ConvertIO *write_io, enum ConvertFlags flags)
 {
     struct ConvertContext ctx = {
         read_io,
         write_io,
     };
+    int res = 0;
 
-    switch (flags) {
+    switch (flags & CONVERT_FLAG_DIRECTION_MASK) {
         case CONVERT_FLAG_NONE:
             do_convert_uncompressed(&ctx);
             break;
         case CONVERT_FLAG_ZCOMPRESS:
-            do_convert_zcompressed(&ctx);
+            convert_flags_get_codec(flags)->compress(&ctx, convert_flags_level(flags));
             break;
         case CONVERT_FLAG_ZUNCOMPRESS:
-            do_convert_zdecompress(&ctx);
+            res = do_convert_uncompress(&ctx, convert_flags_get_codec(flags));
             break;
         default:
             assert(0);
             break;
     }
 
-    return 0;
+    return res;
+}
+
+/**
+ * Like run_conversion(), but if hash is not NULL, also tee the written
+ * (i.e. decompressed) data into a SHA-1 sink, so that the output can be
+ * verified without reading it back from disk.
+ **/
+static int run_conversion_hash(struct ConvertIO *read_io, struct ConvertIO *write_io,
+        enum ConvertFlags flags, struct SFMF_FileHash *hash)
+{
+    if (hash == NULL) {
+        return run_conversion(read_io, write_io, flags);
+    }
+
+    SHA1_CTX sha1ctx;
+    SHA1_Init(&sha1ctx);
+
+    struct ConvertIO sha1_write_io = {
+        sha1_convert_context_write,
+        &sha1ctx,
+        0,
+    };
+
+    struct DuplicateConvertIOContext dup_ctx = {
+        write_io,
+        &sha1_write_io,
+    };
+
+    struct ConvertIO dup_write_io = {
+        duplicate_convert_io_write,
+        &dup_ctx,
+        0,
+    };
+
+    int res = run_conversion(read_io, &dup_write_io, flags);
+
+    memset(hash, 0, sizeof(*hash));
+    hash->hashtype = HASHTYPE_SHA1;
+    SHA1_Final(&sha1ctx, (unsigned char *)&(hash->hash));
+    hash->size = sha1_write_io.total;
+
+    return res;
 }
 
 // Taken from GNU coreutils' src/copy.c
@@ -349,6 +860,11 @@ clone_file (int dest_fd, int src_fd)
 }
 
 int convert_file_fp(FILE *infile, FILE *outfile, enum ConvertFlags flags)
+{
+    return convert_file_fp_hash(infile, outfile, flags, NULL);
+}
+
+int convert_file_fp_hash(FILE *infile, FILE *outfile, enum ConvertFlags flags, struct SFMF_FileHash *hash)
 {
     struct ConvertIO read_io = {
         file_convert_context_read,
@@ -374,6 +890,10 @@ int convert_file_fp(FILE *infile, FILE *outfile, enum ConvertFlags flags)
         if (src_fd != -1 && dest_fd != -1) {
             if (clone_file(dest_fd, src_fd) == 0) {
                 fprintf(stderr, "BTRFS: Successfully reflinked file (CoW)\n");
+                if (hash) {
+                    // No data passed through, the caller has to use the source hash
+                    memset(hash, 0, sizeof(*hash));
+                }
                 return 0;
             } else {
                 //fprintf(stderr, "BTRFS: Could not reflink file (%s)\n", strerror(errno));
@@ -381,10 +901,15 @@ int convert_file_fp(FILE *infile, FILE *outfile, enum ConvertFlags flags)
         }
     }
 
-    return run_conversion(&read_io, &write_io, flags);
+    return run_conversion_hash(&read_io, &write_io, flags, hash);
 }
 
 int convert_buffer_fp(char *buf, size_t len, FILE *outfile, enum ConvertFlags flags)
+{
+    return convert_buffer_fp_hash(buf, len, outfile, flags, NULL);
+}
+
+int convert_buffer_fp_hash(char *buf, size_t len, FILE *outfile, enum ConvertFlags flags, struct SFMF_FileHash *hash)
 {
     struct BufferConvertContextSource source = { buf, len, 0 };
 
@@ -400,21 +925,47 @@ int convert_buffer_fp(char *buf, size_t len, FILE *outfile, enum ConvertFlags fl
         0,
     };
 
-    return run_conversion(&read_io, &write_io, flags);
+    return run_conversion_hash(&read_io, &write_io, flags, hash);
 }
 
-static ssize_t sha1_convert_context_write(char *buf, size_t len, void *user_data)
+int convert_buffer_zuncompress(const char *buf, size_t len, char *out, size_t out_len)
 {
-    SHA1_CTX *ctx = user_data;
+    uLongf dest_len = out_len;
+    int res = uncompress((Bytef *)out, &dest_len, (const Bytef *)buf, len);
 
-    // When we don't have SHA1HANDSOFF defined, SHA1_Update will modify the contents
-    // of the buffer passed to it, which we can't allow, so we use a local one here.
-    unsigned char *tmp = malloc(len);
-    memcpy(tmp, buf, len);
-    SHA1_Update(ctx, tmp, len);
-    free(tmp);
+    return (res != Z_OK || dest_len != out_len);
+}
 
-    return len;
+int convert_file_range_fp(FILE *infile, uint64_t len, FILE *outfile, enum ConvertFlags flags)
+{
+    return convert_file_range_fp_hash(infile, len, outfile, flags, NULL);
+}
+
+int convert_file_range_fp_hash(FILE *infile, uint64_t len, FILE *outfile, enum ConvertFlags flags,
+        struct SFMF_FileHash *hash)
+{
+    struct FileRangeConvertContextSource source = { infile, len };
+
+    struct ConvertIO read_io = {
+        file_range_convert_context_read,
+        &source,
+        0,
+    };
+
+    struct ConvertIO write_io = {
+        file_convert_context_write,
+        outfile,
+        0,
+    };
+
+    int res = run_conversion_hash(&read_io, &write_io, flags, hash);
+
+    // Short read (truncated input file)
+    if (source.remaining != 0) {
+        return 1;
+    }
+
+    return res;
 }
 
 static ssize_t null_convert_context_write(char *buf, size_t len, void *user_data)
@@ -423,7 +974,55 @@ static ssize_t null_convert_context_write(char *buf, size_t len, void *user_data
     return len;
 }
 
-int convert_file_zsize_hash(const char *filename, struct SFMF_FileHash *hash, uint32_t *zsize)
+uint64_t convert_buffer_size(char *buf, size_t len, enum ConvertFlags flags)
+{
+    struct BufferConvertContextSource source = { buf, len, 0 };
+
+    struct ConvertIO read_io = {
+        buffer_convert_context_read,
+        &source,
+        0,
+    };
+
+    struct ConvertIO null_write_io = {
+        null_convert_context_write,
+        NULL,
+        0,
+    };
+
+    int res = run_conversion(&read_io, &null_write_io, flags);
+    assert(res == 0);
+
+    return null_write_io.total;
+}
+
+int convert_file_zsize_hash(const char *filename, struct SFMF_FileHash *hash, uint64_t *zsize)
+{
+    return convert_file_zsize_hash_fp(filename, hash, zsize, NULL, CONVERT_FLAG_ZCOMPRESS);
+}
+
+struct ObserverConvertContext {
+    convert_observer_func_t func;
+    void *user_data;
+};
+
+static ssize_t observer_convert_context_write(char *buf, size_t len, void *user_data)
+{
+    struct ObserverConvertContext *ctx = user_data;
+
+    ctx->func(buf, len, ctx->user_data);
+
+    return len;
+}
+
+int convert_file_zsize_hash_fp(const char *filename, struct SFMF_FileHash *hash, uint64_t *zsize,
+        FILE *zout, enum ConvertFlags flags)
+{
+    return convert_file_zsize_hash_observe_fp(filename, hash, zsize, zout, flags, NULL, NULL);
+}
+
+int convert_file_zsize_hash_observe_fp(const char *filename, struct SFMF_FileHash *hash, uint64_t *zsize,
+        FILE *zout, enum ConvertFlags flags, convert_observer_func_t observer, void *observer_data)
 {
     FILE *infile = fopen(filename, "rb");
     assert(infile != NULL);
@@ -433,13 +1032,13 @@ int convert_file_zsize_hash(const char *filename, struct SFMF_FileHash *hash, ui
     //  (o) -- (sha1) --> (zcompress) --> (o)
     //   ^       ^ calculate sha1sum       ^
     //   |                                 |
-    //   |                 discard output, but remember
-    //   |                 total bytes written (=zsize)
+    //   |                 discard output (or write to zout),
+    //   |                 remember total bytes written (=zsize)
     //   file source
     //
     // Or with the structs from below:
     //
-    // file_read_io -> dup_ctx -> sha1_write_io
+    // file_read_io -> dup_ctx -> sha1_write_io (-> observer_write_io)
     //                    |
     //                    +-> dup_read_io -> (zcompress) -> null_write_io
 
@@ -458,9 +1057,31 @@ int convert_file_zsize_hash(const char *filename, struct SFMF_FileHash *hash, ui
         0,
     };
 
+    struct ObserverConvertContext observer_ctx = {
+        observer,
+        observer_data,
+    };
+
+    struct ConvertIO observer_write_io = {
+        observer_convert_context_write,
+        &observer_ctx,
+        0,
+    };
+
+    struct DuplicateConvertIOContext observer_dup_ctx = {
+        &sha1_write_io,
+        &observer_write_io,
+    };
+
+    struct ConvertIO observer_dup_write_io = {
+        duplicate_convert_io_write,
+        &observer_dup_ctx,
+        0,
+    };
+
     struct DuplicateConvertIOContext dup_ctx = {
         &file_read_io,
-        &sha1_write_io,
+        observer ? &observer_dup_write_io : &sha1_write_io,
     };
 
     struct ConvertIO dup_read_io = {
@@ -470,14 +1091,14 @@ int convert_file_zsize_hash(const char *filename, struct SFMF_FileHash *hash, ui
     };
 
     struct ConvertIO null_write_io = {
-        null_convert_context_write,
-        NULL,
+        zout ? file_convert_context_write : null_convert_context_write,
+        zout,
         0,
     };
 
     // Only compress if the caller is interested in the zsize
     int res = run_conversion(&dup_read_io, &null_write_io,
-            zsize ? CONVERT_FLAG_ZCOMPRESS : CONVERT_FLAG_NONE);
+            zsize ? flags : CONVERT_FLAG_NONE);
 
     hash->hashtype = HASHTYPE_SHA1;
     SHA1_Final(&sha1ctx, (unsigned char *)&(hash->hash));
@@ -526,3 +1147,115 @@ int convert_file_hash(const char *filename, struct SFMF_FileHash *hash, enum Con
 
     return res;
 }
+
+struct ConvertHasher {
+    SHA1_CTX sha1ctx;
+    struct ConvertIO sha1_io; // total = uncompressed bytes hashed so far
+
+    struct ConvertDecoder *decoder; // NULL if data is not compressed
+
+    int error;
+};
+
+struct ConvertHasher *convert_hasher_new(enum ConvertFlags flags)
+{
+    assert((flags & CONVERT_FLAG_DIRECTION_MASK) == CONVERT_FLAG_NONE ||
+            (flags & CONVERT_FLAG_DIRECTION_MASK) == CONVERT_FLAG_ZUNCOMPRESS);
+
+    struct ConvertHasher *hasher = calloc(1, sizeof(struct ConvertHasher));
+    SHA1_Init(&(hasher->sha1ctx));
+
+    hasher->sha1_io.transfer = sha1_convert_context_write;
+    hasher->sha1_io.user_data = &(hasher->sha1ctx);
+
+    if ((flags & CONVERT_FLAG_DIRECTION_MASK) == CONVERT_FLAG_ZUNCOMPRESS) {
+        hasher->decoder = convert_decoder_new(convert_flags_get_codec(flags), &(hasher->sha1_io));
+    }
+
+    return hasher;
+}
+
+int convert_hasher_update(struct ConvertHasher *hasher, char *buf, size_t len)
+{
+    if (hasher->error) {
+        return 1;
+    }
+
+    if (!hasher->decoder) {
+        sha1_convert_context_write(buf, len, &(hasher->sha1ctx));
+        hasher->sha1_io.total += len;
+        return 0;
+    }
+
+    if (convert_decoder_update(hasher->decoder, buf, len) != 0) {
+        hasher->error = 1;
+    }
+
+    return hasher->error;
+}
+
+int convert_hasher_finish(struct ConvertHasher *hasher, struct SFMF_FileHash *hash)
+{
+    if (hasher->decoder && !hasher->decoder->done) {
+        // Truncated compressed stream
+        hasher->error = 1;
+    }
+
+    memset(hash, 0, sizeof(*hash));
+    if (!hasher->error) {
+        hash->hashtype = HASHTYPE_SHA1;
+        hash->size = hasher->sha1_io.total;
+    }
+    SHA1_Final(&(hasher->sha1ctx), (unsigned char *)&(hash->hash));
+
+    return hasher->error;
+}
+
+void convert_hasher_free(struct ConvertHasher *hasher)
+{
+    if (hasher->decoder) {
+        convert_decoder_free(hasher->decoder);
+    }
+
+    free(hasher);
+}
+
+struct ConvertHasherStream {
+    struct ConvertHasher *hasher;
+    FILE *outfile;
+};
+
+static ssize_t convert_hasher_stream_write(void *cookie, const char *buf, size_t size)
+{
+    struct ConvertHasherStream *stream = cookie;
+
+    if (size > 0 && fwrite(buf, size, 1, stream->outfile) != 1) {
+        return -1;
+    }
+
+    convert_hasher_update(stream->hasher, (char *)buf, size);
+    return size;
+}
+
+static int convert_hasher_stream_close(void *cookie)
+{
+    struct ConvertHasherStream *stream = cookie;
+    int res = fflush(stream->outfile);
+    free(stream);
+    return res;
+}
+
+FILE *convert_hasher_fopen(struct ConvertHasher *hasher, FILE *outfile)
+{
+    struct ConvertHasherStream *stream = calloc(1, sizeof(struct ConvertHasherStream));
+    stream->hasher = hasher;
+    stream->outfile = outfile;
+
+    cookie_io_functions_t functions = { NULL, convert_hasher_stream_write, NULL, convert_hasher_stream_close };
+    FILE *fp = fopencookie(stream, "w", functions);
+    if (fp == NULL) {
+        free(stream);
+    }
+
+    return fp;
+}
@@ -25,28 +25,129 @@
 
 #define DEFAULT_BUFFER_SIZE (64 * 1024)
 
+/**
+ * Compression codecs; zlib is always available, the others only if
+ * enabled at build time (USE_ZSTD=1, USE_LZ4=1). Each codec has its own
+ * SFMF_BlobEntry_Flag that marks blobs compressed with it.
+ * CONVERT_CODEC_ZSTD_DICT is zstd against the shared dictionary of the
+ * manifest, and is only available after convert_set_dictionary().
+ **/
+enum ConvertCodec {
+    CONVERT_CODEC_ZLIB = 0,
+    CONVERT_CODEC_ZSTD = 1,
+    CONVERT_CODEC_LZ4 = 2,
+    CONVERT_CODEC_ZSTD_DICT = 3,
+    CONVERT_CODEC_COUNT,
+};
+
+/**
+ * Conversion to apply: ZCOMPRESS/ZUNCOMPRESS use zlib by default, another
+ * codec can be selected by OR-ing in CONVERT_FLAG_CODEC(codec), and for
+ * compression a codec-specific level with CONVERT_FLAG_LEVEL(level) (0 is
+ * the default level of the codec); use the convert_flags_*() functions
+ * below instead of building flags by hand.
+ **/
 enum ConvertFlags {
     CONVERT_FLAG_NONE = 0,
     CONVERT_FLAG_ZCOMPRESS = 1,
     CONVERT_FLAG_ZUNCOMPRESS = 2,
 };
 
+#define CONVERT_FLAG_DIRECTION_MASK 0xFF
+#define CONVERT_FLAG_CODEC_SHIFT 8
+#define CONVERT_FLAG_CODEC(codec) ((codec) << CONVERT_FLAG_CODEC_SHIFT)
+#define CONVERT_FLAG_LEVEL_SHIFT 16
+#define CONVERT_FLAG_LEVEL(level) ((level) << CONVERT_FLAG_LEVEL_SHIFT)
+
+const char *convert_codec_name(enum ConvertCodec codec);
+// Returns 1 and sets *codec if name is a known codec, 0 otherwise
+int convert_codec_from_name(const char *name, enum ConvertCodec *codec);
+// Returns 1 if the codec has been compiled in
+int convert_codec_available(enum ConvertCodec codec);
+// SFMF_BlobEntry_Flag value for blobs compressed with codec
+uint32_t convert_codec_blob_flag(enum ConvertCodec codec);
+// Returns 1 and sets *codec if blob_flags (SFMF_BlobEntry_Flag values) describe
+// data compressed with a known codec, 0 otherwise
+int convert_codec_from_blob_flags(uint32_t blob_flags, enum ConvertCodec *codec);
+
+enum ConvertFlags convert_flags_compress(enum ConvertCodec codec);
+enum ConvertFlags convert_flags_compress_level(enum ConvertCodec codec, int level);
+enum ConvertFlags convert_flags_uncompress(enum ConvertCodec codec);
+enum ConvertCodec convert_flags_codec(enum ConvertFlags flags);
+int convert_flags_level(enum ConvertFlags flags);
+// SFMF_BlobEntry_Flag values for data written with flags (compressed or not)
+uint32_t convert_flags_blob_flags(enum ConvertFlags flags);
+// Flags for reading a blob stored with the given SFMF_BlobEntry_Flag values
+// (CONVERT_FLAG_NONE if uncompressed); fails if the codec is not available
+enum ConvertFlags convert_flags_for_blob(uint32_t blob_flags);
+
+// Sets the dictionary used by CONVERT_CODEC_ZSTD_DICT (NULL to unset); the data
+// is copied. Must be called before any conversions with that codec are started.
+// Returns 0 if the dictionary is invalid (or zstd is not supported by this build)
+int convert_set_dictionary(const char *data, size_t length);
+// Trains a dictionary of at most capacity bytes into dictionary from count samples
+// (stored back to back in samples); returns its size, or 0 on failure
+size_t convert_train_dictionary(const char *samples, const size_t *sample_sizes, uint32_t count,
+        char *dictionary, size_t capacity);
+
+// Conversions in worker threads must not pump the (D-Bus) mainloop
+void convert_set_thread_pumps_mainloop(int enabled);
+
 /**
  * convert a file (infile) to another file (outfile),
- * optionally with zlib compression (deflate)
+ * optionally with compression or decompression; when decompressing,
+ * returns nonzero if the input is not a valid compressed stream
  **/
-#if defined(USE_LIBCURL)
-int convert_url_fp(const char *url, FILE *outfile, enum ConvertFlags flags);
-#endif /* USE_LIBCURL */
 int convert_file(const char *infile, const char *outfile, enum ConvertFlags flags);
 int convert_file_fp(FILE *infile, FILE *outfile, enum ConvertFlags flags);
 int convert_buffer_fp(char *buf, size_t len, FILE *outfile, enum ConvertFlags flags);
+// Converts exactly len bytes, starting at the current position of infile
+int convert_file_range_fp(FILE *infile, uint64_t len, FILE *outfile, enum ConvertFlags flags);
+// Inflates the compressed data in buf into exactly out_len bytes at out;
+// returns nonzero if the data is invalid or doesn't have the expected size
+int convert_buffer_zuncompress(const char *buf, size_t len, char *out, size_t out_len);
+// Returns the number of bytes the conversion of buf would produce
+uint64_t convert_buffer_size(char *buf, size_t len, enum ConvertFlags flags);
+
+// Same as above, but also calculate the hash of the data written to outfile
+// while writing; if the file was reflinked (no data was transferred), the
+// hash is left with hashtype HASHTYPE_UNKNOWN
+int convert_file_fp_hash(FILE *infile, FILE *outfile, enum ConvertFlags flags, struct SFMF_FileHash *hash);
+int convert_buffer_fp_hash(char *buf, size_t len, FILE *outfile, enum ConvertFlags flags, struct SFMF_FileHash *hash);
+int convert_file_range_fp_hash(FILE *infile, uint64_t len, FILE *outfile, enum ConvertFlags flags,
+        struct SFMF_FileHash *hash);
 
 // Passing in NULL for zsize (if not required) will just calculate the hash of the file;
 // this is faster than also calculating the zsize (which compresses all input data). In
 // case zsize == NULL, the total size of the file will be stored in hash->size, which
 // is useful for getting a hash object for a given file to be compared later.
-int convert_file_zsize_hash(const char *filename, struct SFMF_FileHash *hash, uint32_t *zsize);
+int convert_file_zsize_hash(const char *filename, struct SFMF_FileHash *hash, uint64_t *zsize);
+// Like convert_file_zsize_hash(), but compresses with flags (instead of zlib at
+// the default level), and also writes the compressed data to zout (if not NULL)
+int convert_file_zsize_hash_fp(const char *filename, struct SFMF_FileHash *hash, uint64_t *zsize,
+        FILE *zout, enum ConvertFlags flags);
+// Called with all data of the file as it is read (the buffer must not be modified)
+typedef void (*convert_observer_func_t)(const char *buf, size_t len, void *user_data);
+// Like convert_file_zsize_hash_fp(), but also passes the data to observer (if not NULL),
+// so it can be inspected without reading the file a second time
+int convert_file_zsize_hash_observe_fp(const char *filename, struct SFMF_FileHash *hash, uint64_t *zsize,
+        FILE *zout, enum ConvertFlags flags, convert_observer_func_t observer, void *observer_data);
 int convert_file_hash(const char *filename, struct SFMF_FileHash *hash, enum ConvertFlags flags);
 
+/**
+ * Incremental hashing of data as it arrives (e.g. from the network);
+ * with CONVERT_FLAG_ZUNCOMPRESS (and a codec), data is decompressed before
+ * being hashed.
+ * convert_hasher_update() and convert_hasher_finish() return nonzero if
+ * the data is not a valid compressed stream (hash->hashtype is then unset).
+ **/
+struct ConvertHasher;
+struct ConvertHasher *convert_hasher_new(enum ConvertFlags flags);
+int convert_hasher_update(struct ConvertHasher *hasher, char *buf, size_t len);
+int convert_hasher_finish(struct ConvertHasher *hasher, struct SFMF_FileHash *hash);
+void convert_hasher_free(struct ConvertHasher *hasher);
+// Returns a stream that writes through to outfile and hashes everything written with
+// hasher (e.g. to hash a file that is written in parts); closing the stream keeps outfile open
+FILE *convert_hasher_fopen(struct ConvertHasher *hasher, FILE *outfile);
+
 #endif /* SAILFISH_SNAPSHOT_CONVERT_H */
@@ -0,0 +1,237 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#include "costmodel.h"
+
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+/* Number of bytes at the start of a file used for estimating compressed sizes */
+#define COSTMODEL_SAMPLE_SIZE (256 * 1024)
+
+/* Files that don't compress below this percentage with a fast setting are stored */
+#define COSTMODEL_INCOMPRESSIBLE_PERCENT 98
+
+/* Slow, high-ratio settings are only tried for files of at least this size */
+#define COSTMODEL_HIGH_RATIO_MIN_SIZE (64 * 1024)
+
+/* Default expected download speed */
+#define COSTMODEL_DEFAULT_BANDWIDTH_KIB 1024
+
+struct CostModelCandidate {
+    const char *name;
+    enum ConvertCodec codec;
+    int level; // 0 = default level of the codec
+    uint64_t min_size; // only considered for files of at least this size
+    int small_only; // only considered for files up to dictionary_max_size
+};
+
+static const struct CostModelCandidate costmodel_candidates[] = {
+    { "stored" },
+    { "zlib", CONVERT_CODEC_ZLIB, 0, 0 },
+    { "zlib-9", CONVERT_CODEC_ZLIB, 9, COSTMODEL_HIGH_RATIO_MIN_SIZE },
+    { "zstd", CONVERT_CODEC_ZSTD, 0, 0 },
+    { "zstd-19", CONVERT_CODEC_ZSTD, 19, COSTMODEL_HIGH_RATIO_MIN_SIZE },
+    { "lz4", CONVERT_CODEC_LZ4, 0, 0 },
+    { "lz4-9", CONVERT_CODEC_LZ4, 9, COSTMODEL_HIGH_RATIO_MIN_SIZE },
+    { "zstd-dict", CONVERT_CODEC_ZSTD_DICT, 0, 0, 1 },
+};
+
+#define COSTMODEL_CANDIDATES (sizeof(costmodel_candidates) / sizeof(costmodel_candidates[0]))
+
+/* The candidate that sfmf-pack used for all files before adaptive selection */
+#define COSTMODEL_BASELINE 1
+
+struct CostModel *costmodel_new()
+{
+    assert(COSTMODEL_CANDIDATES <= COSTMODEL_MAX_CANDIDATES);
+
+    struct CostModel *model = calloc(1, sizeof(struct CostModel));
+
+    model->codec = CONVERT_CODEC_ZLIB;
+    model->bandwidth = COSTMODEL_DEFAULT_BANDWIDTH_KIB * 1024.0;
+
+    // Rough single-core decompression speeds on a phone (MiB/s of output)
+    model->decode_speed[CONVERT_CODEC_ZLIB] = 60 * 1024.0 * 1024.0;
+    model->decode_speed[CONVERT_CODEC_ZSTD] = 250 * 1024.0 * 1024.0;
+    model->decode_speed[CONVERT_CODEC_LZ4] = 800 * 1024.0 * 1024.0;
+    model->decode_speed[CONVERT_CODEC_ZSTD_DICT] = 250 * 1024.0 * 1024.0;
+
+    return model;
+}
+
+void costmodel_free(struct CostModel *model)
+{
+    free(model);
+}
+
+int costmodel_set_decode_speed(struct CostModel *model, const char *spec)
+{
+    const char *sep = strchr(spec, '=');
+    if (sep == NULL) {
+        return 0;
+    }
+
+    char *name = strndup(spec, sep - spec);
+    enum ConvertCodec codec;
+    int found = convert_codec_from_name(name, &codec);
+    free(name);
+
+    char *endptr = NULL;
+    double speed = strtod(sep + 1, &endptr);
+    if (!found || *(sep + 1) == '\0' || *endptr != '\0' || speed <= 0) {
+        return 0;
+    }
+
+    model->decode_speed[codec] = speed * 1024.0 * 1024.0;
+    return 1;
+}
+
+static double costmodel_decode_time(struct CostModel *model, enum ConvertCodec codec, uint64_t size)
+{
+    return (double)size / model->decode_speed[codec];
+}
+
+enum ConvertFlags costmodel_choose(struct CostModel *model, const char *filename, uint64_t size,
+        struct CostEstimate *estimate)
+{
+    memset(estimate, 0, sizeof(*estimate));
+    estimate->baseline_zsize = size;
+
+    int small = (size <= model->dictionary_max_size);
+
+    if (!model->adaptive) {
+        if (small && convert_codec_available(CONVERT_CODEC_ZSTD_DICT)) {
+            return convert_flags_compress(CONVERT_CODEC_ZSTD_DICT);
+        }
+        return convert_flags_compress(model->codec);
+    }
+
+    size_t sample_length = (size < COSTMODEL_SAMPLE_SIZE) ? size : COSTMODEL_SAMPLE_SIZE;
+    char *sample = malloc(sample_length + 1);
+
+    FILE *fp = fopen(filename, "rb");
+    assert(fp != NULL);
+    sample_length = fread(sample, 1, sample_length, fp);
+    fclose(fp);
+
+    // Already-compressed data (media files, archives) is stored as-is
+    uint64_t probe = convert_buffer_size(sample, sample_length,
+            convert_flags_compress_level(CONVERT_CODEC_ZLIB, 1));
+    if (sample_length == 0 || probe * 100 >= (uint64_t)sample_length * COSTMODEL_INCOMPRESSIBLE_PERCENT) {
+        free(sample);
+        return CONVERT_FLAG_NONE;
+    }
+
+    // Storing costs the download of the whole file, but no decoding
+    double best_cost = (double)size / model->bandwidth;
+
+    for (int i=1; i<COSTMODEL_CANDIDATES; i++) {
+        const struct CostModelCandidate *candidate = &(costmodel_candidates[i]);
+        if (!convert_codec_available(candidate->codec) || size < candidate->min_size ||
+                (candidate->small_only && !small)) {
+            continue;
+        }
+
+        enum ConvertFlags flags = convert_flags_compress_level(candidate->codec, candidate->level);
+        uint64_t zsize = convert_buffer_size(sample, sample_length, flags);
+
+        // Extrapolate from the sample to the whole file
+        uint64_t estimated = (uint64_t)((double)zsize * size / sample_length);
+        if (i == COSTMODEL_BASELINE && estimated < size) {
+            estimate->baseline_zsize = estimated;
+        }
+
+        double cost = (double)estimated / model->bandwidth +
+            costmodel_decode_time(model, candidate->codec, size);
+        if (cost < best_cost) {
+            best_cost = cost;
+            estimate->candidate = i;
+        }
+    }
+
+    free(sample);
+
+    if (estimate->candidate == 0) {
+        return CONVERT_FLAG_NONE;
+    }
+
+    const struct CostModelCandidate *best = &(costmodel_candidates[estimate->candidate]);
+    return convert_flags_compress_level(best->codec, best->level);
+}
+
+static void costmodel_stats_add(struct CostModelStats *stats, uint64_t size, uint64_t zsize, double decode_time)
+{
+    stats->files++;
+    stats->size += size;
+    stats->zsize += zsize;
+    stats->decode_time += decode_time;
+}
+
+void costmodel_account(struct CostModel *model, struct CostEstimate *estimate, uint64_t size, uint64_t zsize)
+{
+    if (!model->adaptive) {
+        return;
+    }
+
+    // The estimate might have been too optimistic, then the file is stored
+    int index = (zsize < size) ? estimate->candidate : 0;
+    const struct CostModelCandidate *candidate = &(costmodel_candidates[index]);
+    costmodel_stats_add(&(model->chosen[index]), size, (index != 0) ? zsize : size,
+            (index != 0) ? costmodel_decode_time(model, candidate->codec, size) : 0.0);
+
+    int baseline_compressed = (estimate->baseline_zsize < size);
+    costmodel_stats_add(&(model->baseline), size, estimate->baseline_zsize,
+            baseline_compressed ? costmodel_decode_time(model, CONVERT_CODEC_ZLIB, size) : 0.0);
+}
+
+void costmodel_report(struct CostModel *model)
+{
+    if (!model->adaptive) {
+        return;
+    }
+
+    struct CostModelStats total;
+    memset(&total, 0, sizeof(total));
+
+    SFMF_LOG("Codec selection (%.0f KiB/s download speed):\n", model->bandwidth / 1024.0);
+    for (int i=0; i<COSTMODEL_CANDIDATES; i++) {
+        struct CostModelStats *stats = &(model->chosen[i]);
+        if (stats->files == 0) {
+            continue;
+        }
+
+        SFMF_LOG("   %-8s %8" PRIu32 " files, %12" PRIu64 " -> %12" PRIu64 " bytes, %8.2f s decode\n",
+                costmodel_candidates[i].name, stats->files, stats->size, stats->zsize, stats->decode_time);
+
+        total.size += stats->size;
+        total.zsize += stats->zsize;
+        total.decode_time += stats->decode_time;
+    }
+
+    SFMF_LOG("Estimated download size: %" PRIu64 " bytes (zlib for all: %" PRIu64 ", saved %" PRId64 ")\n",
+            total.zsize, model->baseline.zsize, (int64_t)(model->baseline.zsize - total.zsize));
+    SFMF_LOG("Estimated decode time: %.2f s (zlib for all: %.2f s, saved %.2f s)\n",
+            total.decode_time, model->baseline.decode_time, model->baseline.decode_time - total.decode_time);
+}
@@ -0,0 +1,82 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#ifndef SFMF_COSTMODEL_H
+#define SFMF_COSTMODEL_H
+
+#include "convert.h"
+
+#include <stdint.h>
+
+/**
+ * Per-blob codec selection for sfmf-pack: for every file, a sample of the
+ * data is compressed with all candidate codecs and levels, and the one
+ * with the lowest estimated cost (download time plus decode time on the
+ * device) is picked; if none of them pays off, the file is stored.
+ * Without adaptive selection, all files are compressed with one codec at
+ * its default level (and stored if that doesn't make them smaller).
+ * Once a dictionary has been set (see convert_set_dictionary()), small
+ * files are compressed with it (or it is one more candidate for them).
+ **/
+
+// Candidate 0 is "store uncompressed"
+#define COSTMODEL_MAX_CANDIDATES 8
+
+struct CostModelStats {
+    uint32_t files;
+    uint64_t size; // uncompressed bytes
+    uint64_t zsize; // stored bytes (compressed or not)
+    double decode_time; // estimated, in seconds
+};
+
+struct CostModel {
+    int adaptive; // pick codec and level per blob (otherwise always use codec)
+    enum ConvertCodec codec; // codec to use if not adaptive
+    uint64_t dictionary_max_size; // files up to this size can use CONVERT_CODEC_ZSTD_DICT
+
+    double bandwidth; // expected download speed in bytes per second
+    double decode_speed[CONVERT_CODEC_COUNT]; // expected decode speed in (output) bytes per second
+
+    // Accounting for costmodel_report() (adaptive selection only)
+    struct CostModelStats baseline; // zlib at the default level for all files
+    struct CostModelStats chosen[COSTMODEL_MAX_CANDIDATES];
+};
+
+// Filled in by costmodel_choose() and passed to costmodel_account()
+struct CostEstimate {
+    int candidate; // index of the chosen candidate (0 = stored)
+    uint64_t baseline_zsize; // estimated size with zlib at the default level
+};
+
+struct CostModel *costmodel_new();
+void costmodel_free(struct CostModel *model);
+
+// Parses "CODEC=MIB" (decode speed of CODEC in MiB/s), returns 1 on success
+int costmodel_set_decode_speed(struct CostModel *model, const char *spec);
+
+// Returns the conversion to use for compressing filename (size bytes), or
+// CONVERT_FLAG_NONE if it should be stored uncompressed; thread-safe
+enum ConvertFlags costmodel_choose(struct CostModel *model, const char *filename, uint64_t size,
+        struct CostEstimate *estimate);
+// Records the outcome of compressing a file (zsize >= size if it is stored); not thread-safe
+void costmodel_account(struct CostModel *model, struct CostEstimate *estimate, uint64_t size, uint64_t zsize);
+// Logs the chosen codecs, and the estimated savings compared to zlib for all files
+void costmodel_report(struct CostModel *model);
+
+#endif /* SFMF_COSTMODEL_H */
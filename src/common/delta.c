@@ -0,0 +1,288 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+
+#define _GNU_SOURCE
+
+#include "delta.h"
+
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Multiplier of the rolling hash */
+#define DELTA_HASH_PRIME 0x01000193u
+
+/* Upper limit for the size of the block index (in bits), to bound memory use for huge files */
+#define DELTA_INDEX_MAX_BITS 24
+
+/* Size of reads when copying from the base file */
+#define DELTA_COPY_SIZE (64 * 1024)
+
+/* No offset in the block index */
+#define DELTA_INDEX_EMPTY UINT64_MAX
+
+struct DeltaIndex {
+    uint64_t *offsets; // offset of a block of the base file with that hash (or DELTA_INDEX_EMPTY)
+    uint32_t bits;
+};
+
+static uint32_t delta_hash(const char *data)
+{
+    uint32_t hash = 0;
+    for (int i=0; i<DELTA_BLOCK_SIZE; i++) {
+        hash = hash * DELTA_HASH_PRIME + (uint8_t)data[i];
+    }
+    return hash;
+}
+
+static uint32_t delta_index_slot(struct DeltaIndex *index, uint32_t hash)
+{
+    return (hash * 2654435761u) >> (32 - index->bits);
+}
+
+static void delta_index_init(struct DeltaIndex *index, const char *base, uint64_t base_length)
+{
+    uint64_t blocks = base_length / DELTA_BLOCK_SIZE;
+
+    index->bits = 10;
+    while (index->bits < DELTA_INDEX_MAX_BITS && (1ull << index->bits) < 2 * blocks) {
+        index->bits++;
+    }
+
+    index->offsets = malloc(sizeof(uint64_t) << index->bits);
+    assert(index->offsets != NULL);
+    memset(index->offsets, 0xff, sizeof(uint64_t) << index->bits);
+
+    // The first block with a given hash is kept
+    for (uint64_t i=0; i<blocks; i++) {
+        uint64_t offset = i * DELTA_BLOCK_SIZE;
+        uint32_t slot = delta_index_slot(index, delta_hash(base + offset));
+        if (index->offsets[slot] == DELTA_INDEX_EMPTY) {
+            index->offsets[slot] = offset;
+        }
+    }
+}
+
+static int delta_write_u64(FILE *out, uint64_t value)
+{
+    value = htobe64(value);
+    return (fwrite(&value, sizeof(value), 1, out) == 1);
+}
+
+static int delta_write_insert(FILE *out, const char *data, uint64_t length)
+{
+    if (length == 0) {
+        return 1;
+    }
+
+    return (fputc(DELTA_OP_INSERT, out) != EOF && delta_write_u64(out, length) &&
+            fwrite(data, length, 1, out) == 1);
+}
+
+static int delta_write_copy(FILE *out, uint64_t offset, uint64_t length)
+{
+    return (fputc(DELTA_OP_COPY, out) != EOF && delta_write_u64(out, offset) &&
+            delta_write_u64(out, length));
+}
+
+int delta_encode(const char *base, uint64_t base_length, const char *target, uint64_t target_length,
+        FILE *out)
+{
+    struct DeltaIndex index;
+    delta_index_init(&index, base, base_length);
+
+    // Factor of the byte that leaves the rolling hash window
+    uint32_t out_factor = 1;
+    for (int i=0; i<DELTA_BLOCK_SIZE; i++) {
+        out_factor *= DELTA_HASH_PRIME;
+    }
+
+    int ok = 1;
+    uint64_t insert_start = 0;
+    uint64_t pos = 0;
+    uint32_t hash = (target_length >= DELTA_BLOCK_SIZE) ? delta_hash(target) : 0;
+
+    while (ok && pos + DELTA_BLOCK_SIZE <= target_length) {
+        uint64_t offset = index.offsets[delta_index_slot(&index, hash)];
+
+        if (offset != DELTA_INDEX_EMPTY && memcmp(base + offset, target + pos, DELTA_BLOCK_SIZE) == 0) {
+            // Extend the match backwards (into data not written yet) and forwards
+            while (pos > insert_start && offset > 0 && base[offset - 1] == target[pos - 1]) {
+                pos--;
+                offset--;
+            }
+
+            uint64_t length = DELTA_BLOCK_SIZE;
+            while (pos + length < target_length && offset + length < base_length &&
+                    base[offset + length] == target[pos + length]) {
+                length++;
+            }
+
+            ok = delta_write_insert(out, target + insert_start, pos - insert_start) &&
+                delta_write_copy(out, offset, length);
+
+            pos += length;
+            insert_start = pos;
+            if (pos + DELTA_BLOCK_SIZE <= target_length) {
+                hash = delta_hash(target + pos);
+            }
+        } else if (pos + DELTA_BLOCK_SIZE < target_length) {
+            hash = hash * DELTA_HASH_PRIME + (uint8_t)target[pos + DELTA_BLOCK_SIZE] -
+                (uint8_t)target[pos] * out_factor;
+            pos++;
+        } else {
+            break;
+        }
+    }
+
+    if (ok) {
+        ok = delta_write_insert(out, target + insert_start, target_length - insert_start);
+    }
+
+    free(index.offsets);
+
+    return !ok;
+}
+
+static const char *delta_map_file(const char *filename, uint64_t *length)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        SFMF_WARN("Cannot open %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        SFMF_WARN("Cannot stat %s: %s\n", filename, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    *length = st.st_size;
+
+    // Empty files can't be mapped, but any non-NULL pointer will do
+    const char *data = "";
+    if (*length > 0) {
+        data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            SFMF_WARN("Cannot map %s: %s\n", filename, strerror(errno));
+            data = NULL;
+        } else {
+            madvise((void *)data, *length, MADV_SEQUENTIAL);
+        }
+    }
+
+    close(fd);
+    return data;
+}
+
+int delta_encode_file(const char *base_filename, const char *target_filename, FILE *out)
+{
+    uint64_t base_length = 0;
+    uint64_t target_length = 0;
+    const char *base = delta_map_file(base_filename, &base_length);
+    const char *target = delta_map_file(target_filename, &target_length);
+
+    int res = 1;
+    if (base != NULL && target != NULL) {
+        res = delta_encode(base, base_length, target, target_length, out);
+    }
+
+    if (base != NULL && base_length > 0) {
+        munmap((void *)base, base_length);
+    }
+
+    if (target != NULL && target_length > 0) {
+        munmap((void *)target, target_length);
+    }
+
+    return res;
+}
+
+static const char *delta_read_u64(const char *p, const char *end, uint64_t *value)
+{
+    if (p == NULL || end - p < sizeof(*value)) {
+        return NULL;
+    }
+
+    memcpy(value, p, sizeof(*value));
+    *value = be64toh(*value);
+    return p + sizeof(*value);
+}
+
+static int delta_copy(FILE *base, uint64_t offset, uint64_t length, FILE *out)
+{
+    if (fseeko(base, offset, SEEK_SET) != 0) {
+        return 0;
+    }
+
+    char buf[DELTA_COPY_SIZE];
+    while (length > 0) {
+        size_t len = (length < sizeof(buf)) ? length : sizeof(buf);
+        if (fread(buf, len, 1, base) != 1 || fwrite(buf, len, 1, out) != 1) {
+            return 0;
+        }
+        length -= len;
+    }
+
+    return 1;
+}
+
+int delta_apply(const char *delta, size_t length, FILE *base, FILE *out)
+{
+    const char *p = delta;
+    const char *end = delta + length;
+
+    while (p < end) {
+        uint8_t op = *p++;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+
+        switch (op) {
+            case DELTA_OP_COPY:
+                p = delta_read_u64(p, end, &offset);
+                p = delta_read_u64(p, end, &size);
+                if (p == NULL || !delta_copy(base, offset, size, out)) {
+                    return 1;
+                }
+                break;
+            case DELTA_OP_INSERT:
+                p = delta_read_u64(p, end, &size);
+                if (p == NULL || end - p < size || fwrite(p, size, 1, out) != 1) {
+                    return 1;
+                }
+                p += size;
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    return 0;
+}
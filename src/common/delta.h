@@ -0,0 +1,59 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+
+#ifndef SFMF_DELTA_H
+#define SFMF_DELTA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Binary deltas (see SFMF_DeltaEntry): the target file is described as a
+ * sequence of copies of ranges of the base file and inserts of new data.
+ * Matches are found by indexing the base file in blocks of
+ * DELTA_BLOCK_SIZE bytes and looking up a rolling hash of the target at
+ * every offset, so data that moved within the file is still found.
+ *
+ * Delta data is a sequence of operations, with integers in network byte order:
+ *  - DELTA_OP_COPY, uint64_t offset, uint64_t length (copy from the base file)
+ *  - DELTA_OP_INSERT, uint64_t length, <length> bytes of data
+ **/
+
+enum DeltaOp {
+    DELTA_OP_COPY = 1,
+    DELTA_OP_INSERT = 2,
+};
+
+/* Size of the blocks of the base file that are indexed (and shortest match) */
+#define DELTA_BLOCK_SIZE 32
+
+// Writes the delta that turns base (base_length bytes) into target (target_length bytes)
+// to out; returns 0 on success
+int delta_encode(const char *base, uint64_t base_length, const char *target, uint64_t target_length,
+        FILE *out);
+// Like delta_encode(), with the data of both files mapped; returns 0 on success
+int delta_encode_file(const char *base_filename, const char *target_filename, FILE *out);
+
+// Writes the result of applying delta (length bytes) to base to out; returns 0 on
+// success, nonzero if the delta is invalid or can't be applied to base
+int delta_apply(const char *delta, size_t length, FILE *base, FILE *out);
+
+#endif /* SFMF_DELTA_H */
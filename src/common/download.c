@@ -0,0 +1,592 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#include "download.h"
+#include "convert.h"
+#include "logging.h"
+#include "control.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#if defined(USE_LIBCURL)
+#include <curl/curl.h>
+#endif /* USE_LIBCURL */
+
+
+static struct DownloadQueue *downloadqueue_resize(struct DownloadQueue *queue, uint32_t size)
+{
+    assert(size >= queue->length);
+    queue->size = size;
+    queue->data = realloc(queue->data, queue->size * sizeof(struct DownloadQueueItem));
+    return queue;
+}
+
+struct DownloadQueue *downloadqueue_new(int max_parallel)
+{
+    struct DownloadQueue *queue = downloadqueue_resize(calloc(1, sizeof(struct DownloadQueue)), 16);
+    queue->max_parallel = (max_parallel > 0) ? max_parallel : 1;
+    return queue;
+}
+
+void downloadqueue_append(struct DownloadQueue *queue, const char *url, const char *filename,
+        struct SFMF_FileHash *expected_hash, uint32_t blob_flags)
+{
+    if (queue->size < queue->length + 1) {
+        queue = downloadqueue_resize(queue, queue->size * 2);
+    }
+
+    struct DownloadQueueItem *item = &(queue->data[queue->length++]);
+    memset(item, 0, sizeof(*item));
+
+    item->url = strdup(url);
+    item->filename = strdup(filename);
+    item->state = DOWNLOAD_QUEUED;
+    item->expected_hash = expected_hash;
+    item->blob_flags = blob_flags;
+}
+
+static int is_remote_url(const char *url)
+{
+    return (strncmp(url, "http://", 7) == 0 || strncmp(url, "https://", 8) == 0);
+}
+
+static struct DownloadQueueItem *downloadqueue_next_remote(struct DownloadQueue *queue)
+{
+    for (int i=0; i<queue->length; i++) {
+        struct DownloadQueueItem *item = &(queue->data[i]);
+        if (item->state == DOWNLOAD_QUEUED && is_remote_url(item->url)) {
+            return item;
+        }
+    }
+
+    return NULL;
+}
+
+static int downloadqueue_finish(struct DownloadQueueItem *item, int result,
+        downloadqueue_done_func_t done_func, void *user_data)
+{
+    item->state = DOWNLOAD_DONE;
+    item->result = result;
+
+    return done_func ? done_func(item, user_data) : 1;
+}
+
+/**
+ * Destination of a download: Data is written to the target file and
+ * hashed at the same time, so it doesn't need to be read back again.
+ **/
+struct DownloadSink {
+    FILE *fp;
+    struct ConvertHasher *hasher;
+    int error;
+};
+
+static void download_sink_open(struct DownloadSink *sink, struct DownloadQueueItem *item)
+{
+    sink->fp = fopen(item->filename, "wb");
+    if (sink->fp == NULL) {
+        SFMF_FAIL_AND_EXIT("Failed to create '%s'\n", item->filename);
+    }
+
+    sink->hasher = convert_hasher_new(convert_flags_for_blob(item->blob_flags));
+    sink->error = 0;
+}
+
+static int download_sink_write(struct DownloadSink *sink, char *buf, size_t len)
+{
+    if (fwrite(buf, 1, len, sink->fp) != len) {
+        sink->error = 1;
+        return 1;
+    }
+
+    // A hash failure (broken compressed data) shows up in the final hash
+    (void)convert_hasher_update(sink->hasher, buf, len);
+
+    return 0;
+}
+
+// Returns nonzero if the file could not be written
+static int download_sink_close(struct DownloadSink *sink, struct DownloadQueueItem *item)
+{
+    if (fclose(sink->fp) != 0) {
+        sink->error = 1;
+    }
+    sink->fp = NULL;
+
+    (void)convert_hasher_finish(sink->hasher, &(item->hash));
+    convert_hasher_free(sink->hasher);
+    sink->hasher = NULL;
+
+    if (sink->error) {
+        SFMF_WARN("Could not write %s: %s\n", item->filename, strerror(errno));
+    }
+
+    return sink->error;
+}
+
+static int download_local_file(struct DownloadQueueItem *item)
+{
+    SFMF_DEBUG("Copy %s -> %s\n", item->url, item->filename);
+
+    FILE *fp = fopen(item->url, "rb");
+    if (fp == NULL) {
+        SFMF_WARN("Could not open %s: %s\n", item->url, strerror(errno));
+        return 1;
+    }
+
+    struct DownloadSink sink;
+    download_sink_open(&sink, item);
+
+    char buf[DEFAULT_BUFFER_SIZE];
+    size_t len;
+    int result = 0;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        if (download_sink_write(&sink, buf, len) != 0) {
+            break;
+        }
+    }
+
+    if (ferror(fp)) {
+        SFMF_WARN("Could not read %s\n", item->url);
+        result = 1;
+    }
+    fclose(fp);
+
+    if (download_sink_close(&sink, item) != 0) {
+        result = 1;
+    }
+
+    return result;
+}
+
+#if defined(USE_LIBCURL)
+struct DownloadTransfer {
+    CURL *curl;
+    struct DownloadSink sink;
+    struct DownloadQueueItem *item; // NULL if this transfer slot is free
+};
+
+static size_t download_transfer_write(char *ptr, size_t size, size_t nmemb, void *user_data)
+{
+    struct DownloadTransfer *transfer = user_data;
+
+    if (download_sink_write(&(transfer->sink), ptr, size * nmemb) != 0) {
+        // Signals an error to libcurl, which aborts the transfer
+        return 0;
+    }
+
+    return size * nmemb;
+}
+
+static CURL *download_transfer_new_handle(struct DownloadTransfer *transfer)
+{
+    CURL *curl = curl_easy_init();
+    if (curl == NULL) {
+        SFMF_FAIL_AND_EXIT("Could not init cURL-easy\n");
+    }
+
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, download_transfer_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, transfer);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "sfmf/" VERSION " (+https://sailfishos.org/)");
+
+    /* Error handling */
+    //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L * 20L /* seconds */);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 4196L /* bytes/second */);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 10L /* seconds */);
+
+    /* Authentication */
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+
+    /* Redirection */
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 10L);
+
+    /* Connection reuse and HTTP/2 multiplexing (if supported by the server) */
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00 /* 7.43.0 */
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+
+    return curl;
+}
+
+static int downloadqueue_run_remote(struct DownloadQueue *queue,
+        downloadqueue_done_func_t done_func, void *user_data)
+{
+    static int curl_initialized = 0;
+
+    if (!curl_initialized) {
+        if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) {
+            SFMF_FAIL_AND_EXIT("Could not init cURL\n");
+        }
+        curl_initialized = 1;
+    }
+
+    CURLM *multi = curl_multi_init();
+    if (multi == NULL) {
+        SFMF_FAIL_AND_EXIT("Could not init cURL-multi\n");
+    }
+
+    // All transfers share the connection cache of the multi handle
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)queue->max_parallel);
+#if defined(CURLPIPE_MULTIPLEX)
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
+
+    struct DownloadTransfer *transfers = calloc(queue->max_parallel, sizeof(struct DownloadTransfer));
+
+    int failed = 0;
+    int active = 0;
+    int keep_going = 1;
+
+    while (keep_going) {
+        // Fill up free transfer slots with queued downloads
+        for (int i=0; i<queue->max_parallel; i++) {
+            struct DownloadTransfer *transfer = &(transfers[i]);
+            if (transfer->item != NULL) {
+                continue;
+            }
+
+            struct DownloadQueueItem *item = downloadqueue_next_remote(queue);
+            if (item == NULL) {
+                break;
+            }
+
+            download_sink_open(&(transfer->sink), item);
+
+            if (transfer->curl == NULL) {
+                // Handles are re-used for subsequent transfers
+                transfer->curl = download_transfer_new_handle(transfer);
+            }
+
+            SFMF_DEBUG("Download %s\n", item->url);
+            curl_easy_setopt(transfer->curl, CURLOPT_URL, item->url);
+
+            transfer->item = item;
+            item->state = DOWNLOAD_ACTIVE;
+            curl_multi_add_handle(multi, transfer->curl);
+            active++;
+        }
+
+        if (active == 0) {
+            break;
+        }
+
+        int running = 0;
+        CURLMcode mres = curl_multi_perform(multi, &running);
+        if (mres != CURLM_OK) {
+            SFMF_FAIL_AND_EXIT("cURL-multi failed: %s\n", curl_multi_strerror(mres));
+        }
+
+        CURLMsg *msg;
+        int remaining = 0;
+        while ((msg = curl_multi_info_read(multi, &remaining)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+
+            struct DownloadTransfer *transfer = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+            assert(transfer != NULL && transfer->item != NULL);
+
+            CURLcode res = msg->data.result;
+            curl_multi_remove_handle(multi, transfer->curl);
+
+            struct DownloadQueueItem *item = transfer->item;
+            transfer->item = NULL;
+            active--;
+
+            int result = download_sink_close(&(transfer->sink), item);
+            if (res != CURLE_OK) {
+                SFMF_WARN("Could not download %s: %s\n", item->url, curl_easy_strerror(res));
+                result = 1;
+            }
+
+            if (result != 0) {
+                failed++;
+            }
+
+            if (!downloadqueue_finish(item, result, done_func, user_data)) {
+                keep_going = 0;
+            }
+        }
+
+        // Make sure D-Bus doesn't starve while we wait for data
+        sfmf_control_process();
+
+        if (keep_going && active > 0) {
+            curl_multi_wait(multi, NULL, 0, 100 /* ms */, NULL);
+        }
+    }
+
+    for (int i=0; i<queue->max_parallel; i++) {
+        struct DownloadTransfer *transfer = &(transfers[i]);
+
+        if (transfer->item != NULL) {
+            // Stopped before this transfer finished
+            curl_multi_remove_handle(multi, transfer->curl);
+            (void)download_sink_close(&(transfer->sink), transfer->item);
+        }
+
+        if (transfer->curl != NULL) {
+            curl_easy_cleanup(transfer->curl);
+        }
+    }
+
+    free(transfers);
+    curl_multi_cleanup(multi);
+
+    return failed;
+}
+#else
+struct DownloadProcess {
+    pid_t pid;
+    int fd; // read end of the pipe connected to curl's stdout
+    struct DownloadSink sink;
+    struct DownloadQueueItem *item; // NULL if this process slot is free
+};
+
+static void download_process_start(struct DownloadProcess *process, struct DownloadQueueItem *item)
+{
+    SFMF_DEBUG("Download %s\n", item->url);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        SFMF_FAIL_AND_EXIT("Could not create pipe: %s\n", strerror(errno));
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // curl writes the data to the pipe, the parent process writes the file
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        char * const args[] = { "curl", "-o", "-", item->url, NULL };
+        execvp("curl", args);
+        // Don't run the atexit() cleanup handlers of the parent in the child
+        fprintf(stderr, "Could not execute curl: %s\n", strerror(errno));
+        _exit(127);
+    } else if (pid == -1) {
+        SFMF_FAIL_AND_EXIT("Could not fork: %s\n", strerror(errno));
+    }
+
+    close(fds[1]);
+
+    process->pid = pid;
+    process->fd = fds[0];
+    process->item = item;
+    download_sink_open(&(process->sink), item);
+    item->state = DOWNLOAD_ACTIVE;
+}
+
+// Returns nonzero if curl has closed its output (download finished)
+static int download_process_read(struct DownloadProcess *process)
+{
+    char buf[DEFAULT_BUFFER_SIZE];
+
+    ssize_t len = read(process->fd, buf, sizeof(buf));
+    if (len > 0) {
+        if (!process->sink.error && download_sink_write(&(process->sink), buf, len) != 0) {
+            // Can't write the file, so stop downloading it
+            kill(process->pid, SIGTERM);
+        }
+        return 0;
+    } else if (len == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+static int download_process_finish(struct DownloadProcess *process)
+{
+    struct DownloadQueueItem *item = process->item;
+
+    close(process->fd);
+    process->item = NULL;
+
+    int result = download_sink_close(&(process->sink), item);
+
+    int status = 0;
+    if (waitpid(process->pid, &status, 0) != process->pid) {
+        SFMF_FAIL_AND_EXIT("Could not wait for curl exit status: %s\n", strerror(errno));
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        SFMF_WARN("curl exited with non-zero exit status: %d\n", status);
+        result = 1;
+    }
+
+    return result;
+}
+
+static int downloadqueue_run_remote(struct DownloadQueue *queue,
+        downloadqueue_done_func_t done_func, void *user_data)
+{
+    struct DownloadProcess *processes = calloc(queue->max_parallel, sizeof(struct DownloadProcess));
+    struct pollfd *fds = calloc(queue->max_parallel, sizeof(struct pollfd));
+
+    int failed = 0;
+    int active = 0;
+    int keep_going = 1;
+
+    while (keep_going) {
+        // Fill up free process slots with queued downloads
+        for (int i=0; i<queue->max_parallel; i++) {
+            struct DownloadProcess *process = &(processes[i]);
+            if (process->item != NULL) {
+                continue;
+            }
+
+            struct DownloadQueueItem *item = downloadqueue_next_remote(queue);
+            if (item == NULL) {
+                break;
+            }
+
+            download_process_start(process, item);
+            active++;
+        }
+
+        if (active == 0) {
+            break;
+        }
+
+        for (int i=0; i<queue->max_parallel; i++) {
+            fds[i].fd = processes[i].item ? processes[i].fd : -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds, queue->max_parallel, 100 /* ms */) == -1 && errno != EINTR) {
+            SFMF_FAIL_AND_EXIT("Could not poll for curl output: %s\n", strerror(errno));
+        }
+
+        for (int i=0; i<queue->max_parallel; i++) {
+            struct DownloadProcess *process = &(processes[i]);
+            if (process->item == NULL || fds[i].revents == 0) {
+                continue;
+            }
+
+            if (!download_process_read(process)) {
+                continue;
+            }
+
+            struct DownloadQueueItem *item = process->item;
+            int result = download_process_finish(process);
+            active--;
+
+            if (result != 0) {
+                failed++;
+            }
+
+            if (!downloadqueue_finish(item, result, done_func, user_data)) {
+                keep_going = 0;
+                break;
+            }
+        }
+
+        // Make sure D-Bus doesn't starve while we wait for curl
+        sfmf_control_process();
+    }
+
+    for (int i=0; i<queue->max_parallel; i++) {
+        struct DownloadProcess *process = &(processes[i]);
+        if (process->item != NULL) {
+            // Stopped before this download finished
+            kill(process->pid, SIGTERM);
+            (void)download_process_finish(process);
+        }
+    }
+
+    free(fds);
+    free(processes);
+
+    return failed;
+}
+#endif /* USE_LIBCURL */
+
+int downloadqueue_run(struct DownloadQueue *queue, downloadqueue_done_func_t done_func, void *user_data)
+{
+    int failed = 0;
+
+    // Local files are just copied over, there's nothing to gain from parallelism
+    for (int i=0; i<queue->length; i++) {
+        struct DownloadQueueItem *item = &(queue->data[i]);
+        if (item->state != DOWNLOAD_QUEUED || is_remote_url(item->url)) {
+            continue;
+        }
+
+        item->state = DOWNLOAD_ACTIVE;
+        int res = download_local_file(item);
+        if (res != 0) {
+            failed++;
+        }
+
+        if (!downloadqueue_finish(item, res, done_func, user_data)) {
+            return failed;
+        }
+    }
+
+    return failed + downloadqueue_run_remote(queue, done_func, user_data);
+}
+
+void downloadqueue_remove_partial(struct DownloadQueue *queue)
+{
+    for (int i=0; i<queue->length; i++) {
+        struct DownloadQueueItem *item = &(queue->data[i]);
+        if (item->state != DOWNLOAD_ACTIVE) {
+            continue;
+        }
+
+        if (remove(item->filename) != 0 && errno != ENOENT) {
+            SFMF_WARN("Cannot remove temporary download %s: %s\n",
+                      item->filename, strerror(errno));
+        }
+    }
+}
+
+void downloadqueue_free(struct DownloadQueue *queue)
+{
+    assert(queue);
+
+    for (int i=0; i<queue->length; i++) {
+        free(queue->data[i].url);
+        free(queue->data[i].filename);
+    }
+
+    free(queue->data);
+    free(queue);
+}
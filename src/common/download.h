@@ -0,0 +1,73 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#ifndef SFMF_DOWNLOAD_H
+#define SFMF_DOWNLOAD_H
+
+#include "sfmf.h"
+
+#include <stdint.h>
+
+#define DOWNLOAD_DEFAULT_PARALLEL 4
+
+enum DownloadQueueItemState {
+    DOWNLOAD_QUEUED = 0,
+    DOWNLOAD_ACTIVE, // file is being written to
+    DOWNLOAD_DONE,
+};
+
+struct DownloadQueueItem {
+    char *url; // http(s) URL or local filename
+    char *filename; // target filename
+    enum DownloadQueueItemState state;
+    int result; // 0 on success (when state == DOWNLOAD_DONE)
+
+    // Expected hash of the (uncompressed) file, or NULL if unknown
+    struct SFMF_FileHash *expected_hash;
+    uint32_t blob_flags; // SFMF_BlobEntry_Flag values (how the file is compressed)
+
+    // Hash of the downloaded data, calculated while downloading (decompressed
+    // first if blob_flags says so); hashtype is HASHTYPE_UNKNOWN if it failed
+    struct SFMF_FileHash hash;
+};
+
+/**
+ * Called when a download has finished; return nonzero to keep
+ * the queue running, zero to stop processing the queue.
+ **/
+typedef int (*downloadqueue_done_func_t)(struct DownloadQueueItem *item, void *user_data);
+
+struct DownloadQueue {
+    struct DownloadQueueItem *data;
+    uint32_t length; // current length
+    uint32_t size; // allocated size
+
+    int max_parallel; // maximum number of concurrent transfers
+};
+
+struct DownloadQueue *downloadqueue_new(int max_parallel);
+void downloadqueue_append(struct DownloadQueue *queue, const char *url, const char *filename,
+        struct SFMF_FileHash *expected_hash, uint32_t blob_flags);
+// Downloads all queued items (up to max_parallel at a time), returns the number of failed items
+int downloadqueue_run(struct DownloadQueue *queue, downloadqueue_done_func_t done_func, void *user_data);
+// Removes partially-written files of active downloads (e.g. when interrupted)
+void downloadqueue_remove_partial(struct DownloadQueue *queue);
+void downloadqueue_free(struct DownloadQueue *queue);
+
+#endif /* SFMF_DOWNLOAD_H */
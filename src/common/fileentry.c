@@ -23,6 +23,9 @@
 #include "logging.h"
 #include "policy.h"
 #include "control.h"
+#include "sparse.h"
+#include "hashindex.h"
+#include "inodemap.h"
 
 #include "sha1.h"
 
@@ -34,11 +37,13 @@
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 #include <ftw.h>
+#include <pthread.h>
 
 
 static struct FileList *filelist_resize(struct FileList *list, uint32_t size)
@@ -55,10 +60,10 @@ struct FileList *filelist_new()
     return filelist_resize(calloc(1, sizeof(struct FileList)), 128);
 }
 
-int32_t fileentry_get_min_size(struct FileEntry *entry)
+uint64_t fileentry_get_min_size(struct FileEntry *entry)
 {
     // Minimum possible size of entry (either compressed or uncompressed)
-    uint32_t size = entry->st.st_size;
+    uint64_t size = entry->st.st_size;
     if (entry->zsize > 0 && entry->zsize < size) {
         size = entry->zsize;
     }
@@ -82,6 +87,12 @@ struct FileEntry *filelist_foreach(struct FileList *list, filelist_foreach_func_
 void fileentry_calculate_zsize_hash(struct FileEntry *entry)
 {
     convert_file_zsize_hash(entry->filename, &(entry->hash), &(entry->zsize));
+    entry->zconvert = CONVERT_FLAG_ZCOMPRESS;
+}
+
+void fileentry_calculate_hash(struct FileEntry *entry)
+{
+    convert_file_zsize_hash(entry->filename, &(entry->hash), NULL);
 }
 
 static void SHA1(const unsigned char *buf, size_t length, unsigned char *hash)
@@ -93,7 +104,8 @@ static void SHA1(const unsigned char *buf, size_t length, unsigned char *hash)
     SHA1_Final(&ctx, hash);
 }
 
-void filelist_append(struct FileList *list, const char *filename, enum FileListFlags flags)
+static void filelist_append_cached(struct FileList *list, const char *filename, enum FileListFlags flags,
+        struct HashCache *cache)
 {
     if (list->size < list->length + 1) {
         list = filelist_resize(list, list->size * 2);
@@ -138,11 +150,18 @@ void filelist_append(struct FileList *list, const char *filename, enum FileListF
     if (S_ISREG(entry->st.st_mode) && entry->st.st_size > 0) {
         entry->hash.size = entry->st.st_size;
 
-        if ((flags & FILE_LIST_CALCULATE_HASH) != 0) {
+        if (cache && hashcache_lookup(cache, &(entry->st), &(entry->hash), &(entry->zsize), &(entry->zconvert),
+                    &(entry->extents), &(entry->extents_length))) {
+            // Unchanged since it was last hashed
+        } else if ((flags & FILE_LIST_CALCULATE_HASH) != 0) {
             // If it's a nonempty regular file or symlink, check how well it compresses
             //SFMF_DEBUG("Calculating size and hash: %s\n", entry->filename);
             fileentry_calculate_zsize_hash(entry);
             //sfmf_print_hash(entry->filename, &(entry->hash));
+            if (cache) {
+                hashcache_store(cache, &(entry->st), &(entry->hash), entry->zsize, entry->zconvert,
+                        entry->extents, entry->extents_length);
+            }
         } else {
             //SFMF_DEBUG("Not calculating hash of file: %s\n", entry->filename);
             entry->hash.hashtype = HASHTYPE_LAZY;
@@ -166,6 +185,11 @@ void filelist_append(struct FileList *list, const char *filename, enum FileListF
     entry->hardlink_index = -1;
 }
 
+void filelist_append(struct FileList *list, const char *filename, enum FileListFlags flags)
+{
+    filelist_append_cached(list, filename, flags, NULL);
+}
+
 void filelist_append_clone(struct FileList *list, struct FileEntry *source)
 {
     if (list->size < list->length + 1) {
@@ -176,8 +200,12 @@ void filelist_append_clone(struct FileList *list, struct FileEntry *source)
 
     // Most fields can be copied as-is (they're just data)
     memcpy(entry, source, sizeof(struct FileEntry));
-    // Need to duplicate the filename, as it's a pointer
+    // Need to duplicate the filename and extents, as they're pointers
     entry->filename = strdup(entry->filename);
+    if (entry->extents) {
+        size_t size = entry->extents_length * sizeof(struct SFMF_ExtentEntry);
+        entry->extents = memcpy(malloc(size), entry->extents, size);
+    }
 }
 
 static int filelist_free_entry(struct FileEntry *entry, void *user_data)
@@ -187,6 +215,8 @@ static int filelist_free_entry(struct FileEntry *entry, void *user_data)
         free(entry->filename);
     }
 
+    free(entry->extents);
+
     return 0;
 }
 
@@ -201,9 +231,126 @@ void filelist_free(struct FileList *list)
     free(list);
 }
 
+/**
+ * Parallel hashing: While the main thread enumerates the tree, worker
+ * threads take the next unhashed entry from the shared list and
+ * calculate its hash and zsize. Entries are appended in nftw() order as
+ * before, so the resulting list is the same regardless of thread count.
+ * If a spill store is given, the compressed data produced while
+ * calculating the zsize is kept there, so it doesn't need to be
+ * compressed a second time when writing the pack files. Zero extents
+ * of large files are collected from the data as it is hashed. Entries
+ * found in the hash cache are not marked as lazy, so the workers skip
+ * them (their zero extents are kept in the cache, too).
+ **/
+struct FileHashPool {
+    struct FileList *list;
+    struct SpillStore *spill; // may be NULL
+    struct HashCache *cache; // may be NULL
+    struct CostModel *model; // picks the codec for calculating the zsize (may be NULL)
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t next; // index of next entry to be considered by a worker
+    int enumerated; // set once all entries have been appended
+};
+
+static void file_hash_pool_scan(const char *buf, size_t len, void *user_data)
+{
+    sparse_scanner_update(user_data, buf, len);
+}
+
+static void *file_hash_pool_worker(void *user_data)
+{
+    struct FileHashPool *pool = user_data;
+
+    // Only the main thread may pump the D-Bus mainloop
+    convert_set_thread_pumps_mainloop(0);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (pool->next >= pool->list->length && !pool->enumerated) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+
+        if (pool->next >= pool->list->length) {
+            break;
+        }
+
+        uint32_t index = pool->next++;
+        struct FileEntry *entry = &(pool->list->data[index]);
+        if (entry->hash.hashtype != HASHTYPE_LAZY) {
+            continue;
+        }
+
+        // The list might be reallocated while we are hashing, so don't
+        // keep the entry pointer, only the filename (which doesn't move)
+        char *filename = entry->filename;
+        struct stat st = entry->st;
+        struct SFMF_FileHash hash = entry->hash; // hash.size is already set
+        pthread_mutex_unlock(&pool->mutex);
+
+        struct CostEstimate estimate;
+        enum ConvertFlags zconvert = CONVERT_FLAG_ZCOMPRESS;
+        if (pool->model) {
+            zconvert = costmodel_choose(pool->model, filename, hash.size, &estimate);
+        }
+
+        // Shorter files can't have zero runs worth recording
+        struct SparseScanner *scanner = NULL;
+        if (hash.size >= SPARSE_DEFAULT_MIN_RUN) {
+            scanner = sparse_scanner_new();
+        }
+        convert_observer_func_t observer = scanner ? file_hash_pool_scan : NULL;
+
+        uint64_t zsize = hash.size;
+        if (zconvert == CONVERT_FLAG_NONE) {
+            // Not worth compressing, only calculate the hash
+            convert_file_zsize_hash_observe_fp(filename, &hash, NULL, NULL, zconvert, observer, scanner);
+        } else {
+            struct SpillStoreItem *item = NULL;
+            if (pool->spill) {
+                item = spillstore_begin(pool->spill, hash.size);
+            }
+
+            convert_file_zsize_hash_observe_fp(filename, &hash, &zsize, item ? item->fp : NULL, zconvert,
+                    observer, scanner);
+
+            if (item) {
+                // Only worth keeping if it will be stored compressed
+                spillstore_commit(pool->spill, item, &hash, zsize < hash.size);
+            }
+        }
+
+        struct SFMF_ExtentEntry *extents = NULL;
+        uint32_t extents_length = 0;
+        if (scanner) {
+            extents_length = sparse_scanner_finish(scanner, SPARSE_DEFAULT_MIN_RUN, &extents);
+        }
+
+        if (pool->cache) {
+            hashcache_store(pool->cache, &st, &hash, zsize, zconvert, extents, extents_length);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        entry = &(pool->list->data[index]);
+        entry->hash = hash;
+        entry->zsize = zsize;
+        entry->zconvert = zconvert;
+        entry->extents = extents;
+        entry->extents_length = extents_length;
+        if (pool->model) {
+            costmodel_account(pool->model, &estimate, hash.size, zsize);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
 struct VisitDirectoryContext {
     struct FileList *list;
     enum FileListFlags flags;
+    struct FileHashPool *pool;
 };
 
 static struct VisitDirectoryContext *visit_directory_context = NULL;
@@ -211,8 +358,18 @@ static struct VisitDirectoryContext *visit_directory_context = NULL;
 static int visit_directory(const char *fpath, const struct stat *sb,
         int typeflag, struct FTW *ftwbuf)
 {
+    struct FileHashPool *pool = visit_directory_context->pool;
+
     // Add this entry to the list
-    filelist_append(visit_directory_context->list, fpath, visit_directory_context->flags);
+    if (pool) {
+        // Hashes are calculated by the workers (entry is marked as lazy)
+        pthread_mutex_lock(&pool->mutex);
+        filelist_append_cached(visit_directory_context->list, fpath, FILE_LIST_NONE, pool->cache);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+    } else {
+        filelist_append(visit_directory_context->list, fpath, visit_directory_context->flags);
+    }
 
     // Make sure D-Bus doesn't starve while we walk local directories
     sfmf_control_process();
@@ -220,9 +377,60 @@ static int visit_directory(const char *fpath, const struct stat *sb,
     return 0;
 }
 
-struct FileList *get_file_list(const char *root)
+struct FileList *get_file_list(const char *root, int jobs, struct SpillStore *spill,
+        struct CostModel *model, struct HashCache *cache)
 {
-    return extend_file_list(NULL, root, FILE_LIST_CALCULATE_HASH);
+    if (jobs <= 1 && spill == NULL && model == NULL && cache == NULL) {
+        return extend_file_list(NULL, root, FILE_LIST_CALCULATE_HASH);
+    }
+
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    struct FileList *list = filelist_new();
+
+    struct FileHashPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.list = list;
+    pool.spill = spill;
+    pool.model = model;
+    pool.cache = cache;
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    for (int i=0; i<jobs; i++) {
+        if (pthread_create(&threads[i], NULL, file_hash_pool_worker, &pool) != 0) {
+            SFMF_FAIL_AND_EXIT("Could not create hashing thread: %s\n", strerror(errno));
+        }
+    }
+
+    struct VisitDirectoryContext ctx = {
+        list,
+        FILE_LIST_CALCULATE_HASH,
+        &pool,
+    };
+    visit_directory_context = &ctx;
+
+    nftw(root, visit_directory, 0, FTW_PHYS);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.enumerated = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (int i=0; i<jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.mutex);
+
+    visit_directory_context = NULL;
+
+    return list;
 }
 
 struct FileList *extend_file_list(struct FileList *list, const char *root, enum FileListFlags flags)
@@ -234,6 +442,7 @@ struct FileList *extend_file_list(struct FileList *list, const char *root, enum
     struct VisitDirectoryContext ctx = {
         list,
         flags,
+        NULL,
     };
     visit_directory_context = &ctx;
 
@@ -241,3 +450,67 @@ struct FileList *extend_file_list(struct FileList *list, const char *root, enum
 
     return list;
 }
+
+void filelist_mark_duplicates(struct FileList *files)
+{
+    uint64_t savings = 0;
+
+    // First file for each content hash, and last file for each inode
+    struct HashIndex *contents = hashindex_new(files->length);
+    struct InodeMap *inodes = inodemap_new(files->length);
+
+    for (int i=0; i<files->length; i++) {
+        struct FileEntry *b = &(files->data[i]);
+
+        /**
+         * We cannot skip duplicate (b->duplicate) files here, as we might
+         * find that those are hardlinked together with other files later;
+         * example:
+         *
+         *  File 1 (content "A") inode number 1              \
+         *  File 2 (content "A") inode number 2 \_ hardlink --- duplicate
+         *  File 3 (content "A") inode number 2 /            /
+         *
+         *  Step 1: Mark File 2 as duplicate (of File 1)
+         *  Step 2: Mark File 3 as duplicate (of File 1)
+         *
+         *  Step 3: Mark File 3 as hardlink of File 2
+         **/
+
+        if (b->st.st_size == 0 || !(S_ISREG(b->st.st_mode) || S_ISLNK(b->st.st_mode))) {
+            continue;
+        }
+
+        if (hashindex_insert(contents, &(b->hash), b) != NULL) {
+            if (!b->duplicate) {
+                SFMF_LOG("Marking as dup: %s (%" PRIu64 " bytes)\n",
+                        b->filename, fileentry_get_min_size(b));
+                savings += b->st.st_size;
+                b->duplicate = 1;
+            }
+        }
+
+        int32_t index = inodemap_get(inodes, b->st.st_dev, b->st.st_ino);
+        struct FileEntry *a = (index != -1) ? &(files->data[index]) : NULL;
+        if (a != NULL && sfmf_filehash_compare(&(a->hash), &(b->hash)) == 0) {
+            SFMF_LOG("Found hard link: %s <-> %s (storing reference)\n",
+                    a->filename, b->filename);
+
+            // Assume we can only have regular files as hardlinks
+            assert(S_ISREG(b->st.st_mode));
+
+            // Store index of file that is the source of the hardlink; the source of
+            // the hardlink will always be smaller than the current index, so that at
+            // extraction time, the source file already exists.
+            b->hardlink_index = index;
+        }
+
+        // Later hardlinks of this inode refer to the most recent file
+        inodemap_set(inodes, b->st.st_dev, b->st.st_ino, i);
+    }
+
+    inodemap_free(inodes);
+    hashindex_free(contents);
+
+    SFMF_LOG("Savings of dup elimination: %" PRIu64 " bytes\n", savings);
+}
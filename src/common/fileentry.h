@@ -21,6 +21,10 @@
 #define SFMF_FILEENTRY_H
 
 #include "sfmf.h"
+#include "spillstore.h"
+#include "convert.h"
+#include "costmodel.h"
+#include "hashcache.h"
 
 #define _XOPEN_SOURCE 500
 #define __USE_XOPEN_EXTENDED
@@ -34,10 +38,14 @@
 struct FileEntry {
     char *filename;
     struct stat st;
-    uint32_t zsize;
+    uint64_t zsize;
+    enum ConvertFlags zconvert; // conversion (codec and level) that zsize was calculated with
     struct SFMF_FileHash hash;
+    uint64_t offset; // offset of the data in filename (for chunks of files, else 0)
     int duplicate; // set to 1 if we don't need to store this (hash match with another file)
     int hardlink_index; // if it's a duplicate, stores the index of the matching file (otherwise -1)
+    struct SFMF_ExtentEntry *extents; // zero extents found while hashing (NULL if there are none)
+    uint32_t extents_length;
 };
 
 struct FileList {
@@ -61,12 +69,24 @@ void filelist_append(struct FileList *list, const char *filename, enum FileListF
 void filelist_append_clone(struct FileList *list, struct FileEntry *source);
 void filelist_free(struct FileList *list);
 
-struct FileList *get_file_list(const char *root);
+// Lists all files in root and calculates their hash and zsize (using jobs threads), with
+// the codec picked by model (or zlib if NULL); if spill is not NULL, compressed data of
+// compressible files is kept there; if cache is not NULL, unchanged files are taken
+// from it (and newly hashed files are stored there). The zero extents of files (see
+// sparse.h) are found at the same time, without reading the files a second time
+struct FileList *get_file_list(const char *root, int jobs, struct SpillStore *spill,
+        struct CostModel *model, struct HashCache *cache);
 struct FileList *extend_file_list(struct FileList *list, const char *root, enum FileListFlags flags);
 // Returns the first entry for which func returns 1, or NULL if none of them does
 struct FileEntry *filelist_foreach(struct FileList *list, filelist_foreach_func_t func, void *user_data);
+// Marks files whose content already appeared earlier in the list as duplicate, and
+// points hardlink_index of hardlinks (same device and inode) at the previous link
+void filelist_mark_duplicates(struct FileList *files);
 
-int32_t fileentry_get_min_size(struct FileEntry *entry);
+uint64_t fileentry_get_min_size(struct FileEntry *entry);
+// Calculates the hash and the zsize (using zlib)
 void fileentry_calculate_zsize_hash(struct FileEntry *entry);
+// Only calculates the hash (and not the zsize), which is much faster
+void fileentry_calculate_hash(struct FileEntry *entry);
 
 #endif /* SFMF_FILEENTRY_H */
@@ -0,0 +1,123 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#include "fileindex.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+
+static int fileindex_item_compare(const void *a, const void *b)
+{
+    const struct FileIndexItem *ia = a;
+    const struct FileIndexItem *ib = b;
+
+    if (ia->size != ib->size) {
+        return (ia->size < ib->size) ? -1 : 1;
+    }
+
+    // Keep list order for files of the same size
+    return (ia->index < ib->index) ? -1 : (ia->index > ib->index);
+}
+
+struct FileIndex *fileindex_new(struct FileList *list)
+{
+    struct FileIndex *index = calloc(1, sizeof(struct FileIndex));
+    index->list = list;
+    index->data = calloc(list->length ?: 1, sizeof(struct FileIndexItem));
+    index->inodes = inodemap_new(list->length);
+
+    for (uint32_t i=0; i<list->length; i++) {
+        struct FileEntry *entry = &(list->data[i]);
+
+        if (!S_ISREG(entry->st.st_mode) || entry->st.st_size == 0) {
+            continue;
+        }
+
+        struct FileIndexItem *item = &(index->data[index->length++]);
+        item->size = entry->st.st_size;
+        item->index = i;
+
+        if (inodemap_get(index->inodes, entry->st.st_dev, entry->st.st_ino) == -1) {
+            inodemap_set(index->inodes, entry->st.st_dev, entry->st.st_ino, i);
+        }
+    }
+
+    qsort(index->data, index->length, sizeof(struct FileIndexItem), fileindex_item_compare);
+
+    return index;
+}
+
+static void fileindex_ensure_hash(struct FileIndex *index, struct FileEntry *entry)
+{
+    if (entry->hash.hashtype != HASHTYPE_LAZY) {
+        return;
+    }
+
+    // All hardlinks of an inode share the hash of the first one we have seen
+    int32_t first = inodemap_get(index->inodes, entry->st.st_dev, entry->st.st_ino);
+    assert(first != -1);
+
+    struct FileEntry *source = &(index->list->data[first]);
+    if (source->hash.hashtype == HASHTYPE_LAZY) {
+        SFMF_DEBUG("Lazily calculating file hash: %s\n", source->filename);
+        fileentry_calculate_hash(source);
+    }
+
+    assert(source->hash.hashtype == HASHTYPE_SHA1);
+    memcpy(&(entry->hash), &(source->hash), sizeof(struct SFMF_FileHash));
+}
+
+struct FileEntry *fileindex_search(struct FileIndex *index, struct SFMF_FileHash *hash)
+{
+    // Binary search for the first file with the requested size
+    uint32_t lo = 0;
+    uint32_t hi = index->length;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index->data[mid].size < hash->size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (uint32_t i=lo; i<index->length && index->data[i].size == hash->size; i++) {
+        struct FileEntry *entry = &(index->list->data[index->data[i].index]);
+
+        fileindex_ensure_hash(index, entry);
+
+        if (sfmf_filehash_compare(hash, &(entry->hash)) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+void fileindex_free(struct FileIndex *index)
+{
+    assert(index);
+
+    inodemap_free(index->inodes);
+    free(index->data);
+    free(index);
+}
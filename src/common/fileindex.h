@@ -0,0 +1,50 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#ifndef SFMF_FILEINDEX_H
+#define SFMF_FILEINDEX_H
+
+#include "sfmf.h"
+#include "fileentry.h"
+#include "inodemap.h"
+
+/**
+ * Index for searching a FileList (e.g. local reference files) by hash;
+ * files are bucketed by size, and only files with a matching size are
+ * hashed (lazily) when searched. Hardlinked files are hashed only once.
+ **/
+
+struct FileIndexItem {
+    uint64_t size;
+    uint32_t index; // index into the FileList
+};
+
+struct FileIndex {
+    struct FileList *list;
+    struct FileIndexItem *data; // non-empty regular files, sorted by size
+    uint32_t length;
+    struct InodeMap *inodes; // (st_dev, st_ino) -> first FileList index with that inode
+};
+
+struct FileIndex *fileindex_new(struct FileList *list);
+// Returns the first file with matching hash (in list order), or NULL if not found
+struct FileEntry *fileindex_search(struct FileIndex *index, struct SFMF_FileHash *hash);
+void fileindex_free(struct FileIndex *index);
+
+#endif /* SFMF_FILEINDEX_H */
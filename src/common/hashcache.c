@@ -0,0 +1,439 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+
+#define _GNU_SOURCE
+
+#include "hashcache.h"
+
+#include "readmanifest.h"
+#include "sparse.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+
+
+static uint64_t hashcache_timespec_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ull + (uint64_t)ts->tv_nsec;
+}
+
+static struct HashCacheRecord *hashcache_find(struct HashCache *cache, const struct stat *st)
+{
+    int32_t index = inodemap_get(cache->map, st->st_dev, st->st_ino);
+    if (index == -1) {
+        return NULL;
+    }
+
+    return &(cache->records[index]);
+}
+
+static int hashcache_record_matches(struct HashCacheRecord *record, const struct stat *st)
+{
+    return (record->size == (uint64_t)st->st_size &&
+            record->mtime_ns == hashcache_timespec_ns(&st->st_mtim) &&
+            record->ctime_ns == hashcache_timespec_ns(&st->st_ctim));
+}
+
+// Adds a record for (dev, ino), or returns the existing one; record->used is left as-is
+static struct HashCacheRecord *hashcache_insert(struct HashCache *cache, dev_t dev, ino_t ino)
+{
+    int32_t index = inodemap_get(cache->map, dev, ino);
+    if (index != -1) {
+        return &(cache->records[index]);
+    }
+
+    if (cache->length == cache->size) {
+        cache->size = cache->size ? 2 * cache->size : 1024;
+        cache->records = realloc(cache->records, cache->size * sizeof(struct HashCacheRecord));
+        assert(cache->records != NULL);
+    }
+
+    index = cache->length++;
+    inodemap_set(cache->map, dev, ino, index);
+
+    struct HashCacheRecord *record = &(cache->records[index]);
+    memset(record, 0, sizeof(*record));
+    record->dev = dev;
+    record->ino = ino;
+    return record;
+}
+
+static struct SFMF_ExtentEntry *hashcache_copy_extents(const struct SFMF_ExtentEntry *extents, uint32_t length)
+{
+    if (length == 0) {
+        return NULL;
+    }
+
+    size_t size = length * sizeof(struct SFMF_ExtentEntry);
+    return memcpy(malloc(size), extents, size);
+}
+
+static void hashcache_set(struct HashCacheRecord *record, const struct stat *st,
+        const struct SFMF_FileHash *hash, uint64_t zsize, enum ConvertFlags zconvert,
+        struct SFMF_ExtentEntry *extents, uint32_t extents_length)
+{
+    free(record->extents);
+    record->size = st->st_size;
+    record->mtime_ns = hashcache_timespec_ns(&st->st_mtim);
+    record->ctime_ns = hashcache_timespec_ns(&st->st_ctim);
+    record->hash = *hash;
+    record->zsize = zsize;
+    record->zconvert = zconvert;
+    record->extents = extents;
+    record->extents_length = extents_length;
+}
+
+static int hashcache_read_u32(FILE *fp, uint32_t *value)
+{
+    if (fread(value, sizeof(*value), 1, fp) != 1) {
+        return 0;
+    }
+
+    *value = be32toh(*value);
+    return 1;
+}
+
+static int hashcache_read_u64(FILE *fp, uint64_t *value)
+{
+    if (fread(value, sizeof(*value), 1, fp) != 1) {
+        return 0;
+    }
+
+    *value = be64toh(*value);
+    return 1;
+}
+
+static int hashcache_write_u32(FILE *fp, uint32_t value)
+{
+    value = htobe32(value);
+    return (fwrite(&value, sizeof(value), 1, fp) == 1);
+}
+
+static int hashcache_write_u64(FILE *fp, uint64_t value)
+{
+    value = htobe64(value);
+    return (fwrite(&value, sizeof(value), 1, fp) == 1);
+}
+
+static int hashcache_load(struct HashCache *cache, FILE *fp)
+{
+    uint32_t magic, version, config, count;
+    if (!hashcache_read_u32(fp, &magic) || !hashcache_read_u32(fp, &version) ||
+            !hashcache_read_u32(fp, &config) || !hashcache_read_u32(fp, &count) ||
+            magic != HASHCACHE_MAGIC_NUMBER) {
+        SFMF_WARN("Not a valid hash cache: %s\n", cache->filename);
+        return 0;
+    }
+
+    if (version != HASHCACHE_VERSION) {
+        SFMF_LOG("Hash cache %s has a different format, not using it\n", cache->filename);
+        return 0;
+    }
+
+    if (config != cache->config) {
+        SFMF_LOG("Hash cache %s was built with a different configuration, not using it\n", cache->filename);
+        return 0;
+    }
+
+    for (uint32_t i=0; i<count; i++) {
+        uint64_t dev, ino, size, mtime_ns, ctime_ns, zsize;
+        uint32_t zconvert, hashtype, extents_length;
+        unsigned char hash[SFMF_MAX_HASHSIZE];
+
+        if (!hashcache_read_u64(fp, &dev) || !hashcache_read_u64(fp, &ino) ||
+                !hashcache_read_u64(fp, &size) || !hashcache_read_u64(fp, &mtime_ns) ||
+                !hashcache_read_u64(fp, &ctime_ns) || !hashcache_read_u64(fp, &zsize) ||
+                !hashcache_read_u32(fp, &zconvert) || !hashcache_read_u32(fp, &hashtype) ||
+                fread(hash, sizeof(hash), 1, fp) != 1 || !hashcache_read_u32(fp, &extents_length) ||
+                extents_length > size / SPARSE_DEFAULT_MIN_RUN) {
+            SFMF_WARN("Hash cache %s is truncated\n", cache->filename);
+            return 0;
+        }
+
+        struct SFMF_ExtentEntry *extents = NULL;
+        if (extents_length > 0) {
+            extents = calloc(extents_length, sizeof(struct SFMF_ExtentEntry));
+        }
+
+        for (uint32_t j=0; j<extents_length; j++) {
+            if (!hashcache_read_u64(fp, &(extents[j].offset)) || !hashcache_read_u64(fp, &(extents[j].length))) {
+                SFMF_WARN("Hash cache %s is truncated\n", cache->filename);
+                free(extents);
+                return 0;
+            }
+        }
+
+        struct HashCacheRecord *record = hashcache_insert(cache, dev, ino);
+        record->size = size;
+        record->mtime_ns = mtime_ns;
+        record->ctime_ns = ctime_ns;
+        record->hash.size = size;
+        record->hash.hashtype = hashtype;
+        memcpy(record->hash.hash, hash, sizeof(hash));
+        record->zsize = zsize;
+        record->zconvert = zconvert;
+        free(record->extents);
+        record->extents = extents;
+        record->extents_length = extents_length;
+    }
+
+    return 1;
+}
+
+static void hashcache_clear(struct HashCache *cache)
+{
+    for (uint32_t i=0; i<cache->length; i++) {
+        free(cache->records[i].extents);
+    }
+
+    inodemap_free(cache->map);
+    cache->map = inodemap_new(0);
+    cache->length = 0;
+}
+
+struct HashCache *hashcache_open(const char *filename, uint32_t config)
+{
+    struct HashCache *cache = calloc(1, sizeof(struct HashCache));
+    cache->filename = strdup(filename);
+    cache->config = config;
+    cache->map = inodemap_new(0);
+    pthread_mutex_init(&cache->mutex, NULL);
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            SFMF_WARN("Could not open hash cache %s: %s\n", filename, strerror(errno));
+        }
+        return cache;
+    }
+
+    if (!hashcache_load(cache, fp)) {
+        hashcache_clear(cache);
+    }
+    fclose(fp);
+
+    SFMF_LOG("Loaded %" PRIu32 " entries from hash cache %s\n", cache->length, filename);
+
+    return cache;
+}
+
+int hashcache_lookup(struct HashCache *cache, const struct stat *st, struct SFMF_FileHash *hash,
+        uint64_t *zsize, enum ConvertFlags *zconvert, struct SFMF_ExtentEntry **extents,
+        uint32_t *extents_length)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&cache->mutex);
+    struct HashCacheRecord *record = hashcache_find(cache, st);
+    if (record != NULL && hashcache_record_matches(record, st)) {
+        record->used = 1;
+        *hash = record->hash;
+        *zsize = record->zsize;
+        *zconvert = record->zconvert;
+        *extents = hashcache_copy_extents(record->extents, record->extents_length);
+        *extents_length = record->extents_length;
+        cache->hits++;
+        result = 1;
+    } else {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    return result;
+}
+
+void hashcache_store(struct HashCache *cache, const struct stat *st, const struct SFMF_FileHash *hash,
+        uint64_t zsize, enum ConvertFlags zconvert, const struct SFMF_ExtentEntry *extents,
+        uint32_t extents_length)
+{
+    assert(hash->size == (uint64_t)st->st_size);
+
+    struct SFMF_ExtentEntry *copy = hashcache_copy_extents(extents, extents_length);
+
+    pthread_mutex_lock(&cache->mutex);
+    struct HashCacheRecord *record = hashcache_insert(cache, st->st_dev, st->st_ino);
+    hashcache_set(record, st, hash, zsize, zconvert, copy, extents_length);
+    record->used = 1;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+uint32_t hashcache_seed(struct HashCache *cache, const char *root, const char *manifest_filename,
+        struct CostModel *model)
+{
+    assert(!model->adaptive);
+
+    struct ManifestReader *reader = manifestreader_open(manifest_filename);
+    if (reader == NULL) {
+        SFMF_FAIL_AND_EXIT("Could not read manifest: %s\n", manifest_filename);
+    }
+
+    // The manifest only has whole-second mtimes, so a file that was changed in the same
+    // second (keeping its size) would look unchanged; but if the file hasn't changed at
+    // all (not even its inode) since before the manifest was written, the hash is right
+    struct stat manifest_st;
+    if (fstat(reader->fd, &manifest_st) != 0) {
+        SFMF_FAIL_AND_EXIT("Could not stat manifest: %s\n", manifest_filename);
+    }
+
+    enum ConvertFlags zconvert = convert_flags_compress(model->codec);
+    uint32_t codec_flags = convert_flags_blob_flags(zconvert);
+    uint32_t count = 0;
+
+    // Without any zero extents, the manifest might have been packed without looking
+    // for them, so we can't tell if large files have any
+    int has_extents = (reader->header.version >= SFMF_VERSION_EXTENTS &&
+            reader->sections[MANIFEST_SECTION_EXTENTS].entry.size > 0);
+
+    for (uint32_t i=0; i<reader->header.entries_length; i++) {
+        struct SFMF_FileEntry entry;
+        manifestreader_get_entry(reader, i, &entry);
+
+        if (entry.type != ENTRY_FILE || entry.hash.size == 0) {
+            continue;
+        }
+
+        // Small files might have been compressed with a (different) dictionary
+        if (entry.hash.size <= model->dictionary_max_size) {
+            continue;
+        }
+
+        if (entry.hash.size >= SPARSE_DEFAULT_MIN_RUN && !has_extents) {
+            continue;
+        }
+
+        // Only files that are stored or compressed at the default level of our codec
+        // (the level isn't recorded in the manifest, but it's the only one we'd use)
+        if (!((entry.flags == BLOB_FLAG_NONE && entry.zsize >= entry.hash.size) ||
+                    entry.flags == codec_flags)) {
+            continue;
+        }
+
+        const char *filename = manifestreader_get_filename(reader, i);
+        char *path = malloc(strlen(root) + strlen(filename) + 1);
+        sprintf(path, "%s%s", root, filename);
+
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size == entry.hash.size &&
+                st.st_mtime == entry.mtime && st.st_ctime < manifest_st.st_mtime) {
+            struct HashCacheRecord *record = hashcache_find(cache, &st);
+            if (record == NULL || !hashcache_record_matches(record, &st)) {
+                struct SFMF_ExtentEntry *extents = NULL;
+                uint32_t first = 0;
+                uint32_t extents_length = has_extents ? manifestreader_find_extents(reader, i, &first) : 0;
+                if (extents_length > 0) {
+                    extents = calloc(extents_length, sizeof(struct SFMF_ExtentEntry));
+                    for (uint32_t j=0; j<extents_length; j++) {
+                        manifestreader_get_extent(reader, first + j, &(extents[j]));
+                        extents[j].entry = 0;
+                    }
+                }
+
+                record = hashcache_insert(cache, st.st_dev, st.st_ino);
+                hashcache_set(record, &st, &(entry.hash), entry.zsize, zconvert, extents, extents_length);
+                count++;
+            }
+        }
+
+        free(path);
+    }
+
+    manifestreader_close(reader);
+
+    return count;
+}
+
+int hashcache_save(struct HashCache *cache)
+{
+    char *tmp = malloc(strlen(cache->filename) + strlen(".tmp") + 1);
+    sprintf(tmp, "%s.tmp", cache->filename);
+
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        SFMF_WARN("Could not write hash cache %s: %s\n", tmp, strerror(errno));
+        free(tmp);
+        return 1;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i=0; i<cache->length; i++) {
+        count += cache->records[i].used;
+    }
+
+    int ok = (hashcache_write_u32(fp, HASHCACHE_MAGIC_NUMBER) && hashcache_write_u32(fp, HASHCACHE_VERSION) &&
+            hashcache_write_u32(fp, cache->config) && hashcache_write_u32(fp, count));
+
+    for (uint32_t i=0; ok && i<cache->length; i++) {
+        struct HashCacheRecord *record = &(cache->records[i]);
+        if (!record->used) {
+            continue;
+        }
+
+        ok = (hashcache_write_u64(fp, record->dev) && hashcache_write_u64(fp, record->ino) &&
+                hashcache_write_u64(fp, record->size) && hashcache_write_u64(fp, record->mtime_ns) &&
+                hashcache_write_u64(fp, record->ctime_ns) && hashcache_write_u64(fp, record->zsize) &&
+                hashcache_write_u32(fp, record->zconvert) && hashcache_write_u32(fp, record->hash.hashtype) &&
+                fwrite(record->hash.hash, SFMF_MAX_HASHSIZE, 1, fp) == 1 &&
+                hashcache_write_u32(fp, record->extents_length));
+
+        for (uint32_t j=0; ok && j<record->extents_length; j++) {
+            ok = (hashcache_write_u64(fp, record->extents[j].offset) &&
+                    hashcache_write_u64(fp, record->extents[j].length));
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+
+    if (!ok || rename(tmp, cache->filename) != 0) {
+        SFMF_WARN("Could not write hash cache %s: %s\n", cache->filename, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return 1;
+    }
+
+    free(tmp);
+
+    SFMF_LOG("Hash cache: %" PRIu32 " hits, %" PRIu32 " misses, saved %" PRIu32 " entries\n",
+            cache->hits, cache->misses, count);
+
+    return 0;
+}
+
+void hashcache_free(struct HashCache *cache)
+{
+    assert(cache);
+
+    for (uint32_t i=0; i<cache->length; i++) {
+        free(cache->records[i].extents);
+    }
+    inodemap_free(cache->map);
+    free(cache->records);
+    free(cache->filename);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
@@ -0,0 +1,113 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+
+#ifndef SFMF_HASHCACHE_H
+#define SFMF_HASHCACHE_H
+
+#include "sfmf.h"
+#include "convert.h"
+#include "costmodel.h"
+#include "inodemap.h"
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/**
+ * Persistent cache of file hashes and zsizes for sfmf-pack: results are
+ * keyed by (st_dev, st_ino, size, mtime, ctime) of the file, so files
+ * that haven't changed since the last run don't need to be read (and
+ * compressed) again. The conversion that zsize was calculated with is
+ * kept too, as the data is compressed again when writing the blob (and
+ * must come out at exactly zsize bytes), and so are the zero extents of
+ * the file (see sparse.h). The cache is only valid for one
+ * configuration (codec selection and dictionary), identified by a
+ * checksum of it: if it doesn't match, the cache is started from scratch.
+ * It can also be seeded with the hashes of a previous manifest, for files
+ * that are still there with the same size and mtime, and haven't changed
+ * since before the manifest was written (large files only if
+ * the manifest lists zero extents, as it might have been packed without).
+ *
+ * Cache file format (integers in network byte order):
+ *  - HASHCACHE_MAGIC_NUMBER, HASHCACHE_VERSION, config, count (uint32_t each)
+ *  - count records: dev, ino, size, mtime_ns, ctime_ns, zsize (uint64_t each),
+ *    zconvert, hashtype (uint32_t each), SFMF_MAX_HASHSIZE bytes of hash,
+ *    extents_length (uint32_t), extents_length times offset, length (uint64_t each)
+ *
+ * All functions except hashcache_seed() can be called from multiple threads.
+ **/
+
+#define HASHCACHE_MAGIC_NUMBER (('S' << 24) | ('F' << 16) | ('H' << 8) | 'C')
+#define HASHCACHE_VERSION 2
+
+struct HashCacheRecord {
+    dev_t dev;
+    ino_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t ctime_ns;
+
+    struct SFMF_FileHash hash;
+    uint64_t zsize;
+    enum ConvertFlags zconvert;
+    struct SFMF_ExtentEntry *extents; // zero extents (NULL if there are none)
+    uint32_t extents_length;
+
+    int used; // looked up or stored in this run (only those are saved)
+};
+
+struct HashCache {
+    char *filename;
+    uint32_t config;
+
+    struct HashCacheRecord *records;
+    uint32_t length;
+    uint32_t size; // allocated records
+    struct InodeMap *map; // (dev, ino) -> index into records
+
+    uint32_t hits;
+    uint32_t misses;
+
+    pthread_mutex_t mutex;
+};
+
+// Loads the cache from filename (if it exists and was saved with the same config)
+struct HashCache *hashcache_open(const char *filename, uint32_t config);
+// Returns 1 and fills in hash, zsize, zconvert and the zero extents (a copy to be freed
+// by the caller, NULL if there are none) if the file described by st is cached
+int hashcache_lookup(struct HashCache *cache, const struct stat *st, struct SFMF_FileHash *hash,
+        uint64_t *zsize, enum ConvertFlags *zconvert, struct SFMF_ExtentEntry **extents,
+        uint32_t *extents_length);
+// The extents are copied into the cache
+void hashcache_store(struct HashCache *cache, const struct stat *st, const struct SFMF_FileHash *hash,
+        uint64_t zsize, enum ConvertFlags zconvert, const struct SFMF_ExtentEntry *extents,
+        uint32_t extents_length);
+// Adds the regular files of manifest_filename that are found unchanged (same size and
+// mtime, and last changed in an earlier second than the manifest was written) below
+// root; only for a model that isn't adaptive, and files compressed with its codec at
+// the default level (or stored); returns the number of files added
+uint32_t hashcache_seed(struct HashCache *cache, const char *root, const char *manifest_filename,
+        struct CostModel *model);
+// Writes all records used in this run back to the cache file; returns 0 on success
+int hashcache_save(struct HashCache *cache);
+void hashcache_free(struct HashCache *cache);
+
+#endif /* SFMF_HASHCACHE_H */
@@ -0,0 +1,121 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#include "hashindex.h"
+
+#include "logging.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+
+static uint32_t hashindex_bucket(struct SFMF_FileHash *hash)
+{
+    // The hash value is already a SHA-1 digest, so its first bytes are
+    // uniformly distributed; mix in the size for (unlikely) collisions
+    uint32_t result;
+    memcpy(&result, hash->hash, sizeof(result));
+    return result ^ ((uint32_t)(hash->size ^ (hash->size >> 32)) * 2654435761u);
+}
+
+static int hashindex_equal(struct SFMF_FileHash *a, struct SFMF_FileHash *b)
+{
+    return (a->size == b->size && memcmp(a->hash, b->hash, SFMF_MAX_HASHSIZE) == 0);
+}
+
+static struct HashIndexSlot *hashindex_find_slot(struct HashIndex *index, struct SFMF_FileHash *hash)
+{
+    uint32_t mask = index->size - 1;
+    uint32_t pos = hashindex_bucket(hash) & mask;
+
+    // Linear probing; the table is never full, so this terminates
+    while (index->data[pos].hash != NULL && !hashindex_equal(index->data[pos].hash, hash)) {
+        pos = (pos + 1) & mask;
+    }
+
+    return &(index->data[pos]);
+}
+
+static struct HashIndex *hashindex_resize(struct HashIndex *index, uint32_t size)
+{
+    struct HashIndexSlot *old_data = index->data;
+    uint32_t old_size = index->size;
+
+    index->size = size;
+    index->data = calloc(index->size, sizeof(struct HashIndexSlot));
+    assert(index->data != NULL);
+
+    for (uint32_t i=0; i<old_size; i++) {
+        if (old_data[i].hash != NULL) {
+            *hashindex_find_slot(index, old_data[i].hash) = old_data[i];
+        }
+    }
+
+    free(old_data);
+
+    return index;
+}
+
+struct HashIndex *hashindex_new(uint32_t expected_length)
+{
+    // Keep the load factor below 50% for the expected number of items
+    uint32_t size = 16;
+    while (size < 2 * expected_length) {
+        size *= 2;
+    }
+
+    return hashindex_resize(calloc(1, sizeof(struct HashIndex)), size);
+}
+
+void *hashindex_insert(struct HashIndex *index, struct SFMF_FileHash *hash, void *value)
+{
+    assert(hash->hashtype == HASHTYPE_SHA1);
+
+    if (2 * (index->length + 1) > index->size) {
+        index = hashindex_resize(index, index->size * 2);
+    }
+
+    struct HashIndexSlot *slot = hashindex_find_slot(index, hash);
+    if (slot->hash != NULL) {
+        // Keep the first value that has been inserted for this hash
+        return slot->value;
+    }
+
+    slot->hash = hash;
+    slot->value = value;
+    index->length++;
+
+    return NULL;
+}
+
+void *hashindex_lookup(struct HashIndex *index, struct SFMF_FileHash *hash)
+{
+    assert(hash->hashtype == HASHTYPE_SHA1);
+
+    return hashindex_find_slot(index, hash)->value;
+}
+
+void hashindex_free(struct HashIndex *index)
+{
+    assert(index);
+
+    free(index->data);
+    free(index);
+}
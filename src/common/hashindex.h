@@ -0,0 +1,51 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#ifndef SFMF_HASHINDEX_H
+#define SFMF_HASHINDEX_H
+
+#include "sfmf.h"
+
+#include <stdint.h>
+
+/**
+ * Open-addressing hash table mapping SFMF_FileHash keys (size + hash value)
+ * to arbitrary values. Keys are stored by reference, so the caller has to
+ * make sure they stay valid (and unmodified) for the lifetime of the index.
+ **/
+
+struct HashIndexSlot {
+    struct SFMF_FileHash *hash; // NULL if the slot is unused
+    void *value;
+};
+
+struct HashIndex {
+    struct HashIndexSlot *data;
+    uint32_t length; // number of used slots
+    uint32_t size; // allocated slots (always a power of two)
+};
+
+struct HashIndex *hashindex_new(uint32_t expected_length);
+// Returns NULL if inserted, or the value already stored for this hash (first insert wins)
+void *hashindex_insert(struct HashIndex *index, struct SFMF_FileHash *hash, void *value);
+// Returns the value stored for the hash, or NULL if not found
+void *hashindex_lookup(struct HashIndex *index, struct SFMF_FileHash *hash);
+void hashindex_free(struct HashIndex *index);
+
+#endif /* SFMF_HASHINDEX_H */
@@ -0,0 +1,110 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#include "inodemap.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+
+static uint32_t inodemap_bucket(dev_t dev, ino_t ino)
+{
+    uint64_t key = (uint64_t)ino ^ ((uint64_t)dev << 40) ^ ((uint64_t)dev >> 24);
+    key *= 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(key >> 32);
+}
+
+static struct InodeMapSlot *inodemap_find_slot(struct InodeMap *map, dev_t dev, ino_t ino)
+{
+    uint32_t mask = map->size - 1;
+    uint32_t pos = inodemap_bucket(dev, ino) & mask;
+
+    // Linear probing; the table is never full, so this terminates
+    while (map->data[pos].value != -1 && !(map->data[pos].dev == dev && map->data[pos].ino == ino)) {
+        pos = (pos + 1) & mask;
+    }
+
+    return &(map->data[pos]);
+}
+
+static struct InodeMap *inodemap_resize(struct InodeMap *map, uint32_t size)
+{
+    struct InodeMapSlot *old_data = map->data;
+    uint32_t old_size = map->size;
+
+    map->size = size;
+    map->data = malloc(map->size * sizeof(struct InodeMapSlot));
+    assert(map->data != NULL);
+
+    for (uint32_t i=0; i<map->size; i++) {
+        map->data[i].value = -1;
+    }
+
+    for (uint32_t i=0; i<old_size; i++) {
+        if (old_data[i].value != -1) {
+            *inodemap_find_slot(map, old_data[i].dev, old_data[i].ino) = old_data[i];
+        }
+    }
+
+    free(old_data);
+
+    return map;
+}
+
+struct InodeMap *inodemap_new(uint32_t expected_length)
+{
+    // Keep the load factor below 50% for the expected number of items
+    uint32_t size = 16;
+    while (size < 2 * expected_length) {
+        size *= 2;
+    }
+
+    return inodemap_resize(calloc(1, sizeof(struct InodeMap)), size);
+}
+
+int32_t inodemap_get(struct InodeMap *map, dev_t dev, ino_t ino)
+{
+    return inodemap_find_slot(map, dev, ino)->value;
+}
+
+void inodemap_set(struct InodeMap *map, dev_t dev, ino_t ino, int32_t value)
+{
+    assert(value != -1);
+
+    if (2 * (map->length + 1) > map->size) {
+        map = inodemap_resize(map, map->size * 2);
+    }
+
+    struct InodeMapSlot *slot = inodemap_find_slot(map, dev, ino);
+    if (slot->value == -1) {
+        slot->dev = dev;
+        slot->ino = ino;
+        map->length++;
+    }
+
+    slot->value = value;
+}
+
+void inodemap_free(struct InodeMap *map)
+{
+    assert(map);
+
+    free(map->data);
+    free(map);
+}
@@ -0,0 +1,49 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#ifndef SFMF_INODEMAP_H
+#define SFMF_INODEMAP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Open-addressing hash table mapping (st_dev, st_ino) pairs to indices
+ * (e.g. into a FileList), used for detecting hardlinked files.
+ **/
+
+struct InodeMapSlot {
+    dev_t dev;
+    ino_t ino;
+    int32_t value; // -1 if the slot is unused
+};
+
+struct InodeMap {
+    struct InodeMapSlot *data;
+    uint32_t length; // number of used slots
+    uint32_t size; // allocated slots (always a power of two)
+};
+
+struct InodeMap *inodemap_new(uint32_t expected_length);
+// Returns the value stored for (dev, ino), or -1 if not found
+int32_t inodemap_get(struct InodeMap *map, dev_t dev, ino_t ino);
+void inodemap_set(struct InodeMap *map, dev_t dev, ino_t ino, int32_t value);
+void inodemap_free(struct InodeMap *map);
+
+#endif /* SFMF_INODEMAP_H */
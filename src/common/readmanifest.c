@@ -0,0 +1,671 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#include "readmanifest.h"
+
+#include "convert.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <inttypes.h>
+
+
+// Returns a pointer to size bytes at offset in data (or NULL if out of bounds)
+static const char *manifestreader_range(const char *data, uint64_t length, uint64_t offset, uint64_t size)
+{
+    if (offset > length || size > length - offset) {
+        return NULL;
+    }
+
+    return data + offset;
+}
+
+// Returns a pointer to the next length bytes at *offset (or NULL if out of bounds)
+static const char *manifestreader_section(struct ManifestReader *reader, uint64_t *offset, uint64_t length)
+{
+    const char *result = manifestreader_range(reader->data, reader->length, *offset, length);
+    if (result != NULL) {
+        *offset += length;
+    }
+
+    return result;
+}
+
+// Strings are returned as pointers into the section data, so make sure they are terminated
+static int manifestreader_check_section(int type, const char *data, uint64_t size)
+{
+    if (type == MANIFEST_SECTION_METADATA || type == MANIFEST_SECTION_FILENAMES) {
+        return (size == 0 || data[size - 1] == '\0');
+    }
+
+    return 1;
+}
+
+// Returns the data of a section, verifying and inflating it on first use
+static const char *manifestreader_load(struct ManifestReader *reader, enum ManifestSectionType type)
+{
+    struct ManifestReaderSection *section = &(reader->sections[type]);
+
+    if (section->data == NULL && section->has_checksum &&
+            sfmf_section_checksum(section->stored, section->entry.stored_size) != section->entry.checksum) {
+        SFMF_FAIL_AND_EXIT("Checksum mismatch in manifest (section %d)\n", type);
+    }
+
+    if (section->data == NULL && !(section->entry.flags & SECTION_FLAG_ZCOMPRESSED)) {
+        if (!manifestreader_check_section(type, section->stored, section->entry.size)) {
+            SFMF_FAIL_AND_EXIT("Invalid string table in manifest (section %d)\n", type);
+        }
+
+        section->data = section->stored;
+    } else if (section->data == NULL) {
+        size_t size = section->entry.size;
+        section->buffer = malloc(size ?: 1);
+        if (section->buffer == NULL ||
+                convert_buffer_zuncompress(section->stored, section->entry.stored_size, section->buffer, size) != 0 ||
+                !manifestreader_check_section(type, section->buffer, size)) {
+            SFMF_FAIL_AND_EXIT("Invalid compressed section in manifest (section %d)\n", type);
+        }
+
+        section->data = section->buffer;
+    }
+
+    return section->data;
+}
+
+// Checks the size and flags of the section table entry of section type
+static int manifestreader_check_entry(int type, struct SFMF_SectionEntry *entry, uint64_t size, uint32_t version)
+{
+    int sized = (type != MANIFEST_SECTION_PACK_HASHES && type != MANIFEST_SECTION_DICTIONARY &&
+            type != MANIFEST_SECTION_EXTENTS && type != MANIFEST_SECTION_CHUNKS &&
+            type != MANIFEST_SECTION_DELTAS);
+    if ((sized && entry->size != size) ||
+            (type == MANIFEST_SECTION_EXTENTS && entry->size % sfmf_extententry_size(version) != 0) ||
+            (type == MANIFEST_SECTION_CHUNKS && entry->size % sfmf_chunkentry_size(version) != 0) ||
+            (type == MANIFEST_SECTION_DELTAS && entry->size % sfmf_deltaentry_size(version) != 0) ||
+            (entry->flags & ~SECTION_FLAG_ZCOMPRESSED) != 0 || entry->size > SIZE_MAX ||
+            (!(entry->flags & SECTION_FLAG_ZCOMPRESSED) && entry->stored_size != entry->size)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Reads the section table (version >= 2) at *offset, and sets *offset to the end of the last section
+static int manifestreader_open_section_table(struct ManifestReader *reader, uint64_t *offset, uint64_t *sizes)
+{
+    uint32_t version = reader->header.version;
+
+    const char *buf = manifestreader_section(reader, offset, sizeof(uint32_t));
+    if (buf == NULL) {
+        return 0;
+    }
+
+    uint32_t count;
+    memcpy(&count, buf, sizeof(count));
+    count = ntohl(count);
+
+    const char *table = manifestreader_section(reader, offset, (uint64_t)count * sfmf_sectionentry_size(version));
+    if (table == NULL) {
+        return 0;
+    }
+
+    int found[MANIFEST_SECTION_COUNT] = { 0 };
+    for (uint32_t i=0; i<count; i++) {
+        struct SFMF_SectionEntry entry;
+        sfmf_sectionentry_decode(&entry, version, table + i * sfmf_sectionentry_size(version));
+
+        // Sections of types we don't know about are skipped
+        if (entry.type >= MANIFEST_SECTION_COUNT) {
+            continue;
+        }
+
+        struct ManifestReaderSection *section = &(reader->sections[entry.type]);
+        section->entry = entry;
+        section->stored = manifestreader_range(reader->data, reader->length, entry.offset, entry.stored_size);
+        section->has_checksum = 1;
+        if (found[entry.type]++ || section->stored == NULL ||
+                !manifestreader_check_entry(entry.type, &(section->entry), sizes[entry.type], version)) {
+            return 0;
+        }
+
+        if (entry.offset + entry.stored_size > *offset) {
+            *offset = entry.offset + entry.stored_size;
+        }
+    }
+
+    for (int i=0; i<MANIFEST_SECTION_COUNT; i++) {
+        if (!found[i]) {
+            // Missing sections are empty (which is only valid for some of them)
+            struct ManifestReaderSection *section = &(reader->sections[i]);
+            section->entry = (struct SFMF_SectionEntry){ i, SECTION_FLAG_NONE, 0, 0, 0, 0 };
+            section->stored = reader->data;
+            if (!manifestreader_check_entry(i, &(section->entry), sizes[i], version)) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+struct ManifestReader *manifestreader_open(const char *filename)
+{
+    struct ManifestReader *reader = calloc(1, sizeof(struct ManifestReader));
+
+    reader->fd = open(filename, O_RDONLY);
+    if (reader->fd == -1) {
+        SFMF_WARN("Could not open %s: %s\n", filename, strerror(errno));
+        free(reader);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(reader->fd, &st) != 0 || st.st_size < sfmf_fileheader_size(1)) {
+        SFMF_WARN("Not a manifest file: %s\n", filename);
+        goto fail;
+    }
+
+    reader->length = st.st_size;
+    reader->data = mmap(NULL, reader->length, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+    if (reader->data == MAP_FAILED) {
+        SFMF_WARN("Could not map %s: %s\n", filename, strerror(errno));
+        reader->data = NULL;
+        goto fail;
+    }
+
+    // The header size depends on the version, so check that first
+    uint32_t magic, version;
+    memcpy(&magic, reader->data + offsetof(struct SFMF_FileHeader, magic), sizeof(magic));
+    memcpy(&version, reader->data + offsetof(struct SFMF_FileHeader, version), sizeof(version));
+    magic = ntohl(magic);
+    version = ntohl(version);
+
+    if (magic != SFMF_MAGIC_NUMBER || version < SFMF_MIN_VERSION || version > SFMF_CURRENT_VERSION ||
+            reader->length < sfmf_fileheader_size(version)) {
+        SFMF_WARN("Unsupported manifest file: %s\n", filename);
+        goto fail;
+    }
+
+    sfmf_fileheader_decode(&(reader->header), reader->data);
+
+    struct SFMF_FileHeader *header = &(reader->header);
+    uint64_t sizes[MANIFEST_SECTION_COUNT] = {
+        header->metadata_size,
+        header->filename_table_size,
+        (uint64_t)header->entries_length * sfmf_fileentry_size(version),
+        (uint64_t)header->packs_length * sfmf_packentry_size(version),
+        (uint64_t)header->blobs_length * sfmf_blobentry_size(version),
+        (version >= SFMF_VERSION_HASH_INDEX) ? (uint64_t)header->hash_index_length * sfmf_hashindexentry_size(version) : 0,
+        0, // only known from the section table
+        0, // only known from the section table
+        0, // only known from the section table
+        0, // only known from the section table
+        0, // only known from the section table
+    };
+
+    uint64_t offset = sfmf_fileheader_size(version);
+    if (version >= SFMF_VERSION_SECTION_TABLE) {
+        if (!manifestreader_open_section_table(reader, &offset, sizes)) {
+            SFMF_WARN("Invalid section table in manifest file: %s\n", filename);
+            goto fail;
+        }
+    }
+
+    // Without a section table, the sections follow the header (uncompressed)
+    for (int i=0; version < SFMF_VERSION_SECTION_TABLE && i<MANIFEST_SECTION_COUNT; i++) {
+        struct ManifestReaderSection *section = &(reader->sections[i]);
+
+        if (i == MANIFEST_SECTION_DICTIONARY || i == MANIFEST_SECTION_EXTENTS ||
+                i == MANIFEST_SECTION_CHUNKS || i == MANIFEST_SECTION_DELTAS /* only with a section table */) {
+            section->entry = (struct SFMF_SectionEntry){ i, SECTION_FLAG_NONE, 0, 0, 0, 0 };
+            section->stored = section->data = reader->data;
+            continue;
+        } else if (i == MANIFEST_SECTION_PACK_HASHES) {
+            // Pack offsets are file offsets before version 2
+            section->entry = (struct SFMF_SectionEntry){ i, SECTION_FLAG_NONE, 0, reader->length, reader->length, 0 };
+            section->stored = section->data = reader->data;
+            continue;
+        }
+
+        section->entry = (struct SFMF_SectionEntry){ i, SECTION_FLAG_NONE, offset, sizes[i], sizes[i], 0 };
+        section->stored = section->data = manifestreader_section(reader, &offset, sizes[i]);
+        if (section->stored == NULL) {
+            SFMF_WARN("Truncated manifest file: %s\n", filename);
+            goto fail;
+        }
+
+        if (!manifestreader_check_section(i, section->data, sizes[i])) {
+            SFMF_WARN("Invalid string table in manifest file: %s\n", filename);
+            goto fail;
+        }
+    }
+
+    // Blob offsets are file offsets before version 2
+    if (version >= SFMF_VERSION_SECTION_TABLE) {
+        reader->payload = reader->data + offset;
+        reader->payload_length = reader->length - offset;
+    } else {
+        reader->payload = reader->data;
+        reader->payload_length = reader->length;
+    }
+
+    reader->path = malloc(PATH_MAX);
+
+    // We mostly read the entries and the blobs/packs sequentially; with a section
+    // table, sections are loaded on demand, so only the payload is read ahead
+    if (version >= SFMF_VERSION_SECTION_TABLE) {
+        size_t start = (reader->payload - reader->data) & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        (void)madvise((void *)(reader->data + start), reader->length - start, MADV_SEQUENTIAL);
+    } else {
+        (void)madvise((void *)reader->data, reader->length, MADV_SEQUENTIAL);
+    }
+
+    return reader;
+
+fail:
+    manifestreader_close(reader);
+    return NULL;
+}
+
+void manifestreader_get_entry(struct ManifestReader *reader, uint32_t index, struct SFMF_FileEntry *entry)
+{
+    uint32_t version = reader->header.version;
+
+    assert(index < reader->header.entries_length);
+    const char *entries = manifestreader_load(reader, MANIFEST_SECTION_ENTRIES);
+    sfmf_fileentry_decode(entry, version, entries + index * sfmf_fileentry_size(version));
+}
+
+void manifestreader_get_pack(struct ManifestReader *reader, uint32_t index, struct SFMF_PackEntry *entry)
+{
+    uint32_t version = reader->header.version;
+
+    assert(index < reader->header.packs_length);
+    const char *packs = manifestreader_load(reader, MANIFEST_SECTION_PACKS);
+    sfmf_packentry_decode(entry, version, packs + index * sfmf_packentry_size(version));
+}
+
+void manifestreader_get_blob(struct ManifestReader *reader, uint32_t index, struct SFMF_BlobEntry *entry)
+{
+    uint32_t version = reader->header.version;
+
+    assert(index < reader->header.blobs_length);
+    const char *blobs = manifestreader_load(reader, MANIFEST_SECTION_BLOBS);
+    sfmf_blobentry_decode(entry, version, blobs + index * sfmf_blobentry_size(version));
+}
+
+const char *manifestreader_get_metadata(struct ManifestReader *reader)
+{
+    if (reader->header.metadata_size == 0) {
+        return "";
+    }
+
+    return manifestreader_load(reader, MANIFEST_SECTION_METADATA);
+}
+
+const char *manifestreader_get_filename(struct ManifestReader *reader, uint32_t index)
+{
+    struct SFMF_FileEntry entry;
+    uint32_t table_size = reader->header.filename_table_size;
+    const char *filename_table = manifestreader_load(reader, MANIFEST_SECTION_FILENAMES);
+
+    if (reader->header.version < SFMF_VERSION_FRONTCODED) {
+        manifestreader_get_entry(reader, index, &entry);
+        if (entry.filename_offset >= table_size) {
+            SFMF_FAIL_AND_EXIT("Invalid filename offset in manifest: %u\n", entry.filename_offset);
+        }
+
+        return filename_table + entry.filename_offset;
+    }
+
+    if (reader->path_next == index + 1) {
+        return reader->path;
+    }
+
+    // Continue from the current filename if we can, else start at the restart point
+    uint32_t restart = index - index % SFMF_FILENAME_RESTART_INTERVAL;
+    if (reader->path_next <= restart || reader->path_next > index) {
+        manifestreader_get_entry(reader, restart, &entry);
+        reader->path_next = restart;
+        reader->path_next_offset = entry.filename_offset;
+        reader->path_length = 0;
+    }
+
+    while (reader->path_next <= index) {
+        uint32_t offset = reader->path_next_offset;
+        size_t size = 0;
+        if (offset < table_size) {
+            size = sfmf_filename_record_decode(filename_table + offset, table_size - offset,
+                    reader->path, &(reader->path_length), PATH_MAX);
+        }
+
+        if (size == 0) {
+            reader->path_next = 0;
+            SFMF_FAIL_AND_EXIT("Invalid filename table record in manifest: %u\n", offset);
+        }
+
+        reader->path_next++;
+        reader->path_next_offset += size;
+    }
+
+    return reader->path;
+}
+
+void manifestreader_get_pack_hashes(struct ManifestReader *reader, struct SFMF_PackEntry *pack,
+        struct SFMF_FileHash *hashes)
+{
+    uint32_t version = reader->header.version;
+    struct ManifestReaderSection *section = &(reader->sections[MANIFEST_SECTION_PACK_HASHES]);
+    const char *data = manifestreader_range(manifestreader_load(reader, MANIFEST_SECTION_PACK_HASHES),
+            section->entry.size, pack->offset, (uint64_t)pack->count * sfmf_filehash_size(version));
+    if (data == NULL) {
+        SFMF_FAIL_AND_EXIT("Invalid pack hash list in manifest (offset %" PRIu64 ")\n", pack->offset);
+    }
+
+    for (uint32_t i=0; i<pack->count; i++) {
+        sfmf_filehash_decode(&(hashes[i]), version, data + i * sfmf_filehash_size(version));
+    }
+}
+
+static void manifestreader_build_hash_index(struct ManifestReader *reader)
+{
+    struct SFMF_FileHeader *header = &(reader->header);
+
+    uint32_t length = header->blobs_length;
+    for (uint32_t i=0; i<header->packs_length; i++) {
+        struct SFMF_PackEntry pack;
+        manifestreader_get_pack(reader, i, &pack);
+        length += pack.count;
+    }
+
+    struct SFMF_HashIndexEntry *entries = calloc(length ?: 1, sizeof(struct SFMF_HashIndexEntry));
+    struct SFMF_HashIndexEntry *entry = entries;
+
+    for (uint32_t i=0; i<header->blobs_length; i++) {
+        struct SFMF_BlobEntry blob;
+        manifestreader_get_blob(reader, i, &blob);
+
+        entry->hash = blob.hash;
+        entry->type = HASH_INDEX_BLOB;
+        entry->index = i;
+        entry++;
+    }
+
+    for (uint32_t i=0; i<header->packs_length; i++) {
+        struct SFMF_PackEntry pack;
+        manifestreader_get_pack(reader, i, &pack);
+
+        struct SFMF_FileHash *hashes = calloc(pack.count ?: 1, sizeof(struct SFMF_FileHash));
+        manifestreader_get_pack_hashes(reader, &pack, hashes);
+
+        for (uint32_t j=0; j<pack.count; j++) {
+            entry->hash = hashes[j];
+            entry->type = HASH_INDEX_PACK;
+            entry->index = i;
+            entry->slot = j;
+            entry++;
+        }
+
+        free(hashes);
+    }
+
+    sfmf_hashindex_sort(entries, &length);
+
+    // Store in on-disk format, so that lookups work the same as for version 2
+    size_t entry_size = sfmf_hashindexentry_size(header->version);
+    reader->hash_index_buffer = malloc((length ?: 1) * entry_size);
+    for (uint32_t i=0; i<length; i++) {
+        sfmf_hashindexentry_encode(&(entries[i]), header->version, reader->hash_index_buffer + i * entry_size);
+    }
+
+    free(entries);
+
+    reader->hash_index = reader->hash_index_buffer;
+    reader->hash_index_length = length;
+}
+
+static void manifestreader_load_hash_index(struct ManifestReader *reader)
+{
+    if (reader->hash_index != NULL) {
+        return;
+    }
+
+    if (reader->header.version < SFMF_VERSION_HASH_INDEX) {
+        manifestreader_build_hash_index(reader);
+    } else {
+        reader->hash_index = manifestreader_load(reader, MANIFEST_SECTION_HASH_INDEX);
+        reader->hash_index_length = reader->header.hash_index_length;
+    }
+}
+
+void manifestreader_get_hash_index_entry(struct ManifestReader *reader, uint32_t index,
+        struct SFMF_HashIndexEntry *entry)
+{
+    uint32_t version = reader->header.version;
+
+    manifestreader_load_hash_index(reader);
+    assert(index < reader->hash_index_length);
+    sfmf_hashindexentry_decode(entry, version, reader->hash_index + index * sfmf_hashindexentry_size(version));
+}
+
+int manifestreader_find_hash(struct ManifestReader *reader, struct SFMF_FileHash *hash,
+        struct SFMF_HashIndexEntry *result)
+{
+    manifestreader_load_hash_index(reader);
+
+    uint32_t version = reader->header.version;
+    size_t entry_size = sfmf_hashindexentry_size(version);
+
+    // Binary search for the first entry not less than hash
+    uint32_t lo = 0;
+    uint32_t hi = reader->hash_index_length;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        sfmf_hashindexentry_decode(result, version, reader->hash_index + mid * entry_size);
+        if (sfmf_hashindex_compare(&(result->hash), hash) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == reader->hash_index_length) {
+        return 0;
+    }
+
+    sfmf_hashindexentry_decode(result, version, reader->hash_index + lo * entry_size);
+    return (sfmf_hashindex_compare(&(result->hash), hash) == 0);
+}
+
+const char *manifestreader_get_blob_data(struct ManifestReader *reader, struct SFMF_BlobEntry *blob)
+{
+    const char *data = manifestreader_range(reader->payload, reader->payload_length, blob->offset, blob->size);
+    if (data == NULL) {
+        SFMF_FAIL_AND_EXIT("Invalid blob data in manifest (offset %" PRIu64 ")\n", blob->offset);
+    }
+
+    return data;
+}
+
+const char *manifestreader_get_dictionary(struct ManifestReader *reader, size_t *length)
+{
+    *length = reader->sections[MANIFEST_SECTION_DICTIONARY].entry.size;
+    if (*length == 0) {
+        return NULL;
+    }
+
+    return manifestreader_load(reader, MANIFEST_SECTION_DICTIONARY);
+}
+
+// Finds the records of entry index in a section of records sorted by entry (zero extents
+// or chunks, which both start with the entry index); returns their number and first index
+static uint32_t manifestreader_find_entry_records(struct ManifestReader *reader, enum ManifestSectionType type,
+        size_t size, uint32_t index, uint32_t *first)
+{
+    struct ManifestReaderSection *section = &(reader->sections[type]);
+
+    *first = 0;
+    if (section->entry.size == 0) {
+        return 0;
+    }
+
+    const char *records = manifestreader_load(reader, type);
+    uint32_t length = section->entry.size / size;
+
+    // Records are sorted by entry, so find the first one of index
+    uint32_t lo = 0;
+    uint32_t hi = length;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t entry;
+        memcpy(&entry, records + (size_t)mid * size, sizeof(entry));
+        if (ntohl(entry) < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *first = lo;
+
+    uint32_t count = 0;
+    while (lo + count < length) {
+        uint32_t entry;
+        memcpy(&entry, records + (size_t)(lo + count) * size, sizeof(entry));
+        if (ntohl(entry) != index) {
+            break;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+uint32_t manifestreader_find_extents(struct ManifestReader *reader, uint32_t index, uint32_t *first)
+{
+    return manifestreader_find_entry_records(reader, MANIFEST_SECTION_EXTENTS,
+            sfmf_extententry_size(reader->header.version), index, first);
+}
+
+void manifestreader_get_extent(struct ManifestReader *reader, uint32_t index, struct SFMF_ExtentEntry *extent)
+{
+    uint32_t version = reader->header.version;
+    size_t size = sfmf_extententry_size(version);
+
+    assert((uint64_t)(index + 1) * size <= reader->sections[MANIFEST_SECTION_EXTENTS].entry.size);
+    const char *extents = manifestreader_load(reader, MANIFEST_SECTION_EXTENTS);
+    sfmf_extententry_decode(extent, version, extents + (size_t)index * size);
+}
+
+uint32_t manifestreader_find_chunks(struct ManifestReader *reader, uint32_t index, uint32_t *first)
+{
+    return manifestreader_find_entry_records(reader, MANIFEST_SECTION_CHUNKS,
+            sfmf_chunkentry_size(reader->header.version), index, first);
+}
+
+void manifestreader_get_chunk(struct ManifestReader *reader, uint32_t index, struct SFMF_ChunkEntry *chunk)
+{
+    uint32_t version = reader->header.version;
+    size_t size = sfmf_chunkentry_size(version);
+
+    assert((uint64_t)(index + 1) * size <= reader->sections[MANIFEST_SECTION_CHUNKS].entry.size);
+    const char *chunks = manifestreader_load(reader, MANIFEST_SECTION_CHUNKS);
+    sfmf_chunkentry_decode(chunk, version, chunks + (size_t)index * size);
+}
+
+uint32_t manifestreader_find_deltas(struct ManifestReader *reader, struct SFMF_FileHash *target, uint32_t *first)
+{
+    struct ManifestReaderSection *section = &(reader->sections[MANIFEST_SECTION_DELTAS]);
+
+    *first = 0;
+    if (section->entry.size == 0) {
+        return 0;
+    }
+
+    uint32_t version = reader->header.version;
+    size_t size = sfmf_deltaentry_size(version);
+    const char *deltas = manifestreader_load(reader, MANIFEST_SECTION_DELTAS);
+    uint32_t length = section->entry.size / size;
+
+    // Deltas are sorted by target, so find the first one for target
+    struct SFMF_DeltaEntry delta;
+    uint32_t lo = 0;
+    uint32_t hi = length;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        sfmf_deltaentry_decode(&delta, version, deltas + (size_t)mid * size);
+        if (sfmf_hashindex_compare(&(delta.target), target) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *first = lo;
+
+    uint32_t count = 0;
+    while (lo + count < length) {
+        sfmf_deltaentry_decode(&delta, version, deltas + (size_t)(lo + count) * size);
+        if (sfmf_hashindex_compare(&(delta.target), target) != 0) {
+            break;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+void manifestreader_get_delta(struct ManifestReader *reader, uint32_t index, struct SFMF_DeltaEntry *delta)
+{
+    uint32_t version = reader->header.version;
+    size_t size = sfmf_deltaentry_size(version);
+
+    assert((uint64_t)(index + 1) * size <= reader->sections[MANIFEST_SECTION_DELTAS].entry.size);
+    const char *deltas = manifestreader_load(reader, MANIFEST_SECTION_DELTAS);
+    sfmf_deltaentry_decode(delta, version, deltas + (size_t)index * size);
+}
+
+void manifestreader_close(struct ManifestReader *reader)
+{
+    assert(reader);
+
+    free(reader->hash_index_buffer);
+    free(reader->path);
+    for (int i=0; i<MANIFEST_SECTION_COUNT; i++) {
+        free(reader->sections[i].buffer);
+    }
+
+    if (reader->data) {
+        munmap((void *)reader->data, reader->length);
+    }
+
+    close(reader->fd);
+    free(reader);
+}
@@ -0,0 +1,123 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#ifndef SFMF_READMANIFEST_H
+#define SFMF_READMANIFEST_H
+
+#include "sfmf.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Reader for a manifest file: the file is mapped into memory, and records
+ * are converted to host byte order only when they are accessed. Metadata,
+ * filenames and included blob data are returned as pointers into the
+ * mapping, so nothing is copied (and the kernel only pages in the parts
+ * of the file that are actually used). Content hashes are looked up by
+ * binary search in the sorted hash index of the file; for version 1
+ * files (which don't have one), it is built in memory on first use.
+ * Front-coded filenames (version >= 2) are reconstructed into a buffer,
+ * continuing from the previously returned filename when accessed in order.
+ * With a section table (version >= 2), opening only reads the header and
+ * the table, and each section is located, verified against its checksum
+ * and (if needed) inflated when first used, so tools only touch the pages
+ * of the sections they actually need.
+ **/
+enum ManifestSectionType {
+    MANIFEST_SECTION_METADATA = 0,
+    MANIFEST_SECTION_FILENAMES,
+    MANIFEST_SECTION_ENTRIES,
+    MANIFEST_SECTION_PACKS,
+    MANIFEST_SECTION_BLOBS,
+    MANIFEST_SECTION_HASH_INDEX,
+    MANIFEST_SECTION_PACK_HASHES,
+    MANIFEST_SECTION_DICTIONARY,
+    MANIFEST_SECTION_EXTENTS,
+    MANIFEST_SECTION_CHUNKS,
+    MANIFEST_SECTION_DELTAS,
+    MANIFEST_SECTION_COUNT,
+};
+
+struct ManifestReaderSection {
+    struct SFMF_SectionEntry entry; // from the section table (made up for version 1 files)
+    const char *stored; // <entry.stored_size> bytes in the mapping
+    const char *data; // <entry.size> bytes of section data (NULL until loaded)
+    char *buffer; // inflated data of compressed sections
+    int has_checksum; // entry.checksum is valid (version >= 2)
+};
+
+struct ManifestReader {
+    int fd;
+    const char *data; // mapped manifest file
+    size_t length;
+
+    struct SFMF_FileHeader header;
+
+    // Records are kept in their on-disk format
+    struct ManifestReaderSection sections[MANIFEST_SECTION_COUNT];
+    const char *payload; // included blob data (blob offsets are relative to this)
+    uint64_t payload_length;
+
+    const char *hash_index; // <hash_index_length> x SFMF_HashIndexEntry (NULL until used)
+    uint32_t hash_index_length;
+    char *hash_index_buffer; // for version 1 files, where we build the hash index
+
+    char *path; // last reconstructed filename (front-coded filename tables)
+    size_t path_length;
+    uint32_t path_next; // index of the entry following path (0 = none)
+    uint32_t path_next_offset; // filename table offset of the record of path_next
+};
+
+// Returns NULL (after logging a warning) if the file is not a valid manifest
+struct ManifestReader *manifestreader_open(const char *filename);
+
+// Returns the '\0'-terminated metadata blob
+const char *manifestreader_get_metadata(struct ManifestReader *reader);
+void manifestreader_get_entry(struct ManifestReader *reader, uint32_t index, struct SFMF_FileEntry *entry);
+void manifestreader_get_pack(struct ManifestReader *reader, uint32_t index, struct SFMF_PackEntry *entry);
+void manifestreader_get_blob(struct ManifestReader *reader, uint32_t index, struct SFMF_BlobEntry *entry);
+
+// Returns the filename of entry index; the result is only valid until the next call
+const char *manifestreader_get_filename(struct ManifestReader *reader, uint32_t index);
+// Converts all <pack->count> file hashes of pack into hashes
+void manifestreader_get_pack_hashes(struct ManifestReader *reader, struct SFMF_PackEntry *pack,
+        struct SFMF_FileHash *hashes);
+void manifestreader_get_hash_index_entry(struct ManifestReader *reader, uint32_t index,
+        struct SFMF_HashIndexEntry *entry);
+// Looks up hash in the hash index, returns 1 and fills in result if found
+int manifestreader_find_hash(struct ManifestReader *reader, struct SFMF_FileHash *hash,
+        struct SFMF_HashIndexEntry *result);
+// Returns the compression dictionary (<*length> bytes), or NULL if the manifest has none
+const char *manifestreader_get_dictionary(struct ManifestReader *reader, size_t *length);
+// Returns the number of zero extents of entry index, and the index of the first one in *first
+uint32_t manifestreader_find_extents(struct ManifestReader *reader, uint32_t index, uint32_t *first);
+void manifestreader_get_extent(struct ManifestReader *reader, uint32_t index, struct SFMF_ExtentEntry *extent);
+// Returns the number of chunks of entry index (0 if it isn't chunked), and the index of the first one in *first
+uint32_t manifestreader_find_chunks(struct ManifestReader *reader, uint32_t index, uint32_t *first);
+void manifestreader_get_chunk(struct ManifestReader *reader, uint32_t index, struct SFMF_ChunkEntry *chunk);
+// Returns the number of deltas that produce the file with hash target, and the index of the first one in *first
+uint32_t manifestreader_find_deltas(struct ManifestReader *reader, struct SFMF_FileHash *target, uint32_t *first);
+void manifestreader_get_delta(struct ManifestReader *reader, uint32_t index, struct SFMF_DeltaEntry *delta);
+// Returns the (possibly compressed) data of an included blob (<blob->size> bytes)
+const char *manifestreader_get_blob_data(struct ManifestReader *reader, struct SFMF_BlobEntry *blob);
+
+void manifestreader_close(struct ManifestReader *reader);
+
+#endif /* SFMF_READMANIFEST_H */
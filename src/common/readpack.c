@@ -18,6 +18,7 @@
  **/
 
 #include "readpack.h"
+#include "convert.h"
 #include "logging.h"
 
 #define _XOPEN_SOURCE 500
@@ -32,73 +33,198 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
 
-char *get_blob_from_pack(const char *filename, struct SFMF_FileHash *hash, size_t *size, enum SFMF_BlobEntry_Flag *flags)
+struct PackReader *packreader_open(const char *filename)
 {
-    char *result = NULL;
+    struct PackReader *reader = calloc(1, sizeof(struct PackReader));
 
-    struct SFPF_FileHeader header;
-
-    FILE *fp = fopen(filename, "rb");
-    assert(fp);
-    int res = sfpf_fileheader_read(&header, fp);
+    reader->fp = fopen(filename, "rb");
+    assert(reader->fp);
+    int res = sfpf_fileheader_read(&(reader->header), reader->fp);
     assert(res == 1);
 
-    assert(header.magic == SFPF_MAGIC_NUMBER);
-    assert(header.version == SFPF_CURRENT_VERSION);
-
-#if 0
-    SFMF_LOG("File header:\n"
-           " Magic: %x (%c%c%c%c)\n"
-           " Version: %d\n"
-           " Metadata size: %d bytes\n"
-           " Packed items: %d\n\n",
-           header.magic,
-           (header.magic >> 24) & 0xFF,
-           (header.magic >> 16) & 0xFF,
-           (header.magic >> 8) & 0xFF,
-           (header.magic >> 0) & 0xff,
-           header.version,
-           header.metadata_size,
-           header.blobs_length);
-#endif
-
-    char *metadata = malloc(header.metadata_size);
-    res = fread(metadata, header.metadata_size, 1, fp);
-    assert(res == 1);
+    assert(reader->header.magic == SFPF_MAGIC_NUMBER);
+    assert(reader->header.version >= SFPF_MIN_VERSION && reader->header.version <= SFPF_CURRENT_VERSION);
 
-#if 0
-    SFMF_LOG("==== Metadata ====\n");
-    SFMF_LOG("%s\n", metadata);
-    SFMF_LOG("==== Metadata ====\n");
-#endif
-    free(metadata);
+    // Skip over metadata, we don't need it for extracting blobs
+    res = fseek(reader->fp, reader->header.metadata_size, SEEK_CUR);
+    assert(res == 0);
 
-    struct SFMF_BlobEntry *entries;
-    entries = calloc(sizeof(struct SFMF_BlobEntry), header.blobs_length);
+    reader->entries = calloc(sizeof(struct SFMF_BlobEntry), reader->header.blobs_length);
+    reader->index = hashindex_new(reader->header.blobs_length);
 
-    for (int i=0; i<header.blobs_length; i++) {
-        sfmf_blobentry_read(&(entries[i]), fp);
+    uint32_t version = sfpf_blobentry_version(reader->header.version);
+    for (int i=0; i<reader->header.blobs_length; i++) {
+        res = sfmf_blobentry_read(&(reader->entries[i]), version, reader->fp);
+        assert(res == 1);
+
+        (void)hashindex_insert(reader->index, &(reader->entries[i].hash), &(reader->entries[i]));
     }
 
-    for (int i=0; i<header.blobs_length; i++) {
-        if (sfmf_filehash_compare(&(entries[i].hash), hash) == 0) {
-            // Found match - read data into memory
-            result = malloc(entries[i].size);
-            res = fseek(fp, entries[i].offset, SEEK_SET);
-            assert(res == 0);
-            res = fread(result, entries[i].size, 1, fp);
+    if (reader->header.version >= SFPF_VERSION_SOLID) {
+        uint32_t blocks_length;
+        res = fread(&blocks_length, sizeof(blocks_length), 1, reader->fp);
+        assert(res == 1);
+        reader->blocks_length = ntohl(blocks_length);
+
+        reader->blocks = calloc(sizeof(struct SFPF_BlockEntry), reader->blocks_length);
+        reader->block_starts = calloc(sizeof(uint64_t), reader->blocks_length);
+        uint64_t start = 0;
+        for (int i=0; i<reader->blocks_length; i++) {
+            res = sfpf_blockentry_read(&(reader->blocks[i]), reader->fp);
             assert(res == 1);
 
-            // These are only set when result is non-NULL
-            *size = entries[i].size;
-            *flags = entries[i].flags;
-            break;
+            reader->block_starts[i] = start;
+            start += reader->blocks[i].uncompressed_size;
         }
     }
 
-    free(entries);
-    fclose(fp);
+    return reader;
+}
+
+// Returns the index of the block that contains offset (of the concatenated blobs)
+static uint32_t packreader_find_block(struct PackReader *reader, uint64_t offset)
+{
+    uint32_t lo = 0;
+    uint32_t hi = reader->blocks_length;
+
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (reader->block_starts[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static void packreader_load_block(struct PackReader *reader, uint32_t index)
+{
+    if (reader->block_data != NULL && reader->block == index) {
+        return;
+    }
+
+    struct SFPF_BlockEntry *block = &(reader->blocks[index]);
+
+    free(reader->block_data);
+    reader->block_data = NULL;
+
+    int res = fseeko(reader->fp, block->offset, SEEK_SET);
+    assert(res == 0);
+
+    char *data = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&data, &length);
+    assert(out != NULL);
+    res = convert_file_range_fp(reader->fp, block->size, out, convert_flags_for_blob(block->flags));
+    fclose(out);
+
+    if (res != 0 || length != block->uncompressed_size) {
+        SFMF_FAIL_AND_EXIT("Invalid block %" PRIu32 " in pack file\n", index);
+    }
+
+    reader->block = index;
+    reader->block_data = data;
+}
+
+static int packreader_write_solid_blob(struct PackReader *reader, struct SFMF_BlobEntry *entry, FILE *outfile,
+        struct SFMF_FileHash *hash)
+{
+    uint32_t index = packreader_find_block(reader, entry->offset);
+    struct SFPF_BlockEntry *block = &(reader->blocks[index]);
+
+    uint64_t start = entry->offset - reader->block_starts[index];
+    if (entry->offset < reader->block_starts[index] ||
+            entry->flags != BLOB_FLAG_NONE || start + entry->size > block->uncompressed_size) {
+        SFMF_FAIL_AND_EXIT("Invalid blob in solid pack file (offset %" PRIu64 ")\n", entry->offset);
+    }
+
+    if (start == 0 && entry->size == block->uncompressed_size) {
+        // Usually a large file, no need to keep it in memory
+        int res = fseeko(reader->fp, block->offset, SEEK_SET);
+        assert(res == 0);
+
+        return convert_file_range_fp_hash(reader->fp, block->size, outfile,
+                convert_flags_for_blob(block->flags), hash);
+    }
+
+    packreader_load_block(reader, index);
+    return convert_buffer_fp_hash(reader->block_data + start, entry->size, outfile, CONVERT_FLAG_NONE, hash);
+}
+
+struct SFMF_BlobEntry *packreader_find(struct PackReader *reader, struct SFMF_FileHash *hash)
+{
+    return hashindex_lookup(reader->index, hash);
+}
+
+int packreader_write_blob(struct PackReader *reader, struct SFMF_BlobEntry *entry, FILE *outfile,
+        struct SFMF_FileHash *hash)
+{
+    if (reader->blocks_length > 0) {
+        return packreader_write_solid_blob(reader, entry, outfile, hash);
+    }
+
+    // Avoid seeking if we are reading blobs sequentially
+    if (ftello(reader->fp) != entry->offset) {
+        int res = fseeko(reader->fp, entry->offset, SEEK_SET);
+        assert(res == 0);
+    }
+
+    return convert_file_range_fp_hash(reader->fp, entry->size, outfile,
+            convert_flags_for_blob(entry->flags), hash);
+}
+
+void packreader_close(struct PackReader *reader)
+{
+    assert(reader);
+
+    hashindex_free(reader->index);
+    free(reader->entries);
+    free(reader->blocks);
+    free(reader->block_starts);
+    free(reader->block_data);
+    fclose(reader->fp);
+    free(reader);
+}
+
+char *get_blob_from_pack(const char *filename, struct SFMF_FileHash *hash, size_t *size, enum SFMF_BlobEntry_Flag *flags)
+{
+    char *result = NULL;
+
+    struct PackReader *reader = packreader_open(filename);
+    struct SFMF_BlobEntry *entry = packreader_find(reader, hash);
+
+    if (entry && reader->blocks_length > 0) {
+        // Blobs in solid packs are returned uncompressed
+        char *data = NULL;
+        size_t length = 0;
+        FILE *out = open_memstream(&data, &length);
+        assert(out != NULL);
+        int res = packreader_write_solid_blob(reader, entry, out, NULL);
+        assert(res == 0);
+        fclose(out);
+
+        result = data;
+        *size = length;
+        *flags = BLOB_FLAG_NONE;
+    } else if (entry) {
+        // Found match - read data into memory
+        result = malloc(entry->size);
+        int res = fseeko(reader->fp, entry->offset, SEEK_SET);
+        assert(res == 0);
+        res = fread(result, entry->size, 1, reader->fp);
+        assert(res == 1);
+
+        // These are only set when result is non-NULL
+        *size = entry->size;
+        *flags = entry->flags;
+    }
+
+    packreader_close(reader);
 
     return result;
 }
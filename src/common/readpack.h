@@ -22,9 +22,42 @@
 
 #include "sfmf.h"
 #include "sfpf.h"
+#include "hashindex.h"
 
+#include <stdio.h>
 #include <sys/types.h>
 
+/**
+ * Reader for a pack file: the header and blob index are read once when
+ * the pack is opened, blobs can then be looked up by hash and streamed
+ * out (ideally in order of their offset, for sequential reads).
+ * In solid packs, the last used block is kept in memory decompressed, so
+ * when reading blobs in order of their offset, each block is decompressed
+ * only once; blocks holding a single blob are streamed out directly.
+ **/
+struct PackReader {
+    FILE *fp;
+    struct SFPF_FileHeader header;
+    struct SFMF_BlobEntry *entries; // <header.blobs_length> blob index entries
+    struct HashIndex *index; // hash -> blob index entry
+
+    struct SFPF_BlockEntry *blocks; // <blocks_length> block index entries (solid packs)
+    uint64_t *block_starts; // offset of the first byte of each block in the concatenated blobs
+    uint32_t blocks_length;
+
+    uint32_t block; // index of the block in block_data (only valid if block_data is not NULL)
+    char *block_data; // decompressed data of block
+};
+
+struct PackReader *packreader_open(const char *filename);
+// Returns the blob index entry for the given hash, or NULL if not in the pack
+struct SFMF_BlobEntry *packreader_find(struct PackReader *reader, struct SFMF_FileHash *hash);
+// Writes the (uncompressed) blob data to outfile, returns 0 on success;
+// if hash is not NULL, the hash of the written data is stored there
+int packreader_write_blob(struct PackReader *reader, struct SFMF_BlobEntry *entry, FILE *outfile,
+        struct SFMF_FileHash *hash);
+void packreader_close(struct PackReader *reader);
+
 char *get_blob_from_pack(const char *filename, struct SFMF_FileHash *hash, size_t *size, enum SFMF_BlobEntry_Flag *flags);
 
 #endif /* SFMF_READPACK_H */
@@ -25,9 +25,23 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
 #include <arpa/inet.h>
 
 #include <endian.h>
+#include <zlib.h>
+
+size_t sfmf_fileheader_size(uint32_t version)
+{
+    if (version < SFMF_VERSION_HASH_INDEX) {
+        // Version 1 headers end before hash_index_length
+        return offsetof(struct SFMF_FileHeader, hash_index_length);
+    }
+
+    return sizeof(struct SFMF_FileHeader);
+}
 
 int sfmf_fileheader_write(struct SFMF_FileHeader *header, FILE *fp)
 {
@@ -40,166 +54,751 @@ int sfmf_fileheader_write(struct SFMF_FileHeader *header, FILE *fp)
     h.entries_length = htonl(header->entries_length);
     h.packs_length = htonl(header->packs_length);
     h.blobs_length = htonl(header->blobs_length);
+    h.hash_index_length = htonl(header->hash_index_length);
 
-    return fwrite(&h, sizeof(struct SFMF_FileHeader), 1, fp);
+    return fwrite(&h, sfmf_fileheader_size(header->version), 1, fp);
 }
 
-int sfmf_fileheader_read(struct SFMF_FileHeader *header, FILE *fp)
+void sfmf_fileheader_decode(struct SFMF_FileHeader *header, const void *buf)
 {
     struct SFMF_FileHeader h;
 
-    int res = fread(&h, sizeof(h), 1, fp);
+    // buf holds sfmf_fileheader_size(version) bytes, which depends on the version
+    memset(&h, 0, sizeof(h));
+    memcpy(&h, buf, sfmf_fileheader_size(1));
+    memcpy(&h, buf, sfmf_fileheader_size(ntohl(h.version)));
+
+    header->magic = ntohl(h.magic);
+    header->version = ntohl(h.version);
+    header->metadata_size = ntohl(h.metadata_size);
+    header->filename_table_size = ntohl(h.filename_table_size);
+    header->entries_length = ntohl(h.entries_length);
+    header->packs_length = ntohl(h.packs_length);
+    header->blobs_length = ntohl(h.blobs_length);
+    header->hash_index_length = ntohl(h.hash_index_length);
+}
+
+int sfmf_fileheader_read(struct SFMF_FileHeader *header, FILE *fp)
+{
+    char buf[sizeof(struct SFMF_FileHeader)];
+
+    // Read the version 1 header first, then the rest (if any) for the version
+    size_t size = sfmf_fileheader_size(1);
+    int res = fread(buf, size, 1, fp);
 
     if (res == 1) {
-        header->magic = ntohl(h.magic);
-        header->version = ntohl(h.version);
-        header->metadata_size = ntohl(h.metadata_size);
-        header->filename_table_size = ntohl(h.filename_table_size);
-        header->entries_length = ntohl(h.entries_length);
-        header->packs_length = ntohl(h.packs_length);
-        header->blobs_length = ntohl(h.blobs_length);
+        uint32_t version;
+        memcpy(&version, buf + offsetof(struct SFMF_FileHeader, version), sizeof(version));
+        size_t total = sfmf_fileheader_size(ntohl(version));
+        if (total > size) {
+            res = fread(buf + size, total - size, 1, fp);
+        }
+    }
+
+    if (res == 1) {
+        sfmf_fileheader_decode(header, buf);
     }
 
     return res;
 }
 
-int sfmf_fileentry_write(struct SFMF_FileEntry *entry, FILE *fp)
+// Largest on-disk record (SFMF_FileEntry in version 2)
+#define SFMF_MAX_RECORD_SIZE 128
+
+static char *put_u32(char *p, uint32_t value)
 {
-    struct SFMF_FileEntry e;
+    value = htonl(value);
+    memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
 
-    e.type = htonl(entry->type);
-    e.mode = htonl(entry->mode);
-    e.uid = htonl(entry->uid);
-    e.gid = htonl(entry->gid);
-    e.mtime = htobe64(entry->mtime);
-    e.dev = htonl(entry->dev);
-    e.zsize = htonl(entry->zsize);
+static char *put_u64(char *p, uint64_t value)
+{
+    value = htobe64(value);
+    memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
 
-    e.hash.size = htonl(entry->hash.size);
-    e.hash.hashtype = htonl(entry->hash.hashtype);
-    memcpy(&(e.hash.hash), &(entry->hash.hash), sizeof(e.hash.hash));
+static char *put_size(char *p, uint64_t value, uint32_t version)
+{
+    if (version >= SFMF_VERSION_64BIT) {
+        return put_u64(p, value);
+    }
+
+    // Older formats can't store this; we only ever write the current version
+    assert(value <= UINT32_MAX);
+    return put_u32(p, value);
+}
+
+static char *put_hash(char *p, struct SFMF_FileHash *hash, uint32_t version)
+{
+    p = put_size(p, hash->size, version);
+    p = put_u32(p, hash->hashtype);
+    memcpy(p, hash->hash, sizeof(hash->hash));
+    return p + sizeof(hash->hash);
+}
+
+static const char *get_u32(const char *p, uint32_t *value)
+{
+    memcpy(value, p, sizeof(*value));
+    *value = ntohl(*value);
+    return p + sizeof(*value);
+}
 
-    e.filename_offset = htonl(entry->filename_offset);
+static const char *get_u64(const char *p, uint64_t *value)
+{
+    memcpy(value, p, sizeof(*value));
+    *value = be64toh(*value);
+    return p + sizeof(*value);
+}
+
+static const char *get_size(const char *p, uint64_t *value, uint32_t version)
+{
+    if (version >= SFMF_VERSION_64BIT) {
+        return get_u64(p, value);
+    }
 
-    return fwrite(&e, sizeof(struct SFMF_FileEntry), 1, fp);
+    uint32_t value32;
+    p = get_u32(p, &value32);
+    *value = value32;
+    return p;
 }
 
-int sfmf_fileentry_read(struct SFMF_FileEntry *entry, FILE *fp)
+static const char *get_hash(const char *p, struct SFMF_FileHash *hash, uint32_t version)
 {
-    struct SFMF_FileEntry e;
+    p = get_size(p, &(hash->size), version);
+    p = get_u32(p, &(hash->hashtype));
+    memcpy(hash->hash, p, sizeof(hash->hash));
+    return p + sizeof(hash->hash);
+}
+
+static size_t sfmf_size_size(uint32_t version)
+{
+    return (version >= SFMF_VERSION_64BIT) ? sizeof(uint64_t) : sizeof(uint32_t);
+}
 
-    int res = fread(&e, sizeof(struct SFMF_FileEntry), 1, fp);
+size_t sfmf_filehash_size(uint32_t version)
+{
+    return sfmf_size_size(version) + sizeof(uint32_t) + SFMF_MAX_HASHSIZE;
+}
+
+size_t sfmf_fileentry_size(uint32_t version)
+{
+    return 4 * sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t) +
+        sfmf_size_size(version) + ((version >= SFMF_VERSION_CODECS) ? sizeof(uint32_t) : 0) +
+        sfmf_filehash_size(version) + sizeof(uint32_t);
+}
+
+size_t sfmf_packentry_size(uint32_t version)
+{
+    return sfmf_filehash_size(version) + sfmf_size_size(version) + sizeof(uint32_t);
+}
+
+size_t sfmf_blobentry_size(uint32_t version)
+{
+    return sfmf_filehash_size(version) + sizeof(uint32_t) + 2 * sfmf_size_size(version);
+}
+
+size_t sfmf_hashindexentry_size(uint32_t version)
+{
+    return sfmf_filehash_size(version) + 3 * sizeof(uint32_t);
+}
+
+size_t sfmf_extententry_size(uint32_t version)
+{
+    return sizeof(uint32_t) + 2 * sizeof(uint64_t);
+}
+
+size_t sfmf_chunkentry_size(uint32_t version)
+{
+    return sizeof(uint32_t) + sizeof(uint64_t) + sfmf_filehash_size(version);
+}
+
+size_t sfmf_deltaentry_size(uint32_t version)
+{
+    return 3 * sfmf_filehash_size(version) + sizeof(uint32_t);
+}
+
+size_t sfmf_sectionentry_size(uint32_t version)
+{
+    return 3 * sizeof(uint32_t) + 3 * sizeof(uint64_t);
+}
+
+static int sfmf_record_write(const char *buf, size_t size, FILE *fp)
+{
+    assert(size <= SFMF_MAX_RECORD_SIZE);
+    return fwrite(buf, size, 1, fp);
+}
+
+static int sfmf_record_read(char *buf, size_t size, FILE *fp)
+{
+    assert(size <= SFMF_MAX_RECORD_SIZE);
+    return fread(buf, size, 1, fp);
+}
+
+static void sfmf_fileentry_encode(struct SFMF_FileEntry *entry, uint32_t version, void *buf)
+{
+    char *p = buf;
+
+    p = put_u32(p, entry->type);
+    p = put_u32(p, entry->mode);
+    p = put_u32(p, entry->uid);
+    p = put_u32(p, entry->gid);
+    p = put_u64(p, entry->mtime);
+    p = put_u32(p, entry->dev);
+    p = put_size(p, entry->zsize, version);
+    if (version >= SFMF_VERSION_CODECS) {
+        p = put_u32(p, entry->flags);
+    }
+    p = put_hash(p, &(entry->hash), version);
+    p = put_u32(p, entry->filename_offset);
+}
+
+int sfmf_fileentry_write(struct SFMF_FileEntry *entry, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    sfmf_fileentry_encode(entry, version, buf);
+
+    return sfmf_record_write(buf, sfmf_fileentry_size(version), fp);
+}
+
+void sfmf_fileentry_decode(struct SFMF_FileEntry *entry, uint32_t version, const void *buf)
+{
+    const char *p = buf;
+
+    p = get_u32(p, &(entry->type));
+    p = get_u32(p, &(entry->mode));
+    p = get_u32(p, &(entry->uid));
+    p = get_u32(p, &(entry->gid));
+    p = get_u64(p, &(entry->mtime));
+    p = get_u32(p, &(entry->dev));
+    p = get_size(p, &(entry->zsize), version);
+    if (version >= SFMF_VERSION_CODECS) {
+        p = get_u32(p, &(entry->flags));
+    }
+    p = get_hash(p, &(entry->hash), version);
+    p = get_u32(p, &(entry->filename_offset));
+
+    if (version < SFMF_VERSION_CODECS) {
+        // Older formats only know about zlib, and derive this from the sizes
+        entry->flags = (entry->zsize < entry->hash.size) ? BLOB_FLAG_ZCOMPRESSED : BLOB_FLAG_NONE;
+    }
+}
+
+int sfmf_fileentry_read(struct SFMF_FileEntry *entry, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    int res = sfmf_record_read(buf, sfmf_fileentry_size(version), fp);
 
     if (res == 1) {
-        entry->type = ntohl(e.type);
-        entry->mode = ntohl(e.mode);
-        entry->uid = ntohl(e.uid);
-        entry->gid = ntohl(e.gid);
-        entry->mtime = be64toh(e.mtime);
-        entry->dev = ntohl(e.dev);
-        entry->zsize = ntohl(e.zsize);
+        sfmf_fileentry_decode(entry, version, buf);
+    }
+
+    return res;
+}
 
-        entry->hash.size = ntohl(e.hash.size);
-        entry->hash.hashtype = ntohl(e.hash.hashtype);
-        memcpy(&(entry->hash.hash), &(e.hash.hash), sizeof(e.hash.hash));
+int sfmf_filehash_write(struct SFMF_FileHash *hash, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    put_hash(buf, hash, version);
+
+    return sfmf_record_write(buf, sfmf_filehash_size(version), fp);
+}
+
+void sfmf_filehash_decode(struct SFMF_FileHash *hash, uint32_t version, const void *buf)
+{
+    get_hash(buf, hash, version);
+}
+
+int sfmf_filehash_read(struct SFMF_FileHash *hash, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
 
-        entry->filename_offset = ntohl(e.filename_offset);
+    int res = sfmf_record_read(buf, sfmf_filehash_size(version), fp);
+
+    if (res == 1) {
+        sfmf_filehash_decode(hash, version, buf);
     }
 
     return res;
 }
 
-int sfmf_filehash_write(struct SFMF_FileHash *hash, FILE *fp)
+int sfmf_packentry_write(struct SFMF_PackEntry *entry, uint32_t version, FILE *fp)
 {
-    struct SFMF_FileHash h;
+    char buf[SFMF_MAX_RECORD_SIZE];
+    char *p = buf;
 
-    h.size = htonl(hash->size);
-    h.hashtype = htonl(hash->hashtype);
-    memcpy(&(h.hash), &(hash->hash), sizeof(h.hash));
+    p = put_hash(p, &(entry->hash), version);
+    p = put_size(p, entry->offset, version);
+    p = put_u32(p, entry->count);
 
-    return fwrite(&h, sizeof(struct SFMF_FileHash), 1, fp);
+    return sfmf_record_write(buf, sfmf_packentry_size(version), fp);
 }
 
-int sfmf_filehash_read(struct SFMF_FileHash *hash, FILE *fp)
+void sfmf_packentry_decode(struct SFMF_PackEntry *entry, uint32_t version, const void *buf)
 {
-    struct SFMF_FileHash h;
+    const char *p = buf;
 
-    int res = fread(&h, sizeof(struct SFMF_FileHash), 1, fp);
+    p = get_hash(p, &(entry->hash), version);
+    p = get_size(p, &(entry->offset), version);
+    p = get_u32(p, &(entry->count));
+}
+
+int sfmf_packentry_read(struct SFMF_PackEntry *entry, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    int res = sfmf_record_read(buf, sfmf_packentry_size(version), fp);
 
     if (res == 1) {
-        hash->size = ntohl(h.size);
-        hash->hashtype = ntohl(h.hashtype);
-        memcpy(&(hash->hash), &(h.hash), sizeof(h.hash));
+        sfmf_packentry_decode(entry, version, buf);
     }
 
     return res;
 }
 
-int sfmf_packentry_write(struct SFMF_PackEntry *entry, FILE *fp)
+int sfmf_blobentry_write(struct SFMF_BlobEntry *entry, uint32_t version, FILE *fp)
 {
-    struct SFMF_PackEntry e;
+    char buf[SFMF_MAX_RECORD_SIZE];
+    char *p = buf;
+
+    p = put_hash(p, &(entry->hash), version);
+    p = put_u32(p, entry->flags);
+    p = put_size(p, entry->offset, version);
+    p = put_size(p, entry->size, version);
 
-    e.hash.size = htonl(entry->hash.size);
-    e.hash.hashtype = htonl(entry->hash.hashtype);
-    memcpy(&(e.hash.hash), &(entry->hash.hash), sizeof(e.hash.hash));
+    return sfmf_record_write(buf, sfmf_blobentry_size(version), fp);
+}
 
-    e.offset = htonl(entry->offset);
-    e.count = htonl(entry->count);
+void sfmf_blobentry_decode(struct SFMF_BlobEntry *entry, uint32_t version, const void *buf)
+{
+    const char *p = buf;
 
-    return fwrite(&e, sizeof(struct SFMF_PackEntry), 1, fp);
+    p = get_hash(p, &(entry->hash), version);
+    p = get_u32(p, &(entry->flags));
+    p = get_size(p, &(entry->offset), version);
+    p = get_size(p, &(entry->size), version);
 }
 
-int sfmf_packentry_read(struct SFMF_PackEntry *entry, FILE *fp)
+int sfmf_blobentry_read(struct SFMF_BlobEntry *entry, uint32_t version, FILE *fp)
 {
-    struct SFMF_PackEntry e;
+    char buf[SFMF_MAX_RECORD_SIZE];
 
-    int res = fread(&e, sizeof(struct SFMF_PackEntry), 1,fp);
+    int res = sfmf_record_read(buf, sfmf_blobentry_size(version), fp);
 
     if (res == 1) {
-        entry->hash.size = ntohl(e.hash.size);
-        entry->hash.hashtype = ntohl(e.hash.hashtype);
+        sfmf_blobentry_decode(entry, version, buf);
+    }
+
+    return res;
+}
+
+void sfmf_hashindexentry_encode(struct SFMF_HashIndexEntry *entry, uint32_t version, void *buf)
+{
+    char *p = buf;
+
+    p = put_hash(p, &(entry->hash), version);
+    p = put_u32(p, entry->type);
+    p = put_u32(p, entry->index);
+    p = put_u32(p, entry->slot);
+}
+
+int sfmf_hashindexentry_write(struct SFMF_HashIndexEntry *entry, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    sfmf_hashindexentry_encode(entry, version, buf);
+
+    return sfmf_record_write(buf, sfmf_hashindexentry_size(version), fp);
+}
+
+void sfmf_hashindexentry_decode(struct SFMF_HashIndexEntry *entry, uint32_t version, const void *buf)
+{
+    const char *p = buf;
+
+    p = get_hash(p, &(entry->hash), version);
+    p = get_u32(p, &(entry->type));
+    p = get_u32(p, &(entry->index));
+    p = get_u32(p, &(entry->slot));
+}
+
+int sfmf_hashindexentry_read(struct SFMF_HashIndexEntry *entry, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
 
-        memcpy(&(entry->hash.hash), &(e.hash.hash), sizeof(e.hash.hash));
+    int res = sfmf_record_read(buf, sfmf_hashindexentry_size(version), fp);
 
-        entry->offset = ntohl(e.offset);
-        entry->count = ntohl(e.count);
+    if (res == 1) {
+        sfmf_hashindexentry_decode(entry, version, buf);
     }
 
     return res;
 }
 
-int sfmf_blobentry_write(struct SFMF_BlobEntry *entry, FILE *fp)
+static void sfmf_extententry_encode(struct SFMF_ExtentEntry *entry, uint32_t version, void *buf)
 {
-    struct SFMF_BlobEntry e;
+    char *p = buf;
+
+    assert(version >= SFMF_VERSION_EXTENTS);
+    p = put_u32(p, entry->entry);
+    p = put_u64(p, entry->offset);
+    p = put_u64(p, entry->length);
+}
+
+int sfmf_extententry_write(struct SFMF_ExtentEntry *entry, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    sfmf_extententry_encode(entry, version, buf);
+
+    return sfmf_record_write(buf, sfmf_extententry_size(version), fp);
+}
 
-    e.hash.size = htonl(entry->hash.size);
-    e.hash.hashtype = htonl(entry->hash.hashtype);
-    memcpy(&(e.hash.hash), &(entry->hash.hash), sizeof(e.hash.hash));
-    e.flags = htonl(entry->flags);
-    e.offset = htonl(entry->offset);
-    e.size = htonl(entry->size);
+void sfmf_extententry_decode(struct SFMF_ExtentEntry *entry, uint32_t version, const void *buf)
+{
+    const char *p = buf;
 
-    return fwrite(&e, sizeof(struct SFMF_BlobEntry), 1, fp);
+    assert(version >= SFMF_VERSION_EXTENTS);
+    p = get_u32(p, &(entry->entry));
+    p = get_u64(p, &(entry->offset));
+    p = get_u64(p, &(entry->length));
 }
 
-int sfmf_blobentry_read(struct SFMF_BlobEntry *entry, FILE *fp)
+int sfmf_extententry_read(struct SFMF_ExtentEntry *entry, uint32_t version, FILE *fp)
 {
-    struct SFMF_BlobEntry e;
+    char buf[SFMF_MAX_RECORD_SIZE];
 
-    int res = fread(&e, sizeof(struct SFMF_BlobEntry), 1, fp);
+    int res = sfmf_record_read(buf, sfmf_extententry_size(version), fp);
 
     if (res == 1) {
-        entry->hash.size = ntohl(e.hash.size);
-        entry->hash.hashtype = ntohl(e.hash.hashtype);
-        memcpy(&(entry->hash.hash), &(e.hash.hash), sizeof(e.hash.hash));
-        entry->flags = ntohl(e.flags);
-        entry->offset = ntohl(e.offset);
-        entry->size = ntohl(e.size);
+        sfmf_extententry_decode(entry, version, buf);
     }
 
     return res;
 }
 
+static void sfmf_chunkentry_encode(struct SFMF_ChunkEntry *entry, uint32_t version, void *buf)
+{
+    char *p = buf;
+
+    assert(version >= SFMF_VERSION_CHUNKS);
+    p = put_u32(p, entry->entry);
+    p = put_u64(p, entry->offset);
+    p = put_hash(p, &(entry->hash), version);
+}
+
+int sfmf_chunkentry_write(struct SFMF_ChunkEntry *entry, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    sfmf_chunkentry_encode(entry, version, buf);
+
+    return sfmf_record_write(buf, sfmf_chunkentry_size(version), fp);
+}
+
+void sfmf_chunkentry_decode(struct SFMF_ChunkEntry *entry, uint32_t version, const void *buf)
+{
+    const char *p = buf;
+
+    assert(version >= SFMF_VERSION_CHUNKS);
+    p = get_u32(p, &(entry->entry));
+    p = get_u64(p, &(entry->offset));
+    p = get_hash(p, &(entry->hash), version);
+}
+
+int sfmf_chunkentry_read(struct SFMF_ChunkEntry *entry, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    int res = sfmf_record_read(buf, sfmf_chunkentry_size(version), fp);
+
+    if (res == 1) {
+        sfmf_chunkentry_decode(entry, version, buf);
+    }
+
+    return res;
+}
+
+static void sfmf_deltaentry_encode(struct SFMF_DeltaEntry *entry, uint32_t version, void *buf)
+{
+    char *p = buf;
+
+    assert(version >= SFMF_VERSION_DELTAS);
+    p = put_hash(p, &(entry->target), version);
+    p = put_hash(p, &(entry->base), version);
+    p = put_hash(p, &(entry->delta), version);
+    p = put_u32(p, entry->flags);
+}
+
+int sfmf_deltaentry_write(struct SFMF_DeltaEntry *entry, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    sfmf_deltaentry_encode(entry, version, buf);
+
+    return sfmf_record_write(buf, sfmf_deltaentry_size(version), fp);
+}
+
+void sfmf_deltaentry_decode(struct SFMF_DeltaEntry *entry, uint32_t version, const void *buf)
+{
+    const char *p = buf;
+
+    assert(version >= SFMF_VERSION_DELTAS);
+    p = get_hash(p, &(entry->target), version);
+    p = get_hash(p, &(entry->base), version);
+    p = get_hash(p, &(entry->delta), version);
+    p = get_u32(p, &(entry->flags));
+}
+
+int sfmf_deltaentry_read(struct SFMF_DeltaEntry *entry, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    int res = sfmf_record_read(buf, sfmf_deltaentry_size(version), fp);
+
+    if (res == 1) {
+        sfmf_deltaentry_decode(entry, version, buf);
+    }
+
+    return res;
+}
+
+static int sfmf_deltaentry_compare(const void *a, const void *b)
+{
+    const struct SFMF_DeltaEntry *da = a;
+    const struct SFMF_DeltaEntry *db = b;
+
+    int res = sfmf_hashindex_compare((struct SFMF_FileHash *)&(da->target), (struct SFMF_FileHash *)&(db->target));
+    if (res == 0) {
+        res = sfmf_hashindex_compare((struct SFMF_FileHash *)&(da->base), (struct SFMF_FileHash *)&(db->base));
+    }
+
+    return res;
+}
+
+void sfmf_deltaentry_sort(struct SFMF_DeltaEntry *entries, uint32_t length)
+{
+    qsort(entries, length, sizeof(struct SFMF_DeltaEntry), sfmf_deltaentry_compare);
+}
+
+uint32_t sfmf_section_checksum(const char *data, uint64_t size)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    // crc32() takes an unsigned int length
+    while (size > 0) {
+        uInt length = (size > 0x40000000) ? 0x40000000 : size;
+        crc = crc32(crc, (const Bytef *)data, length);
+        data += length;
+        size -= length;
+    }
+
+    return crc;
+}
+
+int sfmf_section_write(const char *data, uint64_t size, uint32_t version, FILE *fp,
+        struct SFMF_SectionEntry *entry)
+{
+    if (version < SFMF_VERSION_SECTION_TABLE) {
+        return (size == 0 || fwrite(data, size, 1, fp) == 1);
+    }
+
+    off_t offset = ftello(fp);
+    assert(offset != -1);
+    struct SFMF_SectionEntry section = { 0, SECTION_FLAG_NONE, offset, size, size, 0 };
+
+    char *zdata = NULL;
+    size_t zsize = 0;
+    FILE *zfp = open_memstream(&zdata, &zsize);
+    assert(zfp != NULL);
+    convert_buffer_fp((char *)data, size, zfp, CONVERT_FLAG_ZCOMPRESS);
+    fclose(zfp);
+
+    if (zsize < size) {
+        section.flags = SECTION_FLAG_ZCOMPRESSED;
+        section.stored_size = zsize;
+        data = zdata;
+    }
+
+    section.checksum = sfmf_section_checksum(data, section.stored_size);
+    if (entry != NULL) {
+        *entry = section;
+    }
+
+    int res = 1;
+    if (section.stored_size > 0) {
+        res = fwrite(data, section.stored_size, 1, fp);
+    }
+
+    free(zdata);
+
+    return res;
+}
+
+int sfmf_sectiontable_write(struct SFMF_SectionEntry *entries, uint32_t count, uint32_t version, FILE *fp)
+{
+    char buf[SFMF_MAX_RECORD_SIZE];
+
+    assert(version >= SFMF_VERSION_SECTION_TABLE);
+    put_u32(buf, count);
+    int res = sfmf_record_write(buf, sizeof(uint32_t), fp);
+
+    for (uint32_t i=0; res == 1 && i<count; i++) {
+        char *p = buf;
+        p = put_u32(p, entries[i].type);
+        p = put_u32(p, entries[i].flags);
+        p = put_u64(p, entries[i].offset);
+        p = put_u64(p, entries[i].size);
+        p = put_u64(p, entries[i].stored_size);
+        p = put_u32(p, entries[i].checksum);
+
+        res = sfmf_record_write(buf, sfmf_sectionentry_size(version), fp);
+    }
+
+    return res;
+}
+
+void sfmf_sectionentry_decode(struct SFMF_SectionEntry *entry, uint32_t version, const void *buf)
+{
+    const char *p = buf;
+
+    assert(version >= SFMF_VERSION_SECTION_TABLE);
+    p = get_u32(p, &(entry->type));
+    p = get_u32(p, &(entry->flags));
+    p = get_u64(p, &(entry->offset));
+    p = get_u64(p, &(entry->size));
+    p = get_u64(p, &(entry->stored_size));
+    p = get_u32(p, &(entry->checksum));
+}
+
+uint32_t sfmf_filename_shared_length(uint32_t index, const char *previous, const char *filename)
+{
+    if (index % SFMF_FILENAME_RESTART_INTERVAL == 0 || previous == NULL) {
+        return 0;
+    }
+
+    uint32_t shared = 0;
+    while (previous[shared] != '\0' && previous[shared] == filename[shared]) {
+        shared++;
+    }
+
+    return shared;
+}
+
+size_t sfmf_filename_record_size(const char *filename, uint32_t shared)
+{
+    // Shared length as varint (7 bits per byte), suffix plus '\0'
+    size_t size = 1;
+    for (uint32_t value=shared; value >= 0x80; value >>= 7) {
+        size++;
+    }
+
+    return size + strlen(filename + shared) + 1;
+}
+
+int sfmf_filename_record_write(const char *filename, uint32_t shared, FILE *fp)
+{
+    char buf[8];
+    size_t size = 0;
+
+    uint32_t value = shared;
+    while (value >= 0x80) {
+        buf[size++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[size++] = value;
+
+    const char *suffix = filename + shared;
+    if (fwrite(buf, size, 1, fp) != 1 || fwrite(suffix, strlen(suffix) + 1, 1, fp) != 1) {
+        return 0;
+    }
+
+    return 1;
+}
+
+size_t sfmf_filename_record_decode(const char *buf, size_t length, char *path,
+        size_t *path_length, size_t path_size)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t pos = 0;
+
+    uint32_t shared = 0;
+    for (int shift=0; ; shift += 7) {
+        if (pos == length || shift > 28) {
+            return 0;
+        }
+
+        shared |= (uint32_t)(p[pos] & 0x7F) << shift;
+        if ((p[pos++] & 0x80) == 0) {
+            break;
+        }
+    }
+
+    const char *suffix = buf + pos;
+    const char *end = memchr(suffix, '\0', length - pos);
+    if (shared > *path_length || end == NULL || shared + (end - suffix) >= path_size) {
+        return 0;
+    }
+
+    memcpy(path + shared, suffix, end - suffix + 1);
+    *path_length = shared + (end - suffix);
+
+    return pos + (end - suffix) + 1;
+}
+
+int sfmf_hashindex_compare(struct SFMF_FileHash *a, struct SFMF_FileHash *b)
+{
+    int res = memcmp(a->hash, b->hash, SFMF_MAX_HASHSIZE);
+    if (res != 0) {
+        return res;
+    }
+
+    return (a->size > b->size) - (a->size < b->size);
+}
+
+static int sfmf_hashindexentry_compare(const void *a, const void *b)
+{
+    const struct SFMF_HashIndexEntry *ea = a;
+    const struct SFMF_HashIndexEntry *eb = b;
+
+    int res = sfmf_hashindex_compare((struct SFMF_FileHash *)&(ea->hash), (struct SFMF_FileHash *)&(eb->hash));
+    if (res != 0) {
+        return res;
+    }
+
+    // Same hash: Included blobs first, then in file order
+    if (ea->type != eb->type) {
+        return (ea->type > eb->type) - (ea->type < eb->type);
+    }
+
+    if (ea->index != eb->index) {
+        return (ea->index > eb->index) - (ea->index < eb->index);
+    }
+
+    return (ea->slot > eb->slot) - (ea->slot < eb->slot);
+}
+
+void sfmf_hashindex_sort(struct SFMF_HashIndexEntry *entries, uint32_t *length)
+{
+    if (*length == 0) {
+        return;
+    }
+
+    qsort(entries, *length, sizeof(struct SFMF_HashIndexEntry), sfmf_hashindexentry_compare);
+
+    uint32_t result = 1;
+    for (uint32_t i=1; i<*length; i++) {
+        if (sfmf_hashindex_compare(&(entries[result-1].hash), &(entries[i].hash)) != 0) {
+            entries[result++] = entries[i];
+        }
+    }
+
+    *length = result;
+}
+
 int sfmf_filehash_format(struct SFMF_FileHash *hash, char *buf, size_t len)
 {
     assert(hash->hashtype == HASHTYPE_SHA1);
@@ -221,25 +820,23 @@ int sfmf_filehash_compare(struct SFMF_FileHash *a, struct SFMF_FileHash *b)
     assert(a->hashtype == HASHTYPE_SHA1 && b->hashtype == HASHTYPE_SHA1);
 
     if (a->size != b->size) {
-        return a->size - b->size;
+        return (a->size > b->size) ? 1 : -1;
     }
 
     return memcmp(a->hash, b->hash, 20);
 }
 
-int sfmf_filehash_verify(struct SFMF_FileHash *expected, const char *filename, int zcompressed)
+int sfmf_filehash_check(struct SFMF_FileHash *expected, struct SFMF_FileHash *hash, const char *filename)
 {
-    struct SFMF_FileHash hash;
-    memset(&hash, 0, sizeof(hash));
-    int res = convert_file_hash(filename, &hash, zcompressed ? CONVERT_FLAG_ZUNCOMPRESS : CONVERT_FLAG_NONE);
-    assert(res == 0);
-
     char tmp[100];
-    res = sfmf_filehash_format(expected, tmp, sizeof(tmp));
+    int res = sfmf_filehash_format(expected, tmp, sizeof(tmp));
 
     SFMF_DEBUG("Checking file hash of %s (expecting %s)\n", filename, tmp);
-    if (sfmf_filehash_compare(&hash, expected) != 0) {
-        res = sfmf_filehash_format(&hash, tmp, sizeof(tmp));
+    if (hash->hashtype != HASHTYPE_SHA1) {
+        SFMF_WARN("File failed hash check: %s, could not be hashed\n", filename);
+        return 1;
+    } else if (sfmf_filehash_compare(hash, expected) != 0) {
+        res = sfmf_filehash_format(hash, tmp, sizeof(tmp));
         assert(res);
 
         SFMF_WARN("File failed hash check: %s, got: %s\n", filename, tmp);
@@ -249,3 +846,32 @@ int sfmf_filehash_verify(struct SFMF_FileHash *expected, const char *filename, i
         return 0;
     }
 }
+
+int sfmf_filehash_verify(struct SFMF_FileHash *expected, const char *filename, uint32_t flags)
+{
+    struct SFMF_FileHash hash;
+    memset(&hash, 0, sizeof(hash));
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        SFMF_WARN("Could not open %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    // Data that can't be decoded with flags (e.g. a file stored with another
+    // codec by an earlier release) is a mismatch, not a fatal error
+    struct ConvertHasher *hasher = convert_hasher_new(convert_flags_for_blob(flags));
+    char buf[64 * 1024];
+    size_t length;
+    int res = 0;
+    while (res == 0 && (length = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        res = convert_hasher_update(hasher, buf, length);
+    }
+    if (convert_hasher_finish(hasher, &hash) != 0 || res != 0 || ferror(fp)) {
+        hash.hashtype = 0;
+    }
+    convert_hasher_free(hasher);
+    fclose(fp);
+
+    return sfmf_filehash_check(expected, &hash, filename);
+}
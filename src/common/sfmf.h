@@ -23,8 +23,8 @@
 #include <stdint.h>
 #include <stdio.h>
 
-// make sure stuff is 32-bit aligned in the structs
-// all integer values are stored in network byte order
+// records are stored field by field in the order of the structs below (see
+// the _encode()/_decode() functions), all integer values in network byte order
 
 /* Magic number header of sfmf files */
 #define SFMF_MAGIC_NUMBER (('S' << 24) | ('F' << 16) | ('M' << 8) | 'F')
@@ -33,19 +33,93 @@
 #define SFMF_MAX_HASHSIZE 20
 
 /* File version - increment when it changes */
-#define SFMF_CURRENT_VERSION 1
+#define SFMF_CURRENT_VERSION 2
+
+/* Oldest file version that can still be read */
+#define SFMF_MIN_VERSION 1
+
+/**
+ * Version 2 added all of the following features at once, so readers only
+ * need to tell versions 1 and 2 apart; the names below say which feature
+ * a version check is about.
+ **/
+
+/* First file version with a hash index, see SFMF_HashIndexEntry */
+#define SFMF_VERSION_HASH_INDEX 2
+
+/* First file version with 64-bit sizes and offsets (32-bit before) */
+#define SFMF_VERSION_64BIT 2
+
+/* First file version with a front-coded filename table (plain strings before) */
+#define SFMF_VERSION_FRONTCODED 2
+
+/* In front-coded filename tables, every n-th filename is stored in full */
+#define SFMF_FILENAME_RESTART_INTERVAL 16
+
+/* First file version with selectable blob codecs (zlib only before), see SFMF_FileEntry.flags */
+#define SFMF_VERSION_CODECS 2
+
+/* First file version with a dictionary section, see BLOB_FLAG_ZSTD_DICT */
+#define SFMF_VERSION_DICTIONARY 2
+
+/* First file version with zero extents of files, see SFMF_ExtentEntry */
+#define SFMF_VERSION_EXTENTS 2
+
+/* First file version with a section table and (optionally compressed) sections, see SFMF_SectionEntry */
+#define SFMF_VERSION_SECTION_TABLE 2
+
+/* First file version with chunked files, see SFMF_ChunkEntry */
+#define SFMF_VERSION_CHUNKS 2
+
+/* First file version with delta blobs against files of a base release, see SFMF_DeltaEntry */
+#define SFMF_VERSION_DELTAS 2
 
 /**
  * Structure of a manifest file:
  *
  *  - header
+ *  - section table (version >= 2)
  *  - metadata
- *  - filename table
+ *  - filename table (front-coded since version 2, see below)
  *  - entries list
- *  - blobs index
  *  - packs index
- *  - blobs
+ *  - blobs index
+ *  - hash index (version >= 2)
  *  - packs
+ *  - dictionary (version >= 2)
+ *  - zero extents (version >= 2)
+ *  - chunks (version >= 2)
+ *  - deltas (version >= 2)
+ *  - blobs
+ *
+ * Since version 2, the section table after the file header lists where
+ * each section is stored: a uint32_t count followed by one SFMF_SectionEntry
+ * per section, with the file offset and a checksum of the stored data,
+ * which is compressed if that makes it smaller. Readers can then load
+ * (and verify) just the sections they use, without walking through the
+ * ones before. The blobs payload follows the section that ends last.
+ * Pack offsets are relative to the start of the (uncompressed) packs
+ * section, and blob offsets are relative to the start of the blobs
+ * payload. Before version 2, there is no section table, all sections are
+ * stored uncompressed one after the other, and offsets are file offsets.
+ *
+ * The dictionary section holds the zstd dictionary that blobs flagged
+ * with BLOB_FLAG_ZSTD_DICT (included blobs, and files in packs or full
+ * blobs) are compressed against; it is empty if no dictionary is used.
+ * The zero extents section lists SFMF_ExtentEntry records; its size is
+ * only known from the section table.
+ *
+ * The chunks section lists SFMF_ChunkEntry records (its size is also
+ * only known from the section table): files that are split into
+ * content-defined chunks have no blob of their own. Instead, each chunk
+ * is stored as an included blob or in a pack (and found through the hash
+ * index), and the file is assembled from its chunks when unpacking.
+ *
+ * The deltas section lists SFMF_DeltaEntry records: for files of a base
+ * release, a delta blob file ("<delta hash>.delta", compressed like a
+ * full blob) describes how to turn them into a file of this release.
+ * Files that have a delta are still stored as usual, the delta is only
+ * used if the base file is available locally.
  **/
 
 struct SFMF_FileHeader {
@@ -56,12 +130,14 @@ struct SFMF_FileHeader {
     uint32_t entries_length;
     uint32_t packs_length;
     uint32_t blobs_length;
+    uint32_t hash_index_length; // version >= 2 only (not stored in version 1 files)
 
     // variable size '\0'-terminated metadata blob (<metadata_size> bytes)
     // variable size filename table (<filename_size> bytes)
     // variable size list of <entries_length> x SFMF_FileEntry structs
     // variable size list of <packs_length> x SFMF_PackEntry structs
     // variable size list of <blobs_length> x SFMF_BlobEntry structs
+    // variable size list of <hash_index_length> x SFMF_HashIndexEntry structs
     // tightly packed pack payload
     // tightly packed blob payload
 };
@@ -86,7 +162,7 @@ enum SFMF_FileEntry_HashType {
 };
 
 struct SFMF_FileHash {
-    uint32_t size; // file size in bytes (not hash size)
+    uint64_t size; // file size in bytes (not hash size); 32-bit on disk before version 2
     uint32_t hashtype; // SFMF_FileEntry_HashType
     unsigned char hash[SFMF_MAX_HASHSIZE];
 };
@@ -98,49 +174,196 @@ struct SFMF_FileEntry {
     uint32_t gid;
     uint64_t mtime; // mtime as unix timestamp
     uint32_t dev; // for ENTRY_CHARACTER or ENTRY_BLOCK, the device node value
-    uint32_t zsize; // compressed file size in bytes
+    uint64_t zsize; // compressed file size in bytes; 32-bit on disk before version 2
+    uint32_t flags; // SFMF_BlobEntry_Flag values for the blob of this file; not stored
+                    // before version 2 (where zsize < hash.size means BLOB_FLAG_ZCOMPRESSED)
 
     struct SFMF_FileHash hash; // includes file size and hash value
-    uint32_t filename_offset; // offset into filename table
+    uint32_t filename_offset; // offset into filename table (of the entry's record since version 2)
 };
 
+/**
+ * Front-coded filename table (version >= 2): one record per entry, in the
+ * order of the entries list. Each record stores the number of leading
+ * bytes shared with the previous entry's filename (as a varint), followed
+ * by the rest of the filename ('\0'-terminated). The filename of every
+ * SFMF_FILENAME_RESTART_INTERVAL-th entry is stored in full (shared = 0),
+ * so any filename can be reconstructed starting at the preceding restart
+ * point. Before version 2, the table contains the plain filenames.
+ **/
+
 struct SFMF_PackEntry {
     struct SFMF_FileHash hash; // hash of the pack (to be used to look up, size = download size in bytes)
-    uint32_t offset; // absolute file offset of first SFMF_FileHash for this pack
+    uint64_t offset; // offset of first SFMF_FileHash for this pack: file offset before version 2 (32-bit),
+                     // else relative to the start of the uncompressed pack hashes section
     uint32_t count; // number of file hashes contained in this pack
 };
 
+// at most one of the compression flags is set (only zlib before version 2)
 enum SFMF_BlobEntry_Flag {
     BLOB_FLAG_NONE = 0,
-    BLOB_FLAG_ZCOMPRESSED = 1 << 0,
+    BLOB_FLAG_ZCOMPRESSED = 1 << 0, // zlib
+    BLOB_FLAG_ZSTD = 1 << 1,
+    BLOB_FLAG_LZ4 = 1 << 2,
+    BLOB_FLAG_ZSTD_DICT = 1 << 3, // zstd with the dictionary of the manifest (version >= 2)
     /* ... */
 };
 
-// some blobs might not be z-compressed if their uncompressed size is smaller
+// some blobs might not be compressed if their uncompressed size is smaller
 struct SFMF_BlobEntry {
     struct SFMF_FileHash hash; // hash of the blob and uncompressed file size)
     uint32_t flags; // OR-ed field of SFMF_BlobEntry_Flag values
-    uint32_t offset; // absolute file offset of start of blob data
-    uint32_t size; // number of bytes for this blob (in the file)
+    uint64_t offset; // offset of start of blob data: file offset before version 2 (32-bit),
+                     // else relative to the start of the blob payload (after the last section)
+    uint64_t size; // number of bytes for this blob in the file (32-bit before version 2)
 };
 
+enum SFMF_HashIndexEntry_Type {
+    HASH_INDEX_UNKNOWN = 0, // invalid
+    HASH_INDEX_BLOB = 1, // included blob
+    HASH_INDEX_PACK = 2, // file in a pack
+    /* ... */
+};
+
+enum SFMF_Section_Flag {
+    SECTION_FLAG_NONE = 0,
+    SECTION_FLAG_ZCOMPRESSED = 1 << 0,
+    /* ... */
+};
+
+// Entry of the section table (version >= 2)
+struct SFMF_SectionEntry {
+    uint32_t type; // position of the section in the file structure list (0 = metadata)
+    uint32_t flags; // OR-ed field of SFMF_Section_Flag values
+    uint64_t offset; // file offset of the stored data
+    uint64_t size; // size of the (uncompressed) section data
+    uint64_t stored_size; // number of bytes stored at offset
+    uint32_t checksum; // CRC-32 of the stored data
+};
+
+// sorted by hash value (then size) for binary search, one entry per hash
+// (if a hash is found in multiple places, included blobs come first)
+struct SFMF_HashIndexEntry {
+    struct SFMF_FileHash hash;
+    uint32_t type; // SFMF_HashIndexEntry_Type
+    uint32_t index; // index into blobs index or packs index
+    uint32_t slot; // for HASH_INDEX_PACK, position in the list of hashes of the pack
+};
+
+// Zero-filled range of a regular file (a hole or a long run of zeros in the source file),
+// which doesn't need to be written when unpacking; sorted by entry, then offset (version >= 2)
+struct SFMF_ExtentEntry {
+    uint32_t entry; // index of the file entry
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Content-defined chunk of a regular file (version >= 2); sorted by entry, then offset,
+// the chunks of an entry cover the whole file without gaps
+struct SFMF_ChunkEntry {
+    uint32_t entry; // index of the file entry
+    uint64_t offset; // offset of the chunk in the file
+    struct SFMF_FileHash hash; // hash of the chunk data (size = chunk length)
+};
+
+// Delta blob that turns the file with hash base into the one with hash target (version >= 2);
+// sorted by target, then base (there can be deltas against several base files)
+struct SFMF_DeltaEntry {
+    struct SFMF_FileHash target;
+    struct SFMF_FileHash base;
+    struct SFMF_FileHash delta; // hash of the (uncompressed) delta data, see delta.h
+    uint32_t flags; // OR-ed field of SFMF_BlobEntry_Flag values for the delta blob file
+};
+
+// The on-disk size of records depends on the file version
+size_t sfmf_fileheader_size(uint32_t version);
+size_t sfmf_fileentry_size(uint32_t version);
+size_t sfmf_filehash_size(uint32_t version);
+size_t sfmf_packentry_size(uint32_t version);
+size_t sfmf_blobentry_size(uint32_t version);
+size_t sfmf_hashindexentry_size(uint32_t version);
+size_t sfmf_extententry_size(uint32_t version);
+size_t sfmf_sectionentry_size(uint32_t version);
+size_t sfmf_chunkentry_size(uint32_t version);
+size_t sfmf_deltaentry_size(uint32_t version);
+
+// The header is read/written in the format of header->version; the other
+// records in the format of the given file version. The _decode() functions
+// convert an on-disk record at buf (which need not be aligned, e.g. in a
+// memory-mapped file) to host byte order, _encode() does the reverse.
+
 int sfmf_fileheader_write(struct SFMF_FileHeader *header, FILE *fp);
 int sfmf_fileheader_read(struct SFMF_FileHeader *header, FILE *fp);
+void sfmf_fileheader_decode(struct SFMF_FileHeader *header, const void *buf);
+
+int sfmf_fileentry_write(struct SFMF_FileEntry *entry, uint32_t version, FILE *fp);
+int sfmf_fileentry_read(struct SFMF_FileEntry *entry, uint32_t version, FILE *fp);
+void sfmf_fileentry_decode(struct SFMF_FileEntry *entry, uint32_t version, const void *buf);
+
+int sfmf_filehash_write(struct SFMF_FileHash *hash, uint32_t version, FILE *fp);
+int sfmf_filehash_read(struct SFMF_FileHash *hash, uint32_t version, FILE *fp);
+void sfmf_filehash_decode(struct SFMF_FileHash *hash, uint32_t version, const void *buf);
+
+int sfmf_packentry_write(struct SFMF_PackEntry *entry, uint32_t version, FILE *fp);
+int sfmf_packentry_read(struct SFMF_PackEntry *entry, uint32_t version, FILE *fp);
+void sfmf_packentry_decode(struct SFMF_PackEntry *entry, uint32_t version, const void *buf);
+
+int sfmf_blobentry_write(struct SFMF_BlobEntry *entry, uint32_t version, FILE *fp);
+int sfmf_blobentry_read(struct SFMF_BlobEntry *entry, uint32_t version, FILE *fp);
+void sfmf_blobentry_decode(struct SFMF_BlobEntry *entry, uint32_t version, const void *buf);
+
+int sfmf_hashindexentry_write(struct SFMF_HashIndexEntry *entry, uint32_t version, FILE *fp);
+int sfmf_hashindexentry_read(struct SFMF_HashIndexEntry *entry, uint32_t version, FILE *fp);
+void sfmf_hashindexentry_decode(struct SFMF_HashIndexEntry *entry, uint32_t version, const void *buf);
+void sfmf_hashindexentry_encode(struct SFMF_HashIndexEntry *entry, uint32_t version, void *buf);
+
+int sfmf_extententry_write(struct SFMF_ExtentEntry *entry, uint32_t version, FILE *fp);
+int sfmf_extententry_read(struct SFMF_ExtentEntry *entry, uint32_t version, FILE *fp);
+void sfmf_extententry_decode(struct SFMF_ExtentEntry *entry, uint32_t version, const void *buf);
+
+int sfmf_chunkentry_write(struct SFMF_ChunkEntry *entry, uint32_t version, FILE *fp);
+int sfmf_chunkentry_read(struct SFMF_ChunkEntry *entry, uint32_t version, FILE *fp);
+void sfmf_chunkentry_decode(struct SFMF_ChunkEntry *entry, uint32_t version, const void *buf);
+
+int sfmf_deltaentry_write(struct SFMF_DeltaEntry *entry, uint32_t version, FILE *fp);
+int sfmf_deltaentry_read(struct SFMF_DeltaEntry *entry, uint32_t version, FILE *fp);
+void sfmf_deltaentry_decode(struct SFMF_DeltaEntry *entry, uint32_t version, const void *buf);
+// Sorts deltas by target, then base (in the order of sfmf_hashindex_compare())
+void sfmf_deltaentry_sort(struct SFMF_DeltaEntry *entries, uint32_t length);
 
-int sfmf_fileentry_write(struct SFMF_FileEntry *entry, FILE *fp);
-int sfmf_fileentry_read(struct SFMF_FileEntry *entry, FILE *fp);
+// Writes size bytes of data as a section; since version 2 compressed if that makes
+// it smaller (plain data for version 1); entry (if not NULL) is filled in for the
+// section table, except for its type
+int sfmf_section_write(const char *data, uint64_t size, uint32_t version, FILE *fp,
+        struct SFMF_SectionEntry *entry);
 
-int sfmf_filehash_write(struct SFMF_FileHash *hash, FILE *fp);
-int sfmf_filehash_read(struct SFMF_FileHash *hash, FILE *fp);
+// Writes the section table (count, then count entries)
+int sfmf_sectiontable_write(struct SFMF_SectionEntry *entries, uint32_t count, uint32_t version, FILE *fp);
+void sfmf_sectionentry_decode(struct SFMF_SectionEntry *entry, uint32_t version, const void *buf);
+// Returns the checksum of size bytes of stored section data
+uint32_t sfmf_section_checksum(const char *data, uint64_t size);
 
-int sfmf_packentry_write(struct SFMF_PackEntry *entry, FILE *fp);
-int sfmf_packentry_read(struct SFMF_PackEntry *entry, FILE *fp);
+// Number of bytes of filename (entry index) to take from previous in the filename table
+uint32_t sfmf_filename_shared_length(uint32_t index, const char *previous, const char *filename);
+// On-disk size of a front-coded filename table record
+size_t sfmf_filename_record_size(const char *filename, uint32_t shared);
+int sfmf_filename_record_write(const char *filename, uint32_t shared, FILE *fp);
+// Applies the record at buf (with at most length bytes left in the table) to the
+// previous filename in path (*path_length bytes, path_size bytes available);
+// returns the size of the record, or 0 if the record is invalid
+size_t sfmf_filename_record_decode(const char *buf, size_t length, char *path,
+        size_t *path_length, size_t path_size);
 
-int sfmf_blobentry_write(struct SFMF_BlobEntry *entry, FILE *fp);
-int sfmf_blobentry_read(struct SFMF_BlobEntry *entry, FILE *fp);
+// Compares the sort key (hash value, then size) of two hashes
+int sfmf_hashindex_compare(struct SFMF_FileHash *a, struct SFMF_FileHash *b);
+// Sorts entries for the hash index and removes duplicate hashes (updating *length)
+void sfmf_hashindex_sort(struct SFMF_HashIndexEntry *entries, uint32_t *length);
 
 int sfmf_filehash_format(struct SFMF_FileHash *hash, char *buf, size_t len);
 int sfmf_filehash_compare(struct SFMF_FileHash *a, struct SFMF_FileHash *b);
-int sfmf_filehash_verify(struct SFMF_FileHash *expected, const char *filename, int zcompressed);
+// Compares an already-calculated hash of filename against the expected hash
+int sfmf_filehash_check(struct SFMF_FileHash *expected, struct SFMF_FileHash *hash, const char *filename);
+// Hashes filename (stored as described by the SFMF_BlobEntry_Flag values in flags)
+int sfmf_filehash_verify(struct SFMF_FileHash *expected, const char *filename, uint32_t flags);
 
 #endif /* SAILFISH_SNAPSHOT_SFMF_H */
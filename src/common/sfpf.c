@@ -19,6 +19,8 @@
 
 #include "sfpf.h"
 #include <arpa/inet.h>
+#include <endian.h>
+#include <string.h>
 
 int sfpf_fileheader_write(struct SFPF_FileHeader *header, FILE *fp)
 {
@@ -46,3 +48,45 @@ int sfpf_fileheader_read(struct SFPF_FileHeader *header, FILE *fp)
 
     return result;
 }
+
+uint32_t sfpf_blobentry_version(uint32_t version)
+{
+    return (version >= 2) ? SFMF_VERSION_64BIT : 1;
+}
+
+size_t sfpf_blockentry_size()
+{
+    return sizeof(uint32_t) + 3 * sizeof(uint64_t);
+}
+
+int sfpf_blockentry_write(struct SFPF_BlockEntry *entry, FILE *fp)
+{
+    uint32_t flags = htonl(entry->flags);
+    uint64_t values[] = { htobe64(entry->offset), htobe64(entry->size), htobe64(entry->uncompressed_size) };
+
+    char buf[sizeof(flags) + sizeof(values)];
+    memcpy(buf, &flags, sizeof(flags));
+    memcpy(buf + sizeof(flags), values, sizeof(values));
+
+    return fwrite(buf, sizeof(buf), 1, fp);
+}
+
+int sfpf_blockentry_read(struct SFPF_BlockEntry *entry, FILE *fp)
+{
+    uint32_t flags;
+    uint64_t values[3];
+
+    char buf[sizeof(flags) + sizeof(values)];
+    int result = fread(buf, sizeof(buf), 1, fp);
+    if (result == 1) {
+        memcpy(&flags, buf, sizeof(flags));
+        memcpy(values, buf + sizeof(flags), sizeof(values));
+
+        entry->flags = ntohl(flags);
+        entry->offset = be64toh(values[0]);
+        entry->size = be64toh(values[1]);
+        entry->uncompressed_size = be64toh(values[2]);
+    }
+
+    return result;
+}
@@ -30,7 +30,13 @@
 #define SFPF_MAGIC_NUMBER (('S' << 24) | ('F' << 16) | ('P' << 8) | 'F')
 
 /* File version - increment when it changes */
-#define SFPF_CURRENT_VERSION 1
+#define SFPF_CURRENT_VERSION 4
+
+/* Oldest file version that can still be read */
+#define SFPF_MIN_VERSION 1
+
+/* First file version with a block index (for solid packs) */
+#define SFPF_VERSION_SOLID 4
 
 /**
  * Structure of a pack file:
@@ -38,7 +44,15 @@
  *  - header
  *  - metadata
  *  - blob index
+ *  - block index (version >= 4)
  *  - blobs
+ *
+ * If the block index is empty, each blob is stored (and compressed) on
+ * its own, and blob offsets are file offsets. Otherwise, the pack is
+ * solid: the uncompressed blobs are concatenated and split into blocks
+ * that can be decompressed independently (a blob never spans blocks).
+ * Blob offsets are then offsets into the concatenated data, blob sizes
+ * are uncompressed sizes, and blob flags are always BLOB_FLAG_NONE.
  **/
 
 struct SFPF_FileHeader {
@@ -49,10 +63,29 @@ struct SFPF_FileHeader {
 
     // variable size '\0'-terminated metadata blob (<metadata_size> bytes)
     // variable size list of <blobs_length> x SFMF_BlobEntry structs
-    // tightly packed blob payload
+    //     (64-bit sizes and offsets since version 2, see sfpf_blobentry_version();
+    //     blobs may be compressed with codecs other than zlib since version 3;
+    //     BLOB_FLAG_ZSTD_DICT blobs need the dictionary of the manifest)
+    // uint32_t number of blocks, followed by that many SFPF_BlockEntry records (version >= 4)
+    // tightly packed blob payload (blocks in solid packs)
+};
+
+struct SFPF_BlockEntry {
+    uint32_t flags; // SFMF_BlobEntry_Flag values (compression of the block data)
+    uint64_t offset; // file offset of the block data
+    uint64_t size; // number of bytes of the block data in the file
+    uint64_t uncompressed_size; // blobs in the block (blocks follow each other without gaps)
 };
 
 int sfpf_fileheader_write(struct SFPF_FileHeader *header, FILE *fp);
 int sfpf_fileheader_read(struct SFPF_FileHeader *header, FILE *fp);
 
+// SFMF file version to use for reading/writing the blob index of a pack file
+uint32_t sfpf_blobentry_version(uint32_t version);
+
+// Size of an encoded block index entry
+size_t sfpf_blockentry_size();
+int sfpf_blockentry_write(struct SFPF_BlockEntry *entry, FILE *fp);
+int sfpf_blockentry_read(struct SFPF_BlockEntry *entry, FILE *fp);
+
 #endif /* SAILFISH_SNAPSHOT_SFPF_H */
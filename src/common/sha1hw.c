@@ -0,0 +1,297 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#include "sha1hw.h"
+
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1HW_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#define SHA1HW_ARMV8
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// Portable transform for a single block, from src/external/sha1.c
+void SHA1_Transform(uint32_t state[5], const uint8_t buffer[64]);
+
+#if defined(SHA1HW_ARMV8)
+static const uint32_t sha1hw_k[4] = {
+    0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6,
+};
+#endif
+
+
+static void sha1hw_transform_portable(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    while (blocks--) {
+        SHA1_Transform(state, data);
+        data += 64;
+    }
+}
+
+static int sha1hw_supported_always(void)
+{
+    return 1;
+}
+
+#if defined(SHA1HW_X86)
+static int sha1hw_cpuid_leaf1_ecx(unsigned int bit)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    return (ecx & bit) != 0;
+}
+
+static int sha1hw_supported_x86_sha(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    // SHA extensions (leaf 7, EBX bit 29), plus SSSE3 and SSE4.1 for shuffling
+    return (ebx & (1 << 29)) != 0 && sha1hw_cpuid_leaf1_ecx(bit_SSSE3) && sha1hw_cpuid_leaf1_ecx(bit_SSE4_1);
+}
+
+/**
+ * Intel SHA extensions: Four rounds per sha1rnds4 instruction, with the
+ * message schedule computed by sha1msg1/sha1msg2 in the same registers.
+ **/
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha1hw_transform_x86_sha(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (blocks--) {
+        __m128i abcd_saved = abcd;
+        __m128i e0_saved = e0;
+        __m128i msg[4];
+        __m128i e1;
+
+        for (int i=0; i<4; i++) {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+        }
+
+        // Rounds 0-3
+        e0 = _mm_add_epi32(e0, msg[0]);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+#define SHA1HW_X86_ROUNDS(r, e_in, e_out, func) \
+        e_in = _mm_sha1nexte_epu32(e_in, msg[(r) % 4]); \
+        e_out = abcd; \
+        if ((r) >= 3 && (r) <= 18) { msg[((r) + 1) % 4] = _mm_sha1msg2_epu32(msg[((r) + 1) % 4], msg[(r) % 4]); } \
+        abcd = _mm_sha1rnds4_epu32(abcd, e_in, func); \
+        if ((r) >= 1 && (r) <= 16) { msg[((r) + 3) % 4] = _mm_sha1msg1_epu32(msg[((r) + 3) % 4], msg[(r) % 4]); } \
+        if ((r) >= 2 && (r) <= 17) { msg[((r) + 2) % 4] = _mm_xor_si128(msg[((r) + 2) % 4], msg[(r) % 4]); }
+
+        // Rounds 4-79, alternating between e0 and e1
+        SHA1HW_X86_ROUNDS(1, e1, e0, 0);
+        SHA1HW_X86_ROUNDS(2, e0, e1, 0);
+        SHA1HW_X86_ROUNDS(3, e1, e0, 0);
+        SHA1HW_X86_ROUNDS(4, e0, e1, 0);
+        SHA1HW_X86_ROUNDS(5, e1, e0, 1);
+        SHA1HW_X86_ROUNDS(6, e0, e1, 1);
+        SHA1HW_X86_ROUNDS(7, e1, e0, 1);
+        SHA1HW_X86_ROUNDS(8, e0, e1, 1);
+        SHA1HW_X86_ROUNDS(9, e1, e0, 1);
+        SHA1HW_X86_ROUNDS(10, e0, e1, 2);
+        SHA1HW_X86_ROUNDS(11, e1, e0, 2);
+        SHA1HW_X86_ROUNDS(12, e0, e1, 2);
+        SHA1HW_X86_ROUNDS(13, e1, e0, 2);
+        SHA1HW_X86_ROUNDS(14, e0, e1, 2);
+        SHA1HW_X86_ROUNDS(15, e1, e0, 3);
+        SHA1HW_X86_ROUNDS(16, e0, e1, 3);
+        SHA1HW_X86_ROUNDS(17, e1, e0, 3);
+        SHA1HW_X86_ROUNDS(18, e0, e1, 3);
+        SHA1HW_X86_ROUNDS(19, e1, e0, 3);
+
+#undef SHA1HW_X86_ROUNDS
+
+        // Add this block's result to the state
+        e0 = _mm_sha1nexte_epu32(e0, e0_saved);
+        abcd = _mm_add_epi32(abcd, abcd_saved);
+
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#endif /* SHA1HW_X86 */
+
+#if defined(SHA1HW_ARMV8)
+static int sha1hw_supported_armv8(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+}
+
+/**
+ * ARMv8 crypto extensions: Four rounds per sha1c/sha1p/sha1m instruction,
+ * with the message schedule computed by sha1su0/sha1su1.
+ **/
+__attribute__((target("+crypto")))
+static void sha1hw_transform_armv8(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e = state[4];
+
+    while (blocks--) {
+        uint32x4_t abcd_saved = abcd;
+        uint32_t e_saved = e;
+        uint32x4_t msg[4];
+
+        for (int i=0; i<4; i++) {
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+        }
+
+        for (int r=0; r<20; r++) {
+            uint32x4_t wk = vaddq_u32(msg[r % 4], vdupq_n_u32(sha1hw_k[r / 5]));
+            uint32_t e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+
+            if (r < 5) {
+                abcd = vsha1cq_u32(abcd, e, wk);
+            } else if (r >= 10 && r < 15) {
+                abcd = vsha1mq_u32(abcd, e, wk);
+            } else {
+                abcd = vsha1pq_u32(abcd, e, wk);
+            }
+            e = e_next;
+
+            if (r < 16) {
+                // Schedule the message words for rounds 4 * (r + 4) .. 4 * (r + 4) + 3
+                msg[r % 4] = vsha1su1q_u32(vsha1su0q_u32(msg[r % 4], msg[(r + 1) % 4], msg[(r + 2) % 4]),
+                        msg[(r + 3) % 4]);
+            }
+        }
+
+        abcd = vaddq_u32(abcd, abcd_saved);
+        e += e_saved;
+
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e;
+}
+#endif /* SHA1HW_ARMV8 */
+
+// In order of preference; the portable implementation must be last
+static const struct SHA1HWBackend sha1hw_backend_list[] = {
+#if defined(SHA1HW_X86)
+    { "x86-sha", sha1hw_transform_x86_sha, sha1hw_supported_x86_sha },
+#endif
+#if defined(SHA1HW_ARMV8)
+    { "armv8-ce", sha1hw_transform_armv8, sha1hw_supported_armv8 },
+#endif
+    { "portable", sha1hw_transform_portable, sha1hw_supported_always },
+    { NULL, NULL, NULL },
+};
+
+static const struct SHA1HWBackend *sha1hw_current = NULL;
+static pthread_once_t sha1hw_current_once = PTHREAD_ONCE_INIT;
+
+// Returns the first supported backend (with the given name, if not NULL)
+static const struct SHA1HWBackend *sha1hw_find(const char *name)
+{
+    for (const struct SHA1HWBackend *backend = sha1hw_backend_list; backend->name; backend++) {
+        if (name != NULL && strcmp(name, backend->name) != 0) {
+            continue;
+        }
+
+        if (backend->supported()) {
+            return backend;
+        }
+    }
+
+    return NULL;
+}
+
+static void sha1hw_select(void)
+{
+    // Allow forcing a backend (e.g. for debugging and benchmarking)
+    const char *name = getenv("SFMF_SHA1_BACKEND");
+
+    const struct SHA1HWBackend *backend = sha1hw_find(name);
+    if (backend == NULL && name != NULL) {
+        SFMF_WARN("SHA-1 backend '%s' not available, using auto-detection\n", name);
+        backend = sha1hw_find(NULL);
+    }
+
+    assert(backend != NULL);
+    SFMF_DEBUG("Using SHA-1 backend: %s\n", backend->name);
+    sha1hw_current = backend;
+}
+
+static void sha1hw_transform_resolve(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    // Used until sha1hw_init() is called; threads may get here at the same time,
+    // so only sha1hw_get_backend() (not sha1hw_transform) is updated
+    sha1hw_get_backend()->transform(state, data, blocks);
+}
+
+sha1hw_transform_func_t sha1hw_transform = sha1hw_transform_resolve;
+
+const struct SHA1HWBackend *sha1hw_backends(void)
+{
+    return sha1hw_backend_list;
+}
+
+const struct SHA1HWBackend *sha1hw_get_backend(void)
+{
+    pthread_once(&sha1hw_current_once, sha1hw_select);
+
+    return sha1hw_current;
+}
+
+void sha1hw_set_backend(const struct SHA1HWBackend *backend)
+{
+    assert(backend != NULL && backend->supported());
+
+    // Make sure the automatic selection doesn't override this later
+    pthread_once(&sha1hw_current_once, sha1hw_select);
+
+    SFMF_DEBUG("Using SHA-1 backend: %s\n", backend->name);
+    sha1hw_current = backend;
+    sha1hw_transform = backend->transform;
+}
+
+void sha1hw_init(void)
+{
+    sha1hw_set_backend(sha1hw_get_backend());
+}
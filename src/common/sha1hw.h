@@ -0,0 +1,56 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#ifndef SFMF_SHA1HW_H
+#define SFMF_SHA1HW_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * SHA-1 block transform backends: The portable implementation from
+ * src/external/sha1.c is always available, CPU-specific ones (x86 SHA
+ * extensions, ARMv8 crypto extensions) are selected at runtime if the
+ * CPU supports them. SHA1_Update() uses the selected backend. Setting
+ * SFMF_SHA1_BACKEND in the environment forces a specific backend.
+ **/
+
+// Processes blocks * 64 bytes of data (input data is never modified)
+typedef void (*sha1hw_transform_func_t)(uint32_t state[5], const uint8_t *data, size_t blocks);
+
+struct SHA1HWBackend {
+    const char *name;
+    sha1hw_transform_func_t transform;
+    int (*supported)(void);
+};
+
+// Transform function of the currently-selected backend
+extern sha1hw_transform_func_t sha1hw_transform;
+
+// Returns all compiled-in backends, terminated by an entry with name == NULL
+const struct SHA1HWBackend *sha1hw_backends(void);
+// Returns the backend currently in use (selects the best one on first use)
+const struct SHA1HWBackend *sha1hw_get_backend(void);
+// Overrides the selected backend (must be supported by the CPU); not thread-safe
+void sha1hw_set_backend(const struct SHA1HWBackend *backend);
+// Selects the backend, so that sha1hw_transform calls it directly; to be called
+// in main() before starting any threads that hash (else each call is dispatched)
+void sha1hw_init(void);
+
+#endif /* SFMF_SHA1HW_H */
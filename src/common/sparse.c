@@ -0,0 +1,286 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#define _GNU_SOURCE
+
+#include "sparse.h"
+
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Granularity of runs of zeros (the usual file system block size) */
+#define SPARSE_BLOCK_SIZE 4096
+
+/* Size of reads when looking for runs of zeros */
+#define SPARSE_READ_SIZE (1024 * 1024)
+
+struct SparseScan {
+    struct SFMF_ExtentEntry *extents;
+    uint32_t length;
+    uint32_t size;
+};
+
+struct SparseScanner {
+    struct SparseScan scan;
+    uint64_t offset; // file offset of block
+    char block[SPARSE_BLOCK_SIZE]; // partial block (block_length bytes)
+    size_t block_length;
+};
+
+struct SparseWriter {
+    int fd;
+    struct SFMF_ExtentEntry *extents;
+    uint32_t length;
+    uint32_t current; // first extent that doesn't end before pos
+    uint64_t pos;
+};
+
+static int sparse_is_zero(const char *buf, size_t len)
+{
+    return (len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0));
+}
+
+static void sparse_scan_add(struct SparseScan *scan, uint64_t offset, uint64_t length)
+{
+    // Adjacent ranges (e.g. a hole followed by zeros) are merged
+    if (scan->length > 0) {
+        struct SFMF_ExtentEntry *last = &(scan->extents[scan->length - 1]);
+        if (last->offset + last->length == offset) {
+            last->length += length;
+            return;
+        }
+    }
+
+    if (scan->length == scan->size) {
+        scan->size = scan->size ? 2 * scan->size : 16;
+        scan->extents = realloc(scan->extents, scan->size * sizeof(struct SFMF_ExtentEntry));
+        assert(scan->extents != NULL);
+    }
+
+    scan->extents[scan->length++] = (struct SFMF_ExtentEntry){ 0, offset, length };
+}
+
+// Keeps only the extents of at least min_run bytes, and hands them over to *extents
+static uint32_t sparse_scan_finish(struct SparseScan *scan, uint64_t min_run, struct SFMF_ExtentEntry **extents)
+{
+    uint32_t count = 0;
+    for (uint32_t i=0; i<scan->length; i++) {
+        if (scan->extents[i].length >= min_run) {
+            scan->extents[count++] = scan->extents[i];
+        }
+    }
+
+    if (count == 0) {
+        free(scan->extents);
+        scan->extents = NULL;
+    }
+
+    *extents = scan->extents;
+    return count;
+}
+
+uint32_t sparse_scan_file(const char *filename, uint64_t min_run, struct SFMF_ExtentEntry **extents)
+{
+    struct SparseScan scan = { NULL, 0, 0 };
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        SFMF_FAIL_AND_EXIT("Can't open %s: %s\n", filename, strerror(errno));
+    }
+
+    uint64_t size = st.st_size;
+    char *buf = malloc(SPARSE_READ_SIZE);
+
+    uint64_t offset = 0;
+    while (offset < size) {
+        // Holes are skipped without reading them (if the file system can tell)
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data == -1) {
+            data = (errno == ENXIO) ? size : offset;
+        }
+
+        if (data > offset) {
+            sparse_scan_add(&scan, offset, data - offset);
+            offset = data;
+            continue;
+        }
+
+        off_t hole = lseek(fd, offset, SEEK_HOLE);
+        uint64_t end = (hole == -1 || hole > size) ? size : hole;
+
+        while (offset < end) {
+            size_t length = (end - offset < SPARSE_READ_SIZE) ? end - offset : SPARSE_READ_SIZE;
+            ssize_t res = pread(fd, buf, length, offset);
+            if (res <= 0) {
+                SFMF_FAIL_AND_EXIT("Can't read %s: %s\n", filename, strerror(errno));
+            }
+
+            for (size_t pos=0; pos<res; pos+=SPARSE_BLOCK_SIZE) {
+                size_t block = (res - pos < SPARSE_BLOCK_SIZE) ? res - pos : SPARSE_BLOCK_SIZE;
+                if (sparse_is_zero(buf + pos, block)) {
+                    sparse_scan_add(&scan, offset + pos, block);
+                }
+            }
+
+            offset += res;
+        }
+    }
+
+    free(buf);
+    close(fd);
+
+    return sparse_scan_finish(&scan, min_run, extents);
+}
+
+struct SparseScanner *sparse_scanner_new()
+{
+    return calloc(1, sizeof(struct SparseScanner));
+}
+
+static void sparse_scanner_add_block(struct SparseScanner *scanner, const char *block, size_t length)
+{
+    if (sparse_is_zero(block, length)) {
+        sparse_scan_add(&(scanner->scan), scanner->offset, length);
+    }
+    scanner->offset += length;
+}
+
+void sparse_scanner_update(struct SparseScanner *scanner, const char *buf, size_t len)
+{
+    while (len > 0) {
+        if (scanner->block_length > 0 || len < SPARSE_BLOCK_SIZE) {
+            // Collect a block that is split between two pieces of data
+            size_t length = SPARSE_BLOCK_SIZE - scanner->block_length;
+            if (length > len) {
+                length = len;
+            }
+            memcpy(scanner->block + scanner->block_length, buf, length);
+            scanner->block_length += length;
+            buf += length;
+            len -= length;
+
+            if (scanner->block_length == SPARSE_BLOCK_SIZE) {
+                sparse_scanner_add_block(scanner, scanner->block, SPARSE_BLOCK_SIZE);
+                scanner->block_length = 0;
+            }
+        } else {
+            sparse_scanner_add_block(scanner, buf, SPARSE_BLOCK_SIZE);
+            buf += SPARSE_BLOCK_SIZE;
+            len -= SPARSE_BLOCK_SIZE;
+        }
+    }
+}
+
+uint32_t sparse_scanner_finish(struct SparseScanner *scanner, uint64_t min_run, struct SFMF_ExtentEntry **extents)
+{
+    // The last block of the file can be shorter
+    if (scanner->block_length > 0) {
+        sparse_scanner_add_block(scanner, scanner->block, scanner->block_length);
+    }
+
+    uint32_t count = sparse_scan_finish(&(scanner->scan), min_run, extents);
+    free(scanner);
+
+    return count;
+}
+
+static ssize_t sparse_writer_write(void *cookie, const char *buf, size_t size)
+{
+    struct SparseWriter *writer = cookie;
+
+    size_t done = 0;
+    while (done < size) {
+        while (writer->current < writer->length &&
+                writer->extents[writer->current].offset + writer->extents[writer->current].length <= writer->pos) {
+            writer->current++;
+        }
+
+        size_t length = size - done;
+        int in_extent = 0;
+        if (writer->current < writer->length) {
+            struct SFMF_ExtentEntry *extent = &(writer->extents[writer->current]);
+            in_extent = (extent->offset <= writer->pos);
+            uint64_t next = in_extent ? extent->offset + extent->length : extent->offset;
+            if (next - writer->pos < length) {
+                length = next - writer->pos;
+            }
+        }
+
+        // Data that isn't zero is always written, even within an extent
+        if (!in_extent || !sparse_is_zero(buf + done, length)) {
+            ssize_t res = pwrite(writer->fd, buf + done, length, writer->pos);
+            if (res <= 0) {
+                return done ? done : -1;
+            }
+            length = res;
+        }
+
+        writer->pos += length;
+        done += length;
+    }
+
+    return done;
+}
+
+static int sparse_writer_close(void *cookie)
+{
+    struct SparseWriter *writer = cookie;
+
+    // Zeros skipped at the end of the file haven't extended it yet
+    int res = ftruncate(writer->fd, writer->pos);
+    if (close(writer->fd) != 0) {
+        res = -1;
+    }
+
+    free(writer->extents);
+    free(writer);
+
+    return res;
+}
+
+FILE *sparse_fopen(const char *filename, const struct SFMF_ExtentEntry *extents, uint32_t length)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct SparseWriter *writer = calloc(1, sizeof(struct SparseWriter));
+    writer->fd = fd;
+    writer->length = length;
+    writer->extents = malloc((length ?: 1) * sizeof(struct SFMF_ExtentEntry));
+    memcpy(writer->extents, extents, length * sizeof(struct SFMF_ExtentEntry));
+
+    cookie_io_functions_t functions = { NULL, sparse_writer_write, NULL, sparse_writer_close };
+    FILE *fp = fopencookie(writer, "w", functions);
+    if (fp == NULL) {
+        sparse_writer_close(writer);
+    }
+
+    return fp;
+}
@@ -0,0 +1,56 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#ifndef SFMF_SPARSE_H
+#define SFMF_SPARSE_H
+
+#include "sfmf.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Zero extents of files (see SFMF_ExtentEntry): when packing, holes and
+ * long runs of zeros are found in the source files; when unpacking, the
+ * zeros in these extents are skipped instead of written, so the files
+ * get holes there (saving I/O, flash wear and space on the device).
+ **/
+
+/* Runs of zeros shorter than this are not worth recording */
+#define SPARSE_DEFAULT_MIN_RUN (64 * 1024)
+
+// Finds the holes and runs of zeros (in whole file system blocks) of at least min_run
+// bytes in filename; returns their number, the extents (with entry set to 0) are stored
+// in *extents (to be freed by the caller, NULL if there are none)
+uint32_t sparse_scan_file(const char *filename, uint64_t min_run, struct SFMF_ExtentEntry **extents);
+
+// Finds the same extents as sparse_scan_file() in data that is passed in as it is read
+// from the start of a file (in pieces of any size), e.g. while hashing the file
+struct SparseScanner;
+struct SparseScanner *sparse_scanner_new();
+void sparse_scanner_update(struct SparseScanner *scanner, const char *buf, size_t len);
+// Like sparse_scan_file(), for all data passed in so far; frees scanner
+uint32_t sparse_scanner_finish(struct SparseScanner *scanner, uint64_t min_run, struct SFMF_ExtentEntry **extents);
+
+// Opens filename for writing (truncating it); zeros written within one of the length
+// extents are skipped, any other data is written as usual. Returns NULL on error
+FILE *sparse_fopen(const char *filename, const struct SFMF_ExtentEntry *extents, uint32_t length);
+
+#endif /* SFMF_SPARSE_H */
@@ -0,0 +1,224 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#include "spillstore.h"
+
+#include "convert.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+
+// Items larger than this always go to temporary files
+#define SPILLSTORE_MEMORY_ITEM_LIMIT (1024 * 1024)
+
+
+struct SpillStore *spillstore_new(const char *parent_dir, size_t memory_limit, uint64_t disk_limit)
+{
+    struct SpillStore *store = calloc(1, sizeof(struct SpillStore));
+
+    store->parent_dir = strdup(parent_dir);
+    store->memory_item_limit = SPILLSTORE_MEMORY_ITEM_LIMIT;
+    store->memory_limit = memory_limit;
+    store->disk_limit = disk_limit;
+    store->index = hashindex_new(0);
+    pthread_mutex_init(&store->mutex, NULL);
+
+    return store;
+}
+
+static int spillstore_ensure_dir(struct SpillStore *store)
+{
+    if (store->dir == NULL) {
+        char tmp[PATH_MAX];
+        snprintf(tmp, sizeof(tmp), "%s/spill-XXXXXX", store->parent_dir);
+        if (mkdtemp(tmp) == NULL) {
+            SFMF_WARN("Could not create spill directory in %s: %s\n", store->parent_dir, strerror(errno));
+            return 0;
+        }
+        store->dir = strdup(tmp);
+    }
+
+    return 1;
+}
+
+struct SpillStoreItem *spillstore_begin(struct SpillStore *store, uint64_t size_hint)
+{
+    struct SpillStoreItem *item = NULL;
+
+    pthread_mutex_lock(&store->mutex);
+
+    if (size_hint <= store->memory_item_limit && store->memory_used + size_hint <= store->memory_limit) {
+        item = calloc(1, sizeof(struct SpillStoreItem));
+        item->fp = open_memstream(&item->buffer, &item->length);
+        assert(item->fp != NULL);
+        item->reserved = size_hint;
+        store->memory_used += size_hint;
+    } else if (store->disk_used + size_hint <= store->disk_limit && spillstore_ensure_dir(store)) {
+        char tmp[PATH_MAX];
+        snprintf(tmp, sizeof(tmp), "%s/%u.z", store->dir, store->counter++);
+
+        item = calloc(1, sizeof(struct SpillStoreItem));
+        item->filename = strdup(tmp);
+        item->fp = fopen(item->filename, "wb");
+        if (item->fp == NULL) {
+            SFMF_FAIL_AND_EXIT("Could not create spill file %s: %s\n", item->filename, strerror(errno));
+        }
+        item->reserved = size_hint;
+        store->disk_used += size_hint;
+    }
+
+    pthread_mutex_unlock(&store->mutex);
+
+    return item;
+}
+
+// Must be called with the mutex held
+static void spillstore_release(struct SpillStore *store, struct SpillStoreItem *item)
+{
+    if (item->filename) {
+        unlink(item->filename);
+        free(item->filename);
+        item->filename = NULL;
+        store->disk_used -= item->reserved;
+    } else {
+        free(item->buffer);
+        item->buffer = NULL;
+        store->memory_used -= item->reserved;
+    }
+
+    item->reserved = 0;
+}
+
+void spillstore_commit(struct SpillStore *store, struct SpillStoreItem *item,
+        struct SFMF_FileHash *hash, int keep)
+{
+    int res = fclose(item->fp);
+    item->fp = NULL;
+    if (res != 0) {
+        SFMF_WARN("Could not write spill data: %s\n", strerror(errno));
+        keep = 0;
+    }
+
+    pthread_mutex_lock(&store->mutex);
+
+    uint64_t length = item->length;
+    if (keep && item->filename) {
+        // For temporary files, we don't get the length from open_memstream()
+        FILE *fp = fopen(item->filename, "rb");
+        if (fp != NULL) {
+            fseeko(fp, 0, SEEK_END);
+            length = ftello(fp);
+            fclose(fp);
+        }
+    }
+
+    if (keep && length <= item->reserved) {
+        item->hash = *hash;
+        if (hashindex_insert(store->index, &(item->hash), item) == NULL) {
+            // Only account for the actual size from now on
+            if (item->filename) {
+                store->disk_used -= item->reserved - length;
+            } else {
+                store->memory_used -= item->reserved - length;
+            }
+            item->reserved = length;
+
+            pthread_mutex_unlock(&store->mutex);
+            return;
+        }
+    }
+
+    // Not needed (not compressible, or same contents already stored)
+    spillstore_release(store, item);
+    free(item);
+
+    pthread_mutex_unlock(&store->mutex);
+}
+
+int spillstore_write(struct SpillStore *store, struct SFMF_FileHash *hash, FILE *fp)
+{
+    pthread_mutex_lock(&store->mutex);
+
+    struct SpillStoreItem *item = hashindex_lookup(store->index, hash);
+    if (item == NULL || (item->buffer == NULL && item->filename == NULL)) {
+        store->misses++;
+        pthread_mutex_unlock(&store->mutex);
+        return 1;
+    }
+
+    store->hits++;
+
+    if (item->filename) {
+        FILE *in = fopen(item->filename, "rb");
+        if (in == NULL) {
+            SFMF_FAIL_AND_EXIT("Could not open spill file %s: %s\n", item->filename, strerror(errno));
+        }
+
+        // Plain copy, as fp is usually not at the start of the file
+        char buf[DEFAULT_BUFFER_SIZE];
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+            size_t res = fwrite(buf, 1, len, fp);
+            assert(res == len);
+        }
+        fclose(in);
+    } else if (item->length > 0) {
+        size_t res = fwrite(item->buffer, item->length, 1, fp);
+        assert(res == 1);
+    }
+
+    // Every blob is written only once, so we can free the data now; the
+    // item itself stays in the index, as the index references its hash
+    spillstore_release(store, item);
+
+    pthread_mutex_unlock(&store->mutex);
+
+    return 0;
+}
+
+void spillstore_free(struct SpillStore *store)
+{
+    assert(store);
+
+    SFMF_LOG("Spill store: %u compressed blobs reused, %u compressed again\n",
+            store->hits, store->misses);
+
+    for (uint32_t i=0; i<store->index->size; i++) {
+        struct SpillStoreItem *item = store->index->data[i].value;
+        if (item != NULL) {
+            spillstore_release(store, item);
+            free(item);
+        }
+    }
+
+    if (store->dir) {
+        rmdir(store->dir);
+        free(store->dir);
+    }
+
+    hashindex_free(store->index);
+    pthread_mutex_destroy(&store->mutex);
+    free(store->parent_dir);
+    free(store);
+}
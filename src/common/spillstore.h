@@ -0,0 +1,80 @@
+/**
+ * Sailfish OS Factory Snapshot Update
+ * Copyright (C) 2015 Jolla Ltd.
+ * Contact: Thomas Perl <thomas.perl@jolla.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ **/
+
+#ifndef SFMF_SPILLSTORE_H
+#define SFMF_SPILLSTORE_H
+
+#include "sfmf.h"
+#include "hashindex.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Keeps compressed file contents (keyed by hash of the uncompressed
+ * data) around, so that data compressed once (e.g. while determining
+ * the zsize) can be written out later without compressing it again.
+ * Small items are kept in memory, larger ones in temporary files; both
+ * are bounded in total size (items that don't fit aren't stored).
+ * All functions can be called from multiple threads.
+ **/
+
+struct SpillStoreItem {
+    struct SFMF_FileHash hash;
+    FILE *fp; // only while the item is being written
+
+    char *buffer; // in-memory data (or NULL)
+    size_t length;
+
+    char *filename; // temporary file (or NULL)
+    uint64_t reserved; // bytes reserved from the limits
+};
+
+struct SpillStore {
+    char *parent_dir; // temporary directory is created in here
+    char *dir; // created on first use
+
+    size_t memory_item_limit; // maximum size for items to be kept in memory
+    size_t memory_limit;
+    size_t memory_used;
+    uint64_t disk_limit;
+    uint64_t disk_used;
+
+    struct HashIndex *index;
+    uint32_t counter; // for temporary filenames
+
+    uint32_t hits; // items written out from the store
+    uint32_t misses; // lookups not found in the store
+
+    pthread_mutex_t mutex;
+};
+
+struct SpillStore *spillstore_new(const char *parent_dir, size_t memory_limit, uint64_t disk_limit);
+// Starts a new item for (at most) size_hint bytes; returns NULL if it doesn't fit
+struct SpillStoreItem *spillstore_begin(struct SpillStore *store, uint64_t size_hint);
+// Finishes writing item->fp; stores it (if keep and not stored yet) or discards it
+void spillstore_commit(struct SpillStore *store, struct SpillStoreItem *item,
+        struct SFMF_FileHash *hash, int keep);
+// Writes the stored data for hash to fp and releases it; returns 0 on success,
+// nonzero if the item is not in the store (the caller has to compress it again)
+int spillstore_write(struct SpillStore *store, struct SFMF_FileHash *hash, FILE *fp);
+void spillstore_free(struct SpillStore *store);
+
+#endif /* SFMF_SPILLSTORE_H */
@@ -76,7 +76,8 @@ A million repetitions of "a"
   34AA973C D4C4DAA4 F61EEB2B DBAD2731 6534016F
 */
 
-/* #define SHA1HANDSOFF  */
+/* Never modify the input buffer (it's used for other things, too) */
+#define SHA1HANDSOFF
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -87,6 +88,7 @@ A million repetitions of "a"
 
 #include <stdint.h>
 #include "sha1.h"
+#include "sha1hw.h"
 
 void SHA1_Transform(uint32_t state[5], const uint8_t buffer[64]);
 
@@ -136,8 +138,9 @@ void SHA1_Transform(uint32_t state[5], const uint8_t buffer[64])
     CHAR64LONG16* block;
 
 #ifdef SHA1HANDSOFF
-    static uint8_t workspace[64];
-    block = (CHAR64LONG16*)workspace;
+    /* on the stack instead of static, so that hashing is thread-safe */
+    CHAR64LONG16 workspace;
+    block = &workspace;
     memcpy(block, buffer, 64);
 #else
     block = (CHAR64LONG16*)buffer;
@@ -211,9 +214,11 @@ void SHA1_Update(SHA1_CTX* context, const uint8_t* data, const size_t len)
     context->count[1] += (len >> 29);
     if ((j + len) > 63) {
         memcpy(&context->buffer[j], data, (i = 64-j));
-        SHA1_Transform(context->state, context->buffer);
-        for ( ; i + 63 < len; i += 64) {
-            SHA1_Transform(context->state, data + i);
+        sha1hw_transform(context->state, context->buffer, 1);
+        /* all remaining full blocks in one go (see sha1hw.c) */
+        if (len - i >= 64) {
+            sha1hw_transform(context->state, data + i, (len - i) / 64);
+            i += ((len - i) / 64) * 64;
         }
         j = 0;
     }
@@ -252,10 +257,6 @@ void SHA1_Final(SHA1_CTX* context, uint8_t digest[SHA1_DIGEST_SIZE])
     memset(context->state, 0, 20);
     memset(context->count, 0, 8);
     memset(finalcount, 0, 8);	/* SWR */
-
-#ifdef SHA1HANDSOFF  /* make SHA1Transform overwrite its own static vars */
-    SHA1_Transform(context->state, context->buffer);
-#endif
 }
 
 /*************************************************************/
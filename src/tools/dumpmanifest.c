@@ -19,6 +19,7 @@
 
 #include "sfmf.h"
 #include "sfpf.h"
+#include "readmanifest.h"
 #include "convert.h"
 #include "logging.h"
 
@@ -30,6 +31,7 @@
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -76,15 +78,10 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    struct SFMF_FileHeader header;
+    struct ManifestReader *reader = manifestreader_open(opts.filename);
+    assert(reader);
 
-    FILE *fp = fopen(opts.filename, "rb");
-    assert(fp);
-    int res = sfmf_fileheader_read(&header, fp);
-    assert(res == 1);
-
-    assert(header.magic == SFMF_MAGIC_NUMBER);
-    assert(header.version == SFMF_CURRENT_VERSION);
+    struct SFMF_FileHeader header = reader->header;
 
     SFMF_LOG("File header:\n"
            " Magic: %x (%c%c%c%c)\n"
@@ -93,7 +90,8 @@ int main(int argc, char *argv[])
            " Filename table size: %d bytes\n"
            " Entries: %d\n"
            " Packs: %d\n"
-           " Blobs: %d\n\n",
+           " Blobs: %d\n"
+           " Hash index: %d\n\n",
            header.magic,
            (header.magic >> 24) & 0xFF,
            (header.magic >> 16) & 0xFF,
@@ -104,41 +102,49 @@ int main(int argc, char *argv[])
            header.filename_table_size,
            header.entries_length,
            header.packs_length,
-           header.blobs_length);
-
+           header.blobs_length,
+           header.hash_index_length);
+
+    if (header.version >= SFMF_VERSION_SECTION_TABLE) {
+        const char *names[MANIFEST_SECTION_COUNT] = {
+            "Metadata", "Filename table", "Entries", "Packs", "Blobs", "Hash index", "Pack hashes",
+            "Dictionary", "Zero extents", "Chunks", "Deltas",
+        };
+
+        SFMF_LOG("Sections:\n");
+        for (int i=0; i<MANIFEST_SECTION_COUNT; i++) {
+            struct SFMF_SectionEntry *section = &(reader->sections[i].entry);
+            char location[64] = "";
+            if (reader->sections[i].has_checksum) {
+                snprintf(location, sizeof(location), ", at offset %zu, crc32 %08x",
+                        (size_t)section->offset, section->checksum);
+            }
+            SFMF_LOG(" %s: %" PRIu64 " bytes (%" PRIu64 " stored%s%s)\n", names[i], section->size,
+                    section->stored_size, (section->flags & SECTION_FLAG_ZCOMPRESSED) ? ", zcompressed" : "",
+                    location);
+        }
+        SFMF_LOG("\n");
+    }
 
-    char *metadata = malloc(header.metadata_size);
-    res = fread(metadata, header.metadata_size, 1, fp);
-    assert(res == 1);
 
     SFMF_LOG("==== Metadata ====\n");
-    SFMF_LOG("%s\n", metadata);
+    SFMF_LOG("%s\n", manifestreader_get_metadata(reader));
     SFMF_LOG("==== Metadata ====\n");
-    free(metadata);
-
-    char *filename_table = malloc(header.filename_table_size);
-    res = fread(filename_table, header.filename_table_size, 1, fp);
-    assert(res == 1);
 
 #if 0
     SFMF_LOG("==== Filename table ====\n");
-    for (int i=0; i<header.filename_table_size; i++) {
-        SFMF_LOG("%s\n", filename_table + i);
-        i += strlen(filename_table + i) + 1;
+    for (int i=0; i<header.entries_length; i++) {
+        SFMF_LOG("%s\n", manifestreader_get_filename(reader, i));
     }
     SFMF_LOG("==== Filename table ====\n");
 #endif
 
-    struct SFMF_FileEntry *fentries;
-    fentries = calloc(sizeof(struct SFMF_FileEntry), header.entries_length);
-
-    for (int i=0; i<header.entries_length; i++) {
-        sfmf_fileentry_read(&(fentries[i]), fp);
-    }
-
     SFMF_LOG("==== Entries ====\n");
     for (int i=0; i<header.entries_length; i++) {
-        struct SFMF_FileEntry *entry = &(fentries[i]);
+        struct SFMF_FileEntry e;
+        manifestreader_get_entry(reader, i, &e);
+        struct SFMF_FileEntry *entry = &e;
+
         char filetype = '?';
         switch (entry->type) {
             case ENTRY_DIRECTORY: filetype = 'd'; break;
@@ -158,82 +164,111 @@ int main(int argc, char *argv[])
             strcpy(tmp, "-");
         }
 
-        SFMF_LOG("[%c] %06o %5d:%5d (%s) %s (%d bytes / %d zbytes)\n",
+        SFMF_LOG("[%c] %06o %5d:%5d (%s) %s (%" PRIu64 " bytes / %" PRIu64 " zbytes)\n",
                 filetype, entry->mode, entry->uid, entry->gid,
-                tmp, filename_table + entry->filename_offset,
+                tmp, manifestreader_get_filename(reader, i),
                 entry->hash.size, entry->zsize);
-    }
-    SFMF_LOG("==== Entries ====\n");
-
-    free(fentries);
 
-    struct SFMF_PackEntry *pentries;
+        uint32_t first = 0;
+        uint32_t count = manifestreader_find_extents(reader, i, &first);
+        for (uint32_t j=0; j<count; j++) {
+            struct SFMF_ExtentEntry extent;
+            manifestreader_get_extent(reader, first + j, &extent);
+            SFMF_LOG("    zeros @ %" PRIu64 ", %" PRIu64 " bytes\n", extent.offset, extent.length);
+        }
 
-    pentries = calloc(sizeof(struct SFMF_PackEntry), header.packs_length);
+        count = manifestreader_find_chunks(reader, i, &first);
+        for (uint32_t j=0; j<count; j++) {
+            struct SFMF_ChunkEntry chunk;
+            manifestreader_get_chunk(reader, first + j, &chunk);
+            sfmf_filehash_format(&(chunk.hash), tmp, sizeof(tmp));
+            SFMF_LOG("    chunk @ %" PRIu64 ", %" PRIu64 " bytes (%s)\n", chunk.offset, chunk.hash.size, tmp);
+        }
 
-    for (int i=0; i<header.packs_length; i++) {
-        sfmf_packentry_read(&(pentries[i]), fp);
+        count = (entry->hash.size > 0) ? manifestreader_find_deltas(reader, &(entry->hash), &first) : 0;
+        for (uint32_t j=0; j<count; j++) {
+            struct SFMF_DeltaEntry delta;
+            manifestreader_get_delta(reader, first + j, &delta);
+            char delta_hash[64];
+            sfmf_filehash_format(&(delta.base), tmp, sizeof(tmp));
+            sfmf_filehash_format(&(delta.delta), delta_hash, sizeof(delta_hash));
+            SFMF_LOG("    delta from %s, %" PRIu64 " bytes (%s)\n", tmp, delta.delta.size, delta_hash);
+        }
     }
+    SFMF_LOG("==== Entries ====\n");
 
     SFMF_LOG("==== Pack entries ====\n");
     for (int i=0; i<header.packs_length; i++) {
-        struct SFMF_PackEntry *entry = &(pentries[i]);
+        struct SFMF_PackEntry entry;
+        manifestreader_get_pack(reader, i, &entry);
 
         char tmp[512];
-        sfmf_filehash_format(&(entry->hash), tmp, sizeof(tmp));
-        SFMF_LOG("Pack %d (%s), %d bytes: %d entries @ offset %d\n",
-                i, tmp, entry->hash.size, entry->count, entry->offset);
+        sfmf_filehash_format(&(entry.hash), tmp, sizeof(tmp));
+        SFMF_LOG("Pack %d (%s), %" PRIu64 " bytes: %d entries @ offset %" PRIu64 "\n",
+                i, tmp, entry.hash.size, entry.count, entry.offset);
     }
     SFMF_LOG("==== Pack entries ====\n");
 
-    struct SFMF_BlobEntry *bentries;
-    bentries = calloc(sizeof(struct SFMF_BlobEntry), header.blobs_length);
-
     for (int i=0; i<header.blobs_length; i++) {
-        sfmf_blobentry_read(&(bentries[i]), fp);
-    }
+        struct SFMF_BlobEntry entry;
+        manifestreader_get_blob(reader, i, &entry);
 
-    for (int i=0; i<header.blobs_length; i++) {
         SFMF_LOG(" == Item %d ==\n", i);
         char tmp[512];
-        sfmf_filehash_format(&(bentries[i].hash), tmp, sizeof(tmp));
+        sfmf_filehash_format(&(entry.hash), tmp, sizeof(tmp));
         SFMF_LOG("  Hash: %s\n", tmp);
-        if (bentries[i].flags & BLOB_FLAG_ZCOMPRESSED) {
-            SFMF_LOG("  Flags: zcompressed\n");
+        enum ConvertCodec codec;
+        if (convert_codec_from_blob_flags(entry.flags, &codec)) {
+            SFMF_LOG("  Flags: compressed (%s)\n", convert_codec_name(codec));
+        } else if (entry.flags != BLOB_FLAG_NONE) {
+            SFMF_LOG("  Flags: 0x%x (unknown)\n", entry.flags);
         } else {
             SFMF_LOG("  Flags: -\n");
         }
-        SFMF_LOG("  Offset: %d\n", bentries[i].offset);
-        SFMF_LOG("  Size: %d (%d uncompressed)\n", bentries[i].size,
-                bentries[i].hash.size);
+        SFMF_LOG("  Offset: %" PRIu64 "\n", entry.offset);
+        SFMF_LOG("  Size: %" PRIu64 " (%" PRIu64 " uncompressed)\n", entry.size,
+                entry.hash.size);
     }
 
     SFMF_LOG("==== Pack Contents ====\n");
     for (int i=0; i<header.packs_length; i++) {
-        struct SFMF_PackEntry *entry = &(pentries[i]);
+        struct SFMF_PackEntry entry;
+        manifestreader_get_pack(reader, i, &entry);
 
         char tmp[512];
-        sfmf_filehash_format(&(entry->hash), tmp, sizeof(tmp));
+        sfmf_filehash_format(&(entry.hash), tmp, sizeof(tmp));
         SFMF_LOG("Pack %d (%s):\n", i, tmp);
-        fseek(fp, entry->offset, SEEK_SET);
 
-        for (int j=0; j<entry->count; j++) {
-            struct SFMF_FileHash hash;
-            res = sfmf_filehash_read(&hash, fp);
-            assert(res == 1);
+        struct SFMF_FileHash *hashes = calloc(sizeof(struct SFMF_FileHash), entry.count ?: 1);
+        manifestreader_get_pack_hashes(reader, &entry, hashes);
 
-            sfmf_filehash_format(&hash, tmp, sizeof(tmp));
-            SFMF_LOG("  #%4d: %s (%d bytes)\n", j, tmp, hash.size);
+        for (int j=0; j<entry.count; j++) {
+            sfmf_filehash_format(&(hashes[j]), tmp, sizeof(tmp));
+            SFMF_LOG("  #%4d: %s (%" PRIu64 " bytes)\n", j, tmp, hashes[j].size);
         }
+
+        free(hashes);
     }
     SFMF_LOG("==== Pack Contents ====\n");
 
+    SFMF_LOG("==== Hash index ====\n");
+    for (int i=0; i<header.hash_index_length; i++) {
+        struct SFMF_HashIndexEntry entry;
+        manifestreader_get_hash_index_entry(reader, i, &entry);
 
-    free(pentries);
-    free(bentries);
+        char tmp[512];
+        sfmf_filehash_format(&(entry.hash), tmp, sizeof(tmp));
+        if (entry.type == HASH_INDEX_BLOB) {
+            SFMF_LOG("  %s: blob %d\n", tmp, entry.index);
+        } else if (entry.type == HASH_INDEX_PACK) {
+            SFMF_LOG("  %s: pack %d #%d\n", tmp, entry.index, entry.slot);
+        } else {
+            SFMF_LOG("  %s: unknown type %d\n", tmp, entry.type);
+        }
+    }
+    SFMF_LOG("==== Hash index ====\n");
 
-    free(filename_table);
-    fclose(fp);
+    manifestreader_close(reader);
 
     return 0;
 }
@@ -30,10 +30,12 @@
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <arpa/inet.h>
 
 const char *progname = NULL;
 
@@ -83,7 +85,7 @@ int main(int argc, char *argv[])
     assert(res == 1);
 
     assert(header.magic == SFPF_MAGIC_NUMBER);
-    assert(header.version == SFPF_CURRENT_VERSION);
+    assert(header.version >= SFPF_MIN_VERSION && header.version <= SFPF_CURRENT_VERSION);
 
     SFMF_LOG("File header:\n"
            " Magic: %x (%c%c%c%c)\n"
@@ -111,7 +113,14 @@ int main(int argc, char *argv[])
     entries = calloc(sizeof(struct SFMF_BlobEntry), header.blobs_length);
 
     for (int i=0; i<header.blobs_length; i++) {
-        sfmf_blobentry_read(&(entries[i]), fp);
+        sfmf_blobentry_read(&(entries[i]), sfpf_blobentry_version(header.version), fp);
+    }
+
+    uint32_t blocks_length = 0;
+    if (header.version >= SFPF_VERSION_SOLID) {
+        res = fread(&blocks_length, sizeof(blocks_length), 1, fp);
+        assert(res == 1);
+        blocks_length = ntohl(blocks_length);
     }
 
     for (int i=0; i<header.blobs_length; i++) {
@@ -119,16 +128,37 @@ int main(int argc, char *argv[])
         char tmp[512];
         sfmf_filehash_format(&(entries[i].hash), tmp, sizeof(tmp));
         SFMF_LOG("  Hash: %s\n", tmp);
-        if (entries[i].flags & BLOB_FLAG_ZCOMPRESSED) {
-            SFMF_LOG("  Flags: zcompressed\n");
+        enum ConvertCodec codec;
+        if (convert_codec_from_blob_flags(entries[i].flags, &codec)) {
+            SFMF_LOG("  Flags: compressed (%s)\n", convert_codec_name(codec));
+        } else if (entries[i].flags != BLOB_FLAG_NONE) {
+            SFMF_LOG("  Flags: 0x%x (unknown)\n", entries[i].flags);
         } else {
             SFMF_LOG("  Flags: -\n");
         }
-        SFMF_LOG("  Offset: %d\n", entries[i].offset);
-        SFMF_LOG("  Size: %d (%d uncompressed)\n", entries[i].size,
+        SFMF_LOG("  Offset: %" PRIu64 "\n", entries[i].offset);
+        SFMF_LOG("  Size: %" PRIu64 " (%" PRIu64 " uncompressed)\n", entries[i].size,
                 entries[i].hash.size);
     }
 
+    for (uint32_t i=0; i<blocks_length; i++) {
+        struct SFPF_BlockEntry block;
+        res = sfpf_blockentry_read(&block, fp);
+        assert(res == 1);
+
+        SFMF_LOG(" == Block %" PRIu32 " ==\n", i);
+        enum ConvertCodec codec;
+        if (convert_codec_from_blob_flags(block.flags, &codec)) {
+            SFMF_LOG("  Flags: compressed (%s)\n", convert_codec_name(codec));
+        } else if (block.flags != BLOB_FLAG_NONE) {
+            SFMF_LOG("  Flags: 0x%x (unknown)\n", block.flags);
+        } else {
+            SFMF_LOG("  Flags: -\n");
+        }
+        SFMF_LOG("  Offset: %" PRIu64 "\n", block.offset);
+        SFMF_LOG("  Size: %" PRIu64 " (%" PRIu64 " uncompressed)\n", block.size, block.uncompressed_size);
+    }
+
     free(entries);
     fclose(fp);
 
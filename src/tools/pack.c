@@ -21,7 +21,17 @@
 #include "sfpf.h"
 #include "convert.h"
 #include "fileentry.h"
+#include "spillstore.h"
+#include "costmodel.h"
+#include "sparse.h"
+#include "chunker.h"
+#include "delta.h"
+#include "hashcache.h"
+#include "readmanifest.h"
+#include "readpack.h"
+#include "hashindex.h"
 #include "logging.h"
+#include "sha1hw.h"
 
 #define _XOPEN_SOURCE 500
 #define __USE_XOPEN_EXTENDED
@@ -31,25 +41,25 @@
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 #include <ftw.h>
+#include <argp.h>
+#include <arpa/inet.h>
 
 const char *progname = NULL;
 
-static void usage()
-{
-    SFMF_LOG("Usage: %s <in-dir> <out-dir> <meta-file> <blob-upper> <pack-upper> <avg-pack>\n\n"
-             "    <in-dir> ....... Path to source tree\n"
-             "    <out-dir> ...... Output directory\n"
-             "    <meta-file> .... Textfile with metadata\n"
-             "    <blob-upper> ... Maximum total size for embedded blobs (in KiB)\n"
-             "    <pack-upper> ... Maximum size for files to be packed (in KiB)\n"
-             "    <avg-pack> ..... Average target size of pack files (in KiB)\n"
-             "\n", progname);
-}
+const char *argp_program_version = "sfmf-pack " VERSION;
+const char *argp_program_bug_address = "info@sailfishos.org";
+
+/* Maximum number of base release trees for delta blobs */
+#define MAX_DELTA_BASES 16
+
+/* Default size limit of delta blobs, in percent of the stored size of the full file */
+#define DELTA_DEFAULT_MAX_PERCENT 50
 
 struct PackOptions {
     const char *in_dir;
@@ -59,6 +69,30 @@ struct PackOptions {
     uint32_t pack_upper_kb;
     uint32_t avg_pack_kb;
 
+    int jobs; // number of threads for hashing input files
+    uint32_t spill_memory_mb; // memory for keeping compressed data around
+    uint32_t spill_disk_mb; // disk space for keeping compressed data around
+    struct SpillStore *spill;
+    struct CostModel *costmodel; // picks the codec (and level) for each blob
+    uint32_t dictionary_max_kb; // train a dictionary for files up to this size (0 = none)
+    char *dictionary; // trained dictionary (stored in the manifest)
+    size_t dictionary_length;
+    uint32_t solid_block_kb; // write solid packs with blocks of this size (0 = not solid)
+    int sparse; // record the zero extents of files
+    int chunk; // split files bigger than pack_upper_kb into chunks
+    struct ChunkedFile *chunked; // <chunked_length> files that have been split into chunks
+    uint32_t chunked_length;
+    struct HashIndex *chunked_index; // file hash -> ChunkedFile
+    const char *delta_bases[MAX_DELTA_BASES]; // trees of base releases to write delta blobs against
+    int n_delta_bases;
+    uint32_t delta_max_percent; // only keep deltas up to this size (relative to the full file)
+    struct SFMF_DeltaEntry *deltas;
+    uint32_t deltas_length;
+    const char *hash_cache_file; // keep hashes of input files across runs (or NULL)
+    const char *hash_cache_seed; // manifest of a previous build to seed the hash cache with
+    const char *previous_dir; // output directory of the previous release, to reuse packs and blobs from
+    uint32_t reused_blobs; // full blobs taken from previous_dir
+
     char *metadata_bytes;
     size_t metadata_length;
 };
@@ -73,11 +107,18 @@ void sfmf_print_hash(const char *filename, struct SFMF_FileHash *hash)
     SFMF_LOG("%s %s\n", tmp, filename ?: "");
 }
 
+// Content-defined chunks of a file that is stored as chunks (instead of as a full blob)
+struct ChunkedFile {
+    struct SFMF_FileHash hash; // of the whole file
+    struct SFMF_ChunkEntry *chunks;
+    uint32_t length;
+};
+
 struct PackEntry {
     struct FileList *files;
-    uint32_t size; // sum of entries' current minimum size
+    uint64_t size; // sum of entries' current minimum size
 
-    uint32_t packfile_size; // size of written pack file
+    uint64_t packfile_size; // size of written pack file
     struct SFMF_FileHash packfile_hash; // hash of packfile
 };
 
@@ -129,7 +170,7 @@ int packlist_try_insert(struct PackEntry *entry, void *user_data)
 {
     struct packlist_try_insert_t *insert = user_data;
 
-    int32_t new_size = fileentry_get_min_size(insert->source);
+    uint64_t new_size = fileentry_get_min_size(insert->source);
 
     if (entry->size + new_size <= insert->list->max_bin_size_bytes) {
         // Append new file entry to existing pack
@@ -154,7 +195,7 @@ void packlist_insert(struct PackList *list, struct FileEntry *source)
         struct PackEntry *entry = &(list->data[list->length++]);
         memset(entry, 0, sizeof(*entry));
 
-        int32_t new_size = fileentry_get_min_size(source);
+        uint64_t new_size = fileentry_get_min_size(source);
 
         entry->files = filelist_new();
         filelist_append_clone(entry->files, source);
@@ -169,6 +210,20 @@ int packlist_free_entry(struct PackEntry *entry, void *user_data)
     return 0;
 }
 
+// Moves all packs of other to the end of list, and frees other
+void packlist_extend(struct PackList *list, struct PackList *other)
+{
+    if (list->size < list->length + other->length) {
+        list = packlist_resize(list, list->length + other->length);
+    }
+
+    memcpy(list->data + list->length, other->data, other->length * sizeof(struct PackEntry));
+    list->length += other->length;
+
+    free(other->data);
+    free(other);
+}
+
 void packlist_free(struct PackList *list)
 {
     assert(list);
@@ -200,112 +255,240 @@ static int parse_int_into(const char *str, uint32_t *target)
     return 0;
 }
 
-static int parse_opts(int argc, char *argv[], struct PackOptions *opts)
-{
-    int expected_argc = 7;
+enum PackOptionKeys {
+    OPTION_SPILL_MEMORY = 0x100,
+    OPTION_SPILL_DISK,
+    OPTION_CODEC,
+    OPTION_BANDWIDTH,
+    OPTION_DECODE_SPEED,
+    OPTION_DICTIONARY,
+    OPTION_SOLID,
+    OPTION_NO_SPARSE,
+    OPTION_CHUNK,
+    OPTION_DELTA,
+    OPTION_DELTA_MAX,
+    OPTION_HASH_CACHE,
+    OPTION_HASH_CACHE_SEED,
+    OPTION_PREVIOUS,
+};
 
-    if (argc != expected_argc) {
-        SFMF_WARN("Invalid number of arguments: %d (expected %d)\n",
-                argc, expected_argc);
-        return 0;
-    }
+/* Default maximum size of files that are compressed with the dictionary */
+#define DICTIONARY_DEFAULT_MAX_KB 16
 
-    opts->in_dir = argv[1];
-    opts->out_dir = argv[2];
-    opts->meta_file = argv[3];
+/* Default uncompressed size of the blocks of solid packs */
+#define SOLID_DEFAULT_BLOCK_KB 1024
 
-    if (!parse_int_into(argv[4], &opts->blob_upper_kb)) {
-        SFMF_WARN("Not a valid size: '%s'\n", argv[4]);
-        return 0;
-    }
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct PackOptions *opts = state->input;
 
-    if (!parse_int_into(argv[5], &opts->pack_upper_kb)) {
-        SFMF_WARN("Not a valid size: '%s'\n", argv[5]);
-        return 0;
-    }
+    switch (key) {
+        case 'j':
+            opts->jobs = atoi(arg);
+            if (opts->jobs < 1) {
+                argp_error(state, "Invalid number of jobs: %s", arg);
+            }
+            break;
+        case OPTION_SPILL_MEMORY:
+            if (!parse_int_into(arg, &opts->spill_memory_mb)) {
+                argp_error(state, "Not a valid size: '%s'", arg);
+            }
+            break;
+        case OPTION_SPILL_DISK:
+            if (!parse_int_into(arg, &opts->spill_disk_mb)) {
+                argp_error(state, "Not a valid size: '%s'", arg);
+            }
+            break;
+        case OPTION_CODEC:
+            if (strcmp(arg, "auto") == 0) {
+                opts->costmodel->adaptive = 1;
+            } else if (!convert_codec_from_name(arg, &opts->costmodel->codec) ||
+                    opts->costmodel->codec == CONVERT_CODEC_ZSTD_DICT /* see --dictionary */) {
+                argp_error(state, "Unknown codec: '%s'", arg);
+            } else if (!convert_codec_available(opts->costmodel->codec)) {
+                argp_error(state, "Codec '%s' is not supported by this build", arg);
+            }
+            break;
+        case OPTION_BANDWIDTH:
+            {
+                uint32_t kib = 0;
+                if (!parse_int_into(arg, &kib) || kib == 0) {
+                    argp_error(state, "Not a valid speed: '%s'", arg);
+                }
+                opts->costmodel->bandwidth = kib * 1024.0;
+            }
+            break;
+        case OPTION_DECODE_SPEED:
+            if (!costmodel_set_decode_speed(opts->costmodel, arg)) {
+                argp_error(state, "Not a valid decode speed: '%s'", arg);
+            }
+            break;
+        case OPTION_DICTIONARY:
+            opts->dictionary_max_kb = DICTIONARY_DEFAULT_MAX_KB;
+            if (arg != NULL && (!parse_int_into(arg, &opts->dictionary_max_kb) || opts->dictionary_max_kb == 0)) {
+                argp_error(state, "Not a valid size: '%s'", arg);
+            } else if (!convert_codec_available(CONVERT_CODEC_ZSTD)) {
+                argp_error(state, "Dictionaries need zstd, which is not supported by this build");
+            }
+            break;
+        case OPTION_SOLID:
+            opts->solid_block_kb = SOLID_DEFAULT_BLOCK_KB;
+            if (arg != NULL && (!parse_int_into(arg, &opts->solid_block_kb) || opts->solid_block_kb == 0)) {
+                argp_error(state, "Not a valid size: '%s'", arg);
+            }
+            break;
+        case OPTION_NO_SPARSE:
+            opts->sparse = 0;
+            break;
+        case OPTION_CHUNK:
+            opts->chunk = 1;
+            break;
+        case OPTION_DELTA:
+            if (opts->n_delta_bases == MAX_DELTA_BASES) {
+                argp_error(state, "Too many base trees (maximum: %d)", MAX_DELTA_BASES);
+            }
+            opts->delta_bases[opts->n_delta_bases++] = arg;
+            break;
+        case OPTION_DELTA_MAX:
+            if (!parse_int_into(arg, &opts->delta_max_percent) || opts->delta_max_percent == 0 ||
+                    opts->delta_max_percent > 100) {
+                argp_error(state, "Not a valid percentage: '%s'", arg);
+            }
+            break;
+        case OPTION_HASH_CACHE:
+            opts->hash_cache_file = arg;
+            break;
+        case OPTION_HASH_CACHE_SEED:
+            opts->hash_cache_seed = arg;
+            break;
+        case OPTION_PREVIOUS:
+            opts->previous_dir = arg;
+            break;
+        case ARGP_KEY_ARG:
+            switch (state->arg_num) {
+                case 0:
+                    opts->in_dir = arg;
+                    break;
+                case 1:
+                    opts->out_dir = arg;
+                    break;
+                case 2:
+                    opts->meta_file = arg;
+                    break;
+                case 3:
+                    if (!parse_int_into(arg, &opts->blob_upper_kb)) {
+                        argp_error(state, "Not a valid size: '%s'", arg);
+                    }
+                    break;
+                case 4:
+                    if (!parse_int_into(arg, &opts->pack_upper_kb)) {
+                        argp_error(state, "Not a valid size: '%s'", arg);
+                    }
+                    break;
+                case 5:
+                    if (!parse_int_into(arg, &opts->avg_pack_kb)) {
+                        argp_error(state, "Not a valid size: '%s'", arg);
+                    }
+                    break;
+                default:
+                    argp_usage(state);
+                    break;
+            }
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num != 6) {
+                argp_usage(state);
+            }
 
-    if (!parse_int_into(argv[6], &opts->avg_pack_kb)) {
-        SFMF_WARN("Not a valid size: '%s'\n", argv[6]);
-        return 0;
-    }
+            if (opts->avg_pack_kb < opts->pack_upper_kb) {
+                argp_error(state, "Average pack size (%d) is smaller than upper pack limit (%d)",
+                        opts->avg_pack_kb, opts->pack_upper_kb);
+            }
 
-    if (opts->avg_pack_kb < opts->pack_upper_kb) {
-        SFMF_WARN("Average pack size (%d) is smaller than upper pack limit (%d)\n",
-                opts->avg_pack_kb, opts->pack_upper_kb);
-        return 0;
+            if (opts->hash_cache_seed != NULL && opts->hash_cache_file == NULL) {
+                argp_error(state, "--hash-cache-seed needs --hash-cache");
+            } else if (opts->hash_cache_seed != NULL && opts->costmodel->adaptive) {
+                // The manifest doesn't record which level each blob was compressed with
+                argp_error(state, "--hash-cache-seed can't be used with --codec=auto");
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
     }
 
-    return 1;
+    return 0;
 }
 
-void mark_duplicates(struct FileList *files)
+static void parse_opts(int argc, char *argv[], struct PackOptions *opts)
 {
-    uint32_t savings = 0;
-
-    for (int i=0; i<files->length; i++) {
-        struct FileEntry *a = &(files->data[i]);
-
-        /**
-         * We cannot skip duplicate (a->duplicate) files here, as we might
-         * find that those are hardlinked together with other files later;
-         * example:
-         *
-         *  File 1 (content "A") inode number 1              \
-         *  File 2 (content "A") inode number 2 \_ hardlink --- duplicate
-         *  File 3 (content "A") inode number 2 /            /
-         *
-         *  Step 1: Mark File 2 as duplicate (of File 1)
-         *  Step 2: Mark File 3 as duplicate (of File 1)
-         *
-         *  Step 3: Mark File 3 as hardlink of File 2
-         **/
-
-        if (a->st.st_size == 0 || !(S_ISREG(a->st.st_mode) || S_ISLNK(a->st.st_mode))) {
-            continue;
-        }
-
-        for (int j=i+1; j<files->length; j++) {
-            struct FileEntry *b = &(files->data[j]);
-            if (b->st.st_size == 0 || !(S_ISREG(b->st.st_mode) || S_ISLNK(b->st.st_mode))) {
-                continue;
-            }
-
-            if (sfmf_filehash_compare(&(a->hash), &(b->hash)) == 0) {
-                if (!b->duplicate) {
-                    SFMF_LOG("Marking as dup: %s (%d bytes)\n",
-                            b->filename, fileentry_get_min_size(b));
-                    savings += b->st.st_size;
-                    b->duplicate = 1;
-                }
-
-                if (a->st.st_ino == b->st.st_ino) {
-                    SFMF_LOG("Found hard link: %s <-> %s (storing reference)\n",
-                            a->filename, b->filename);
-
-                    // Assume we can only have regular files as hardlinks
-                    assert(S_ISREG(b->st.st_mode));
+    struct argp_option options[] = {
+        { "jobs", 'j', "N", 0, "Hash input files using N threads (default: number of CPUs)" },
+        { "spill-memory", OPTION_SPILL_MEMORY, "MIB", 0,
+            "Keep up to MIB MiB of compressed data in memory for reuse (default: 256)" },
+        { "spill-disk", OPTION_SPILL_DISK, "MIB", 0,
+            "Keep up to MIB MiB of compressed data in temporary files (default: 4096)" },
+        { "codec", OPTION_CODEC, "CODEC", 0,
+            "Compress blobs with CODEC: zlib, zstd or lz4, or pick the codec and level "
+            "with the lowest estimated cost per blob with auto (default: zlib)" },
+        { "bandwidth", OPTION_BANDWIDTH, "KIB", 0,
+            "Expected download speed in KiB/s, for --codec=auto (default: 1024)" },
+        { "decode-speed", OPTION_DECODE_SPEED, "CODEC=MIB", 0,
+            "Expected decompression speed of CODEC on the device in MiB/s, for --codec=auto" },
+        { "dictionary", OPTION_DICTIONARY, "KIB", OPTION_ARG_OPTIONAL,
+            "Train a zstd dictionary on all files of up to KIB KiB (default: 16), and compress "
+            "those files with it; the dictionary is stored in the manifest" },
+        { "solid", OPTION_SOLID, "KIB", OPTION_ARG_OPTIONAL,
+            "Write solid packs: compress the files of each pack together, in blocks of "
+            "KIB KiB (default: 1024)" },
+        { "no-sparse", OPTION_NO_SPARSE, 0, 0,
+            "Don't look for holes and runs of zeros in files (unpacking skips writing them)" },
+        { "chunk", OPTION_CHUNK, 0, 0,
+            "Split files bigger than <pack-upper> into content-defined chunks, which are stored "
+            "in packs; unpacking reuses the chunks of older versions of "
+            "these files in the local directories" },
+        { "delta", OPTION_DELTA, "DIR", 0,
+            "Also write delta blobs for files bigger than <pack-upper> against the files at the "
+            "same path in DIR (the tree of a base release, can be given multiple times); "
+            "unpacking uses them if the base file is found locally" },
+        { "delta-max", OPTION_DELTA_MAX, "PERCENT", 0,
+            "Only keep delta blobs of up to PERCENT of the stored size of the full file "
+            "(default: 50)" },
+        { "hash-cache", OPTION_HASH_CACHE, "FILE", 0,
+            "Keep the hashes of input files in FILE, so files that haven't changed since the "
+            "last run (same inode, size, mtime and ctime) aren't read again" },
+        { "hash-cache-seed", OPTION_HASH_CACHE_SEED, "MANIFEST", 0,
+            "Add the hashes of files in MANIFEST (built from the same tree with the same "
+            "--codec) that still have the same size and mtime to the hash cache" },
+        { "previous", OPTION_PREVIOUS, "DIR", 0,
+            "Keep the packs of the previous release in DIR (its output directory) whose files "
+            "are all still packed, and only put the other files into new packs; full blobs "
+            "found in DIR are reused too" },
+
+        { "<in-dir>", 0, 0, OPTION_DOC, "Path to source tree" },
+        { "<out-dir>", 0, 0, OPTION_DOC, "Output directory" },
+        { "<meta-file>", 0, 0, OPTION_DOC, "Textfile with metadata" },
+        { "<blob-upper>", 0, 0, OPTION_DOC, "Maximum total size for embedded blobs (in KiB)" },
+        { "<pack-upper>", 0, 0, OPTION_DOC, "Maximum size for files to be packed (in KiB)" },
+        { "<avg-pack>", 0, 0, OPTION_DOC, "Average target size of pack files (in KiB)" },
+        { 0 }
+    };
 
-                    // Store index of file that is the source of the hardlink; the source of
-                    // the hardlink will always be smaller than the current index, so that at
-                    // extraction time, the source file already exists.
-                    b->hardlink_index = i;
-                } else {
-                    // This is a file with duplicate contents, but not hardlinked with the
-                    // file which we have found to have duplicate contents
-                }
-            }
-        }
-    }
+    struct argp argp = {
+        options,
+        parse_opt,
+        "<in-dir> <out-dir> <meta-file> <blob-upper> <pack-upper> <avg-pack>",
+        "\nManifest and pack file generation tool."
+    };
 
-    SFMF_LOG("Savings of dup elimination: %d bytes\n", savings);
+    argp_parse(&argp, argc, argv, 0, 0, opts);
 }
 
 
 static int get_cutoff_min_size(struct FileEntry *entry, void *user_data)
 {
-    uint32_t *min_size = user_data;
+    uint64_t *min_size = user_data;
 
-    uint32_t size = fileentry_get_min_size(entry);
+    uint64_t size = fileentry_get_min_size(entry);
     if (size < *min_size) {
         *min_size = size;
     }
@@ -315,7 +498,7 @@ static int get_cutoff_min_size(struct FileEntry *entry, void *user_data)
 
 static int get_cutoff_max_size(struct FileEntry *entry, void *user_data)
 {
-    uint32_t *max_size = user_data;
+    uint64_t *max_size = user_data;
 
     if (entry->st.st_size > *max_size) {
         *max_size = entry->st.st_size;
@@ -329,8 +512,8 @@ static int get_cutoff_max_size(struct FileEntry *entry, void *user_data)
 }
 
 struct cutoff_search_t {
-    uint32_t cutoff;
-    uint32_t sum;
+    uint64_t cutoff;
+    uint64_t sum;
 };
 
 static int get_cutoff_sum(struct FileEntry *entry, void *user_data)
@@ -346,10 +529,10 @@ static int get_cutoff_sum(struct FileEntry *entry, void *user_data)
     return 0;
 }
 
-uint32_t get_cutoff_size_bytes(struct FileList *files, uint32_t blob_upper_bytes)
+uint64_t get_cutoff_size_bytes(struct FileList *files, uint64_t blob_upper_bytes)
 {
-    uint32_t min_size = UINT32_MAX;
-    uint32_t max_size = 0;
+    uint64_t min_size = UINT64_MAX;
+    uint64_t max_size = 0;
 
     (void)filelist_foreach(files, get_cutoff_min_size, &min_size);
     (void)filelist_foreach(files, get_cutoff_max_size, &max_size);
@@ -360,10 +543,10 @@ uint32_t get_cutoff_size_bytes(struct FileList *files, uint32_t blob_upper_bytes
     assert(max_size > 0);
     assert(min_size >= 0);
 
-    uint32_t center = (max_size + min_size) / 2;
-    uint32_t width = (max_size - min_size) / 2;
+    uint64_t center = min_size + (max_size - min_size) / 2;
+    uint64_t width = (max_size - min_size) / 2;
     // Best fit is the maximum center value that fits into the requirements
-    uint32_t best_fit = 0;
+    uint64_t best_fit = 0;
 
     while (width > 1) {
         struct cutoff_search_t search = { center, 0 };
@@ -393,10 +576,10 @@ struct bucketize_context_t {
     struct FileList *unpacked_files;
 
     // Maximum number of bytes for file to be directly included
-    uint32_t blob_cutoff_size_bytes;
+    uint64_t blob_cutoff_size_bytes;
 
     // Maximum number of bytes for file to be put into a pack
-    uint32_t pack_upper_bytes;
+    uint64_t pack_upper_bytes;
 };
 
 static int bucketize_list_entry(struct FileEntry *entry, void *user_data)
@@ -404,7 +587,7 @@ static int bucketize_list_entry(struct FileEntry *entry, void *user_data)
     struct bucketize_context_t *context = user_data;
 
     // Minimum possible size of entry (either compressed or uncompressed)
-    uint32_t size = fileentry_get_min_size(entry);
+    uint64_t size = fileentry_get_min_size(entry);
 
     if (entry->duplicate) {
         // Skip adding this, as it's a duplicate
@@ -438,13 +621,13 @@ static int bucketize_list_entry(struct FileEntry *entry, void *user_data)
     return 0;
 }
 
-void bucketize_file_list(struct FileList *files, uint32_t blob_cutoff_size_bytes,
-        uint32_t pack_upper_bytes, struct FileList **included_files,
+void bucketize_file_list(struct FileList *files, uint64_t blob_cutoff_size_bytes,
+        uint64_t pack_upper_bytes, struct FileList **included_files,
         struct FileList **packed_files, struct FileList **unpacked_files)
 {
     if (pack_upper_bytes <= blob_cutoff_size_bytes) {
         pack_upper_bytes = blob_cutoff_size_bytes + 1;
-        SFMF_LOG("Correcting pack upper bytes limit to %d KiB (blob cutoff size is %d KiB)\n",
+        SFMF_LOG("Correcting pack upper bytes limit to %" PRIu64 " KiB (blob cutoff size is %" PRIu64 " KiB)\n",
                 pack_upper_bytes / 1024, blob_cutoff_size_bytes / 1024);
     }
 
@@ -484,6 +667,308 @@ struct PackList *make_packs(struct FileList *packed_files, uint32_t avg_pack_byt
     return list;
 }
 
+struct chunk_file_t {
+    struct PackOptions *opts;
+    struct FileEntry *source;
+    uint64_t *zsizes; // zsize of each chunk, in order
+    uint32_t length;
+    uint32_t size;
+};
+
+// Compresses each chunk while the file is chunked, and keeps the data in the spill store
+static void chunk_file_compress(const char *data, struct SFMF_ChunkEntry *chunk, void *user_data)
+{
+    struct chunk_file_t *context = user_data;
+    enum ConvertFlags zconvert = context->source->zconvert;
+    uint64_t size = chunk->hash.size;
+    uint64_t zsize = size;
+
+    if (zconvert != CONVERT_FLAG_NONE) {
+        char *zdata = NULL;
+        size_t zlength = 0;
+        FILE *zfp = open_memstream(&zdata, &zlength);
+        assert(zfp != NULL);
+        convert_buffer_fp((char *)data, size, zfp, zconvert);
+        fclose(zfp);
+
+        zsize = zlength;
+        struct SpillStoreItem *item = spillstore_begin(context->opts->spill, zlength);
+        if (item) {
+            int res = fwrite(zdata, zlength, 1, item->fp);
+            assert(zlength == 0 || res == 1);
+            spillstore_commit(context->opts->spill, item, &(chunk->hash), zsize < size);
+        }
+        free(zdata);
+    }
+
+    if (context->length == context->size) {
+        context->size = context->size ? 2 * context->size : 16;
+        context->zsizes = realloc(context->zsizes, context->size * sizeof(uint64_t));
+    }
+    context->zsizes[context->length++] = zsize;
+}
+
+// Splits the files that would be stored as full blobs into content-defined chunks; the
+// chunks are added to the packed files (each distinct chunk once), and the chunked files
+// are removed from unpacked_files
+void chunk_files(struct PackOptions *opts, struct FileList *included_files,
+        struct FileList *packed_files, struct FileList **unpacked_files)
+{
+    struct FileList *files = *unpacked_files;
+
+    opts->chunked = calloc(files->length ?: 1, sizeof(struct ChunkedFile));
+    opts->chunked_index = hashindex_new(files->length);
+
+    // Chunks that are already stored (as a file or an earlier chunk) aren't stored again;
+    // new chunks are only added to the lists at the end, as the lists' data may move
+    struct HashIndex *known = hashindex_new(included_files->length + packed_files->length);
+    for (uint32_t i=0; i<included_files->length; i++) {
+        hashindex_insert(known, &(included_files->data[i].hash), &(included_files->data[i]));
+    }
+    for (uint32_t i=0; i<packed_files->length; i++) {
+        hashindex_insert(known, &(packed_files->data[i].hash), &(packed_files->data[i]));
+    }
+
+    struct FileList *chunks = filelist_new();
+    uint32_t total = 0;
+    uint64_t stored_bytes = 0;
+
+    for (uint32_t i=0; i<files->length; i++) {
+        struct FileEntry *source = &(files->data[i]);
+        struct ChunkedFile *chunked = &(opts->chunked[opts->chunked_length]);
+
+        chunked->hash = source->hash;
+        if (hashindex_insert(opts->chunked_index, &(chunked->hash), chunked) != NULL) {
+            continue;
+        }
+        opts->chunked_length++;
+
+        struct chunk_file_t context = { opts, source, NULL, 0, 0 };
+        chunked->length = chunker_scan_file(source->filename, &(chunked->chunks), chunk_file_compress, &context);
+        assert(context.length == chunked->length);
+        total += chunked->length;
+
+        for (uint32_t j=0; j<chunked->length; j++) {
+            struct SFMF_ChunkEntry *chunk = &(chunked->chunks[j]);
+            if (hashindex_insert(known, &(chunk->hash), chunk) != NULL) {
+                continue;
+            }
+
+            struct FileEntry entry = *source;
+            entry.st.st_size = chunk->hash.size;
+            entry.hash = chunk->hash;
+            entry.offset = chunk->offset;
+            entry.zsize = context.zsizes[j];
+            entry.duplicate = 0;
+            entry.hardlink_index = -1;
+            entry.extents = NULL;
+            entry.extents_length = 0;
+            filelist_append_clone(chunks, &entry);
+
+            stored_bytes += fileentry_get_min_size(&entry);
+        }
+
+        SFMF_LOG("Chunked file %s: %" PRIu32 " chunks\n", source->filename, chunked->length);
+        free(context.zsizes);
+    }
+
+    hashindex_free(known);
+
+    // Chunks are always packed (they are found through the hash index); including them
+    // in the manifest would make everyone download them, even if they have them locally
+    for (uint32_t i=0; i<chunks->length; i++) {
+        filelist_append_clone(packed_files, &(chunks->data[i]));
+    }
+
+    SFMF_LOG("Chunked %" PRIu32 " files into %" PRIu32 " chunks, %" PRIu32 " of them stored (%" PRIu64 " bytes)\n",
+            opts->chunked_length, total, chunks->length, stored_bytes);
+
+    filelist_free(chunks);
+    filelist_free(files);
+    *unpacked_files = filelist_new();
+}
+
+/* Maximum size of the trained dictionary (the zstd default) */
+#define DICTIONARY_CAPACITY (112 * 1024)
+
+/* Total size of training samples, zstd recommends about 100 times the dictionary size */
+#define DICTIONARY_SAMPLES_SIZE (100 * DICTIONARY_CAPACITY)
+
+// Checksum of everything that the zsize (and conversion) of a file depends on
+static uint32_t get_hash_cache_config(struct PackOptions *opts)
+{
+    struct CostModel *model = opts->costmodel;
+
+    char tmp[512];
+    int length = snprintf(tmp, sizeof(tmp), "adaptive=%d codec=%d bandwidth=%a dictionary=%" PRIu64 ":%08" PRIx32,
+            model->adaptive, model->codec, model->bandwidth, model->dictionary_max_size,
+            sfmf_section_checksum(opts->dictionary, opts->dictionary_length));
+    for (int i=0; i<CONVERT_CODEC_COUNT; i++) {
+        length += snprintf(tmp + length, sizeof(tmp) - length, " %a", model->decode_speed[i]);
+    }
+    assert(length < sizeof(tmp));
+
+    return sfmf_section_checksum(tmp, length);
+}
+
+static void train_dictionary(struct PackOptions *opts)
+{
+    uint64_t max_size = (uint64_t)opts->dictionary_max_kb * 1024;
+
+    struct FileList *list = extend_file_list(NULL, opts->in_dir, FILE_LIST_NONE);
+
+    uint64_t total = 0;
+    for (int i=0; i<list->length; i++) {
+        struct stat *st = &(list->data[i].st);
+        if (S_ISREG(st->st_mode) && st->st_size > 0 && st->st_size <= max_size) {
+            total += st->st_size;
+        }
+    }
+
+    // With too many small files, use every n-th one as sample
+    uint64_t step = (total + DICTIONARY_SAMPLES_SIZE - 1) / DICTIONARY_SAMPLES_SIZE ?: 1;
+
+    char *samples = malloc(DICTIONARY_SAMPLES_SIZE + max_size);
+    size_t *sample_sizes = calloc(list->length ?: 1, sizeof(size_t));
+    size_t samples_length = 0;
+    uint32_t count = 0;
+    uint64_t candidates = 0;
+    for (int i=0; i<list->length && samples_length < DICTIONARY_SAMPLES_SIZE; i++) {
+        struct FileEntry *entry = &(list->data[i]);
+        if (!S_ISREG(entry->st.st_mode) || entry->st.st_size == 0 || entry->st.st_size > max_size ||
+                (candidates++ % step) != 0) {
+            continue;
+        }
+
+        FILE *fp = fopen(entry->filename, "rb");
+        assert(fp != NULL);
+        size_t length = fread(samples + samples_length, 1, entry->st.st_size, fp);
+        fclose(fp);
+
+        samples_length += length;
+        sample_sizes[count++] = length;
+    }
+
+    opts->dictionary = malloc(DICTIONARY_CAPACITY);
+    opts->dictionary_length = convert_train_dictionary(samples, sample_sizes, count,
+            opts->dictionary, DICTIONARY_CAPACITY);
+
+    free(sample_sizes);
+    free(samples);
+    filelist_free(list);
+
+    if (opts->dictionary_length == 0 || !convert_set_dictionary(opts->dictionary, opts->dictionary_length)) {
+        SFMF_WARN("Could not train a dictionary from %" PRIu32 " files, not using one\n", count);
+        free(opts->dictionary);
+        opts->dictionary = NULL;
+        opts->dictionary_length = 0;
+        return;
+    }
+
+    opts->costmodel->dictionary_max_size = max_size;
+    SFMF_LOG("Trained a %zu byte dictionary from %" PRIu32 " files (%zu bytes)\n",
+            opts->dictionary_length, count, samples_length);
+}
+
+// Writes the data of entry (the whole file, or a chunk of it) to fp, converted with flags
+static void write_file_data(struct FileEntry *entry, FILE *fp, enum ConvertFlags flags)
+{
+    FILE *infile = fopen(entry->filename, "rb");
+    assert(infile != NULL);
+
+    int res = fseeko(infile, entry->offset, SEEK_SET);
+    assert(res == 0);
+    res = convert_file_range_fp(infile, entry->hash.size, fp, flags);
+    assert(res == 0);
+
+    fclose(infile);
+}
+
+static void write_compressed_file(struct PackOptions *opts, struct FileEntry *entry, FILE *fp)
+{
+    // Reuse the compressed data from calculating the zsize if we still have it
+    if (spillstore_write(opts->spill, &(entry->hash), fp) == 0) {
+        return;
+    }
+
+    write_file_data(entry, fp, entry->zconvert);
+}
+
+/* Size of reads when verifying files of the previous release */
+#define PREVIOUS_READ_SIZE (64 * 1024)
+
+// Returns 1 if the data of filename (stored with blob_flags) has the given hash
+static int verify_previous_file(const char *filename, uint32_t blob_flags, struct SFMF_FileHash *expected)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    struct ConvertHasher *hasher = convert_hasher_new(convert_flags_for_blob(blob_flags));
+    char *buf = malloc(PREVIOUS_READ_SIZE);
+    int res = 0;
+    size_t length;
+    while (res == 0 && (length = fread(buf, 1, PREVIOUS_READ_SIZE, fp)) > 0) {
+        res = convert_hasher_update(hasher, buf, length);
+    }
+
+    struct SFMF_FileHash hash;
+    res = convert_hasher_finish(hasher, &hash) || res || ferror(fp);
+    convert_hasher_free(hasher);
+    free(buf);
+    fclose(fp);
+
+    return (res == 0 && sfmf_filehash_compare(&hash, expected) == 0);
+}
+
+// Returns the path of name in the output directory of the previous release (to be freed)
+static char *get_previous_filename(struct PackOptions *opts, const char *name)
+{
+    char *filename = malloc(strlen(opts->previous_dir) + 1 /* '/' */ + strlen(name) + 1 /* '\0' */);
+    sprintf(filename, "%s/%s", opts->previous_dir, name);
+    return filename;
+}
+
+// Returns 1 if name exists in the previous release with size bytes, and its data
+// (stored with blob_flags) has the given hash
+static int check_previous_file(struct PackOptions *opts, const char *name, uint64_t size,
+        uint32_t blob_flags, struct SFMF_FileHash *hash)
+{
+    char *filename = get_previous_filename(opts, name);
+
+    struct stat st;
+    int result = (stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == size &&
+            verify_previous_file(filename, blob_flags, hash));
+
+    free(filename);
+
+    return result;
+}
+
+// Hardlinks name from the previous release into the output directory (or copies it, if
+// that's not possible)
+static void link_previous_file(struct PackOptions *opts, const char *name)
+{
+    char *source = get_previous_filename(opts, name);
+    char *target = malloc(strlen(opts->out_dir) + 1 /* '/' */ + strlen(name) + 1 /* '\0' */);
+    sprintf(target, "%s/%s", opts->out_dir, name);
+
+    struct stat st, st2;
+    if (stat(source, &st) == 0 && stat(target, &st2) == 0 && st2.st_dev == st.st_dev && st2.st_ino == st.st_ino) {
+        // Already there (e.g. writing to the directory of the previous release)
+    } else {
+        SFMF_LOG("Reusing %s from previous release\n", name);
+        unlink(target);
+        if (link(source, target) != 0) {
+            convert_file(source, target, CONVERT_FLAG_NONE);
+        }
+    }
+
+    free(target);
+    free(source);
+}
+
 static int write_full_blob(struct FileEntry *entry, void *user_data)
 {
     struct PackOptions *opts = user_data;
@@ -500,13 +985,21 @@ static int write_full_blob(struct FileEntry *entry, void *user_data)
 
     sprintf(filename, "%s/%s.blob", opts->out_dir, tmp);
 
-    int32_t min_size = fileentry_get_min_size(entry);
-    if (min_size == entry->st.st_size) {
+    uint64_t min_size = fileentry_get_min_size(entry);
+    uint32_t blob_flags = (min_size == entry->st.st_size) ? BLOB_FLAG_NONE : convert_flags_blob_flags(entry->zconvert);
+    const char *name = filename + strlen(opts->out_dir) + 1;
+    if (opts->previous_dir != NULL && check_previous_file(opts, name, min_size, blob_flags, &(entry->hash))) {
+        link_previous_file(opts, name);
+        opts->reused_blobs++;
+    } else if (min_size == entry->st.st_size) {
         // Write uncompressed
         convert_file(entry->filename, filename, CONVERT_FLAG_NONE);
     } else {
         // Write compressed
-        convert_file(entry->filename, filename, CONVERT_FLAG_ZCOMPRESS);
+        FILE *fp = fopen(filename, "wb");
+        assert(fp != NULL);
+        write_compressed_file(opts, entry, fp);
+        fclose(fp);
     }
 
     free(filename);
@@ -514,6 +1007,110 @@ static int write_full_blob(struct FileEntry *entry, void *user_data)
     return 0;
 }
 
+static void write_pack_blob(struct PackOptions *opts, struct FileEntry *fentry, FILE *fp)
+{
+    uint64_t item_payload = fileentry_get_min_size(fentry);
+
+    int zcompress = (fentry->zsize == item_payload);
+
+    SFMF_LOG("Packing file %s (zcompress=%d)\n",
+             fentry->filename, zcompress);
+
+    if (zcompress) {
+        write_compressed_file(opts, fentry, fp);
+    } else {
+        write_file_data(fentry, fp, CONVERT_FLAG_NONE);
+    }
+}
+
+// Blocks of solid packs are compressed with the configured codec (with --codec=auto, zstd if available)
+static enum ConvertFlags get_solid_block_convert(struct PackOptions *opts)
+{
+    if (!opts->costmodel->adaptive) {
+        return convert_flags_compress(opts->costmodel->codec);
+    }
+
+    if (convert_codec_available(CONVERT_CODEC_ZSTD)) {
+        return convert_flags_compress(CONVERT_CODEC_ZSTD);
+    }
+
+    return CONVERT_FLAG_ZCOMPRESS;
+}
+
+// Splits the files of a solid pack into blocks of up to block_size bytes (unless a single
+// file is bigger); stores the index of the first file of each block in firsts, followed
+// by files->length, and returns the number of blocks
+static uint32_t get_solid_blocks(struct FileList *files, uint64_t block_size, uint32_t *firsts)
+{
+    uint32_t count = 0;
+    uint64_t current = 0;
+
+    for (uint32_t i=0; i<files->length; i++) {
+        uint64_t size = files->data[i].hash.size;
+        if (i == 0 || current + size > block_size) {
+            firsts[count++] = i;
+            current = 0;
+        }
+        current += size;
+    }
+
+    firsts[count] = files->length;
+    return count;
+}
+
+// Writes files [first, last) of a solid pack as one block, fills in all of block except the offset
+static void write_solid_block(struct PackOptions *opts, struct FileList *files, uint32_t first, uint32_t last,
+        FILE *fp, struct SFPF_BlockEntry *block)
+{
+    if (last - first == 1) {
+        // A single file is stored as in non-solid packs (this reuses its compressed data)
+        struct FileEntry *fentry = &(files->data[first]);
+        uint64_t item_payload = fileentry_get_min_size(fentry);
+
+        write_pack_blob(opts, fentry, fp);
+
+        block->flags = (fentry->zsize == item_payload) ? convert_flags_blob_flags(fentry->zconvert) : BLOB_FLAG_NONE;
+        block->size = item_payload;
+        block->uncompressed_size = fentry->hash.size;
+        return;
+    }
+
+    char *data = NULL;
+    size_t length = 0;
+    FILE *dfp = open_memstream(&data, &length);
+    assert(dfp != NULL);
+    for (uint32_t i=first; i<last; i++) {
+        struct FileEntry *fentry = &(files->data[i]);
+        SFMF_LOG("Packing file %s (solid)\n", fentry->filename);
+
+        write_file_data(fentry, dfp, CONVERT_FLAG_NONE);
+    }
+    fclose(dfp);
+
+    char *zdata = NULL;
+    size_t zlength = 0;
+    FILE *zfp = open_memstream(&zdata, &zlength);
+    assert(zfp != NULL);
+    enum ConvertFlags flags = get_solid_block_convert(opts);
+    convert_buffer_fp(data, length, zfp, flags);
+    fclose(zfp);
+
+    block->uncompressed_size = length;
+    if (zlength < length) {
+        block->flags = convert_flags_blob_flags(flags);
+        block->size = zlength;
+    } else {
+        block->flags = BLOB_FLAG_NONE;
+        block->size = length;
+    }
+
+    int res = fwrite(block->flags ? zdata : data, block->size, 1, fp);
+    assert(block->size == 0 || res == 1);
+
+    free(zdata);
+    free(data);
+}
+
 int write_pack(struct PackEntry *entry, void *user_data)
 {
     struct PackOptions *opts = user_data;
@@ -530,10 +1127,16 @@ int write_pack(struct PackEntry *entry, void *user_data)
     };
     SFMF_LOG("Putting %d files into this pack\n", header.blobs_length);
 
-    uint32_t blob_size = header.blobs_length * sizeof(struct SFMF_BlobEntry);
-    uint32_t payload_size = entry->size;
+    uint32_t version = sfpf_blobentry_version(header.version);
+    uint64_t blob_size = (uint64_t)header.blobs_length * sfmf_blobentry_size(version);
 
-    entry->packfile_size = sizeof(header) + header.metadata_size + blob_size + payload_size;
+    // In solid packs, blobs are stored in blocks (see sfpf.h), otherwise there are no blocks
+    int solid = (opts->solid_block_kb != 0);
+    uint32_t *block_firsts = calloc(header.blobs_length + 1, sizeof(uint32_t));
+    uint32_t blocks_length = solid ? get_solid_blocks(entry->files, (uint64_t)opts->solid_block_kb * 1024,
+            block_firsts) : 0;
+    struct SFPF_BlockEntry *blocks = calloc(blocks_length ?: 1, sizeof(struct SFPF_BlockEntry));
+    uint64_t block_index_size = sizeof(uint32_t) + (uint64_t)blocks_length * sfpf_blockentry_size();
 
     char *tmp = malloc(strlen(opts->out_dir) + strlen("/pack.tmp") + 1 /* '\0' */);
     sprintf(tmp, "%s/pack.tmp", opts->out_dir);
@@ -549,48 +1152,74 @@ int write_pack(struct PackEntry *entry, void *user_data)
     assert(res == 1);
 
     // Write blob entry index
-    uint32_t blob_offset = sizeof(header) + header.metadata_size + blob_size;
+    uint64_t blob_offset = solid ? 0 : sizeof(header) + header.metadata_size + blob_size + block_index_size;
     for (int i=0; i<header.blobs_length; i++) {
         struct FileEntry *fentry = &(entry->files->data[i]);
         assert(S_ISREG(fentry->st.st_mode));
         sfmf_print_hash(fentry->filename, &(fentry->hash));
 
-        uint32_t item_payload = fileentry_get_min_size(fentry);
+        uint64_t item_payload = fileentry_get_min_size(fentry);
 
         struct SFMF_BlobEntry entry;
         memcpy(&(entry.hash), &(fentry->hash), sizeof(struct SFMF_FileHash));
-        entry.flags = (fentry->zsize == item_payload) ? BLOB_FLAG_ZCOMPRESSED : 0;
+        if (solid) {
+            entry.flags = BLOB_FLAG_NONE;
+            entry.size = fentry->hash.size;
+        } else {
+            entry.flags = (fentry->zsize == item_payload) ? convert_flags_blob_flags(fentry->zconvert) : BLOB_FLAG_NONE;
+            entry.size = item_payload;
+        }
         entry.offset = blob_offset;
-        entry.size = item_payload;
 
-        res = sfmf_blobentry_write(&entry, fp);
+        res = sfmf_blobentry_write(&entry, version, fp);
         assert(res == 1);
 
-        blob_offset += item_payload;
+        blob_offset += entry.size;
     }
 
-    // Write blobs
-    for (int i=0; i<header.blobs_length; i++) {
-        struct FileEntry *fentry = &(entry->files->data[i]);
-        uint32_t item_payload = fileentry_get_min_size(fentry);
+    // Write block index (filled in after writing the blocks)
+    uint32_t blocks_length_n = htonl(blocks_length);
+    res = fwrite(&blocks_length_n, sizeof(blocks_length_n), 1, fp);
+    assert(res == 1);
+    off_t block_index_offset = ftello(fp);
+    for (uint32_t i=0; i<blocks_length; i++) {
+        res = sfpf_blockentry_write(&(blocks[i]), fp);
+        assert(res == 1);
+    }
 
-        int zcompress = (fentry->zsize == item_payload);
+    // Write blobs
+    if (solid) {
+        for (uint32_t i=0; i<blocks_length; i++) {
+            blocks[i].offset = ftello(fp);
+            write_solid_block(opts, entry->files, block_firsts[i], block_firsts[i+1], fp, &(blocks[i]));
+        }
 
-        SFMF_LOG("Packing file %s (zcompress=%d)\n",
-                 fentry->filename, zcompress);
+        res = fseeko(fp, block_index_offset, SEEK_SET);
+        assert(res == 0);
+        for (uint32_t i=0; i<blocks_length; i++) {
+            res = sfpf_blockentry_write(&(blocks[i]), fp);
+            assert(res == 1);
+        }
+        res = fseeko(fp, 0, SEEK_END);
+        assert(res == 0);
 
-        FILE *infile = fopen(fentry->filename, "rb");
-        assert(infile != NULL);
-        convert_file_fp(infile, fp, zcompress ? CONVERT_FLAG_ZCOMPRESS : CONVERT_FLAG_NONE);
-        fclose(infile);
+        SFMF_LOG("Solid pack: %" PRIu32 " blocks\n", blocks_length);
+    } else {
+        for (int i=0; i<header.blobs_length; i++) {
+            write_pack_blob(opts, &(entry->files->data[i]), fp);
+        }
     }
 
+    entry->packfile_size = ftello(fp);
     fclose(fp);
 
+    free(blocks);
+    free(block_firsts);
+
     struct FileEntry e;
     memset(&e, 0, sizeof(e));
     e.filename = tmp;
-    fileentry_calculate_zsize_hash(&e);
+    fileentry_calculate_hash(&e);
     e.hash.size = entry->packfile_size;
 
     sfmf_print_hash(tmp, &(e.hash));
@@ -612,6 +1241,144 @@ int write_pack(struct PackEntry *entry, void *user_data)
     return 0;
 }
 
+// Returns 1 if a blob or block of pack file name (of the previous release) is compressed with a dictionary
+static int pack_uses_dictionary(struct PackOptions *opts, const char *name)
+{
+    char *filename = get_previous_filename(opts, name);
+    struct PackReader *reader = packreader_open(filename);
+    int result = 0;
+
+    for (uint32_t i=0; i<reader->header.blobs_length; i++) {
+        result = result || (reader->entries[i].flags == BLOB_FLAG_ZSTD_DICT);
+    }
+    for (uint32_t i=0; i<reader->blocks_length; i++) {
+        result = result || (reader->blocks[i].flags == BLOB_FLAG_ZSTD_DICT);
+    }
+
+    packreader_close(reader);
+    free(filename);
+
+    return result;
+}
+
+// Takes the packs of the previous release whose files are all in *packed_files (and
+// haven't been taken by another pack yet), and removes those files from *packed_files;
+// returns the list of reused packs (with their pack files linked to the output directory)
+struct PackList *reuse_packs(struct PackOptions *opts, struct FileList **packed_files)
+{
+    char *manifest = malloc(strlen(opts->previous_dir) + strlen("/manifest.sfmf") + 1 /* '\0' */);
+    sprintf(manifest, "%s/manifest.sfmf", opts->previous_dir);
+    struct ManifestReader *reader = manifestreader_open(manifest);
+    if (reader == NULL) {
+        SFMF_FAIL_AND_EXIT("Could not read manifest of previous release: %s\n", manifest);
+    }
+    free(manifest);
+
+    // Packs with blobs compressed with another dictionary can't be used with ours
+    size_t dictionary_length = 0;
+    const char *dictionary = manifestreader_get_dictionary(reader, &dictionary_length);
+    int same_dictionary = (dictionary_length == opts->dictionary_length &&
+            (dictionary_length == 0 || memcmp(dictionary, opts->dictionary, dictionary_length) == 0));
+
+    struct FileList *files = *packed_files;
+    struct HashIndex *index = hashindex_new(files->length);
+    for (uint32_t i=0; i<files->length; i++) {
+        (void)hashindex_insert(index, &(files->data[i].hash), &(files->data[i]));
+    }
+    char *taken = calloc(files->length ?: 1, 1);
+
+    struct PackList *list = packlist_new(opts->avg_pack_kb * 1024);
+    struct FileEntry **sources = NULL;
+    uint32_t sources_size = 0;
+
+    for (uint32_t i=0; i<reader->header.packs_length; i++) {
+        struct SFMF_PackEntry pack;
+        manifestreader_get_pack(reader, i, &pack);
+
+        struct SFMF_FileHash *hashes = calloc(pack.count ?: 1, sizeof(struct SFMF_FileHash));
+        manifestreader_get_pack_hashes(reader, &pack, hashes);
+
+        if (sources_size < pack.count) {
+            sources_size = pack.count;
+            sources = realloc(sources, sources_size * sizeof(struct FileEntry *));
+        }
+
+        // All files of the pack must still be packed (and not be taken by another pack);
+        // they are marked as taken here, and unmarked if the pack can't be reused
+        uint32_t found = 0;
+        while (found < pack.count) {
+            struct FileEntry *source = hashindex_lookup(index, &(hashes[found]));
+            if (source == NULL || taken[source - files->data]) {
+                break;
+            }
+            taken[source - files->data] = 1;
+            sources[found++] = source;
+        }
+        free(hashes);
+        int complete = (found == pack.count);
+
+        char tmp[512];
+        int res = sfmf_filehash_format(&(pack.hash), tmp, sizeof(tmp));
+        assert(res != 0);
+        strcat(tmp, ".pack");
+
+        if (!complete) {
+            SFMF_DEBUG("Not reusing %s from previous release (files have changed)\n", tmp);
+        } else if (!check_previous_file(opts, tmp, pack.hash.size, BLOB_FLAG_NONE, &(pack.hash))) {
+            SFMF_WARN("Pack %s of previous release is missing or damaged, not reusing it\n", tmp);
+            complete = 0;
+        } else if (!same_dictionary && pack_uses_dictionary(opts, tmp)) {
+            SFMF_DEBUG("Not reusing %s from previous release (different dictionary)\n", tmp);
+            complete = 0;
+        }
+
+        if (!complete) {
+            for (uint32_t j=0; j<found; j++) {
+                taken[sources[j] - files->data] = 0;
+            }
+            continue;
+        }
+
+        link_previous_file(opts, tmp);
+
+        if (list->size < list->length + 1) {
+            list = packlist_resize(list, list->size * 2);
+        }
+
+        struct PackEntry *entry = &(list->data[list->length++]);
+        memset(entry, 0, sizeof(*entry));
+        entry->files = filelist_new();
+        for (uint32_t j=0; j<pack.count; j++) {
+            filelist_append_clone(entry->files, sources[j]);
+            entry->size += fileentry_get_min_size(sources[j]);
+        }
+        entry->packfile_size = pack.hash.size;
+        entry->packfile_hash = pack.hash;
+    }
+
+    // Only the files that aren't in a reused pack need to be packed
+    struct FileList *remaining = filelist_new();
+    for (uint32_t i=0; i<files->length; i++) {
+        if (!taken[i]) {
+            filelist_append_clone(remaining, &(files->data[i]));
+        }
+    }
+
+    SFMF_LOG("Reusing %" PRIu32 " of %" PRIu32 " packs of previous release (%" PRIu32 " files), "
+            "%" PRIu32 " files left to pack\n", list->length, reader->header.packs_length,
+            files->length - remaining->length, remaining->length);
+
+    free(sources);
+    free(taken);
+    hashindex_free(index);
+    manifestreader_close(reader);
+
+    filelist_free(files);
+    *packed_files = remaining;
+
+    return list;
+}
+
 static const char *get_file_basename(struct PackOptions *opts, const char *filename)
 {
     const char *result = filename + strlen(opts->in_dir);
@@ -629,6 +1396,161 @@ static const char *get_file_basename(struct PackOptions *opts, const char *filen
     return result;
 }
 
+// Writes a delta blob for entry against base_filename (whose hash is base_hash), if it
+// is small enough; returns 1 if one was written (and added to opts->deltas)
+static int write_delta(struct PackOptions *opts, struct FileEntry *entry, const char *base_filename,
+        struct SFMF_FileHash *base_hash)
+{
+    char *data = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&data, &size);
+    assert(fp != NULL);
+    int res = delta_encode_file(base_filename, entry->filename, fp);
+    fclose(fp);
+
+    if (res != 0) {
+        SFMF_WARN("Could not write delta for %s from %s\n", entry->filename, base_filename);
+        free(data);
+        return 0;
+    }
+
+    struct SFMF_DeltaEntry delta;
+    memset(&delta, 0, sizeof(delta));
+    delta.target = entry->hash;
+    delta.base = *base_hash;
+
+    struct ConvertHasher *hasher = convert_hasher_new(CONVERT_FLAG_NONE);
+    res = convert_hasher_update(hasher, data, size) || convert_hasher_finish(hasher, &(delta.delta));
+    assert(res == 0);
+    convert_hasher_free(hasher);
+
+    // Deltas are compressed with the default codec, or stored if that doesn't pay off
+    enum ConvertFlags zconvert = convert_flags_compress(opts->costmodel->codec);
+    char *zdata = NULL;
+    size_t zsize = 0;
+    fp = open_memstream(&zdata, &zsize);
+    assert(fp != NULL);
+    res = convert_buffer_fp(data, size, fp, zconvert);
+    assert(res == 0);
+    fclose(fp);
+
+    if (zsize >= size) {
+        zconvert = CONVERT_FLAG_NONE;
+        free(zdata);
+        zdata = data;
+        zsize = size;
+        data = NULL;
+    }
+    delta.flags = convert_flags_blob_flags(zconvert);
+
+    uint64_t full_size = fileentry_get_min_size(entry);
+    int keep = ((uint64_t)zsize * 100 <= full_size * opts->delta_max_percent);
+    SFMF_LOG("Delta for %s from %s: %zu bytes (%" PRIu64 "%% of %" PRIu64 ")%s\n", entry->filename,
+            base_filename, zsize, full_size ? (uint64_t)zsize * 100 / full_size : 0, full_size,
+            keep ? "" : ", not kept");
+
+    if (keep) {
+        char tmp[512];
+        res = sfmf_filehash_format(&(delta.delta), tmp, sizeof(tmp));
+        assert(res != 0);
+
+        char *filename = malloc(strlen(opts->out_dir) + 1 /* '/' */ + strlen(tmp) + strlen(".delta") + 1 /* '\0' */);
+        sprintf(filename, "%s/%s.delta", opts->out_dir, tmp);
+
+        fp = fopen(filename, "wb");
+        if (fp == NULL || (zsize > 0 && fwrite(zdata, zsize, 1, fp) != 1) || fclose(fp) != 0) {
+            SFMF_FAIL_AND_EXIT("Could not write %s: %s\n", filename, strerror(errno));
+        }
+        free(filename);
+
+        opts->deltas = realloc(opts->deltas, (opts->deltas_length + 1) * sizeof(struct SFMF_DeltaEntry));
+        opts->deltas[opts->deltas_length++] = delta;
+    }
+
+    free(zdata);
+    free(data);
+
+    return keep;
+}
+
+// Writes delta blobs for the files that are stored as full blobs, against the files
+// at the same path in the base trees (if they have changed)
+void write_deltas(struct PackOptions *opts, struct FileList *unpacked_files)
+{
+    uint64_t full_bytes = 0;
+    uint32_t count = 0;
+
+    for (uint32_t i=0; i<unpacked_files->length; i++) {
+        struct FileEntry *entry = &(unpacked_files->data[i]);
+        struct SFMF_FileHash base_hashes[MAX_DELTA_BASES];
+        int n_base_hashes = 0;
+
+        for (int j=0; j<opts->n_delta_bases; j++) {
+            char base_filename[PATH_MAX];
+            snprintf(base_filename, sizeof(base_filename), "%s/%s", opts->delta_bases[j],
+                    get_file_basename(opts, entry->filename));
+
+            struct stat st;
+            if (lstat(base_filename, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+                continue;
+            }
+
+            struct SFMF_FileHash base_hash;
+            int res = convert_file_zsize_hash(base_filename, &base_hash, NULL);
+            assert(res == 0);
+
+            // Unchanged files don't need a delta, and each base file needs only one
+            int known = (sfmf_filehash_compare(&base_hash, &(entry->hash)) == 0);
+            for (int k=0; !known && k<n_base_hashes; k++) {
+                known = (sfmf_filehash_compare(&base_hash, &(base_hashes[k])) == 0);
+            }
+            if (known) {
+                continue;
+            }
+            base_hashes[n_base_hashes++] = base_hash;
+
+            if (write_delta(opts, entry, base_filename, &base_hash)) {
+                full_bytes += fileentry_get_min_size(entry);
+                count++;
+            }
+        }
+    }
+
+    SFMF_LOG("Wrote %" PRIu32 " delta blobs (for %" PRIu64 " KiB of full blobs)\n", count, full_bytes / 1024);
+}
+
+/* Number of entries in the section table (metadata to deltas) */
+#define MANIFEST_SECTIONS 11
+
+// Manifest sections are collected in memory, so they can be written compressed
+struct ManifestSection {
+    char *data;
+    size_t size;
+    FILE *fp;
+};
+
+static FILE *manifest_section_begin(struct ManifestSection *section)
+{
+    section->data = NULL;
+    section->size = 0;
+    section->fp = open_memstream(&(section->data), &(section->size));
+    assert(section->fp != NULL);
+
+    return section->fp;
+}
+
+static void manifest_section_end(struct ManifestSection *section, uint32_t version, FILE *fp,
+        struct SFMF_SectionEntry *entry)
+{
+    int res = fclose(section->fp);
+    assert(res == 0);
+
+    res = sfmf_section_write(section->data, section->size, version, fp, entry);
+    assert(res == 1);
+
+    free(section->data);
+}
+
 void write_manifest(struct PackOptions *opts, struct FileList *files,
         struct PackList *pack_list, struct FileList *included_files)
 {
@@ -638,12 +1560,41 @@ void write_manifest(struct PackOptions *opts, struct FileList *files,
 
     uint32_t filename_table_size = 0;
 
-    // Calculate size of filename table
+    // Calculate size of (front-coded) filename table
+    const char *previous = NULL;
     for (int i=0; i<files->length; i++) {
         struct FileEntry *source = &(files->data[i]);
         const char *filename = get_file_basename(opts, source->filename);
-        filename_table_size += strlen(filename) + 1;
+        uint32_t shared = sfmf_filename_shared_length(i, previous, filename);
+        filename_table_size += sfmf_filename_record_size(filename, shared);
+        previous = filename;
+    }
+
+    // Build the hash index of included blobs and packed files
+    uint32_t hash_index_length = included_files->length;
+    for (int i=0; i<pack_list->length; i++) {
+        hash_index_length += pack_list->data[i].files->length;
+    }
+
+    struct SFMF_HashIndexEntry *hash_index = calloc(hash_index_length ?: 1, sizeof(struct SFMF_HashIndexEntry));
+    struct SFMF_HashIndexEntry *hash_entry = hash_index;
+    for (int i=0; i<included_files->length; i++) {
+        hash_entry->hash = included_files->data[i].hash;
+        hash_entry->type = HASH_INDEX_BLOB;
+        hash_entry->index = i;
+        hash_entry++;
+    }
+    for (int i=0; i<pack_list->length; i++) {
+        struct PackEntry *source = &(pack_list->data[i]);
+        for (int j=0; j<source->files->length; j++) {
+            hash_entry->hash = source->files->data[j].hash;
+            hash_entry->type = HASH_INDEX_PACK;
+            hash_entry->index = i;
+            hash_entry->slot = j;
+            hash_entry++;
+        }
     }
+    sfmf_hashindex_sort(hash_index, &hash_index_length);
 
     struct SFMF_FileHeader header = {
         .magic = SFMF_MAGIC_NUMBER,
@@ -653,11 +1604,10 @@ void write_manifest(struct PackOptions *opts, struct FileList *files,
         .entries_length = files->length,
         .packs_length = pack_list->length,
         .blobs_length = included_files->length,
+        .hash_index_length = hash_index_length,
     };
 
-    uint32_t entries_size = header.entries_length * sizeof(struct SFMF_FileEntry);
-    uint32_t packs_size = header.packs_length * sizeof(struct SFMF_PackEntry);
-    uint32_t blobs_size = header.blobs_length * sizeof(struct SFMF_BlobEntry);
+    uint32_t version = header.version;
 
     char *tmp = malloc(strlen(opts->out_dir) + strlen("/manifest.sfmf") + 1 /* '\0' */);
     sprintf(tmp, "%s/manifest.sfmf", opts->out_dir);
@@ -668,21 +1618,41 @@ void write_manifest(struct PackOptions *opts, struct FileList *files,
     int res = sfmf_fileheader_write(&header, fp);
     assert(res == 1);
 
+    // Reserve space for the section table, it is written once the sections are
+    struct SFMF_SectionEntry sections[MANIFEST_SECTIONS];
+    uint32_t sections_length = 0;
+    off_t section_table_offset = ftello(fp);
+    memset(sections, 0, sizeof(sections));
+    res = sfmf_sectiontable_write(sections, MANIFEST_SECTIONS, version, fp);
+    assert(res == 1);
+
     // Write metadata blob
-    res = fwrite(opts->metadata_bytes, opts->metadata_length, 1, fp);
+    res = sfmf_section_write(opts->metadata_bytes, opts->metadata_length, version, fp,
+            &(sections[sections_length++]));
     assert(res == 1);
 
     // Write filename table
+    struct ManifestSection section;
+    FILE *sfp = manifest_section_begin(&section);
+    uint32_t *filename_offsets = calloc(header.entries_length ?: 1, sizeof(uint32_t));
+    uint32_t filename_offset = 0;
+    previous = NULL;
     for (int i=0; i<header.entries_length; i++) {
         struct FileEntry *source = &(files->data[i]);
         const char *filename = get_file_basename(opts, source->filename);
-        res = fwrite(filename, strlen(filename) + 1, 1, fp);
+        uint32_t shared = sfmf_filename_shared_length(i, previous, filename);
+        res = sfmf_filename_record_write(filename, shared, sfp);
         assert(res == 1);
-    }
 
-    uint32_t filename_offset = 0;
+        filename_offsets[i] = filename_offset;
+        filename_offset += sfmf_filename_record_size(filename, shared);
+        previous = filename;
+    }
+    assert(filename_offset == filename_table_size);
+    manifest_section_end(&section, version, fp, &(sections[sections_length++]));
 
     // Write file entries
+    sfp = manifest_section_begin(&section);
     for (int i=0; i<header.entries_length; i++) {
         struct FileEntry *source = &(files->data[i]);
         int is_hardlink = (source->duplicate && source->hardlink_index != -1);
@@ -720,20 +1690,23 @@ void write_manifest(struct PackOptions *opts, struct FileList *files,
             entry.dev = source->st.st_rdev;
         }
         entry.zsize = source->zsize;
+        entry.flags = (S_ISREG(source->st.st_mode) && source->zsize < source->hash.size) ?
+            convert_flags_blob_flags(source->zconvert) : BLOB_FLAG_NONE;
         memcpy(&(entry.hash), &(source->hash), sizeof(struct SFMF_FileHash));
 
-        entry.filename_offset = filename_offset;
-        const char *filename = get_file_basename(opts, source->filename);
-        filename_offset += strlen(filename) + 1;
+        entry.filename_offset = filename_offsets[i];
 
-        res = sfmf_fileentry_write(&entry, fp);
+        res = sfmf_fileentry_write(&entry, version, sfp);
         assert(res == 1);
     }
+    free(filename_offsets);
+    manifest_section_end(&section, version, fp, &(sections[sections_length++]));
 
-    uint32_t offset = sizeof(header) + header.metadata_size + header.filename_table_size +
-        entries_size + packs_size + blobs_size;
+    // Pack offsets are relative to the packs section, blob offsets to the blobs payload
+    uint64_t offset = 0;
 
     // Write pack entries
+    sfp = manifest_section_begin(&section);
     for (int i=0; i<header.packs_length; i++) {
         struct PackEntry *source = &(pack_list->data[i]);
 
@@ -742,45 +1715,138 @@ void write_manifest(struct PackOptions *opts, struct FileList *files,
         entry.offset = offset;
         entry.count = source->files->length;
 
-        res = sfmf_packentry_write(&entry, fp);
+        res = sfmf_packentry_write(&entry, version, sfp);
         assert(res == 1);
 
-        offset += entry.count * sizeof(struct SFMF_FileHash);
+        offset += (uint64_t)entry.count * sfmf_filehash_size(version);
     }
+    manifest_section_end(&section, version, fp, &(sections[sections_length++]));
 
     // Write blob entries
+    offset = 0;
+    sfp = manifest_section_begin(&section);
     for (int i=0; i<header.blobs_length; i++) {
         struct FileEntry *source = &(included_files->data[i]);
 
-        uint32_t item_payload = fileentry_get_min_size(source);
+        uint64_t item_payload = fileentry_get_min_size(source);
 
         struct SFMF_BlobEntry entry;
         memcpy(&(entry.hash), &(source->hash), sizeof(struct SFMF_FileHash));
-        entry.flags = (source->zsize == item_payload) ? BLOB_FLAG_ZCOMPRESSED : 0;
+        entry.flags = (source->zsize == item_payload) ? convert_flags_blob_flags(source->zconvert) : BLOB_FLAG_NONE;
         entry.offset = offset;
         entry.size = item_payload;
 
-        res = sfmf_blobentry_write(&entry, fp);
+        res = sfmf_blobentry_write(&entry, version, sfp);
         assert(res == 1);
 
         offset += item_payload;
     }
+    manifest_section_end(&section, version, fp, &(sections[sections_length++]));
+
+    // Write hash index
+    sfp = manifest_section_begin(&section);
+    for (int i=0; i<header.hash_index_length; i++) {
+        res = sfmf_hashindexentry_write(&(hash_index[i]), version, sfp);
+        assert(res == 1);
+    }
+    free(hash_index);
+    manifest_section_end(&section, version, fp, &(sections[sections_length++]));
 
     // Write pack payloads (hashes)
+    sfp = manifest_section_begin(&section);
     for (int i=0; i<header.packs_length; i++) {
         struct PackEntry *source = &(pack_list->data[i]);
 
         for (int j=0; j<source->files->length; j++) {
             struct SFMF_FileHash *hash = &(source->files->data[j].hash);
-            res = sfmf_filehash_write(hash, fp);
+            res = sfmf_filehash_write(hash, version, sfp);
+            assert(res == 1);
+        }
+    }
+    manifest_section_end(&section, version, fp, &(sections[sections_length++]));
+
+    // Write dictionary (empty if none is used)
+    if (version >= SFMF_VERSION_DICTIONARY) {
+        res = sfmf_section_write(opts->dictionary, opts->dictionary_length, version, fp,
+                &(sections[sections_length++]));
+        assert(res == 1);
+    }
+
+    // Write zero extents of files
+    if (version >= SFMF_VERSION_EXTENTS) {
+        uint64_t zero_bytes = 0;
+        sfp = manifest_section_begin(&section);
+        for (int i=0; opts->sparse && i<header.entries_length; i++) {
+            struct FileEntry *source = &(files->data[i]);
+            int is_hardlink = (source->duplicate && source->hardlink_index != -1);
+            if (!S_ISREG(source->st.st_mode) || is_hardlink || source->hash.size < SPARSE_DEFAULT_MIN_RUN) {
+                continue;
+            }
+
+            // Found while hashing the file (or taken from the hash cache)
+            for (uint32_t j=0; j<source->extents_length; j++) {
+                struct SFMF_ExtentEntry extent = source->extents[j];
+                extent.entry = i;
+                res = sfmf_extententry_write(&extent, version, sfp);
+                assert(res == 1);
+
+                zero_bytes += extent.length;
+            }
+        }
+        manifest_section_end(&section, version, fp, &(sections[sections_length++]));
+
+        SFMF_LOG("Zero extents: %" PRIu64 " bytes won't be written when unpacking\n", zero_bytes);
+    }
+
+    // Write chunks of chunked files (also for duplicates of them, which aren't hardlinks)
+    if (version >= SFMF_VERSION_CHUNKS) {
+        sfp = manifest_section_begin(&section);
+        for (int i=0; opts->chunked_index && i<header.entries_length; i++) {
+            struct FileEntry *source = &(files->data[i]);
+            int is_hardlink = (source->duplicate && source->hardlink_index != -1);
+            if (!S_ISREG(source->st.st_mode) || is_hardlink || source->hash.size == 0) {
+                continue;
+            }
+
+            struct ChunkedFile *chunked = hashindex_lookup(opts->chunked_index, &(source->hash));
+            for (uint32_t j=0; chunked && j<chunked->length; j++) {
+                struct SFMF_ChunkEntry chunk = chunked->chunks[j];
+                chunk.entry = i;
+                res = sfmf_chunkentry_write(&chunk, version, sfp);
+                assert(res == 1);
+            }
+        }
+        manifest_section_end(&section, version, fp, &(sections[sections_length++]));
+    }
+
+    // Write deltas, sorted by target for lookup
+    if (version >= SFMF_VERSION_DELTAS) {
+        sfmf_deltaentry_sort(opts->deltas, opts->deltas_length);
+
+        sfp = manifest_section_begin(&section);
+        for (uint32_t i=0; i<opts->deltas_length; i++) {
+            res = sfmf_deltaentry_write(&(opts->deltas[i]), version, sfp);
             assert(res == 1);
         }
+        manifest_section_end(&section, version, fp, &(sections[sections_length++]));
+    }
+
+    // Write section table, sections are in the order of the file structure
+    assert(sections_length == MANIFEST_SECTIONS);
+    for (int i=0; i<sections_length; i++) {
+        sections[i].type = i;
     }
+    res = fseeko(fp, section_table_offset, SEEK_SET);
+    assert(res == 0);
+    res = sfmf_sectiontable_write(sections, sections_length, version, fp);
+    assert(res == 1);
+    res = fseeko(fp, 0, SEEK_END);
+    assert(res == 0);
 
     // Write blob payloads
     for (int i=0; i<header.blobs_length; i++) {
         struct FileEntry *source = &(included_files->data[i]);
-        uint32_t item_payload = fileentry_get_min_size(source);
+        uint64_t item_payload = fileentry_get_min_size(source);
 
         int zcompress = (source->zsize == item_payload);
 
@@ -790,13 +1856,13 @@ void write_manifest(struct PackOptions *opts, struct FileList *files,
             ssize_t length = readlink(source->filename, buf, sizeof(buf));
             assert(length != -1);
             SFMF_DEBUG("Writing symlink: '%s'\n", buf);
-            convert_buffer_fp(buf, length, fp, zcompress ? CONVERT_FLAG_ZCOMPRESS : CONVERT_FLAG_NONE);
+            convert_buffer_fp(buf, length, fp, zcompress ? source->zconvert : CONVERT_FLAG_NONE);
+        } else if (zcompress) {
+            assert(S_ISREG(source->st.st_mode));
+            write_compressed_file(opts, source, fp);
         } else {
             assert(S_ISREG(source->st.st_mode));
-            FILE *infile = fopen(source->filename, "rb");
-            assert(infile != NULL);
-            convert_file_fp(infile, fp, zcompress ? CONVERT_FLAG_ZCOMPRESS : CONVERT_FLAG_NONE);
-            fclose(infile);
+            write_file_data(source, fp, CONVERT_FLAG_NONE);
         }
     }
 
@@ -812,10 +1878,18 @@ int main(int argc, char *argv[])
     memset(&opts, 0, sizeof(opts));
     progname = argv[0];
 
-    if (!parse_opts(argc, argv, &opts)) {
-        usage();
-        return 1;
-    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts.jobs = (cpus > 0) ? cpus : 1;
+    opts.spill_memory_mb = 256;
+    opts.spill_disk_mb = 4096;
+    opts.costmodel = costmodel_new();
+    opts.sparse = 1;
+    opts.delta_max_percent = DELTA_DEFAULT_MAX_PERCENT;
+
+    parse_opts(argc, argv, &opts);
+
+    // Before any hashing threads are started
+    sha1hw_init();
 
     SFMF_LOG("Configuration:\n"
              "   Input directory:   %s\n"
@@ -823,9 +1897,15 @@ int main(int argc, char *argv[])
              "   Metadata file:     %s\n"
              "   Total blob size:   %d KiB\n"
              "   Max pack size:     %d KiB\n"
-             "   Average pack size: %d KiB\n",
+             "   Average pack size: %d KiB\n"
+             "   Hashing threads:   %d\n"
+             "   Spill memory:      %d MiB\n"
+             "   Spill disk:        %d MiB\n"
+             "   Codec:             %s\n",
              opts.in_dir, opts.out_dir, opts.meta_file,
-             opts.blob_upper_kb, opts.pack_upper_kb, opts.avg_pack_kb);
+             opts.blob_upper_kb, opts.pack_upper_kb, opts.avg_pack_kb,
+             opts.jobs, opts.spill_memory_mb, opts.spill_disk_mb,
+             opts.costmodel->adaptive ? "auto" : convert_codec_name(opts.costmodel->codec));
 
     FILE *mfp = fopen(opts.meta_file, "rb");
     assert(mfp != NULL);
@@ -842,10 +1922,32 @@ int main(int argc, char *argv[])
     fclose(mfp);
 
     // 1. List all files, plus their zsize
-    struct FileList *files = get_file_list(opts.in_dir);
+    // (compressed data is kept in the spill store, so we only compress once)
+    opts.spill = spillstore_new(opts.out_dir, (size_t)opts.spill_memory_mb * 1024 * 1024,
+            (uint64_t)opts.spill_disk_mb * 1024 * 1024);
+    if (opts.dictionary_max_kb != 0) {
+        train_dictionary(&opts);
+    }
+
+    struct HashCache *hash_cache = NULL;
+    if (opts.hash_cache_file != NULL) {
+        hash_cache = hashcache_open(opts.hash_cache_file, get_hash_cache_config(&opts));
+        if (opts.hash_cache_seed != NULL) {
+            uint32_t seeded = hashcache_seed(hash_cache, opts.in_dir, opts.hash_cache_seed, opts.costmodel);
+            SFMF_LOG("Seeded hash cache with %" PRIu32 " files from %s\n", seeded, opts.hash_cache_seed);
+        }
+    }
+
+    struct FileList *files = get_file_list(opts.in_dir, opts.jobs, opts.spill, opts.costmodel, hash_cache);
+    costmodel_report(opts.costmodel);
+
+    if (hash_cache != NULL) {
+        (void)hashcache_save(hash_cache);
+        hashcache_free(hash_cache);
+    }
 
     // Search for duplicates based on hash and mark those
-    mark_duplicates(files);
+    filelist_mark_duplicates(files);
 
     // yeah, we need at least one file, otherwise there's something wrong
     assert(files->length > 0);
@@ -853,37 +1955,73 @@ int main(int argc, char *argv[])
     SFMF_LOG("%d entries to consider\n", files->length);
 
     // 2. Determine blob cutoff size based on upper limit
-    uint32_t blob_cutoff_size_b = get_cutoff_size_bytes(files, opts.blob_upper_kb * 1024);
-    SFMF_LOG("Will include files < %d KiB (%d bytes)\n", blob_cutoff_size_b / 1024,
+    uint64_t blob_cutoff_size_b = get_cutoff_size_bytes(files, (uint64_t)opts.blob_upper_kb * 1024);
+    SFMF_LOG("Will include files < %" PRIu64 " KiB (%" PRIu64 " bytes)\n", blob_cutoff_size_b / 1024,
             blob_cutoff_size_b);
 
     // 3. Sort file entries into three buckets
     struct FileList *included_files = NULL;
     struct FileList *packed_files = NULL;
     struct FileList *unpacked_files = NULL;
-    bucketize_file_list(files, blob_cutoff_size_b, opts.pack_upper_kb * 1024,
+    bucketize_file_list(files, blob_cutoff_size_b, (uint64_t)opts.pack_upper_kb * 1024,
             &included_files, &packed_files, &unpacked_files);
 
+    if (opts.n_delta_bases > 0) {
+        write_deltas(&opts, unpacked_files);
+    }
+
+    if (opts.chunk) {
+        chunk_files(&opts, included_files, packed_files, &unpacked_files);
+    }
+
     SFMF_LOG("Stats: %d included, %d packed, %d unpacked\n",
             included_files->length, packed_files->length, unpacked_files->length);
 
     // TODO: Maybe have an educated guess which files we always need packed,
     // and put those ideally into the same packs before packing the rest
 
-    // 4. Bin packing of packed files into packs
+    // 4. Bin packing of packed files into packs (keeping unchanged packs of the previous release)
+    struct PackList *reused_packs = NULL;
+    if (opts.previous_dir != NULL) {
+        reused_packs = reuse_packs(&opts, &packed_files);
+    }
+
     struct PackList *pack_list = make_packs(packed_files, opts.avg_pack_kb * 1024);
 
     SFMF_LOG("Need %d packs a %d KiB\n", pack_list->length, opts.avg_pack_kb);
 
     // 5. Write out full blobs files
     (void)filelist_foreach(unpacked_files, write_full_blob, &opts);
+    if (opts.previous_dir != NULL) {
+        SFMF_LOG("Reused %" PRIu32 " of %" PRIu32 " full blobs of previous release\n",
+                opts.reused_blobs, unpacked_files->length);
+    }
     
     // 6. Write out packs files
     packlist_foreach(pack_list, write_pack, &opts);
 
+    if (reused_packs != NULL) {
+        packlist_extend(reused_packs, pack_list);
+        pack_list = reused_packs;
+    }
+
     // 7. Write out manifest file
     write_manifest(&opts, files, pack_list, included_files);
 
+    for (uint32_t i=0; i<opts.chunked_length; i++) {
+        free(opts.chunked[i].chunks);
+    }
+    free(opts.chunked);
+    if (opts.chunked_index) {
+        hashindex_free(opts.chunked_index);
+    }
+    free(opts.deltas);
+
+    spillstore_free(opts.spill);
+    costmodel_free(opts.costmodel);
+    convert_set_dictionary(NULL, 0);
+    free(opts.dictionary);
+
     filelist_free(files);
     filelist_free(included_files);
     filelist_free(packed_files);
@@ -19,14 +19,178 @@
 
 #include "sfmf.h"
 #include "convert.h"
+#include "hashindex.h"
+#include "readmanifest.h"
+#include "readpack.h"
+#include "sparse.h"
+#include "chunker.h"
+#include "delta.h"
+#include "costmodel.h"
+#include "hashcache.h"
+#include "fileentry.h"
+#include "sha1hw.h"
+
+#include "sha1.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 
-int main(int argc, char *argv[])
+static double get_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void make_test_hash(struct SFMF_FileHash *hash, uint32_t i)
+{
+    memset(hash, 0, sizeof(*hash));
+
+    SHA1_CTX ctx;
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, (const uint8_t *)&i, sizeof(i));
+    SHA1_Final(&ctx, hash->hash);
+
+    hash->hashtype = HASHTYPE_SHA1;
+    hash->size = 1 + (i % 4096);
+}
+
+static void sha1_hex(const uint8_t *data, size_t len, size_t chunk, char *out)
+{
+    SHA1_CTX ctx;
+    SHA1_Init(&ctx);
+    for (size_t pos=0; pos<len; pos+=chunk) {
+        SHA1_Update(&ctx, data + pos, (len - pos < chunk) ? (len - pos) : chunk);
+    }
+
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    SHA1_Final(&ctx, digest);
+    for (int i=0; i<SHA1_DIGEST_SIZE; i++) {
+        sprintf(out + 2 * i, "%02x", digest[i]);
+    }
+}
+
+static void test_sha1_backends()
+{
+    // Test vectors from FIPS PUB 180-1 and NIST
+    static const struct {
+        const char *data;
+        const char *digest;
+    } vectors[] = {
+        { "", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+        { "abc", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+          "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+        { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmno"
+          "ijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+          "a49b2446a02c645bf419f995b67091253a04a259" },
+    };
+
+    const size_t million = 1000000;
+    uint8_t *as = malloc(million);
+    memset(as, 'a', million);
+
+    // Unaligned, odd-sized data spanning many blocks, compared between backends
+    const size_t random_len = 1024 * 1024 + 7;
+    uint8_t *random_data = malloc(random_len + 1);
+    for (size_t i=0; i<random_len + 1; i++) {
+        random_data[i] = (i * 2654435761u) >> 13;
+    }
+    uint8_t *random_copy = malloc(random_len + 1);
+    memcpy(random_copy, random_data, random_len + 1);
+
+    const struct SHA1HWBackend *previous = sha1hw_get_backend();
+    char reference[2 * SHA1_DIGEST_SIZE + 1] = "";
+
+    for (const struct SHA1HWBackend *backend = sha1hw_backends(); backend->name; backend++) {
+        if (!backend->supported()) {
+            printf("SHA-1 backend %s: not supported by this CPU\n", backend->name);
+            continue;
+        }
+
+        sha1hw_set_backend(backend);
+
+        char out[2 * SHA1_DIGEST_SIZE + 1];
+        for (int i=0; i<sizeof(vectors)/sizeof(vectors[0]); i++) {
+            sha1_hex((const uint8_t *)vectors[i].data, strlen(vectors[i].data), 64, out);
+            assert(strcmp(out, vectors[i].digest) == 0);
+        }
+
+        // A million repetitions of "a", in one go and in odd-sized pieces
+        sha1_hex(as, million, million, out);
+        assert(strcmp(out, "34aa973cd4c4daa4f61eeb2bdbad27316534016f") == 0);
+        sha1_hex(as, million, 1000 - 1, out);
+        assert(strcmp(out, "34aa973cd4c4daa4f61eeb2bdbad27316534016f") == 0);
+
+        sha1_hex(random_data + 1, random_len, 4096 + 13, out);
+        if (reference[0] == '\0') {
+            strcpy(reference, out);
+        }
+        assert(strcmp(out, reference) == 0);
+
+        // The input buffer must not be modified by hashing
+        assert(memcmp(random_data, random_copy, random_len + 1) == 0);
+
+        printf("SHA-1 backend %s: OK\n", backend->name);
+    }
+
+    sha1hw_set_backend(previous);
+
+    free(random_copy);
+    free(random_data);
+    free(as);
+}
+
+static void benchmark_sha1_backends()
+{
+    const size_t buffer_size = DEFAULT_BUFFER_SIZE;
+    const size_t total = 512 * 1024 * 1024;
+
+    uint8_t *buf = malloc(buffer_size);
+    for (size_t i=0; i<buffer_size; i++) {
+        buf[i] = i * 31;
+    }
+
+    const struct SHA1HWBackend *previous = sha1hw_get_backend();
+
+    for (const struct SHA1HWBackend *backend = sha1hw_backends(); backend->name; backend++) {
+        if (!backend->supported()) {
+            continue;
+        }
+
+        sha1hw_set_backend(backend);
+
+        double start = get_seconds();
+
+        SHA1_CTX ctx;
+        SHA1_Init(&ctx);
+        for (size_t pos=0; pos<total; pos+=buffer_size) {
+            SHA1_Update(&ctx, buf, buffer_size);
+        }
+        uint8_t digest[SHA1_DIGEST_SIZE];
+        SHA1_Final(&ctx, digest);
+
+        double elapsed = get_seconds() - start;
+        printf("SHA-1 backend %-10s %8.1f MiB/s%s\n", backend->name,
+                total / (1024. * 1024.) / elapsed,
+                (backend == previous) ? " (default)" : "");
+    }
+
+    sha1hw_set_backend(previous);
+
+    free(buf);
+}
+
+static void test_convert_hash()
 {
     char buf[1024*1024*2];
     memset(buf, 0, sizeof(buf));
@@ -47,19 +211,1308 @@ int main(int argc, char *argv[])
     memset(&a_hash, 0, sizeof(a_hash));
     convert_file_hash("uncompressed", &a_hash, CONVERT_FLAG_NONE);
     sfmf_filehash_format(&a_hash, a, sizeof(a));
-    printf("Got uncompressed hash: %s (%d)\n", a, a_hash.size);
+    printf("Got uncompressed hash: %s (%" PRIu64 ")\n", a, a_hash.size);
 
     struct SFMF_FileHash b_hash;
     char b[100];
     memset(&b_hash, 0, sizeof(b_hash));
     convert_file_hash("zcompressed", &b_hash, CONVERT_FLAG_ZUNCOMPRESS);
     sfmf_filehash_format(&b_hash, b, sizeof(b));
-    printf("Got zcompressed hash: %s (%d)\n", a, b_hash.size);
+    printf("Got zcompressed hash: %s (%" PRIu64 ")\n", a, b_hash.size);
+
+    // Data stored with other flags (e.g. by an earlier release) fails verification
+    assert(sfmf_filehash_verify(&a_hash, "zcompressed", BLOB_FLAG_ZCOMPRESSED) == 0);
+    assert(sfmf_filehash_verify(&a_hash, "uncompressed", BLOB_FLAG_NONE) == 0);
+    assert(sfmf_filehash_verify(&a_hash, "uncompressed", BLOB_FLAG_ZCOMPRESSED) != 0);
+    assert(sfmf_filehash_verify(&a_hash, "zcompressed", BLOB_FLAG_NONE) != 0);
+
+    // Decompressing data that isn't compressed fails (instead of aborting)
+    FILE *in = fopen("uncompressed", "rb");
+    FILE *out = fopen("/dev/null", "wb");
+    assert(convert_file_fp(in, out, CONVERT_FLAG_ZUNCOMPRESS) != 0);
+    fclose(out);
+    fclose(in);
 
     unlink("uncompressed");
     unlink("zcompressed");
 
     assert(sfmf_filehash_compare(&a_hash, &b_hash) == 0);
+}
+
+static void test_convert_hasher(enum ConvertCodec codec)
+{
+    printf("Testing hasher with codec: %s\n", convert_codec_name(codec));
+
+    char buf[1024*512];
+    for (int i=0; i<sizeof(buf); i++) {
+        buf[i] = (i / 1000) ^ (i % 7);
+    }
+
+    FILE *zcompressed = fopen("zcompressed", "w+");
+    convert_buffer_fp(buf, sizeof(buf), zcompressed, convert_flags_compress(codec));
+    size_t zsize = ftell(zcompressed);
+    char *zbuf = malloc(zsize);
+    rewind(zcompressed);
+    size_t res = fread(zbuf, zsize, 1, zcompressed);
+    assert(res == 1);
+    fclose(zcompressed);
+
+    struct SFMF_FileHash expected;
+    memset(&expected, 0, sizeof(expected));
+    convert_file_hash("zcompressed", &expected, convert_flags_uncompress(codec));
+    unlink("zcompressed");
+    assert(expected.size == sizeof(buf));
+    assert(zsize < sizeof(buf));
+
+    // Data arrives in arbitrarily-sized chunks (like from the network)
+    struct ConvertHasher *hasher = convert_hasher_new(convert_flags_uncompress(codec));
+    for (size_t pos=0; pos<zsize; pos+=777) {
+        size_t len = (zsize - pos < 777) ? (zsize - pos) : 777;
+        assert(convert_hasher_update(hasher, zbuf + pos, len) == 0);
+    }
+
+    struct SFMF_FileHash hash;
+    assert(convert_hasher_finish(hasher, &hash) == 0);
+    convert_hasher_free(hasher);
+    assert(sfmf_filehash_compare(&hash, &expected) == 0);
+
+    // A truncated stream must not produce a valid hash
+    hasher = convert_hasher_new(convert_flags_uncompress(codec));
+    assert(convert_hasher_update(hasher, zbuf, zsize / 2) == 0);
+    assert(convert_hasher_finish(hasher, &hash) != 0);
+    assert(hash.hashtype == HASHTYPE_UNKNOWN);
+    convert_hasher_free(hasher);
+
+    // Neither must a stream with trailing garbage
+    hasher = convert_hasher_new(convert_flags_uncompress(codec));
+    assert(convert_hasher_update(hasher, zbuf, zsize) == 0);
+    assert(convert_hasher_update(hasher, buf, 10) != 0);
+    assert(convert_hasher_finish(hasher, &hash) != 0);
+    convert_hasher_free(hasher);
+
+    // The blob flags of the codec map back to the same conversion
+    assert(convert_flags_for_blob(convert_codec_blob_flag(codec)) == convert_flags_uncompress(codec));
+
+    // Uncompressed data is hashed as-is
+    hasher = convert_hasher_new(CONVERT_FLAG_NONE);
+    assert(convert_hasher_update(hasher, buf, 1000) == 0);
+    assert(convert_hasher_update(hasher, buf + 1000, sizeof(buf) - 1000) == 0);
+    assert(convert_hasher_finish(hasher, &hash) == 0);
+    convert_hasher_free(hasher);
+    assert(sfmf_filehash_compare(&hash, &expected) == 0);
+
+    free(zbuf);
+}
+
+static void test_hashindex()
+{
+    const uint32_t count = 1000;
+
+    struct SFMF_FileHash *hashes = calloc(count, sizeof(struct SFMF_FileHash));
+    for (uint32_t i=0; i<count; i++) {
+        make_test_hash(&(hashes[i]), i);
+    }
+
+    struct HashIndex *index = hashindex_new(0);
+    for (uint32_t i=0; i<count; i++) {
+        void *existing = hashindex_insert(index, &(hashes[i]), &(hashes[i]));
+        assert(existing == NULL);
+    }
+    assert(index->length == count);
+
+    // Inserting an existing hash again keeps the first value
+    struct SFMF_FileHash again = hashes[42];
+    assert(hashindex_insert(index, &again, &again) == &(hashes[42]));
+
+    for (uint32_t i=0; i<count; i++) {
+        assert(hashindex_lookup(index, &(hashes[i])) == &(hashes[i]));
+
+        struct SFMF_FileHash miss;
+        make_test_hash(&miss, count + i);
+        assert(hashindex_lookup(index, &miss) == NULL);
+    }
+
+    // Same hash value, but different size must not match
+    struct SFMF_FileHash other_size = hashes[0];
+    other_size.size++;
+    assert(hashindex_lookup(index, &other_size) == NULL);
+
+    hashindex_free(index);
+    free(hashes);
+}
+
+// Section table of the test manifest being written (version >= 2)
+static struct SFMF_SectionEntry test_sections[MANIFEST_SECTION_COUNT];
+static uint32_t test_sections_length;
+
+// Writes the file header, and reserves space for the section table
+static void write_test_header(struct SFMF_FileHeader *header, FILE *fp)
+{
+    sfmf_fileheader_write(header, fp);
+
+    memset(test_sections, 0, sizeof(test_sections));
+    test_sections_length = 0;
+    if (header->version >= SFMF_VERSION_SECTION_TABLE) {
+        sfmf_sectiontable_write(test_sections, MANIFEST_SECTION_COUNT, header->version, fp);
+    }
+}
+
+// Writes size bytes of data as the next manifest section
+static void write_test_section_data(const char *data, size_t size, uint32_t version, FILE *fp)
+{
+    assert(version < SFMF_VERSION_SECTION_TABLE || test_sections_length < MANIFEST_SECTION_COUNT);
+    struct SFMF_SectionEntry *entry = &(test_sections[test_sections_length]);
+    int res = sfmf_section_write(data, size, version, fp, entry);
+    assert(res == 1);
+    entry->type = test_sections_length++;
+}
+
+// Writes the records collected in section (a memory stream) as a manifest section
+static void write_test_section(FILE *section, char **data, size_t *size, uint32_t version, FILE *fp)
+{
+    fclose(section);
+    write_test_section_data(*data, *size, version, fp);
+    free(*data);
+}
+
+// Fills in the section table reserved by write_test_header()
+static void write_test_section_table(uint32_t version, FILE *fp)
+{
+    if (version >= SFMF_VERSION_SECTION_TABLE) {
+        assert(test_sections_length == MANIFEST_SECTION_COUNT);
+        fseeko(fp, sfmf_fileheader_size(version), SEEK_SET);
+        sfmf_sectiontable_write(test_sections, test_sections_length, version, fp);
+        fseeko(fp, 0, SEEK_END);
+    }
+}
+
+static void test_manifestreader(uint32_t version)
+{
+    // Odd metadata size, so that all records are unaligned in the mapping
+    const char metadata[] = "test";
+    const char plain_filenames[] = "/\0/link";
+    // "/" (restart point), then "link" appended to the first byte of "/"
+    const char frontcoded_filenames[] = "\0/\0\001link";
+    const char blob[] = "target";
+    const char dictionary[] = "dictionary";
+
+    int frontcoded = (version >= SFMF_VERSION_FRONTCODED);
+    const char *filenames = frontcoded ? frontcoded_filenames : plain_filenames;
+    uint32_t filenames_size = frontcoded ? sizeof(frontcoded_filenames) : sizeof(plain_filenames);
+
+    struct SFMF_FileHeader header = {
+        .magic = SFMF_MAGIC_NUMBER,
+        .version = version,
+        .metadata_size = sizeof(metadata),
+        .filename_table_size = filenames_size,
+        .entries_length = 2,
+        .packs_length = 1,
+        .blobs_length = 1,
+        .hash_index_length = (version >= SFMF_VERSION_HASH_INDEX) ? 4 : 0,
+    };
+
+    // Before version 2, offsets are file offsets (else relative to their section)
+    int sections = (version >= SFMF_VERSION_SECTION_TABLE);
+    uint64_t offset = sections ? 0 : sfmf_fileheader_size(version) + sizeof(metadata) + filenames_size +
+        2 * sfmf_fileentry_size(version) + sfmf_packentry_size(version) +
+        sfmf_blobentry_size(version) + header.hash_index_length * sfmf_hashindexentry_size(version);
+
+    struct SFMF_FileEntry entries[2];
+    memset(entries, 0, sizeof(entries));
+    entries[0].type = ENTRY_DIRECTORY;
+    entries[0].mtime = 0x123456789ull;
+    entries[1].type = ENTRY_SYMLINK;
+    entries[1].filename_offset = frontcoded ? 3 : 2;
+    make_test_hash(&(entries[1].hash), 1);
+
+    struct SFMF_PackEntry pack;
+    memset(&pack, 0, sizeof(pack));
+    make_test_hash(&(pack.hash), 2);
+    pack.offset = offset;
+    pack.count = 3;
+
+    struct SFMF_BlobEntry blob_entry;
+    memset(&blob_entry, 0, sizeof(blob_entry));
+    blob_entry.hash = entries[1].hash;
+    blob_entry.offset = sections ? 0 : offset + pack.count * sfmf_filehash_size(version);
+    blob_entry.size = strlen(blob);
+
+    char *data;
+    size_t size;
+    FILE *section;
+
+    FILE *fp = fopen("manifest", "wb");
+    write_test_header(&header, fp);
+    write_test_section_data(metadata, sizeof(metadata), version, fp);
+    write_test_section_data(filenames, filenames_size, version, fp);
+    section = open_memstream(&data, &size);
+    sfmf_fileentry_write(&(entries[0]), version, section);
+    sfmf_fileentry_write(&(entries[1]), version, section);
+    write_test_section(section, &data, &size, version, fp);
+    section = open_memstream(&data, &size);
+    sfmf_packentry_write(&pack, version, section);
+    write_test_section(section, &data, &size, version, fp);
+    section = open_memstream(&data, &size);
+    sfmf_blobentry_write(&blob_entry, version, section);
+    write_test_section(section, &data, &size, version, fp);
+    section = open_memstream(&data, &size);
+    if (version >= SFMF_VERSION_HASH_INDEX) {
+        struct SFMF_HashIndexEntry hash_index[4];
+        memset(hash_index, 0, sizeof(hash_index));
+        hash_index[0].hash = blob_entry.hash;
+        hash_index[0].type = HASH_INDEX_BLOB;
+        for (int i=0; i<pack.count; i++) {
+            make_test_hash(&(hash_index[1+i].hash), 10 + i);
+            hash_index[1+i].type = HASH_INDEX_PACK;
+            hash_index[1+i].slot = i;
+        }
+        uint32_t length = 4;
+        sfmf_hashindex_sort(hash_index, &length);
+        assert(length == 4);
+        for (int i=0; i<length; i++) {
+            sfmf_hashindexentry_write(&(hash_index[i]), version, section);
+        }
+    }
+    write_test_section(section, &data, &size, version, fp);
+    long pack_hashes_offset = ftell(fp);
+    section = open_memstream(&data, &size);
+    for (int i=0; i<pack.count; i++) {
+        struct SFMF_FileHash hash;
+        make_test_hash(&hash, 10 + i);
+        sfmf_filehash_write(&hash, version, section);
+    }
+    write_test_section(section, &data, &size, version, fp);
+    if (version >= SFMF_VERSION_DICTIONARY) {
+        write_test_section_data(dictionary, sizeof(dictionary), version, fp);
+    }
+    if (version >= SFMF_VERSION_EXTENTS) {
+        // Two zero extents of the second entry
+        section = open_memstream(&data, &size);
+        for (int i=0; i<2; i++) {
+            struct SFMF_ExtentEntry extent = { 1, 0x100000000ull * i, 4096 };
+            sfmf_extententry_write(&extent, version, section);
+        }
+        write_test_section(section, &data, &size, version, fp);
+    }
+    struct SFMF_ChunkEntry chunks[2];
+    memset(chunks, 0, sizeof(chunks));
+    if (version >= SFMF_VERSION_CHUNKS) {
+        // The second entry, made of two chunks
+        section = open_memstream(&data, &size);
+        for (int i=0; i<2; i++) {
+            chunks[i].entry = 1;
+            chunks[i].offset = 0x100000000ull * i;
+            make_test_hash(&(chunks[i].hash), 20 + i);
+            sfmf_chunkentry_write(&(chunks[i]), version, section);
+        }
+        write_test_section(section, &data, &size, version, fp);
+    }
+    struct SFMF_DeltaEntry deltas[3];
+    memset(deltas, 0, sizeof(deltas));
+    if (version >= SFMF_VERSION_DELTAS) {
+        // Two deltas for the second entry, one for another file
+        section = open_memstream(&data, &size);
+        for (int i=0; i<3; i++) {
+            deltas[i].target = (i < 2) ? entries[1].hash : pack.hash;
+            make_test_hash(&(deltas[i].base), 30 + i);
+            make_test_hash(&(deltas[i].delta), 40 + i);
+            deltas[i].flags = BLOB_FLAG_ZCOMPRESSED;
+        }
+        sfmf_deltaentry_sort(deltas, 3);
+        for (int i=0; i<3; i++) {
+            sfmf_deltaentry_write(&(deltas[i]), version, section);
+        }
+        write_test_section(section, &data, &size, version, fp);
+    }
+    write_test_section_table(version, fp);
+    fwrite(blob, strlen(blob), 1, fp);
+    fclose(fp);
+
+    struct ManifestReader *reader = manifestreader_open("manifest");
+    assert(reader != NULL);
+    assert(reader->header.entries_length == 2);
+
+    // With a section table, nothing is loaded until it is used
+    for (int i=0; version >= SFMF_VERSION_SECTION_TABLE && i<MANIFEST_SECTION_COUNT; i++) {
+        assert(reader->sections[i].data == NULL && reader->sections[i].has_checksum);
+    }
+    assert(strcmp(manifestreader_get_metadata(reader), metadata) == 0);
+    if (version >= SFMF_VERSION_SECTION_TABLE) {
+        assert(reader->sections[MANIFEST_SECTION_ENTRIES].data == NULL);
+    }
+
+    struct SFMF_FileEntry entry;
+    manifestreader_get_entry(reader, 0, &entry);
+    assert(entry.type == ENTRY_DIRECTORY && entry.mtime == 0x123456789ull);
+    assert(strcmp(manifestreader_get_filename(reader, 0), "/") == 0);
+    manifestreader_get_entry(reader, 1, &entry);
+    assert(strcmp(manifestreader_get_filename(reader, 1), "/link") == 0);
+    assert(strcmp(manifestreader_get_filename(reader, 0), "/") == 0);
+    assert(sfmf_filehash_compare(&(entry.hash), &(entries[1].hash)) == 0);
+
+    struct SFMF_PackEntry p;
+    manifestreader_get_pack(reader, 0, &p);
+    assert(p.count == 3 && p.offset == pack.offset);
+
+    struct SFMF_FileHash hashes[3];
+    manifestreader_get_pack_hashes(reader, &p, hashes);
+    for (int i=0; i<3; i++) {
+        struct SFMF_FileHash expected;
+        make_test_hash(&expected, 10 + i);
+        assert(sfmf_filehash_compare(&(hashes[i]), &expected) == 0);
+    }
+
+    struct SFMF_BlobEntry b;
+    manifestreader_get_blob(reader, 0, &b);
+    assert(memcmp(manifestreader_get_blob_data(reader, &b), blob, b.size) == 0);
+
+    uint32_t first = 0;
+    assert(manifestreader_find_extents(reader, 0, &first) == 0);
+    if (version >= SFMF_VERSION_EXTENTS) {
+        assert(manifestreader_find_extents(reader, 1, &first) == 2 && first == 0);
+        struct SFMF_ExtentEntry extent;
+        manifestreader_get_extent(reader, first + 1, &extent);
+        assert(extent.entry == 1 && extent.offset == 0x100000000ull && extent.length == 4096);
+    } else {
+        assert(manifestreader_find_extents(reader, 1, &first) == 0);
+    }
+
+    assert(manifestreader_find_chunks(reader, 0, &first) == 0);
+    if (version >= SFMF_VERSION_CHUNKS) {
+        assert(manifestreader_find_chunks(reader, 1, &first) == 2 && first == 0);
+        struct SFMF_ChunkEntry chunk;
+        manifestreader_get_chunk(reader, first + 1, &chunk);
+        assert(chunk.entry == 1 && chunk.offset == chunks[1].offset);
+        assert(sfmf_filehash_compare(&(chunk.hash), &(chunks[1].hash)) == 0);
+    } else {
+        assert(manifestreader_find_chunks(reader, 1, &first) == 0);
+    }
+
+    if (version >= SFMF_VERSION_DELTAS) {
+        assert(manifestreader_find_deltas(reader, &(entries[1].hash), &first) == 2);
+        for (uint32_t i=0; i<2; i++) {
+            struct SFMF_DeltaEntry delta;
+            manifestreader_get_delta(reader, first + i, &delta);
+            assert(sfmf_filehash_compare(&(delta.target), &(entries[1].hash)) == 0);
+            assert(delta.flags == BLOB_FLAG_ZCOMPRESSED);
+        }
+        assert(manifestreader_find_deltas(reader, &(pack.hash), &first) == 1);
+    } else {
+        assert(manifestreader_find_deltas(reader, &(entries[1].hash), &first) == 0);
+    }
+
+    size_t dictionary_length = 0;
+    const char *dictionary_data = manifestreader_get_dictionary(reader, &dictionary_length);
+    if (version >= SFMF_VERSION_DICTIONARY) {
+        assert(dictionary_length == sizeof(dictionary) && memcmp(dictionary_data, dictionary, sizeof(dictionary)) == 0);
+    } else {
+        assert(dictionary_data == NULL && dictionary_length == 0);
+    }
+
+    // Lookups work the same with (version 2) and without (version 1) a stored hash index
+    struct SFMF_HashIndexEntry found;
+    int res = manifestreader_find_hash(reader, &(b.hash), &found);
+    assert(res == 1 && found.type == HASH_INDEX_BLOB && found.index == 0);
+    for (int i=0; i<3; i++) {
+        res = manifestreader_find_hash(reader, &(hashes[i]), &found);
+        assert(res == 1 && found.type == HASH_INDEX_PACK && found.index == 0 && found.slot == i);
+    }
+    struct SFMF_FileHash missing;
+    make_test_hash(&missing, 100);
+    res = manifestreader_find_hash(reader, &missing, &found);
+    assert(res == 0);
+
+    manifestreader_close(reader);
+
+    // Truncated files are rejected when opening
+    res = truncate("manifest", pack_hashes_offset - 1);
+    assert(res == 0);
+    reader = manifestreader_open("manifest");
+    assert(reader == NULL);
+
+    unlink("manifest");
+}
+
+static void test_manifest_hash_scaling(uint32_t version)
+{
+    // Roughly the number of entries in a full rootfs manifest; with linear
+    // searching, classifying all of them would take a very long time
+    const uint32_t count = 250000;
+    const uint32_t blobs_length = count / 2;
+    const uint32_t pack_count = 100;
+    const uint32_t packs_length = (count - blobs_length) / pack_count;
+
+    struct SFMF_FileHeader header = {
+        .magic = SFMF_MAGIC_NUMBER,
+        .version = version,
+        .packs_length = packs_length,
+        .blobs_length = blobs_length,
+        .hash_index_length = (version >= SFMF_VERSION_HASH_INDEX) ? count : 0,
+    };
+
+    // Before version 2, pack offsets are file offsets (else relative to their section)
+    uint64_t offset = (version >= SFMF_VERSION_SECTION_TABLE) ? 0 : sfmf_fileheader_size(version) +
+        packs_length * sfmf_packentry_size(version) + blobs_length * sfmf_blobentry_size(version);
+
+    // The first half of the hashes are blobs, the second half is spread over the packs
+    struct SFMF_HashIndexEntry *hash_index = calloc(count, sizeof(struct SFMF_HashIndexEntry));
+    for (uint32_t i=0; i<count; i++) {
+        make_test_hash(&(hash_index[i].hash), i);
+        if (i < blobs_length) {
+            hash_index[i].type = HASH_INDEX_BLOB;
+            hash_index[i].index = i;
+        } else {
+            hash_index[i].type = HASH_INDEX_PACK;
+            hash_index[i].index = (i - blobs_length) / pack_count;
+            hash_index[i].slot = (i - blobs_length) % pack_count;
+        }
+    }
+
+    char *data;
+    size_t size;
+    FILE *section;
+
+    FILE *fp = fopen("manifest", "wb");
+    write_test_header(&header, fp);
+    write_test_section_data(NULL, 0, version, fp);
+    write_test_section_data(NULL, 0, version, fp);
+    write_test_section_data(NULL, 0, version, fp);
+    section = open_memstream(&data, &size);
+    for (uint32_t i=0; i<packs_length; i++) {
+        struct SFMF_PackEntry pack;
+        memset(&pack, 0, sizeof(pack));
+        make_test_hash(&(pack.hash), 2 * count + i);
+        pack.offset = offset + (uint64_t)i * pack_count * sfmf_filehash_size(version);
+        pack.count = pack_count;
+        sfmf_packentry_write(&pack, version, section);
+    }
+    write_test_section(section, &data, &size, version, fp);
+    section = open_memstream(&data, &size);
+    for (uint32_t i=0; i<blobs_length; i++) {
+        struct SFMF_BlobEntry blob;
+        memset(&blob, 0, sizeof(blob));
+        blob.hash = hash_index[i].hash;
+        sfmf_blobentry_write(&blob, version, section);
+    }
+    write_test_section(section, &data, &size, version, fp);
+    section = open_memstream(&data, &size);
+    if (version >= SFMF_VERSION_HASH_INDEX) {
+        struct SFMF_HashIndexEntry *sorted = calloc(count, sizeof(struct SFMF_HashIndexEntry));
+        memcpy(sorted, hash_index, count * sizeof(struct SFMF_HashIndexEntry));
+        uint32_t length = count;
+        sfmf_hashindex_sort(sorted, &length);
+        assert(length == count);
+        for (uint32_t i=0; i<length; i++) {
+            sfmf_hashindexentry_write(&(sorted[i]), version, section);
+        }
+        free(sorted);
+    }
+    write_test_section(section, &data, &size, version, fp);
+    section = open_memstream(&data, &size);
+    for (uint32_t i=blobs_length; i<count; i++) {
+        sfmf_filehash_write(&(hash_index[i].hash), version, section);
+    }
+    write_test_section(section, &data, &size, version, fp);
+    for (int i=MANIFEST_SECTION_DICTIONARY; version >= SFMF_VERSION_SECTION_TABLE && i<MANIFEST_SECTION_COUNT; i++) {
+        write_test_section_data(NULL, 0, version, fp);
+    }
+    write_test_section_table(version, fp);
+    fclose(fp);
+
+    double start = get_seconds();
+
+    struct ManifestReader *reader = manifestreader_open("manifest");
+    assert(reader != NULL);
+
+    // Classify every entry once (as sfmf-unpack does), plus the same number of misses
+    for (uint32_t i=0; i<count; i++) {
+        struct SFMF_HashIndexEntry found;
+        int res = manifestreader_find_hash(reader, &(hash_index[i].hash), &found);
+        assert(res == 1 && found.type == hash_index[i].type && found.index == hash_index[i].index);
+        assert(found.type == HASH_INDEX_BLOB || found.slot == hash_index[i].slot);
+
+        struct SFMF_FileHash miss;
+        make_test_hash(&miss, count + i);
+        res = manifestreader_find_hash(reader, &miss, &found);
+        assert(res == 0);
+    }
+
+    // Same hash value, but different size must not match
+    struct SFMF_FileHash other_size = hash_index[0].hash;
+    other_size.size++;
+    struct SFMF_HashIndexEntry found;
+    assert(manifestreader_find_hash(reader, &other_size, &found) == 0);
+
+    double elapsed = get_seconds() - start;
+    printf("Classified %d entries (version %d) in %.3f seconds\n", count, version, elapsed);
+    assert(elapsed < 10.0);
+
+    manifestreader_close(reader);
+    free(hash_index);
+    unlink("manifest");
+}
+
+static void test_records_64bit()
+{
+    // Version 1 records keep their original (32-bit) on-disk layout
+    assert(sfmf_filehash_size(1) == 28);
+    assert(sfmf_fileentry_size(1) == 64);
+    assert(sfmf_packentry_size(1) == 36);
+    assert(sfmf_blobentry_size(1) == 40);
+
+    // Sizes and offsets beyond 4 GiB survive a write/read round trip
+    const uint64_t big = 5ull * 1024 * 1024 * 1024 + 123;
+    uint32_t version = SFMF_CURRENT_VERSION;
+
+    struct SFMF_FileEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.type = ENTRY_FILE;
+    entry.zsize = big - 1;
+    entry.flags = BLOB_FLAG_ZSTD;
+    make_test_hash(&(entry.hash), 1);
+    entry.hash.size = big;
+
+    struct SFMF_PackEntry pack;
+    memset(&pack, 0, sizeof(pack));
+    make_test_hash(&(pack.hash), 2);
+    pack.offset = big + 1;
+    pack.count = 7;
+
+    struct SFMF_BlobEntry blob;
+    memset(&blob, 0, sizeof(blob));
+    make_test_hash(&(blob.hash), 3);
+    blob.flags = BLOB_FLAG_ZCOMPRESSED;
+    blob.offset = big + 2;
+    blob.size = big + 3;
+
+    FILE *fp = fopen("records", "w+b");
+    assert(fp != NULL);
+    assert(sfmf_fileentry_write(&entry, version, fp) == 1);
+    assert(sfmf_packentry_write(&pack, version, fp) == 1);
+    assert(sfmf_blobentry_write(&blob, version, fp) == 1);
+    assert(ftell(fp) == sfmf_fileentry_size(version) + sfmf_packentry_size(version) +
+            sfmf_blobentry_size(version));
+    rewind(fp);
+
+    struct SFMF_FileEntry entry2;
+    struct SFMF_PackEntry pack2;
+    struct SFMF_BlobEntry blob2;
+    assert(sfmf_fileentry_read(&entry2, version, fp) == 1);
+    assert(sfmf_packentry_read(&pack2, version, fp) == 1);
+    assert(sfmf_blobentry_read(&blob2, version, fp) == 1);
+    fclose(fp);
+    unlink("records");
+
+    assert(entry2.zsize == entry.zsize && sfmf_filehash_compare(&(entry2.hash), &(entry.hash)) == 0);
+    assert(entry2.flags == entry.flags);
+    assert(pack2.offset == pack.offset && pack2.count == pack.count);
+    assert(blob2.offset == blob.offset && blob2.size == blob.size && blob2.flags == blob.flags);
+
+    // Hashes differing only above 32 bits of their size are different
+    struct SFMF_FileHash a = entry.hash;
+    struct SFMF_FileHash b = entry.hash;
+    b.size -= 0x100000000ull;
+    assert(sfmf_filehash_compare(&a, &b) > 0);
+}
+
+static void test_fileentry_flags()
+{
+    // Before version 2, only zlib is used, and the flags are derived from zsize
+    struct SFMF_FileEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.type = ENTRY_FILE;
+    entry.zsize = 100;
+    entry.hash.size = 1000;
+
+    char buf[128];
+    for (uint32_t version=SFMF_MIN_VERSION; version<=SFMF_CURRENT_VERSION; version++) {
+        entry.flags = (version < SFMF_VERSION_CODECS) ? BLOB_FLAG_NONE : BLOB_FLAG_LZ4;
+
+        FILE *fp = fmemopen(buf, sizeof(buf), "w+b");
+        assert(sfmf_fileentry_write(&entry, version, fp) == 1);
+        rewind(fp);
+
+        struct SFMF_FileEntry entry2;
+        assert(sfmf_fileentry_read(&entry2, version, fp) == 1);
+        fclose(fp);
+
+        if (version < SFMF_VERSION_CODECS) {
+            assert(entry2.flags == BLOB_FLAG_ZCOMPRESSED);
+        } else {
+            assert(entry2.flags == BLOB_FLAG_LZ4);
+        }
+    }
+
+    // Incompressible files are stored uncompressed
+    entry.zsize = entry.hash.size + 10;
+    FILE *fp = fmemopen(buf, sizeof(buf), "w+b");
+    assert(sfmf_fileentry_write(&entry, SFMF_MIN_VERSION, fp) == 1);
+    rewind(fp);
+    assert(sfmf_fileentry_read(&entry, SFMF_MIN_VERSION, fp) == 1);
+    fclose(fp);
+    assert(entry.flags == BLOB_FLAG_NONE);
+}
+
+static void append_test_file(struct FileList *list, mode_t mode, uint32_t content, dev_t dev, ino_t ino)
+{
+    struct FileEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.filename = "file";
+    entry.st.st_mode = mode;
+    entry.st.st_dev = dev;
+    entry.st.st_ino = ino;
+    make_test_hash(&(entry.hash), content);
+    entry.st.st_size = (content != 0) ? entry.hash.size : 0;
+    entry.hardlink_index = -1;
+
+    filelist_append_clone(list, &entry);
+}
+
+static void test_mark_duplicates()
+{
+    struct FileList *list = filelist_new();
+
+    // Duplicate before hardlink: 1 is a duplicate of 0, 2 is a hardlink of that duplicate
+    append_test_file(list, S_IFREG | 0644, 1, 1, 1);
+    append_test_file(list, S_IFREG | 0644, 1, 1, 2);
+    append_test_file(list, S_IFREG | 0644, 1, 1, 2);
+
+    // Same inode number on different devices: 4 is a duplicate, but no hardlink
+    append_test_file(list, S_IFREG | 0644, 2, 1, 3);
+    append_test_file(list, S_IFREG | 0644, 2, 2, 3);
+
+    // Hardlinks refer to the most recent link of the same inode
+    append_test_file(list, S_IFREG | 0644, 3, 1, 4);
+    append_test_file(list, S_IFREG | 0644, 3, 1, 4);
+    append_test_file(list, S_IFREG | 0644, 3, 1, 4);
+
+    // Same inode with different content (file replaced while listing) is no hardlink
+    append_test_file(list, S_IFREG | 0644, 4, 1, 4);
+
+    // Empty files and directories are never duplicates
+    append_test_file(list, S_IFREG | 0644, 0, 1, 5);
+    append_test_file(list, S_IFREG | 0644, 0, 1, 5);
+    append_test_file(list, S_IFDIR | 0755, 1, 1, 1);
+
+    filelist_mark_duplicates(list);
+
+    int duplicate[] = { 0, 1, 1, 0, 1, 0, 1, 1, 0, 0, 0, 0 };
+    int hardlink_index[] = { -1, -1, 1, -1, -1, -1, 5, 6, -1, -1, -1, -1 };
+    assert(list->length == sizeof(duplicate) / sizeof(duplicate[0]));
+    for (int i=0; i<list->length; i++) {
+        assert(list->data[i].duplicate == duplicate[i]);
+        assert(list->data[i].hardlink_index == hardlink_index[i]);
+    }
+
+    filelist_free(list);
+}
+
+static void write_test_file(const char *filename, const char *data, size_t length, size_t count)
+{
+    FILE *fp = fopen(filename, "wb");
+    assert(fp != NULL);
+    for (size_t i=0; i<count; i++) {
+        assert(fwrite(data, length, 1, fp) == 1);
+    }
+    fclose(fp);
+}
+
+static void test_costmodel()
+{
+    char random[300*1024];
+    FILE *fp = fopen("/dev/urandom", "r");
+    assert(fread(random, sizeof(random), 1, fp) == 1);
+    fclose(fp);
+    write_test_file("random", random, sizeof(random), 1);
+
+    char text[4096];
+    for (int i=0; i<sizeof(text); i++) {
+        text[i] = 'a' + (random[i] & 7);
+    }
+    write_test_file("text", text, sizeof(text), 128);
+    uint64_t text_size = sizeof(text) * 128;
+
+    struct CostModel *model = costmodel_new();
+    struct CostEstimate estimate;
+
+    // Without adaptive selection, the configured codec is always used
+    assert(costmodel_choose(model, "random", sizeof(random), &estimate) == CONVERT_FLAG_ZCOMPRESS);
+
+    model->adaptive = 1;
+
+    // Incompressible data is stored
+    assert(costmodel_choose(model, "random", sizeof(random), &estimate) == CONVERT_FLAG_NONE);
+    assert(estimate.candidate == 0 && estimate.baseline_zsize == sizeof(random));
+    costmodel_account(model, &estimate, sizeof(random), sizeof(random));
+
+    // Compressible data is compressed if the download is the bottleneck
+    enum ConvertFlags flags = costmodel_choose(model, "text", text_size, &estimate);
+    assert(flags != CONVERT_FLAG_NONE && estimate.candidate != 0);
+    assert(estimate.baseline_zsize < text_size);
+    uint64_t zsize = 0;
+    struct SFMF_FileHash hash;
+    convert_file_zsize_hash_fp("text", &hash, &zsize, NULL, flags);
+    assert(zsize < text_size);
+    costmodel_account(model, &estimate, text_size, zsize);
+    assert(model->chosen[0].files == 1 && model->chosen[estimate.candidate].files == 1);
+    assert(model->baseline.files == 2);
+    costmodel_report(model);
+
+    // ...but not if decoding takes longer than downloading the whole file
+    model->bandwidth = 1e15;
+    assert(costmodel_choose(model, "text", text_size, &estimate) == CONVERT_FLAG_NONE);
+
+    assert(costmodel_set_decode_speed(model, "zlib=12.5") == 1);
+    assert(model->decode_speed[CONVERT_CODEC_ZLIB] == 12.5 * 1024 * 1024);
+    assert(costmodel_set_decode_speed(model, "zlib") == 0);
+    assert(costmodel_set_decode_speed(model, "zlib=") == 0);
+    assert(costmodel_set_decode_speed(model, "zlib=0") == 0);
+    assert(costmodel_set_decode_speed(model, "foo=10") == 0);
+
+    costmodel_free(model);
+    unlink("random");
+    unlink("text");
+}
+
+static void test_convert_dictionary()
+{
+    if (!convert_codec_available(CONVERT_CODEC_ZSTD)) {
+        assert(convert_set_dictionary("dictionary", 10) == 0);
+        return;
+    }
+
+    // Lots of small, similar files (like .desktop files), each too small to compress well on its own
+    const uint32_t count = 500;
+    const size_t max_length = 512;
+    char *samples = malloc(count * max_length);
+    size_t *sample_sizes = calloc(count, sizeof(size_t));
+    size_t samples_length = 0;
+    for (uint32_t i=0; i<count + 1; i++) {
+        char *sample = (i < count) ? samples + samples_length : malloc(max_length);
+        int length = snprintf(sample, max_length, "[Desktop Entry]\nType=Application\nName=Application %u\n"
+                "Icon=icon-launcher-%x\nExec=/usr/bin/app%u --prestart\nX-Nemo-Application-Type=silica-qt5\n"
+                "X-Nemo-Single-Instance=%s\n", i, i * 2654435761u, i * 7, (i & 1) ? "no" : "yes");
+        if (i < count) {
+            sample_sizes[i] = length;
+            samples_length += length;
+            continue;
+        }
+
+        // A file that was not part of the training set compresses much better with the dictionary
+        char *dictionary = malloc(16 * 1024);
+        size_t dictionary_length = convert_train_dictionary(samples, sample_sizes, count,
+                dictionary, 16 * 1024);
+        assert(dictionary_length > 0);
+        assert(!convert_codec_available(CONVERT_CODEC_ZSTD_DICT));
+        assert(convert_set_dictionary(dictionary, dictionary_length) == 1);
+        free(dictionary);
+        assert(convert_codec_available(CONVERT_CODEC_ZSTD_DICT));
+
+        uint64_t zsize = convert_buffer_size(sample, length, convert_flags_compress(CONVERT_CODEC_ZSTD));
+        uint64_t dict_zsize = convert_buffer_size(sample, length, convert_flags_compress(CONVERT_CODEC_ZSTD_DICT));
+        assert(dict_zsize * 2 < zsize);
+        free(sample);
+    }
+
+    test_convert_hasher(CONVERT_CODEC_ZSTD_DICT);
+
+    // Small files use the dictionary, other files the configured codec
+    write_test_file("small", samples, sample_sizes[0], 1);
+    struct CostModel *model = costmodel_new();
+    struct CostEstimate estimate;
+    model->dictionary_max_size = 1024;
+    assert(costmodel_choose(model, "small", sample_sizes[0], &estimate) ==
+            convert_flags_compress(CONVERT_CODEC_ZSTD_DICT));
+    assert(costmodel_choose(model, "small", 2048, &estimate) == CONVERT_FLAG_ZCOMPRESS);
+    costmodel_free(model);
+    unlink("small");
+
+    assert(convert_set_dictionary(NULL, 0) == 1);
+    assert(!convert_codec_available(CONVERT_CODEC_ZSTD_DICT));
+
+    free(sample_sizes);
+    free(samples);
+}
+
+// Reads blob index from a pack, checks that its data matches data
+static void check_pack_blob(struct PackReader *reader, struct SFMF_FileHash *hash, const char *data)
+{
+    struct SFMF_BlobEntry *entry = packreader_find(reader, hash);
+    assert(entry != NULL);
+
+    char *buf = NULL;
+    size_t length = 0;
+    FILE *fp = open_memstream(&buf, &length);
+    struct SFMF_FileHash written;
+    assert(packreader_write_blob(reader, entry, fp, &written) == 0);
+    fclose(fp);
+
+    assert(length == hash->size && memcmp(buf, data, length) == 0);
+    assert(sfmf_filehash_compare(&written, hash) == 0);
+    free(buf);
+}
+
+static void test_packreader_solid()
+{
+    // Two small (similar) blobs in one compressed block, and a big one in a stored block
+    char blobs[3][3000];
+    size_t sizes[3] = { 1000, 500, 3000 };
+    struct SFMF_FileHash hashes[3];
+    for (int i=0; i<3; i++) {
+        for (size_t j=0; j<sizes[i]; j++) {
+            blobs[i][j] = (i == 2) ? (char)(j * 2654435761u >> 13) : 'a' + (j % 13);
+        }
+
+        FILE *null = fopen("/dev/null", "wb");
+        convert_buffer_fp_hash(blobs[i], sizes[i], null, CONVERT_FLAG_NONE, &(hashes[i]));
+        fclose(null);
+    }
+
+    char *block0 = NULL;
+    size_t block0_size = 0;
+    FILE *zfp = open_memstream(&block0, &block0_size);
+    char solid[1500];
+    memcpy(solid, blobs[0], sizes[0]);
+    memcpy(solid + sizes[0], blobs[1], sizes[1]);
+    convert_buffer_fp(solid, sizeof(solid), zfp, CONVERT_FLAG_ZCOMPRESS);
+    fclose(zfp);
+
+    const char metadata[] = "solid";
+    struct SFPF_FileHeader header = { SFPF_MAGIC_NUMBER, SFPF_CURRENT_VERSION, sizeof(metadata), 3 };
+    uint32_t version = sfpf_blobentry_version(header.version);
+    uint64_t payload_offset = sizeof(header) + sizeof(metadata) + 3 * sfmf_blobentry_size(version) +
+        sizeof(uint32_t) + 2 * sfpf_blockentry_size();
+    struct SFPF_BlockEntry blocks[2] = {
+        { BLOB_FLAG_ZCOMPRESSED, payload_offset, block0_size, sizeof(solid) },
+        { BLOB_FLAG_NONE, payload_offset + block0_size, sizes[2], sizes[2] },
+    };
+
+    FILE *fp = fopen("pack", "wb");
+    sfpf_fileheader_write(&header, fp);
+    fwrite(metadata, sizeof(metadata), 1, fp);
+    uint64_t offset = 0;
+    for (int i=0; i<3; i++) {
+        struct SFMF_BlobEntry entry = { hashes[i], BLOB_FLAG_NONE, offset, sizes[i] };
+        sfmf_blobentry_write(&entry, version, fp);
+        offset += sizes[i];
+    }
+    uint32_t blocks_length = htonl(2);
+    fwrite(&blocks_length, sizeof(blocks_length), 1, fp);
+    for (int i=0; i<2; i++) {
+        sfpf_blockentry_write(&(blocks[i]), fp);
+    }
+    fwrite(block0, block0_size, 1, fp);
+    fwrite(blobs[2], sizes[2], 1, fp);
+    fclose(fp);
+    free(block0);
+
+    struct PackReader *reader = packreader_open("pack");
+    assert(reader->blocks_length == 2);
+
+    // The block of a single blob is streamed, the shared block decompressed once
+    check_pack_blob(reader, &(hashes[2]), blobs[2]);
+    assert(reader->block_data == NULL);
+    check_pack_blob(reader, &(hashes[0]), blobs[0]);
+    const char *block_data = reader->block_data;
+    assert(block_data != NULL && reader->block == 0);
+    check_pack_blob(reader, &(hashes[1]), blobs[1]);
+    assert(reader->block_data == block_data);
+    packreader_close(reader);
+
+    size_t size = 0;
+    enum SFMF_BlobEntry_Flag flags;
+    char *data = get_blob_from_pack("pack", &(hashes[1]), &size, &flags);
+    assert(data != NULL && size == sizes[1] && flags == BLOB_FLAG_NONE);
+    assert(memcmp(data, blobs[1], size) == 0);
+    free(data);
+
+    unlink("pack");
+}
+
+static void test_sparse()
+{
+    // Data, a zero run, data, a short zero run, data, and a hole up to the end
+    const uint64_t size = 2 * 1024 * 1024;
+    char *buf = calloc(1, size);
+    memset(buf, 'a', 8192);
+    memset(buf + 139264, 'b', 8192);
+    memset(buf + 155648, 'c', 8192);
+    FILE *fp = fopen("sparse", "wb");
+    assert(fwrite(buf, 163840, 1, fp) == 1);
+    fclose(fp);
+    assert(truncate("sparse", size) == 0);
+
+    struct SFMF_ExtentEntry *extents = NULL;
+    uint32_t count = sparse_scan_file("sparse", SPARSE_DEFAULT_MIN_RUN, &extents);
+    assert(count == 2);
+    assert(extents[0].offset == 8192 && extents[0].length == 131072);
+    assert(extents[1].offset == 163840 && extents[1].length == size - 163840);
+
+    // Written in odd-sized chunks, the zeros of the extents are skipped
+    fp = sparse_fopen("sparse", extents, count);
+    assert(fp != NULL);
+    for (uint64_t pos=0; pos<size; pos+=77777) {
+        size_t length = (size - pos < 77777) ? size - pos : 77777;
+        assert(fwrite(buf + pos, length, 1, fp) == 1);
+    }
+    assert(fclose(fp) == 0);
+
+    struct stat st;
+    assert(stat("sparse", &st) == 0);
+    assert(st.st_size == size && st.st_blocks * 512 < size / 2);
+
+    char *result = malloc(size);
+    fp = fopen("sparse", "rb");
+    assert(fread(result, size, 1, fp) == 1);
+    fclose(fp);
+    assert(memcmp(result, buf, size) == 0);
+
+    // Runs shorter than the minimum are not recorded
+    struct SFMF_ExtentEntry *long_runs = NULL;
+    assert(sparse_scan_file("sparse", 1024 * 1024, &long_runs) == 1);
+    assert(long_runs[0].offset == 163840);
+    free(long_runs);
+
+    // The same extents are found in the data passed in pieces (e.g. while hashing)
+    struct SparseScanner *scanner = sparse_scanner_new();
+    for (uint64_t pos=0; pos<size - 100; pos+=77777) {
+        size_t length = (size - 100 - pos < 77777) ? size - 100 - pos : 77777;
+        sparse_scanner_update(scanner, buf + pos, length);
+    }
+    struct SFMF_ExtentEntry *scanned = NULL;
+    assert(sparse_scanner_finish(scanner, SPARSE_DEFAULT_MIN_RUN, &scanned) == count);
+    assert(scanned[0].offset == extents[0].offset && scanned[0].length == extents[0].length);
+    assert(scanned[1].offset == extents[1].offset && scanned[1].length == extents[1].length - 100);
+    free(scanned);
+
+    // Data that isn't zero is written even within an extent
+    extents[0].offset = 0;
+    fp = sparse_fopen("sparse", extents, 1);
+    assert(fwrite(buf, 163840, 1, fp) == 1);
+    assert(fclose(fp) == 0);
+    fp = fopen("sparse", "rb");
+    assert(fread(result, 163840, 1, fp) == 1);
+    fclose(fp);
+    assert(memcmp(result, buf, 163840) == 0);
+    free(extents);
+
+    // Without zero runs, there are no extents
+    memset(buf, 'x', 4096);
+    write_test_file("sparse", buf, 4096, 32);
+    assert(sparse_scan_file("sparse", SPARSE_DEFAULT_MIN_RUN, &extents) == 0 && extents == NULL);
+
+    free(result);
+    free(buf);
+    unlink("sparse");
+}
+
+static void test_hashcache()
+{
+    write_test_file("cached", "hashcache", 9, 60000);
+    struct stat st;
+    assert(stat("cached", &st) == 0);
+
+    struct SFMF_FileHash hash, hash2;
+    make_test_hash(&hash, 42);
+    hash.size = st.st_size;
+    uint64_t zsize = 0;
+    enum ConvertFlags zconvert = CONVERT_FLAG_NONE;
+    struct SFMF_ExtentEntry zeros[2] = { { 0, 0, 65536 }, { 0, 131072, 262144 } };
+    struct SFMF_ExtentEntry *extents = NULL;
+    uint32_t extents_length = 0;
+
+    unlink("hashcache");
+    struct HashCache *cache = hashcache_open("hashcache", 1);
+    assert(!hashcache_lookup(cache, &st, &hash2, &zsize, &zconvert, &extents, &extents_length));
+    hashcache_store(cache, &st, &hash, 123, convert_flags_compress_level(CONVERT_CODEC_ZLIB, 9), zeros, 2);
+    assert(hashcache_lookup(cache, &st, &hash2, &zsize, &zconvert, &extents, &extents_length));
+    assert(extents_length == 2 && extents != zeros);
+    free(extents);
+    assert(hashcache_save(cache) == 0);
+    hashcache_free(cache);
+
+    // Results (including the level and the zero extents) are kept across runs
+    cache = hashcache_open("hashcache", 1);
+    assert(hashcache_lookup(cache, &st, &hash2, &zsize, &zconvert, &extents, &extents_length));
+    assert(sfmf_filehash_compare(&hash, &hash2) == 0);
+    assert(zsize == 123 && zconvert == convert_flags_compress_level(CONVERT_CODEC_ZLIB, 9));
+    assert(extents_length == 2 && extents[1].offset == zeros[1].offset && extents[1].length == zeros[1].length);
+    free(extents);
+    hashcache_free(cache);
+
+    // A different configuration starts from scratch
+    cache = hashcache_open("hashcache", 2);
+    assert(cache->length == 0 && !hashcache_lookup(cache, &st, &hash2, &zsize, &zconvert, &extents, &extents_length));
+    hashcache_free(cache);
+
+    // Modified files are not found
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    times[1].tv_nsec = (times[1].tv_nsec + 1) % 1000000000;
+    assert(utimensat(AT_FDCWD, "cached", times, 0) == 0);
+    struct stat st2;
+    assert(stat("cached", &st2) == 0);
+    cache = hashcache_open("hashcache", 1);
+    assert(hashcache_lookup(cache, &st, &hash2, &zsize, &zconvert, &extents, &extents_length));
+    free(extents);
+    assert(!hashcache_lookup(cache, &st2, &hash2, &zsize, &zconvert, &extents, &extents_length));
+
+    // Only entries used in a run are saved
+    assert(hashcache_save(cache) == 0);
+    hashcache_free(cache);
+    cache = hashcache_open("hashcache", 1);
+    assert(cache->length == 1);
+    assert(hashcache_save(cache) == 0);
+    hashcache_free(cache);
+    cache = hashcache_open("hashcache", 1);
+    assert(cache->length == 0);
+    hashcache_free(cache);
+
+    unlink("hashcache");
+    unlink("cached");
+}
+
+static void test_chunker()
+{
+    // Pseudo-random data, so that boundaries are found at the usual rate
+    const size_t size = 4 * 1024 * 1024;
+    const size_t inserted = 100;
+    char *buf = malloc(size + inserted);
+    uint32_t state = 1;
+    for (size_t i=0; i<size + inserted; i++) {
+        state = state * 1103515245 + 12345;
+        buf[i] = state >> 24;
+    }
+
+    // Data shorter than the minimum size is a single chunk
+    assert(chunker_next(buf, 1000) == 1000);
+    assert(chunker_next(buf, CHUNKER_MIN_SIZE) == CHUNKER_MIN_SIZE);
+
+    write_test_file("chunked", buf + inserted, size, 1);
+    struct SFMF_ChunkEntry *chunks = NULL;
+    uint32_t count = chunker_scan_file("chunked", &chunks, NULL, NULL);
+    printf("Chunker: %u chunks for %zu bytes\n", count, size);
+    assert(count > size / CHUNKER_MAX_SIZE && count < size / CHUNKER_MIN_SIZE);
+
+    uint64_t offset = 0;
+    for (uint32_t i=0; i<count; i++) {
+        assert(chunks[i].offset == offset);
+        assert(chunks[i].hash.size <= CHUNKER_MAX_SIZE);
+        assert(chunks[i].hash.size >= CHUNKER_MIN_SIZE || i == count - 1);
+        offset += chunks[i].hash.size;
+    }
+    assert(offset == size);
+
+    // Inserting data at the start only changes the first chunk(s)
+    write_test_file("chunked", buf, size + inserted, 1);
+    struct SFMF_ChunkEntry *modified = NULL;
+    uint32_t modified_count = chunker_scan_file("chunked", &modified, NULL, NULL);
+    uint32_t reused = 0;
+    for (uint32_t i=0; i<modified_count; i++) {
+        for (uint32_t j=0; j<count; j++) {
+            if (sfmf_filehash_compare(&(modified[i].hash), &(chunks[j].hash)) == 0) {
+                reused++;
+                break;
+            }
+        }
+    }
+    assert(reused >= count - 2);
+
+    free(modified);
+    free(chunks);
+    free(buf);
+    unlink("chunked");
+}
+
+static void check_delta(const char *base, size_t base_length, const char *target, size_t target_length,
+        size_t max_delta_length)
+{
+    char *delta = NULL;
+    size_t delta_length = 0;
+    FILE *fp = open_memstream(&delta, &delta_length);
+    assert(delta_encode(base, base_length, target, target_length, fp) == 0);
+    fclose(fp);
+    assert(delta_length <= max_delta_length);
+
+    write_test_file("base", base, base_length, base_length ? 1 : 0);
+    FILE *base_fp = fopen("base", "rb");
+    char *result = NULL;
+    size_t result_length = 0;
+    fp = open_memstream(&result, &result_length);
+    assert(delta_apply(delta, delta_length, base_fp, fp) == 0);
+    fclose(fp);
+    assert(result_length == target_length && memcmp(result, target, target_length) == 0);
+
+    // Truncated deltas are rejected
+    if (delta_length > 1) {
+        fp = fopen("/dev/null", "wb");
+        assert(delta_apply(delta, delta_length - 1, base_fp, fp) != 0);
+        fclose(fp);
+    }
+
+    fclose(base_fp);
+    free(result);
+    free(delta);
+    unlink("base");
+}
+
+static void test_delta()
+{
+    const size_t size = 1024 * 1024;
+    char *base = malloc(size);
+    char *target = malloc(size + 100);
+    uint32_t state = 1;
+    for (size_t i=0; i<size; i++) {
+        state = state * 1103515245 + 12345;
+        base[i] = state >> 24;
+    }
+
+    // Unchanged data is a single copy
+    check_delta(base, size, base, size, 32);
+
+    // Changed, inserted, removed and moved data
+    memcpy(target, base, size);
+    memset(target + 1000, 'x', 100);
+    memmove(target + 300100, target + 300000, size - 300000);
+    memcpy(target + 300000, "inserted", 8);
+    memmove(target + 500000, target + 600000, size + 100 - 600000);
+    memcpy(target + size - 100000, base + 700000, 50000);
+    check_delta(base, size, target, size - 99900, 4096);
+
+    // Data not in the base is inserted, empty base and target work
+    check_delta(base, size, base + 1, 31, 64);
+    check_delta("", 0, base, 1000, 1100);
+    check_delta(base, 1000, "", 0, 0);
+
+    free(target);
+    free(base);
+}
+
+static void test_filename_table()
+{
+    // Paths with long shared prefixes, as in a rootfs
+    const uint32_t count = 100;
+    char **filenames = calloc(count, sizeof(char *));
+    uint32_t plain_size = 0;
+    for (uint32_t i=0; i<count; i++) {
+        char tmp[256];
+        snprintf(tmp, sizeof(tmp), "/usr/share/locale/%c%c/LC_MESSAGES/file-%u.mo",
+                'a' + i / 260 % 26, 'a' + i / 10 % 26, i);
+        filenames[i] = strdup(tmp);
+        plain_size += strlen(tmp) + 1;
+    }
+
+    uint32_t version = SFMF_CURRENT_VERSION;
+    uint32_t filename_table_size = 0;
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t shared = sfmf_filename_shared_length(i, i ? filenames[i-1] : NULL, filenames[i]);
+        assert(i % SFMF_FILENAME_RESTART_INTERVAL != 0 || shared == 0);
+        filename_table_size += sfmf_filename_record_size(filenames[i], shared);
+    }
+    printf("Filename table: %u bytes front-coded, %u bytes plain\n", filename_table_size, plain_size);
+    assert(filename_table_size < plain_size / 2);
+
+    struct SFMF_FileHeader header = {
+        .magic = SFMF_MAGIC_NUMBER,
+        .version = version,
+        .metadata_size = 1,
+        .filename_table_size = filename_table_size,
+        .entries_length = count,
+    };
+
+    char *data;
+    size_t size;
+    FILE *section;
+
+    FILE *fp = fopen("manifest", "wb");
+    write_test_header(&header, fp);
+    write_test_section_data("", 1, version, fp);
+    uint32_t offset = 0;
+    uint32_t *offsets = calloc(count, sizeof(uint32_t));
+    section = open_memstream(&data, &size);
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t shared = sfmf_filename_shared_length(i, i ? filenames[i-1] : NULL, filenames[i]);
+        sfmf_filename_record_write(filenames[i], shared, section);
+        offsets[i] = offset;
+        offset += sfmf_filename_record_size(filenames[i], shared);
+    }
+    write_test_section(section, &data, &size, version, fp);
+    section = open_memstream(&data, &size);
+    for (uint32_t i=0; i<count; i++) {
+        struct SFMF_FileEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = ENTRY_FILE;
+        entry.filename_offset = offsets[i];
+        sfmf_fileentry_write(&entry, version, section);
+    }
+    write_test_section(section, &data, &size, version, fp);
+    // Empty packs index, blobs index, hash index, pack hashes, dictionary, zero extents, chunks and deltas
+    for (int i=0; i<8; i++) {
+        write_test_section_data("", 0, version, fp);
+    }
+    write_test_section_table(version, fp);
+    fclose(fp);
+    free(offsets);
+
+    struct ManifestReader *reader = manifestreader_open("manifest");
+    assert(reader != NULL);
+
+    // Compressed sections are only inflated when they are used
+    struct ManifestReaderSection *entries = &(reader->sections[MANIFEST_SECTION_ENTRIES]);
+    assert((entries->entry.flags & SECTION_FLAG_ZCOMPRESSED) != 0);
+    assert(entries->entry.stored_size < entries->entry.size);
+    assert(entries->data == NULL);
+
+    // Sequential access (incremental), backwards and with a stride (from restart points)
+    for (uint32_t i=0; i<count; i++) {
+        assert(strcmp(manifestreader_get_filename(reader, i), filenames[i]) == 0);
+    }
+    for (uint32_t i=count; i>0; i--) {
+        assert(strcmp(manifestreader_get_filename(reader, i - 1), filenames[i - 1]) == 0);
+    }
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t index = (i * 37) % count;
+        assert(strcmp(manifestreader_get_filename(reader, index), filenames[index]) == 0);
+    }
+
+    manifestreader_close(reader);
+    unlink("manifest");
+
+    for (uint32_t i=0; i<count; i++) {
+        free(filenames[i]);
+    }
+    free(filenames);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp(argv[1], "--benchmark") == 0) {
+        benchmark_sha1_backends();
+        return 0;
+    }
+
+    test_sha1_backends();
+    test_convert_hash();
+    for (int codec=0; codec<CONVERT_CODEC_COUNT; codec++) {
+        if (convert_codec_available(codec)) {
+            test_convert_hasher(codec);
+        }
+    }
+    test_hashindex();
+    test_manifestreader(1);
+    test_manifestreader(SFMF_CURRENT_VERSION);
+    test_manifest_hash_scaling(1);
+    test_manifest_hash_scaling(SFMF_CURRENT_VERSION);
+    test_records_64bit();
+    test_fileentry_flags();
+    test_mark_duplicates();
+    test_costmodel();
+    test_convert_dictionary();
+    test_packreader_solid();
+    test_sparse();
+    test_hashcache();
+    test_chunker();
+    test_delta();
+    test_filename_table();
 
     return 0;
 }
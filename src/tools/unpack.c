@@ -22,11 +22,19 @@
 #include "convert.h"
 #include "fileentry.h"
 #include "readpack.h"
+#include "readmanifest.h"
+#include "download.h"
+#include "sparse.h"
+#include "chunker.h"
+#include "delta.h"
+#include "hashindex.h"
+#include "fileindex.h"
 #include "logging.h"
 #include "dirstack.h"
 #include "policy.h"
 #include "cleanup.h"
 #include "control.h"
+#include "sha1hw.h"
 
 #define _XOPEN_SOURCE 500
 #define __USE_XOPEN_EXTENDED
@@ -36,10 +44,10 @@
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <errno.h>
 #include <libgen.h>
@@ -62,6 +70,23 @@ enum BlobResultType {
     BLOB_RESULT_FULL,
     BLOB_RESULT_EMPTY,
     BLOB_RESULT_HARDLINK,
+    BLOB_RESULT_CHUNKED,
+    BLOB_RESULT_DELTA,
+};
+
+// Where a chunk of a chunked file comes from (BLOB_RESULT_INCLUDED, _LOCAL or _PACKED)
+struct UnpackChunk {
+    struct SFMF_ChunkEntry chunk;
+    enum BlobResultType type;
+    uint32_t index; // blob index (included) or pack index (packed)
+    struct SFMF_ChunkEntry *local; // chunk of a reference file (entry = UnpackReference index)
+};
+
+// Local file that has been chunked on the fly, to find chunks of chunked files in it
+struct UnpackReference {
+    char *filename;
+    struct SFMF_ChunkEntry *chunks;
+    uint32_t length;
 };
 
 struct BlobResult {
@@ -79,13 +104,24 @@ struct BlobResult {
             enum BlobResultType type;
             struct SFMF_PackEntry *entry;
         } packed;
+        struct {
+            enum BlobResultType type;
+            struct UnpackChunk *chunks;
+            uint32_t count;
+        } chunked;
+        struct {
+            enum BlobResultType type;
+            struct FileEntry *base; // local file the delta is applied to
+            struct SFMF_DeltaEntry *entry;
+        } delta;
     };
 };
 
 struct UnpackFileEntry {
     struct SFMF_FileEntry entry;
     struct BlobResult blob_result;
-    char *target_filename;
+    char *target_filename; // points into UnpackOptions.target_filenames
+    const char *filename; // filename in the manifest (the end of target_filename)
 };
 
 struct UnpackOptions {
@@ -99,6 +135,8 @@ struct UnpackOptions {
     int progress;
     int download_only;
     int offline_mode;
+    int jobs;
+    int paranoid;
 
     struct {
         int current;
@@ -112,18 +150,31 @@ struct UnpackOptions {
     struct FileList *cached_files;
 
     // Runtime context data
-    FILE *fp;
+    struct ManifestReader *manifest;
     struct SFMF_FileHeader header;
-    char *metadata;
-    char *filename_table;
     struct UnpackFileEntry *fentries;
+    char *target_filenames; // storage for the target filenames of all fentries
     struct SFMF_PackEntry *pentries;
     struct SFMF_BlobEntry *bentries;
-    struct SFMF_FileHash **pack_hashes;
     struct FileList *local_files;
+    struct FileIndex *local_index;
     struct DirStack *dir_stack;
+    struct PackReader *pack_reader; // currently extracted pack
+    struct UnpackReference *references; // local files at the paths of chunked files
+    uint32_t references_length;
+    struct HashIndex *reference_chunks; // chunk hash -> chunk of a reference file
+    struct PackReader *chunk_pack_reader; // last pack used for chunks of chunked files
+    uint32_t chunk_pack_index;
+    FILE *reference_fp; // last reference file used for chunks of chunked files
+    uint32_t reference_index;
+    struct {
+        uint32_t local;
+        uint32_t included;
+        uint32_t packed;
+    } chunk_stats;
     char *manifest_local_filename;
-    char *temporary_download;
+    struct DownloadQueue *download_queue;
+    struct HashIndex *download_index; // files already checked or queued
     int success;
 };
 
@@ -133,6 +184,7 @@ const char *argp_program_bug_address = "info@sailfishos.org";
 // Forward declarations
 static char *get_filename_in_cache(struct UnpackOptions *opts, const char *filename);
 static int file_exists(const char *filename);
+static void draw_progress(struct UnpackOptions *opts, int i, int n, const char *message);
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
@@ -151,6 +203,15 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         case 'p':
             opts->progress = 1;
             break;
+        case 'P':
+            opts->paranoid = 1;
+            break;
+        case 'j':
+            opts->jobs = atoi(arg);
+            if (opts->jobs < 1) {
+                argp_error(state, "Invalid number of jobs: %s", arg);
+            }
+            break;
         case 'C':
             opts->cachedir = strdup(arg);
             // FIXME: Create parent directory, error checking, etc..
@@ -209,11 +270,13 @@ static void parse_opts(int argc, char *argv[], struct UnpackOptions *opts)
         // Controlling the output
         { "verbose", 'v', 0, 0, "Verbose output" },
         { "progress", 'p', 0, 0, "Show progress meter" },
+        { "paranoid", 'P', 0, 0, "Verify written files by reading them back" },
 
         // Download and cache directory controlling
         { "download", 'd', 0, 0, "Download only, do not unpack" },
         { "offline", 'D', 0, 0, "Do not try to download anything" },
         { "cache", 'C', "DIR", 0, "Use DIR as persistent local cache" },
+        { "jobs", 'j', "N", 0, "Download up to N files in parallel (default: 4)" },
 
         // Standard options for input and output selection
         { "<manifestfile>", 0, 0, OPTION_DOC, "SFMF file to unpack" },
@@ -232,7 +295,7 @@ static void parse_opts(int argc, char *argv[], struct UnpackOptions *opts)
     argp_parse(&argp, argc, argv, 0, 0, opts);
 }
 
-char *get_blob_data(struct UnpackOptions *opts, struct SFMF_FileEntry *entry, struct BlobResult *blob, size_t *size)
+static const char *get_blob_data(struct UnpackOptions *opts, struct BlobResult *blob, size_t *size)
 {
     // For now, we just assume included blobs (check for uncompressed outside)
     assert(blob->type == BLOB_RESULT_INCLUDED);
@@ -240,18 +303,9 @@ char *get_blob_data(struct UnpackOptions *opts, struct SFMF_FileEntry *entry, st
     // need to have size point to something
     assert(size);
 
-    size_t offset = blob->included.entry->offset;
+    // Points directly into the mapped manifest file (not '\0'-terminated)
     *size = blob->included.entry->size;
-    char *result = malloc(*size + 1);
-    memset(result, 0, *size + 1);
-
-    int res = fseek(opts->fp, offset, SEEK_SET);
-    assert(res == 0);
-
-    size_t read = fread(result, *size, 1, opts->fp);
-    assert(read == 1);
-
-    return result;
+    return manifestreader_get_blob_data(opts->manifest, blob->included.entry);
 }
 
 static char *make_pack_filename(struct SFMF_FileHash *hash)
@@ -278,6 +332,19 @@ static char *make_blob_filename(struct SFMF_FileHash *hash)
     return strdup(tmp);
 }
 
+static char *make_delta_filename(struct SFMF_FileHash *hash)
+{
+    char tmp[128];
+
+    int res = sfmf_filehash_format(hash, tmp, sizeof(tmp));
+    assert(res);
+
+    char filename[sizeof(tmp) + strlen(".delta")];
+    snprintf(filename, sizeof(filename), "%s.delta", tmp);
+
+    return strdup(filename);
+}
+
 static int file_exists(const char *filename)
 {
     struct stat st;
@@ -312,16 +379,22 @@ static int filelist_contains_filename(struct FileEntry *entry, void *user_data)
     return (strcmp(filename, entry->filename) == 0);
 }
 
-static char *download_payload_file(struct UnpackOptions *opts, const char *filename,
-        struct SFMF_FileHash *expected_hash, int is_compressed)
+static char *queue_payload_file(struct UnpackOptions *opts, const char *filename,
+        struct SFMF_FileHash *expected_hash, uint32_t blob_flags)
 {
-    char *source_file = get_filename_in_source(opts, filename);
     char *dest_file = get_filename_in_cache(opts, filename);
 
+    if (expected_hash) {
+        if (hashindex_insert(opts->download_index, expected_hash, expected_hash) != NULL) {
+            // Already checked (and possibly queued) for another entry
+            return dest_file;
+        }
+    }
+
     if (file_exists(dest_file) && expected_hash) {
         if (filelist_foreach(opts->cached_files, filelist_contains_filename, dest_file) != NULL) {
             // Already verified this file before
-        } else if (sfmf_filehash_verify(expected_hash, dest_file, is_compressed) == 0) {
+        } else if (sfmf_filehash_verify(expected_hash, dest_file, blob_flags) == 0) {
             // The file was already in the cache directory, and it verifies,
             // but it's not in opts->cached_files, so add it now
             filelist_append(opts->cached_files, dest_file, FILE_LIST_NONE);
@@ -332,117 +405,193 @@ static char *download_payload_file(struct UnpackOptions *opts, const char *filen
     }
 
     if (!file_exists(dest_file)) {
+        char *source_file = get_filename_in_source(opts, filename);
+
         if (opts->offline_mode) {
             SFMF_FAIL_AND_EXIT("Need to download %s, but offline mode requested.\n", source_file);
         }
 
         SFMF_LOG("Downloading: %s\n", source_file);
 
-        // Remember this file, as we need to clean it up if interrupted
-        opts->temporary_download = strdup(dest_file);
+        // The queue remembers active downloads, so we can clean them up if interrupted
+        downloadqueue_append(opts->download_queue, source_file, dest_file, expected_hash, blob_flags);
 
-        if (strncmp(source_file, "http://", 7) == 0 || strncmp(source_file, "https://", 8) == 0) {
-#if defined(USE_LIBCURL)
-            FILE *fp = fopen(dest_file, "w");
-            if (fp == NULL) {
-                SFMF_FAIL_AND_EXIT("Failed to create '%s'\n", dest_file);
-            }
-            int res = convert_url_fp(source_file, fp, CONVERT_FLAG_NONE);
-            assert(res == 0);
-            fclose(fp);
-#else
-            pid_t pid = fork();
-            if (pid == 0) {
-                char * const args[] = { "curl", "-o", dest_file, source_file, NULL };
-                if (execvp("curl", args) == -1) {
-                    SFMF_FAIL_AND_EXIT("Could not execute curl: %s\n", strerror(errno));
-                }
-            }
+        free(source_file);
+    }
 
-            int res = 0;
-            if (waitpid(pid, &res, 0) != pid) {
-                SFMF_FAIL_AND_EXIT("Could not wait for curl exit status: %s\n", strerror(errno));
-            }
-            if (WIFEXITED(res) && WEXITSTATUS(res) != 0) {
-                SFMF_FAIL_AND_EXIT("curl exited with non-zero exit status: %d\n", res);
-            }
-#endif
+    return dest_file;
+}
+
+struct UnpackDownloadContext {
+    struct UnpackOptions *opts;
+    int done;
+    int total;
+};
+
+static int unpack_download_done(struct DownloadQueueItem *item, void *user_data)
+{
+    struct UnpackDownloadContext *ctx = user_data;
+    struct UnpackOptions *opts = ctx->opts;
+
+    if (item->result != 0) {
+        SFMF_FAIL_AND_EXIT("Could not download %s\n", item->url);
+    }
+
+    if (item->expected_hash) {
+        // The hash has been calculated while downloading, no need to re-read the file
+        if (sfmf_filehash_check(item->expected_hash, &(item->hash), item->filename) == 0) {
+            filelist_append(opts->cached_files, item->filename, FILE_LIST_NONE);
         } else {
-            // Looks like a local file - just copy it over
-            int res = convert_file(source_file, dest_file, CONVERT_FLAG_NONE);
-            assert(res == 0);
+            // TODO: Retry download?
+            SFMF_WARN("Deleting %s as hash does not match (corrupt file?).\n", item->filename);
+            unlink(item->filename);
+            SFMF_FAIL_AND_EXIT("Could not download %s\n", item->url);
         }
+    } else {
+        SFMF_WARN("Unchecked file: %s (no expected_hash available)\n", item->filename);
+        filelist_append(opts->cached_files, item->filename, FILE_LIST_NONE);
+    }
 
-        if (expected_hash) {
-            if (sfmf_filehash_verify(expected_hash, dest_file, is_compressed) == 0) {
-                filelist_append(opts->cached_files, dest_file, FILE_LIST_NONE);
-            } else {
-                // TODO: Retry download?
-                SFMF_WARN("Deleting %s as hash does not match (corrupt file?).\n", dest_file);
-                unlink(dest_file);
-                // return NULL below, because we don't have the file
-                FREE_VAR(dest_file);
-            }
-        } else {
-            SFMF_WARN("Unchecked file: %s (no expected_hash available)\n", dest_file);
-            filelist_append(opts->cached_files, dest_file, FILE_LIST_NONE);
+    draw_progress(opts, ++ctx->done, ctx->total, item->url);
+
+    return !opts->abort;
+}
+
+static void download_queued_files(struct UnpackOptions *opts)
+{
+    struct UnpackDownloadContext ctx = { opts, 0, 0 };
+    for (int i=0; i<opts->download_queue->length; i++) {
+        if (opts->download_queue->data[i].state == DOWNLOAD_QUEUED) {
+            ctx.total++;
         }
+    }
 
-        FREE_VAR(opts->temporary_download);
+    if (ctx.total == 0) {
+        return;
     }
 
-    free(source_file);
+    int failed = downloadqueue_run(opts->download_queue, unpack_download_done, &ctx);
 
-    return dest_file;
+    if (opts->abort) {
+        SFMF_FAIL_AND_EXIT("Operation aborted via D-Bus\n");
+    }
+
+    assert(failed == 0);
 }
 
-static int write_file_from_pack(FILE *fp, const char *filename, struct SFMF_FileHash *hash)
+static FILE *open_blob_file(struct UnpackOptions *opts, uint32_t index, const char *filename)
 {
-    size_t size = 0;
-    enum SFMF_BlobEntry_Flag flags = 0;
+    uint32_t first = 0;
+    uint32_t count = manifestreader_find_extents(opts->manifest, index, &first);
+    if (count == 0) {
+        return fopen(filename, "wb");
+    }
 
-    char *data = get_blob_from_pack(filename, hash, &size, &flags);
+    // Don't write the zeros of zero extents, leaving holes in the file instead
+    struct SFMF_ExtentEntry *extents = calloc(count, sizeof(struct SFMF_ExtentEntry));
+    for (uint32_t i=0; i<count; i++) {
+        manifestreader_get_extent(opts->manifest, first + i, &(extents[i]));
+    }
 
-    if (data) {
-        enum ConvertFlags cflags = CONVERT_FLAG_NONE;
-        if ((flags & BLOB_FLAG_ZCOMPRESSED) != 0) {
-            cflags = CONVERT_FLAG_ZUNCOMPRESS;
-        }
+    FILE *fp = sparse_fopen(filename, extents, count);
+    free(extents);
 
-        int res = convert_buffer_fp(data, size, fp, cflags);
-        assert(res == 0);
+    return fp;
+}
 
-        free(data);
-        return 1;
+static void write_chunk_data(struct UnpackOptions *opts, struct UnpackChunk *c, FILE *fp)
+{
+    int res = 0;
+
+    switch (c->type) {
+        case BLOB_RESULT_INCLUDED:
+            {
+                struct SFMF_BlobEntry *blob = &(opts->bentries[c->index]);
+                const char *data = manifestreader_get_blob_data(opts->manifest, blob);
+                res = convert_buffer_fp((char *)data, blob->size, fp, convert_flags_for_blob(blob->flags));
+            }
+            break;
+        case BLOB_RESULT_LOCAL:
+            {
+                // Chunks are mostly read from the same reference file in sequence
+                if (opts->reference_fp == NULL || opts->reference_index != c->local->entry) {
+                    if (opts->reference_fp) {
+                        fclose(opts->reference_fp);
+                    }
+
+                    opts->reference_index = c->local->entry;
+                    opts->reference_fp = fopen(opts->references[opts->reference_index].filename, "rb");
+                    if (opts->reference_fp == NULL) {
+                        SFMF_FAIL_AND_EXIT("Cannot open %s: %s\n",
+                                opts->references[opts->reference_index].filename, strerror(errno));
+                    }
+                }
+
+                res = fseeko(opts->reference_fp, c->local->offset, SEEK_SET);
+                if (res == 0) {
+                    res = convert_file_range_fp(opts->reference_fp, c->chunk.hash.size, fp, CONVERT_FLAG_NONE);
+                }
+            }
+            break;
+        case BLOB_RESULT_PACKED:
+            {
+                if (opts->chunk_pack_reader == NULL || opts->chunk_pack_index != c->index) {
+                    if (opts->chunk_pack_reader) {
+                        packreader_close(opts->chunk_pack_reader);
+                    }
+
+                    char *pack_filename = make_pack_filename(&(opts->pentries[c->index].hash));
+                    char *pack_local_filename = get_filename_in_cache(opts, pack_filename);
+
+                    opts->chunk_pack_index = c->index;
+                    opts->chunk_pack_reader = packreader_open(pack_local_filename);
+                    if (opts->chunk_pack_reader == NULL) {
+                        SFMF_FAIL_AND_EXIT("Could not open pack file %s\n", pack_local_filename);
+                    }
+
+                    free(pack_local_filename);
+                    free(pack_filename);
+                }
+
+                struct SFMF_BlobEntry *pentry = packreader_find(opts->chunk_pack_reader, &(c->chunk.hash));
+                assert(pentry);
+
+                res = packreader_write_blob(opts->chunk_pack_reader, pentry, fp, NULL);
+            }
+            break;
+        default:
+            assert(0);
+            break;
     }
 
-    return 0;
+    if (res != 0) {
+        SFMF_FAIL_AND_EXIT("Could not write chunk at offset %" PRIu64 "\n", c->chunk.offset);
+    }
 }
 
-void write_blob_data(struct UnpackOptions *opts, struct SFMF_FileEntry *entry, struct BlobResult *blob, const char *filename)
+void write_blob_data(struct UnpackOptions *opts, uint32_t index, struct SFMF_FileEntry *entry,
+        struct BlobResult *blob, const char *filename)
 {
-    FILE *fp = fopen(filename, "wb");
+    FILE *fp = open_blob_file(opts, index, filename);
     if (fp == NULL) {
         SFMF_FAIL_AND_EXIT("Failed to create '%s'\n", filename);
     }
 
+    // Hash of the data as it is written (no need to read it back)
+    struct SFMF_FileHash hash;
+    memset(&hash, 0, sizeof(hash));
+
     switch (blob->type) {
         case BLOB_RESULT_INCLUDED:
             {
-                // Blob is included in the manifest, can seek and write data directly,
+                // Blob is included in the manifest, can write data directly from the mapping,
                 // might need to uncompress data using the converter functions
                 size_t size = 0;
-                char *data = get_blob_data(opts, entry, blob, &size);
+                const char *data = get_blob_data(opts, blob, &size);
 
-                enum ConvertFlags flags = CONVERT_FLAG_NONE;
-                if ((blob->included.entry->flags & BLOB_FLAG_ZCOMPRESSED) != 0) {
-                    flags = CONVERT_FLAG_ZUNCOMPRESS;
-                }
-
-                int res = convert_buffer_fp(data, size, fp, flags);
+                enum ConvertFlags flags = convert_flags_for_blob(blob->included.entry->flags);
+                int res = convert_buffer_fp_hash((char *)data, size, fp, flags, &hash);
                 assert(res == 0);
-
-                free(data);
             }
             break;
         case BLOB_RESULT_LOCAL:
@@ -450,27 +599,27 @@ void write_blob_data(struct UnpackOptions *opts, struct SFMF_FileEntry *entry, s
                 SFMF_DEBUG("Copying: %s -> %s\n", blob->local.entry->filename, filename);
                 FILE *in = fopen(blob->local.entry->filename, "rb");
                 assert(in != NULL);
-                int res = convert_file_fp(in, fp, CONVERT_FLAG_NONE);
+                int res = convert_file_fp_hash(in, fp, CONVERT_FLAG_NONE, &hash);
                 assert(res == 0);
                 fclose(in);
+
+                if (hash.hashtype == HASHTYPE_UNKNOWN) {
+                    // Reflinked, so the data is the same as the (hashed) local file
+                    hash = blob->local.entry->hash;
+                }
             }
             break;
         case BLOB_RESULT_PACKED:
             {
-                // Determine pack filename
-                char *pack_filename = make_pack_filename(&(blob->packed.entry->hash));
-                assert(pack_filename);
-
-                // File must have been downloaded already
-                char *pack_local_filename = get_filename_in_cache(opts, pack_filename);
-                assert(pack_local_filename && file_exists(pack_local_filename));
+                // Packed files are written pack-by-pack, with the pack opened
+                // by unpack_write_packed_entries() (see there)
+                assert(opts->pack_reader);
 
-                // Use pack functions to extract blob from pack
-                int res = write_file_from_pack(fp, pack_local_filename, &(entry->hash));
-                assert(res);
+                struct SFMF_BlobEntry *pentry = packreader_find(opts->pack_reader, &(entry->hash));
+                assert(pentry);
 
-                free(pack_local_filename);
-                free(pack_filename);
+                int res = packreader_write_blob(opts->pack_reader, pentry, fp, &hash);
+                assert(res == 0);
             }
             break;
         case BLOB_RESULT_FULL:
@@ -485,12 +634,7 @@ void write_blob_data(struct UnpackOptions *opts, struct SFMF_FileEntry *entry, s
 
                 // Use convert functions to cross-write blob from file
                 FILE *in = fopen(blob_local_filename, "rb");
-                enum ConvertFlags flags = CONVERT_FLAG_NONE;
-                if (entry->zsize < entry->hash.size) {
-                    // Compressed size is not equal to uncompressed size, so decompress
-                    flags = CONVERT_FLAG_ZUNCOMPRESS;
-                }
-                int res = convert_file_fp(in, fp, flags);
+                int res = convert_file_fp_hash(in, fp, convert_flags_for_blob(entry->flags), &hash);
                 assert(res == 0);
 
                 fclose(in);
@@ -499,6 +643,73 @@ void write_blob_data(struct UnpackOptions *opts, struct SFMF_FileEntry *entry, s
                 free(blob_filename);
             }
             break;
+        case BLOB_RESULT_CHUNKED:
+            {
+                // Chunks are written in order, hashing the file as it is assembled
+                struct ConvertHasher *hasher = convert_hasher_new(CONVERT_FLAG_NONE);
+                FILE *hfp = convert_hasher_fopen(hasher, fp);
+                assert(hfp != NULL);
+
+                for (uint32_t i=0; i<blob->chunked.count; i++) {
+                    write_chunk_data(opts, &(blob->chunked.chunks[i]), hfp);
+                }
+
+                fclose(hfp);
+                int res = convert_hasher_finish(hasher, &hash);
+                assert(res == 0);
+                convert_hasher_free(hasher);
+            }
+            break;
+        case BLOB_RESULT_DELTA:
+            {
+                struct SFMF_DeltaEntry *delta = blob->delta.entry;
+                char *delta_filename = make_delta_filename(&(delta->delta));
+                char *delta_local_filename = get_filename_in_cache(opts, delta_filename);
+                assert(file_exists(delta_local_filename));
+
+                // Deltas are much smaller than the file, so they are decompressed into memory
+                char *data = NULL;
+                size_t size = 0;
+                FILE *dfp = open_memstream(&data, &size);
+                assert(dfp != NULL);
+                FILE *in = fopen(delta_local_filename, "rb");
+                if (in == NULL) {
+                    SFMF_FAIL_AND_EXIT("Cannot open %s: %s\n", delta_local_filename, strerror(errno));
+                }
+                int res = convert_file_fp(in, dfp, convert_flags_for_blob(delta->flags));
+                fclose(in);
+                fclose(dfp);
+                if (res != 0) {
+                    SFMF_FAIL_AND_EXIT("Could not decompress delta %s\n", delta_local_filename);
+                }
+
+                SFMF_DEBUG("Applying delta: %s + %s -> %s\n", blob->delta.base->filename,
+                        delta_filename, filename);
+                FILE *base = fopen(blob->delta.base->filename, "rb");
+                if (base == NULL) {
+                    SFMF_FAIL_AND_EXIT("Cannot open %s: %s\n", blob->delta.base->filename, strerror(errno));
+                }
+
+                struct ConvertHasher *hasher = convert_hasher_new(CONVERT_FLAG_NONE);
+                FILE *hfp = convert_hasher_fopen(hasher, fp);
+                assert(hfp != NULL);
+
+                if (delta_apply(data, size, base, hfp) != 0) {
+                    SFMF_FAIL_AND_EXIT("Could not apply delta %s to %s\n", delta_filename,
+                            blob->delta.base->filename);
+                }
+
+                fclose(hfp);
+                res = convert_hasher_finish(hasher, &hash);
+                assert(res == 0);
+                convert_hasher_free(hasher);
+
+                fclose(base);
+                free(data);
+                free(delta_local_filename);
+                free(delta_filename);
+            }
+            break;
         case BLOB_RESULT_EMPTY:
             // all good, we need to write an empty file
             break;
@@ -507,41 +718,33 @@ void write_blob_data(struct UnpackOptions *opts, struct SFMF_FileEntry *entry, s
             break;
     }
 
-    fclose(fp);
+    // The hash is of the data as it was passed to stdio, so make sure all of it
+    // made it to the file (including the final flush, and truncating sparse files)
+    int write_error = ferror(fp);
+    if (fclose(fp) != 0 || write_error) {
+        SFMF_FAIL_AND_EXIT("Failed to write '%s': %s\n", filename, strerror(errno));
+    }
 
     if (blob->type != BLOB_RESULT_EMPTY) {
         // Verify if the written blob matches the expected hash in the manifest
+        if (opts->paranoid) {
+            // Read back the data from disk, in case the storage corrupts it
+            int res = convert_file_zsize_hash(filename, &hash, NULL);
+            assert(res == 0);
+        }
 
-        struct SFMF_FileHash hash;
-        memset(&hash, 0, sizeof(hash));
-        int res = convert_file_zsize_hash(filename, &hash, NULL);
-        assert(res == 0);
-
-        if (sfmf_filehash_compare(&hash, &(entry->hash)) != 0) {
-            char tmp[100];
-            int res = sfmf_filehash_format(&hash, tmp, sizeof(tmp));
-            assert(res);
-
-            SFMF_FAIL_AND_EXIT("File failed hash check: %s, got: %s\n",
-                    filename, tmp);
-        } else {
-            //SFMF_LOG("File passed hash check: %s\n", filename);
+        if (sfmf_filehash_check(&(entry->hash), &hash, filename) != 0) {
+            SFMF_FAIL_AND_EXIT("File failed hash check: %s\n", filename);
         }
     }
 }
 
-struct FileListSearchContext {
-    struct UnpackOptions *opts;
-    struct SFMF_FileHash *hash;
-    struct BlobResult *result;
-};
-
 static int filelist_download_summary(struct FileEntry *entry, void *user_data)
 {
-    size_t *total = user_data;
+    uint64_t *total = user_data;
 
-    int32_t size = entry->hash.size;
-    SFMF_LOG(" %10d KiB  %s\n", size / 1024, entry->filename);
+    uint64_t size = entry->hash.size;
+    SFMF_LOG(" %10" PRIu64 " KiB  %s\n", size / 1024, entry->filename);
 
     *total += size;
 
@@ -559,83 +762,126 @@ static int filelist_remove_file(struct FileEntry *entry, void *user_data)
     return 0;
 }
 
-static int filelist_search_blob_hash(struct FileEntry *entry, void *user_data)
+static void search_blob_hash(struct UnpackOptions *opts, struct SFMF_FileHash *hash,
+        struct BlobResult *result)
 {
-    struct FileListSearchContext *ctx = user_data;
+    result->type = BLOB_RESULT_INVALID;
 
-    if (entry->hash.size != ctx->hash->size) {
-        // Can skip entries that don't have a matching file size
-        return 0;
-    }
+    // Included blobs and packed files are found in the hash index of the manifest
+    struct SFMF_HashIndexEntry found;
+    int in_manifest = manifestreader_find_hash(opts->manifest, hash, &found);
 
-    if (entry->hash.hashtype == HASHTYPE_LAZY) {
-        // Lazily calculate hash if size matches
-        SFMF_DEBUG("Lazily calculating file hash: %s\n", entry->filename);
-        fileentry_calculate_zsize_hash(entry);
+    // 1. Search in included blobs
+    if (in_manifest && found.type == HASH_INDEX_BLOB) {
+        assert(found.index < opts->header.blobs_length);
+        result->type = BLOB_RESULT_INCLUDED;
+        result->included.entry = &(opts->bentries[found.index]);
+        return;
     }
 
-    // At this point, we must have a sha1 hash of the file (or we skipped it)
-    assert(entry->hash.hashtype == HASHTYPE_SHA1);
+    // 2. Search in local files (only files with matching size are hashed,
+    // and hardlinks to the same inode are only hashed once)
+    struct FileEntry *entry = fileindex_search(opts->local_index, hash);
 
-    if (sfmf_filehash_compare(ctx->hash, &(entry->hash)) == 0) {
-        //SFMF_DEBUG("Found matching hash: %s\n", entry->filename);
-        return 1;
-    } else {
-        //SFMF_DEBUG("No match: %s\n", entry->filename);
+    if (entry) {
+        result->type = BLOB_RESULT_LOCAL;
+        result->local.entry = entry;
+        return;
     }
 
-    return 0;
-}
-
-static void search_blob_hash(struct UnpackOptions *opts, struct SFMF_FileHash *hash,
-        struct BlobResult *result)
-{
-    result->type = BLOB_RESULT_INVALID;
+    // 3. Search in packed files
+    if (in_manifest && found.type == HASH_INDEX_PACK) {
+        assert(found.index < opts->header.packs_length);
+        result->type = BLOB_RESULT_PACKED;
+        result->packed.entry = &(opts->pentries[found.index]);
+        return;
+    }
 
-    // 1. Search in included blobs
-    for (int i=0; i<opts->header.blobs_length; i++) {
-        if (sfmf_filehash_compare(hash, &(opts->bentries[i].hash)) == 0) {
-            result->type = BLOB_RESULT_INCLUDED;
-            result->included.entry = &(opts->bentries[i]);
+    // 4. Search in deltas against local files (of a base release)
+    uint32_t first = 0;
+    uint32_t count = manifestreader_find_deltas(opts->manifest, hash, &first);
+    for (uint32_t i=0; i<count; i++) {
+        struct SFMF_DeltaEntry delta;
+        manifestreader_get_delta(opts->manifest, first + i, &delta);
+
+        entry = fileindex_search(opts->local_index, &(delta.base));
+        if (entry) {
+            result->type = BLOB_RESULT_DELTA;
+            result->delta.base = entry;
+            result->delta.entry = malloc(sizeof(struct SFMF_DeltaEntry));
+            *(result->delta.entry) = delta;
             return;
         }
     }
 
-    // 2. Search in local files
-    struct FileListSearchContext search_ctx = {
-        opts,
-        hash,
-        result,
-    };
+    // 5. Search in / fallback to full blob downloads
+    result->type = BLOB_RESULT_FULL;
+}
 
-    // TODO: Keep list of (device, inode) pairs that have already been visited
-    // to avoid hashing all hardlinks (e.g. happened with 1.1.1.27 on top of 1.1.3.91)
+static void unpack_chunk_references(struct UnpackOptions *opts, const char *filename)
+{
+    // Older versions of a chunked file are usually found at the same path
+    for (int i=0; i<opts->n_sourcedirs; i++) {
+        char tmp[PATH_MAX];
+        snprintf(tmp, sizeof(tmp), "%s%s", opts->sourcedirs[i], filename);
 
-    struct FileEntry *entry = filelist_foreach(opts->local_files, filelist_search_blob_hash, &search_ctx);
+        struct stat st;
+        if (lstat(tmp, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || access(tmp, R_OK) != 0) {
+            continue;
+        }
 
-    if (entry) {
-        result->type = BLOB_RESULT_LOCAL;
-        result->local.entry = entry;
-        return;
-    }
+        struct UnpackReference *reference = NULL;
+        opts->references = realloc(opts->references,
+                sizeof(struct UnpackReference) * (opts->references_length + 1));
+        reference = &(opts->references[opts->references_length]);
+        reference->filename = strdup(tmp);
+        reference->length = chunker_scan_file(tmp, &(reference->chunks), NULL, NULL);
 
-    // 3. Search in packed files
-    for (int i=0; i<opts->header.packs_length; i++) {
-        struct SFMF_PackEntry *entry = &(opts->pentries[i]);
+        for (uint32_t j=0; j<reference->length; j++) {
+            reference->chunks[j].entry = opts->references_length;
+            (void)hashindex_insert(opts->reference_chunks, &(reference->chunks[j].hash), &(reference->chunks[j]));
+        }
 
-        for (int j=0; j<entry->count; j++) {
-            struct SFMF_FileHash *fhash = &(opts->pack_hashes[i][j]);
+        opts->references_length++;
+    }
+}
 
-            if (sfmf_filehash_compare(hash, fhash) == 0) {
-                result->type = BLOB_RESULT_PACKED;
-                result->packed.entry = entry;
-                return;
-            }
+static void unpack_classify_chunks(struct UnpackOptions *opts, struct UnpackFileEntry *e,
+        uint32_t first, uint32_t count)
+{
+    unpack_chunk_references(opts, e->filename);
+
+    struct UnpackChunk *chunks = calloc(count, sizeof(struct UnpackChunk));
+
+    for (uint32_t i=0; i<count; i++) {
+        struct UnpackChunk *c = &(chunks[i]);
+        manifestreader_get_chunk(opts->manifest, first + i, &(c->chunk));
+
+        // Same order as for whole files (see search_blob_hash())
+        struct SFMF_HashIndexEntry found;
+        int in_manifest = manifestreader_find_hash(opts->manifest, &(c->chunk.hash), &found);
+
+        if (in_manifest && found.type == HASH_INDEX_BLOB) {
+            assert(found.index < opts->header.blobs_length);
+            c->type = BLOB_RESULT_INCLUDED;
+            c->index = found.index;
+            opts->chunk_stats.included++;
+        } else if ((c->local = hashindex_lookup(opts->reference_chunks, &(c->chunk.hash))) != NULL) {
+            c->type = BLOB_RESULT_LOCAL;
+            opts->chunk_stats.local++;
+        } else if (in_manifest && found.type == HASH_INDEX_PACK) {
+            assert(found.index < opts->header.packs_length);
+            c->type = BLOB_RESULT_PACKED;
+            c->index = found.index;
+            opts->chunk_stats.packed++;
+        } else {
+            SFMF_FAIL_AND_EXIT("Chunk at offset %" PRIu64 " of %s not found\n", c->chunk.offset, e->filename);
         }
     }
 
-    // 4. Search in / fallback to full blob downloads
-    result->type = BLOB_RESULT_FULL;
+    e->blob_result.type = BLOB_RESULT_CHUNKED;
+    e->blob_result.chunked.chunks = chunks;
+    e->blob_result.chunked.count = count;
 }
 
 static void unpack_dirstack_entry_pop(struct DirStackEntry *entry)
@@ -658,10 +904,6 @@ static void unpack_dirstack_entry_pop(struct DirStackEntry *entry)
 
 static void unpack_classify_entry(struct UnpackOptions *opts, struct UnpackFileEntry *e)
 {
-    const char *filename = opts->filename_table + e->entry.filename_offset;
-    e->target_filename = malloc(strlen(opts->outputdir) + strlen(filename) + 1);
-    sprintf(e->target_filename, "%s%s", opts->outputdir, filename);
-
     char filetype = '?';
     switch (e->entry.type) {
         case ENTRY_DIRECTORY: filetype = 'd'; break;
@@ -688,6 +930,18 @@ static void unpack_classify_entry(struct UnpackOptions *opts, struct UnpackFileE
         e->blob_result.type = BLOB_RESULT_HARDLINK;
     } else if (e->entry.hash.size > 0) {
         search_blob_hash(opts, &(e->entry.hash), &(e->blob_result));
+
+        // Files that are not available as a whole might be assembled from chunks
+        uint32_t first = 0;
+        uint32_t count = 0;
+        if (e->blob_result.type == BLOB_RESULT_FULL) {
+            count = manifestreader_find_chunks(opts->manifest, e - opts->fentries, &first);
+        }
+
+        if (count > 0) {
+            unpack_classify_chunks(opts, e, first, count);
+        }
+
         switch (e->blob_result.type) {
             case BLOB_RESULT_INCLUDED:
                 info = "INCLUDED";
@@ -701,6 +955,12 @@ static void unpack_classify_entry(struct UnpackOptions *opts, struct UnpackFileE
             case BLOB_RESULT_FULL:
                 info = "DOWNBLOB";
                 break;
+            case BLOB_RESULT_CHUNKED:
+                info = "CHUNKED";
+                break;
+            case BLOB_RESULT_DELTA:
+                info = "DOWNDELT";
+                break;
             default:
                 assert(0);
                 break;
@@ -713,12 +973,12 @@ static void unpack_classify_entry(struct UnpackOptions *opts, struct UnpackFileE
     // Shorten blob display
     tmp[10] = '\0';
 
-    SFMF_DEBUG("[%c] %06o %6d:%6d (%s, %s) (%9d b, %9d z) %s\n",
+    SFMF_DEBUG("[%c] %06o %6d:%6d (%s, %s) (%9" PRIu64 " b, %9" PRIu64 " z) %s\n",
                filetype, e->entry.mode, e->entry.uid, e->entry.gid, tmp,
                info, e->entry.hash.size, e->entry.zsize, e->target_filename);
 }
 
-static void unpack_download_requirements(struct UnpackOptions *opts, struct UnpackFileEntry *e)
+static void unpack_queue_requirements(struct UnpackOptions *opts, struct UnpackFileEntry *e)
 {
     if (e->entry.type == ENTRY_FILE) {
         switch (e->blob_result.type) {
@@ -728,24 +988,40 @@ static void unpack_download_requirements(struct UnpackOptions *opts, struct Unpa
                     char *pack_filename = make_pack_filename(expected_hash);
                     assert(pack_filename);
 
-                    char *pack_local_filename = download_payload_file(opts, pack_filename, expected_hash, 0);
-                    assert(pack_local_filename);
-
-                    free(pack_local_filename);
+                    free(queue_payload_file(opts, pack_filename, expected_hash, BLOB_FLAG_NONE));
                     free(pack_filename);
                 }
                 break;
+            case BLOB_RESULT_CHUNKED:
+                for (uint32_t i=0; i<e->blob_result.chunked.count; i++) {
+                    struct UnpackChunk *c = &(e->blob_result.chunked.chunks[i]);
+                    if (c->type == BLOB_RESULT_PACKED) {
+                        struct SFMF_FileHash *expected_hash = &(opts->pentries[c->index].hash);
+                        char *pack_filename = make_pack_filename(expected_hash);
+                        assert(pack_filename);
+
+                        free(queue_payload_file(opts, pack_filename, expected_hash, BLOB_FLAG_NONE));
+                        free(pack_filename);
+                    }
+                }
+                break;
+            case BLOB_RESULT_DELTA:
+                {
+                    struct SFMF_DeltaEntry *delta = e->blob_result.delta.entry;
+                    char *delta_filename = make_delta_filename(&(delta->delta));
+                    assert(delta_filename);
+
+                    free(queue_payload_file(opts, delta_filename, &(delta->delta), delta->flags));
+                    free(delta_filename);
+                }
+                break;
             case BLOB_RESULT_FULL:
                 {
                     struct SFMF_FileHash *expected_hash = &(e->entry.hash);
                     char *blob_filename = make_blob_filename(expected_hash);
                     assert(blob_filename);
 
-                    int is_compressed = (e->entry.zsize < e->entry.hash.size);
-                    char *blob_local_filename = download_payload_file(opts, blob_filename, expected_hash, is_compressed);
-                    assert(blob_local_filename);
-
-                    free(blob_local_filename);
+                    free(queue_payload_file(opts, blob_filename, expected_hash, e->entry.flags));
                     free(blob_filename);
                 }
                 break;
@@ -763,12 +1039,16 @@ static void unpack_write_entry(struct UnpackOptions *opts, struct UnpackFileEntr
     switch (e->entry.type) {
         case ENTRY_DIRECTORY:
             res = mkdir(e->target_filename, 0755);
-            if (res != 0 && !(strcmp(opts->filename_table + e->entry.filename_offset, "/") == 0 && errno == EEXIST)) {
+            if (res != 0 && !(strcmp(e->filename, "/") == 0 && errno == EEXIST)) {
                 SFMF_FAIL_AND_EXIT("Failed to create '%s': %s\n", e->target_filename, strerror(errno));
             }
             break;
         case ENTRY_FILE:
-            write_blob_data(opts, &(e->entry), &(e->blob_result), e->target_filename);
+            if (e->blob_result.type == BLOB_RESULT_PACKED) {
+                // Written later, in one pass per pack (unpack_write_packed_entries)
+                break;
+            }
+            write_blob_data(opts, e - opts->fentries, &(e->entry), &(e->blob_result), e->target_filename);
             break;
         case ENTRY_SYMLINK:
             {
@@ -776,10 +1056,11 @@ static void unpack_write_entry(struct UnpackOptions *opts, struct UnpackFileEntr
                 // into the file, and that the contents are uncompressed, so we can read them
                 // directly (it usually doesn't make sense to compress symlink data too much)
                 assert(e->blob_result.type == BLOB_RESULT_INCLUDED);
-                assert((e->blob_result.included.entry->flags & BLOB_FLAG_ZCOMPRESSED) == 0);
+                assert(e->blob_result.included.entry->flags == BLOB_FLAG_NONE);
 
                 size_t size = 0;
-                char *symlink_target = get_blob_data(opts, &(e->entry), &(e->blob_result), &size);
+                const char *data = get_blob_data(opts, &(e->blob_result), &size);
+                char *symlink_target = strndup(data, size);
                 assert(symlink_target != NULL);
                 //SFMF_LOG("Symlink: '%s' -> '%s'\n", fn, symlink_target);
                 res = symlink(symlink_target, e->target_filename);
@@ -803,22 +1084,8 @@ static void unpack_write_entry(struct UnpackOptions *opts, struct UnpackFileEntr
             }
             break;
         case ENTRY_HARDLINK:
-            {
-                assert(e->blob_result.type == BLOB_RESULT_HARDLINK);
-                //assert(e->entry.dev >= 0 && entry->dev < opts->header.entries_length && entry->dev < i);
-                assert(e->entry.dev >= 0 && e->entry.dev < opts->header.entries_length); // FIXME: entry->dev < i)
-
-                struct SFMF_FileEntry *hentry = &(opts->fentries[e->entry.dev].entry);
-                const char *hfilename = opts->filename_table + hentry->filename_offset;
-                char *hfn = malloc(strlen(opts->outputdir) + strlen(hfilename) + 1);
-                sprintf(hfn, "%s%s", opts->outputdir, hfilename);
-                int res = link(hfn, e->target_filename);
-                if (res != 0) {
-                    SFMF_FAIL_AND_EXIT("Failed to create '%s' (from '%s'): %s\n", e->target_filename,
-                            hfn, strerror(errno));
-                }
-                free(hfn);
-            }
+            // Written after packed files, as the hardlink source might be
+            // a packed file (see unpack_write_hardlink)
             break;
         default:
             assert(0);
@@ -826,6 +1093,24 @@ static void unpack_write_entry(struct UnpackOptions *opts, struct UnpackFileEntr
     }
 }
 
+static void unpack_write_hardlink(struct UnpackOptions *opts, struct UnpackFileEntry *e)
+{
+    if (e->entry.type != ENTRY_HARDLINK) {
+        return;
+    }
+
+    assert(e->blob_result.type == BLOB_RESULT_HARDLINK);
+    //assert(e->entry.dev >= 0 && entry->dev < opts->header.entries_length && entry->dev < i);
+    assert(e->entry.dev >= 0 && e->entry.dev < opts->header.entries_length); // FIXME: entry->dev < i)
+
+    const char *hfn = opts->fentries[e->entry.dev].target_filename;
+    int res = link(hfn, e->target_filename);
+    if (res != 0) {
+        SFMF_FAIL_AND_EXIT("Failed to create '%s' (from '%s'): %s\n", e->target_filename,
+                hfn, strerror(errno));
+    }
+}
+
 static void unpack_set_permissions(struct UnpackOptions *opts, struct UnpackFileEntry *e)
 {
     // Set numeric owner/group, also for symlinks (set the link, not the
@@ -871,6 +1156,19 @@ static void unpack_set_permissions(struct UnpackOptions *opts, struct UnpackFile
 }
 
 
+static void unpack_close_chunk_sources(struct UnpackOptions *opts)
+{
+    if (opts->chunk_pack_reader) {
+        packreader_close(opts->chunk_pack_reader);
+        opts->chunk_pack_reader = 0;
+    }
+
+    if (opts->reference_fp) {
+        fclose(opts->reference_fp);
+        opts->reference_fp = 0;
+    }
+}
+
 void unpack_cleanup(void *user_data)
 {
     struct UnpackOptions *opts = user_data;
@@ -880,18 +1178,39 @@ void unpack_cleanup(void *user_data)
         opts->dir_stack = 0;
     }
 
+    if (opts->pack_reader) {
+        packreader_close(opts->pack_reader);
+        opts->pack_reader = 0;
+    }
+
+    unpack_close_chunk_sources(opts);
+
+    if (opts->reference_chunks) {
+        hashindex_free(opts->reference_chunks);
+        opts->reference_chunks = 0;
+    }
+
+    for (uint32_t i=0; i<opts->references_length; i++) {
+        FREE_VAR(opts->references[i].filename);
+        FREE_VAR(opts->references[i].chunks);
+    }
+    FREE_VAR(opts->references);
+    opts->references_length = 0;
+
     if (!opts->success) {
         // TODO: Also cleanup partially unpacked files, as we didn't arrive at
         // the end (although probably the caller does this for us, too)
     }
 
-    if (opts->temporary_download) {
-        int res = remove(opts->temporary_download);
-        if (res != 0) {
-            SFMF_WARN("Cannot remove temporary download %s: %s\n",
-                      opts->temporary_download, strerror(errno));
-        }
-        FREE_VAR(opts->temporary_download);
+    if (opts->download_queue) {
+        downloadqueue_remove_partial(opts->download_queue);
+        downloadqueue_free(opts->download_queue);
+        opts->download_queue = 0;
+    }
+
+    if (opts->download_index) {
+        hashindex_free(opts->download_index);
+        opts->download_index = 0;
     }
 
     if (!opts->keep_cached_files) {
@@ -907,29 +1226,31 @@ void unpack_cleanup(void *user_data)
         }
     }
 
-    if (opts->pack_hashes) {
-        for (int i=0; i<opts->header.packs_length; i++) {
-            FREE_VAR(opts->pack_hashes[i]);
-        }
-
-        FREE_VAR(opts->pack_hashes);
+    if (opts->local_index) {
+        fileindex_free(opts->local_index);
+        opts->local_index = 0;
     }
 
+
     if (opts->fentries) {
         for (int i=0; i<opts->header.entries_length; i++) {
-            FREE_VAR(opts->fentries[i].target_filename);
+            if (opts->fentries[i].blob_result.type == BLOB_RESULT_CHUNKED) {
+                FREE_VAR(opts->fentries[i].blob_result.chunked.chunks);
+            } else if (opts->fentries[i].blob_result.type == BLOB_RESULT_DELTA) {
+                FREE_VAR(opts->fentries[i].blob_result.delta.entry);
+            }
         }
     }
 
+    FREE_VAR(opts->target_filenames);
     FREE_VAR(opts->bentries);
     FREE_VAR(opts->pentries);
-    FREE_VAR(opts->metadata);
     FREE_VAR(opts->fentries);
-    FREE_VAR(opts->filename_table);
 
-    if (opts->fp) {
-        fclose(opts->fp);
-        opts->fp = 0;
+    if (opts->manifest) {
+        manifestreader_close(opts->manifest);
+        opts->manifest = 0;
+        convert_set_dictionary(NULL, 0);
     }
 
     FREE_VAR(opts->manifest_local_filename);
@@ -943,15 +1264,15 @@ void unpack_cleanup(void *user_data)
     sfmf_control_close();
 }
 
-static void draw_progress(struct UnpackOptions *opts, int i, const char *message)
+static void draw_progress(struct UnpackOptions *opts, int i, int n, const char *message)
 {
     static float last_progress = -1.f;
 
     // i == -1 means "starting" (0%), i == -2 means "finished" (100%)
     // (this value also controls whether a newline or carriage return
-    // is printed, for on-screen progress updates)
-    float partial = (opts->header.entries_length && i >= 0)
-        ? fminf(1.f, i / (float)opts->header.entries_length)
+    // is printed, for on-screen progress updates), n is the item count
+    float partial = (n && i >= 0)
+        ? fminf(1.f, i / (float)n)
         : (i == -1 ? 0.f : 1.f);
 
     float progress = fminf(1.f, (opts->steps.current + partial) / (float)opts->steps.total);
@@ -979,7 +1300,7 @@ static void draw_progress(struct UnpackOptions *opts, int i, const char *message
 static void next_step(struct UnpackOptions *opts, const char *message)
 {
     opts->steps.current++;
-    draw_progress(opts, -1, message);
+    draw_progress(opts, -1, 0, message);
 }
 
 static void foreach_unpack_entry(struct UnpackOptions *opts, void (*f)(struct UnpackOptions *opts, struct UnpackFileEntry *e))
@@ -991,15 +1312,127 @@ static void foreach_unpack_entry(struct UnpackOptions *opts, void (*f)(struct Un
             SFMF_FAIL_AND_EXIT("Operation aborted via D-Bus\n");
         }
 
-        const char *filename = opts->filename_table + e->entry.filename_offset;
-        draw_progress(opts, i, filename);
+        draw_progress(opts, i, opts->header.entries_length, e->filename);
 
         f(opts, e);
 
         sfmf_control_process();
     }
 
-    draw_progress(opts, -2, "DONE");
+    draw_progress(opts, -2, 0, "DONE");
+}
+
+struct UnpackPackedItem {
+    struct UnpackFileEntry *e;
+    uint32_t pack_index;
+    uint32_t entry_index;
+    uint64_t offset; // offset of the blob in the pack file
+};
+
+static int unpack_packed_item_compare_pack(const void *a, const void *b)
+{
+    const struct UnpackPackedItem *ia = a;
+    const struct UnpackPackedItem *ib = b;
+
+    if (ia->pack_index != ib->pack_index) {
+        return (ia->pack_index < ib->pack_index) ? -1 : 1;
+    }
+
+    return (ia->entry_index < ib->entry_index) ? -1 : (ia->entry_index > ib->entry_index);
+}
+
+static int unpack_packed_item_compare_offset(const void *a, const void *b)
+{
+    const struct UnpackPackedItem *ia = a;
+    const struct UnpackPackedItem *ib = b;
+
+    if (ia->offset != ib->offset) {
+        return (ia->offset < ib->offset) ? -1 : 1;
+    }
+
+    return (ia->entry_index < ib->entry_index) ? -1 : (ia->entry_index > ib->entry_index);
+}
+
+static void unpack_write_packed_entries(struct UnpackOptions *opts)
+{
+    // Group all packed files by pack, so that every pack is opened only
+    // once, and its blobs are read sequentially in order of their offset
+    uint32_t count = 0;
+    struct UnpackPackedItem *items = calloc(opts->header.entries_length ?: 1, sizeof(struct UnpackPackedItem));
+
+    for (int i=0; i<opts->header.entries_length; i++) {
+        struct UnpackFileEntry *e = &(opts->fentries[i]);
+
+        if (e->entry.type == ENTRY_FILE && e->blob_result.type == BLOB_RESULT_PACKED) {
+            struct UnpackPackedItem *item = &(items[count++]);
+            item->e = e;
+            item->pack_index = e->blob_result.packed.entry - opts->pentries;
+            item->entry_index = i;
+        }
+    }
+
+    qsort(items, count, sizeof(struct UnpackPackedItem), unpack_packed_item_compare_pack);
+
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t first = done;
+        uint32_t last = first;
+        while (last < count && items[last].pack_index == items[first].pack_index) {
+            last++;
+        }
+
+        char *pack_filename = make_pack_filename(&(opts->pentries[items[first].pack_index].hash));
+        assert(pack_filename);
+
+        // File must have been downloaded already
+        char *pack_local_filename = get_filename_in_cache(opts, pack_filename);
+        assert(pack_local_filename && file_exists(pack_local_filename));
+
+        SFMF_DEBUG("Extracting %d files from %s\n", last - first, pack_filename);
+        opts->pack_reader = packreader_open(pack_local_filename);
+
+        for (uint32_t i=first; i<last; i++) {
+            struct SFMF_BlobEntry *pentry = packreader_find(opts->pack_reader, &(items[i].e->entry.hash));
+            if (pentry == NULL) {
+                SFMF_FAIL_AND_EXIT("Pack %s does not contain %s\n", pack_filename,
+                        items[i].e->target_filename);
+            }
+            items[i].offset = pentry->offset;
+        }
+
+        qsort(items + first, last - first, sizeof(struct UnpackPackedItem), unpack_packed_item_compare_offset);
+
+        for (uint32_t i=first; i<last; i++) {
+            struct UnpackFileEntry *e = items[i].e;
+
+            if (opts->abort) {
+                SFMF_FAIL_AND_EXIT("Operation aborted via D-Bus\n");
+            }
+
+            draw_progress(opts, i, count, e->filename);
+
+            write_blob_data(opts, items[i].entry_index, &(e->entry), &(e->blob_result), e->target_filename);
+
+            sfmf_control_process();
+        }
+
+        packreader_close(opts->pack_reader);
+        opts->pack_reader = 0;
+
+        free(pack_local_filename);
+        free(pack_filename);
+
+        done = last;
+    }
+
+    free(items);
+
+    // Hardlinks can only be created once all files have been written
+    for (int i=0; i<opts->header.entries_length; i++) {
+        unpack_write_hardlink(opts, &(opts->fentries[i]));
+    }
+
+    draw_progress(opts, -2, 0, "DONE");
 }
 
 static int control_abort_cb(void *user_data)
@@ -1017,6 +1450,7 @@ int main(int argc, char *argv[])
 {
     struct UnpackOptions *opts = calloc(1, sizeof(struct UnpackOptions));
     progname = argv[0];
+    opts->jobs = DOWNLOAD_DEFAULT_PARALLEL;
 
     sfmf_cleanup_register(unpack_cleanup, opts);
 
@@ -1026,7 +1460,7 @@ int main(int argc, char *argv[])
     parse_opts(argc, argv, opts);
 
     opts->steps.current = -1;
-    opts->steps.total = 8;
+    opts->steps.total = 9;
 
     sfmf_control_init(&control_callbacks, opts);
 
@@ -1035,11 +1469,14 @@ int main(int argc, char *argv[])
     }
 
     if (opts->download_only) {
-        opts->steps.total -= 2;
+        opts->steps.total -= 3;
     }
 
     sfmf_policy_set_log_debug(opts->verbose);
 
+    // Before any download threads are started
+    sha1hw_init();
+
     // Initialize local file cache
     if (!opts->cachedir) {
         opts->cachedir = strdup("sfmf-cache-XXXXXX");
@@ -1048,22 +1485,31 @@ int main(int argc, char *argv[])
     assert(opts->cachedir != NULL);
     opts->cached_files = filelist_new();
 
+    opts->download_queue = downloadqueue_new(opts->jobs);
+    opts->download_index = hashindex_new(0);
+
     next_step(opts, "Downloading manifest file");
 
     // TODO: Have an expected hash for the manifest file
-    opts->manifest_local_filename = download_payload_file(opts, "manifest.sfmf", NULL, 0);
-    assert(opts->manifest_local_filename);
+    opts->manifest_local_filename = queue_payload_file(opts, "manifest.sfmf", NULL, BLOB_FLAG_NONE);
+    download_queued_files(opts);
 
     // TODO: We could also have a known file hash for the manifest file, so
     // that the download of the manifest file could also be verified.
 
-    opts->fp = fopen(opts->manifest_local_filename, "rb");
-    assert(opts->fp);
-    int res = sfmf_fileheader_read(&(opts->header), opts->fp);
-    assert(res == 1);
-
-    assert(opts->header.magic == SFMF_MAGIC_NUMBER);
-    assert(opts->header.version == SFMF_CURRENT_VERSION);
+    opts->manifest = manifestreader_open(opts->manifest_local_filename);
+    if (opts->manifest == NULL) {
+        SFMF_FAIL_AND_EXIT("Could not read manifest file %s\n", opts->manifest_local_filename);
+    }
+    opts->header = opts->manifest->header;
+
+    // Without zstd support, blobs that use the dictionary can't be read anyway (see convert_flags_for_blob())
+    size_t dictionary_length = 0;
+    const char *dictionary = manifestreader_get_dictionary(opts->manifest, &dictionary_length);
+    if (dictionary != NULL && convert_codec_available(CONVERT_CODEC_ZSTD) &&
+            !convert_set_dictionary(dictionary, dictionary_length)) {
+        SFMF_FAIL_AND_EXIT("Invalid dictionary in manifest file %s\n", opts->manifest_local_filename);
+    }
 
     next_step(opts, "Indexing local files");
 
@@ -1075,6 +1521,9 @@ int main(int argc, char *argv[])
         opts->local_files = extend_file_list(opts->local_files, opts->sourcedirs[i], FILE_LIST_NONE);
     }
     SFMF_LOG("Got local files: %d\n", opts->local_files->length);
+
+    // Local files are bucketed by size and hashed on demand
+    opts->local_index = fileindex_new(opts->local_files);
     sfmf_policy_set_ignore_unsupported(0);
     SFMF_LOG("==== Local Files ====\n");
 
@@ -1085,7 +1534,8 @@ int main(int argc, char *argv[])
              " Filename table size: %d bytes\n"
              " Entries: %d\n"
              " Packs: %d\n"
-             " Blobs: %d\n\n",
+             " Blobs: %d\n"
+             " Hash index: %d\n\n",
              opts->header.magic,
              (opts->header.magic >> 24) & 0xFF,
              (opts->header.magic >> 16) & 0xFF,
@@ -1096,65 +1546,77 @@ int main(int argc, char *argv[])
              opts->header.filename_table_size,
              opts->header.entries_length,
              opts->header.packs_length,
-             opts->header.blobs_length);
-
-    opts->metadata = malloc(opts->header.metadata_size);
-    res = fread(opts->metadata, opts->header.metadata_size, 1, opts->fp);
-    assert(res == 1);
+             opts->header.blobs_length,
+             opts->header.hash_index_length);
 
     SFMF_LOG("==== Metadata ====\n");
-    SFMF_LOG("%s\n", opts->metadata);
+    SFMF_LOG("%s\n", manifestreader_get_metadata(opts->manifest));
     SFMF_LOG("==== Metadata ====\n");
 
     next_step(opts, "Parsing manifest file");
 
-    opts->filename_table = malloc(opts->header.filename_table_size);
-    res = fread(opts->filename_table, opts->header.filename_table_size, 1, opts->fp);
-    assert(res == 1);
-
+    // Only the index records are converted here; filenames and included
+    // blob data are used directly from the mapped manifest file
     opts->fentries = calloc(sizeof(struct UnpackFileEntry), opts->header.entries_length);
 
+    // Target filenames are stored back to back in a single buffer; filenames
+    // are reconstructed incrementally by the reader, as we access them in order
+    size_t outputdir_length = strlen(opts->outputdir);
+    size_t target_filenames_size = 0;
     for (int i=0; i<opts->header.entries_length; i++) {
-        sfmf_fileentry_read(&(opts->fentries[i].entry), opts->fp);
+        manifestreader_get_entry(opts->manifest, i, &(opts->fentries[i].entry));
+        target_filenames_size += outputdir_length + strlen(manifestreader_get_filename(opts->manifest, i)) + 1;
+    }
+
+    opts->target_filenames = malloc(target_filenames_size ?: 1);
+    char *target_filename = opts->target_filenames;
+    for (int i=0; i<opts->header.entries_length; i++) {
+        const char *filename = manifestreader_get_filename(opts->manifest, i);
+        size_t length = strlen(filename);
+
+        opts->fentries[i].target_filename = target_filename;
+        opts->fentries[i].filename = target_filename + outputdir_length;
+        memcpy(target_filename, opts->outputdir, outputdir_length);
+        memcpy(target_filename + outputdir_length, filename, length + 1);
+        target_filename += outputdir_length + length + 1;
     }
 
     opts->pentries = calloc(sizeof(struct SFMF_PackEntry), opts->header.packs_length);
 
     for (int i=0; i<opts->header.packs_length; i++) {
-        sfmf_packentry_read(&(opts->pentries[i]), opts->fp);
+        manifestreader_get_pack(opts->manifest, i, &(opts->pentries[i]));
     }
 
     opts->bentries = calloc(sizeof(struct SFMF_BlobEntry), opts->header.blobs_length);
 
     for (int i=0; i<opts->header.blobs_length; i++) {
-        sfmf_blobentry_read(&(opts->bentries[i]), opts->fp);
-    }
-
-    opts->pack_hashes = calloc(sizeof(struct SFMF_FileHash *), opts->header.packs_length);
-
-    for (int i=0; i<opts->header.packs_length; i++) {
-        struct SFMF_PackEntry *entry = &(opts->pentries[i]);
-
-        opts->pack_hashes[i] = calloc(sizeof(struct SFMF_FileHash), entry->count);
-
-        fseek(opts->fp, entry->offset, SEEK_SET);
-        for (int j=0; j<entry->count; j++) {
-            int res = sfmf_filehash_read(&(opts->pack_hashes[i][j]), opts->fp);
-            assert(res == 1);
-        }
+        manifestreader_get_blob(opts->manifest, i, &(opts->bentries[i]));
     }
 
     next_step(opts, "Classifying entries");
+    opts->reference_chunks = hashindex_new(0);
     foreach_unpack_entry(opts, unpack_classify_entry);
 
+    uint32_t chunks_total = opts->chunk_stats.local + opts->chunk_stats.included + opts->chunk_stats.packed;
+    if (chunks_total > 0) {
+        SFMF_LOG("Chunks: %" PRIu32 " (%" PRIu32 " from %" PRIu32 " local files, %" PRIu32 " included, %" PRIu32 " packed)\n",
+                chunks_total, opts->chunk_stats.local, opts->references_length,
+                opts->chunk_stats.included, opts->chunk_stats.packed);
+    }
+
     if (!opts->offline_mode) {
         next_step(opts, "Downloading requirements");
-        foreach_unpack_entry(opts, unpack_download_requirements);
+        foreach_unpack_entry(opts, unpack_queue_requirements);
+        download_queued_files(opts);
     }
 
     if (!opts->download_only) {
         next_step(opts, "Writing files");
         foreach_unpack_entry(opts, unpack_write_entry);
+        unpack_close_chunk_sources(opts);
+
+        next_step(opts, "Extracting packed files");
+        unpack_write_packed_entries(opts);
 
         next_step(opts, "Setting permissions");
         {
@@ -1177,10 +1639,10 @@ int main(int argc, char *argv[])
     sfmf_control_set_progress(getenv("SFMF_TARGET") ?: "-", 100, "FINISHED");
 
     SFMF_LOG("==== Download Summary ====\n");
-    size_t total = 0;
+    uint64_t total = 0;
     (void)filelist_foreach(opts->cached_files, filelist_download_summary, &total);
     SFMF_LOG("==== Download Summary ====\n");
-    SFMF_LOG("TOTAL DOWNLOAD: %ld KiB\n", total / 1024);
+    SFMF_LOG("TOTAL DOWNLOAD: %" PRIu64 " KiB\n", total / 1024);
     SFMF_LOG("==== Download Summary ====\n");
 
     // If we arrive here, we have successfully unpacked everything